@@ -21,7 +21,7 @@
  *   - init (\ref omlc_init)
  *   - start (\ref omlc_start)
  *   - addMP (\ref omlc_add_mp)
- *   - inject (\ref omlc_inject)
+ *   - inject (\ref omlc_inject, or \ref omlc_inject_batch for several samples at once)
  *   - injectMetadata (\ref omlc_inject_metadata)
  *   - close (\ref omlc_close)
  *
@@ -107,9 +107,12 @@
 #include "mem.h"
 #include "client.h"
 #include "buffered_writer.h"
+#include "staging.h"
 
-static void omlc_ms_process(OmlMStream* ms);
-static int omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_dropped, uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max);
+static void omlc_ms_process(OmlMStream* ms, const struct timeval* tv);
+static int omlc_inject_rows(OmlMP *mp, const OmlValueU *rows, const OmlValueU *const *columns, size_t nrows);
+static int omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_dropped, uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max, uint64_t bytes_spooled);
+static void omlc_inject_stream_instr(void);
 
 extern OmlMP* schema0;
 
@@ -137,66 +140,494 @@ omlc_process(OmlMP *mp, OmlValueU *values)
  * filter, the call omlc_ms_process() to determine whether a new sample has to
  * be output on that MS.
  *
- * The content of values is deep-copied into the MSs' storage, so values can be
- * directly freed/reused when inject returns.
+ * The content of values is only borrowed for the duration of the call: the
+ * filters which need to keep it copy it into the MSs' storage, so values can
+ * be directly freed/reused when inject returns.
  *
  * This function might call omlc_inject_client_instr which in turns calls
  * omlc_inject. We make sure not to loop.
  *
  * \see omlc_add_mp, omlc_ms_process, oml_value_set, omlc_inject_client_instr
+ * \see omlc_inject_batch
  */
 int
 omlc_inject(OmlMP *mp, OmlValueU *values)
 {
-  OmlMStream* ms;
-  OmlValue v;
-  int i;
+  return omlc_inject_rows(mp, values, NULL, 1);
+}
 
-  if (NULL == omlc_instance || omlc_instance->start_time <= 0) {
-    logerror("Cannot inject samples prior to calling omlc_init and omlc_start\n");
+/**  Inject several measurement samples into a Measurement Point.
+ *
+ * \param mp pointer to OmlMP into which the new samples are being injected
+ * \param rows an array of nrows samples of mp->param_count OmlValueU each
+ * \param nrows number of samples in rows
+ * \return 0 on success, <0 otherwise
+ *
+ * This is equivalent to calling omlc_inject for each sample, but the MP is
+ * only locked once, and the writers of the sample-based MSs are reserved for
+ * the whole batch, so their buffers are only locked once as well.
+ *
+ * \see omlc_inject, omlc_inject_batch_columns
+ */
+int
+omlc_inject_batch(OmlMP *mp, const OmlValueU *rows, size_t nrows)
+{
+  if (rows == NULL) {
     return -1;
   }
-  if (mp == NULL || values == NULL) {
+  return omlc_inject_rows(mp, rows, NULL, nrows);
+}
+
+/**  Inject several measurement samples, stored by field, into a Measurement Point.
+ *
+ * \param mp pointer to OmlMP into which the new samples are being injected
+ * \param columns an array of mp->param_count arrays of nrows OmlValueU, one per field
+ * \param nrows number of samples in each column
+ * \return 0 on success, <0 otherwise
+ *
+ * \see omlc_inject_batch
+ */
+int
+omlc_inject_batch_columns(OmlMP *mp, const OmlValueU *const *columns, size_t nrows)
+{
+  if (columns == NULL) {
     return -1;
   }
+  return omlc_inject_rows(mp, NULL, columns, nrows);
+}
 
-  LOGDEBUG("Injecting data into MP '%s'\n", mp->name);
+/** A reusable sample of a Measurement Point, filled field by field.
+ * \see omlc_sample_new
+ */
+struct OmlSample {
+  /** MP into which this sample is injected */
+  OmlMP *mp;
+  /** Array of mp->param_count values */
+  OmlValueU *values;
+};
+
+/** Create a reusable sample for a Measurement Point.
+ *
+ * The sample is allocated once, then filled with the omlc_sample_set_*
+ * functions and injected with omlc_sample_inject as many times as needed.
+ * Strings and blobs are only referred to, not copied, so no memory is
+ * allocated when injecting it, once the MSs have warmed up.
+ *
+ * \param mp OmlMP for which to create the sample
+ * \return a new OmlSample, to be freed with omlc_sample_free, or NULL on error
+ * \see omlc_sample_inject, omlc_sample_free
+ */
+OmlSample*
+omlc_sample_new(OmlMP *mp)
+{
+  OmlSample *self;
 
-  oml_value_init(&v);
-  if (mp_lock(mp) == -1) {
-    logwarn("Cannot lock MP '%s' for injection\n", mp->name);
+  if (mp == NULL) {
+    return NULL;
+  }
+  if (NULL == (self = oml_malloc(sizeof(OmlSample)))) {
+    return NULL;
+  }
+  if (NULL == (self->values = oml_malloc(mp->param_count * sizeof(OmlValueU)))) {
+    oml_free(self);
+    return NULL;
+  }
+  omlc_zero_array(self->values, mp->param_count);
+  self->mp = mp;
+
+  return self;
+}
+
+/** Free a sample created with omlc_sample_new.
+ *
+ * The borrowed strings and blobs are not freed.
+ *
+ * \param self OmlSample to free
+ */
+void
+omlc_sample_free(OmlSample *self)
+{
+  if (self) {
+    oml_free(self->values);
+    oml_free(self);
+  }
+}
+
+/** Find the storage of a field of an OmlSample, checking its type.
+ *
+ * \param self OmlSample to look into
+ * \param index index of the field
+ * \param type expected OmlValueT of the field
+ * \return a pointer to the OmlValueU of the field, or NULL on error
+ */
+static OmlValueU*
+omlc_sample_field(OmlSample *self, unsigned int index, OmlValueT type)
+{
+  if (self == NULL || index >= (unsigned int)self->mp->param_count) {
+    logwarn("Cannot set field %u of sample for MP '%s'\n",
+        index, self ? self->mp->name : "(null)");
+    return NULL;
+  }
+  if (self->mp->param_defs[index].param_types != type) {
+    logwarn("Cannot set field %u of sample for MP '%s' as %s, expected %s\n",
+        index, self->mp->name, oml_type_to_s(type),
+        oml_type_to_s(self->mp->param_defs[index].param_types));
+    return NULL;
+  }
+  return &self->values[index];
+}
+
+/** Set an OML_INT32_VALUE field of a sample.
+ * \param self OmlSample to modify
+ * \param index index of the field in the MP
+ * \param value new value of the field
+ * \return 0 on success, -1 if the field does not exist or has another type
+ * \see omlc_sample_new
+ */
+int
+omlc_sample_set_int32(OmlSample *self, unsigned int index, int32_t value)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_INT32_VALUE);
+  if (u == NULL) { return -1; }
+  omlc_set_int32(*u, value);
+  return 0;
+}
+
+/** Set an OML_UINT32_VALUE field of a sample. \see omlc_sample_set_int32 */
+int
+omlc_sample_set_uint32(OmlSample *self, unsigned int index, uint32_t value)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_UINT32_VALUE);
+  if (u == NULL) { return -1; }
+  omlc_set_uint32(*u, value);
+  return 0;
+}
+
+/** Set an OML_INT64_VALUE field of a sample. \see omlc_sample_set_int32 */
+int
+omlc_sample_set_int64(OmlSample *self, unsigned int index, int64_t value)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_INT64_VALUE);
+  if (u == NULL) { return -1; }
+  omlc_set_int64(*u, value);
+  return 0;
+}
+
+/** Set an OML_UINT64_VALUE field of a sample. \see omlc_sample_set_int32 */
+int
+omlc_sample_set_uint64(OmlSample *self, unsigned int index, uint64_t value)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_UINT64_VALUE);
+  if (u == NULL) { return -1; }
+  omlc_set_uint64(*u, value);
+  return 0;
+}
+
+/** Set an OML_DOUBLE_VALUE field of a sample. \see omlc_sample_set_int32 */
+int
+omlc_sample_set_double(OmlSample *self, unsigned int index, double value)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_DOUBLE_VALUE);
+  if (u == NULL) { return -1; }
+  omlc_set_double(*u, value);
+  return 0;
+}
+
+/** Set an OML_BOOL_VALUE field of a sample. \see omlc_sample_set_int32 */
+int
+omlc_sample_set_bool(OmlSample *self, unsigned int index, int value)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_BOOL_VALUE);
+  if (u == NULL) { return -1; }
+  omlc_set_bool(*u, value);
+  return 0;
+}
+
+/** Set an OML_GUID_VALUE field of a sample. \see omlc_sample_set_int32 */
+int
+omlc_sample_set_guid(OmlSample *self, unsigned int index, oml_guid_t value)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_GUID_VALUE);
+  if (u == NULL) { return -1; }
+  omlc_set_guid(*u, value);
+  return 0;
+}
+
+/** Set an OML_STRING_VALUE field of a sample, without copying the string.
+ *
+ * The string is borrowed: it must remain valid and unchanged until the next
+ * call to omlc_sample_inject has returned.
+ *
+ * \param self OmlSample to modify
+ * \param index index of the field in the MP
+ * \param str nil-terminated string
+ * \return 0 on success, -1 if the field does not exist or has another type
+ * \see omlc_sample_new, omlc_set_const_string
+ */
+int
+omlc_sample_set_string(OmlSample *self, unsigned int index, const char *str)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_STRING_VALUE);
+  if (u == NULL || str == NULL) { return -1; }
+  omlc_set_const_string(*u, str);
+  return 0;
+}
+
+/** Set an OML_BLOB_VALUE field of a sample, without copying the data.
+ *
+ * The data is borrowed: it must remain valid and unchanged until the next
+ * call to omlc_sample_inject has returned.
+ *
+ * \param self OmlSample to modify
+ * \param index index of the field in the MP
+ * \param data pointer to the data of the blob
+ * \param length length of the blob [B]
+ * \return 0 on success, -1 if the field does not exist or has another type
+ * \see omlc_sample_new
+ */
+int
+omlc_sample_set_blob(OmlSample *self, unsigned int index, const void *data, size_t length)
+{
+  OmlValueU *u = omlc_sample_field(self, index, OML_BLOB_VALUE);
+  if (u == NULL || data == NULL) { return -1; }
+  omlc_set_blob_ptr(*u, data);
+  omlc_set_blob_length(*u, length);
+  omlc_set_blob_size(*u, 0);
+  return 0;
+}
+
+/** Inject the current content of a sample into its Measurement Point.
+ *
+ * The sample can be modified and injected again as soon as this returns.
+ *
+ * \param self OmlSample to inject
+ * \return 0 on success, <0 otherwise
+ * \see omlc_inject, omlc_sample_new
+ */
+int
+omlc_sample_inject(OmlSample *self)
+{
+  if (self == NULL) {
     return -1;
   }
+  return omlc_inject_rows(self->mp, self->values, NULL, 1);
+}
 
-  uint64_t written = 0;
-  uint64_t dropped = 0;
+/** Reserve or release the writers of the sample-based MSs of an MP.
+ *
+ * Writers are walked in the order of the instance's list, so concurrent
+ * batches on different MPs always reserve them in the same order.
+ *
+ * Before being released, writers are given a chance to write out the samples
+ * they held back to batch them.
+ *
+ * A lock for the MP must be held before calling this function.
+ *
+ * \param mp OmlMP whose writers to reserve
+ * \param reserve 1 to reserve the writers, 0 to release them
+ * \see bw_reserve, bw_unreserve, oml_writer_flush
+ */
+static void
+omlc_reserve_writers(OmlMP *mp, int reserve)
+{
+  OmlWriter *w;
+  OmlMStream *ms;
+  int i;
+
+  for (w = omlc_instance->first_writer; w; w = w->next) {
+    for (ms = mp->streams; ms; ms = ms->next) {
+      if (ms->sample_thres <= 0) {
+        continue;
+      }
+      for (i = 0; i < ms->nwriters && ms->writers[i] != w; i++);
+      if (i < ms->nwriters) {
+        break;
+      }
+    }
+    if (ms) {
+      if (reserve) {
+        bw_reserve(w->bufferedWriter);
+      } else {
+        if (w->flush) {
+          w->flush(w);
+        }
+        bw_unreserve(w->bufferedWriter);
+      }
+    }
+  }
+}
+
+/** Input one sample into the filters of all the MSs of an MP.
+ *
+ * The value of field i is either row[i], or columns[i][r], whichever array is
+ * not NULL. The values are only borrowed by the filters.
+ *
+ * A lock for the MP must be held before calling this function.
+ *
+ * \param mp pointer to OmlMP into which the new sample is being injected
+ * \param row an array of mp->param_count values, or NULL
+ * \param columns an array of mp->param_count arrays of values, or NULL
+ * \param r index of the sample in the columns
+ * \param tv time at which the sample was injected, or NULL for now
+ *
+ * \see omlc_inject_rows, omlc_ms_process
+ */
+static void
+omlc_filter_row(OmlMP *mp, const OmlValueU *row, const OmlValueU *const *columns, size_t r,
+    const struct timeval *tv)
+{
+  OmlMStream* ms;
+  OmlValue v;
+
+  oml_value_init(&v);
   for (ms = mp->streams; ms; ms = ms->next) {
     LOGDEBUG("Filtering MP '%s' data into MS '%s'\n", mp->name, ms->table_name);
     OmlFilter* f = ms->filters;
     for (; f != NULL; f = f->next) {
 
       /* FIXME:  Should validate this indexing */
-      oml_value_set(&v, &values[f->index], mp->param_defs[f->index].param_types);
+      oml_value_borrow(&v, row ? &row[f->index] : &columns[f->index][r],
+          mp->param_defs[f->index].param_types);
 
+      /* Per-sample streams output before the values go out of scope */
+      f->borrow_input = (ms->sample_thres == 1);
       f->input(f, &v);
     }
-    omlc_ms_process(ms);
-    written += ms->written;
-    dropped += ms->dropped;
-    for (i=0; i<ms->nwriters; i++) {
-      dropped += bw_nlost_reset(ms->writers[i]->bufferedWriter);
-    }
+    omlc_ms_process(ms, tv);
   }
-  mp_unlock(mp);
   oml_value_reset(&v);
+}
+
+/** Process a staged sample \see staging_process, omlc_filter_row */
+static void
+omlc_filter_staged(void *mp, const OmlValueU *values, const struct timeval *tv)
+{
+  omlc_filter_row((OmlMP*)mp, values, NULL, 0, tv);
+}
+
+/** Process the samples staged while an MP was locked.
+ *
+ * A lock for the MP must be held before calling this function.
+ *
+ * \param mp OmlMP whose staged samples to process
+ * \see staging_drain, omlc_mp_release
+ */
+void
+omlc_mp_drain(OmlMP *mp)
+{
+  if (mp->staging) {
+    staging_drain(mp->staging, omlc_filter_staged, mp);
+  }
+}
+
+/** Unlock an MP, then process the samples staged in the meantime.
+ *
+ * Samples staged by other threads while this one held the lock would
+ * otherwise wait until the next injection. After unlocking, the MP is locked
+ * again to drain them, unless another thread has already done so.
+ *
+ * \param mp OmlMP to unlock
+ * \see mp_unlock, omlc_mp_drain, staging_push
+ */
+void
+omlc_mp_release(OmlMP *mp)
+{
+  mp_unlock(mp);
+  while (staging_pending(mp->staging) && !mp_trylock(mp)) {
+    omlc_mp_drain(mp);
+    mp_unlock(mp);
+  }
+}
+
+/** Inject samples into a Measurement Point, from rows or columns of values.
+ *
+ * The value of field i of sample r is either rows[r * mp->param_count + i],
+ * or columns[i][r], whichever array is not NULL.
+ *
+ * If the MP is locked by another thread, a single sample is staged into the
+ * ring of the calling thread rather than waiting for the lock. The holder of
+ * the lock then processes it before releasing it. Batches, and samples which
+ * cannot be staged, wait for the lock.
+ *
+ * \param mp pointer to OmlMP into which the new samples are being injected
+ * \param rows an array of nrows samples, or NULL
+ * \param columns an array of mp->param_count arrays of nrows values, or NULL
+ * \param nrows number of samples
+ * \return 0 on success, <0 otherwise
+ *
+ * \see omlc_inject, omlc_inject_batch, omlc_inject_batch_columns, staging_push
+ */
+static int
+omlc_inject_rows(OmlMP *mp, const OmlValueU *rows, const OmlValueU *const *columns, size_t nrows)
+{
+  OmlMStream* ms;
+  size_t r;
+  int batch = nrows > 1;
+
+  if (NULL == omlc_instance || omlc_instance->start_time <= 0) {
+    logerror("Cannot inject samples prior to calling omlc_init and omlc_start\n");
+    return -1;
+  }
+  if (mp == NULL || (rows == NULL && columns == NULL)) {
+    return -1;
+  }
+  if (nrows == 0) {
+    return 0;
+  }
+
+  LOGDEBUG("Injecting %zu samples into MP '%s'\n", nrows, mp->name);
+
+  if (mp_trylock(mp)) {
+    if (!batch && rows && !staging_push(mp->staging, rows)) {
+      /* The holder will see the sample when releasing the lock, unless it
+       * already has, in which case it is up to us to process it */
+      if (!mp_trylock(mp)) {
+        omlc_mp_drain(mp);
+        omlc_mp_release(mp);
+      }
+      return 0;
+    }
+    if (mp_lock(mp) == -1) {
+      logwarn("Cannot lock MP '%s' for injection\n", mp->name);
+      return -1;
+    }
+  }
+  /* Samples staged earlier go first */
+  omlc_mp_drain(mp);
+  if (batch) {
+    omlc_reserve_writers(mp, 1);
+  }
+
+  for (r = 0; r < nrows; r++) {
+    omlc_filter_row(mp, rows ? &rows[r * mp->param_count] : NULL, columns, r, NULL);
+  }
+
+  uint64_t written = 0;
+  uint64_t dropped = 0;
+  for (ms = mp->streams; ms; ms = ms->next) {
+    written += ms->written;
+    dropped += ms->dropped + __atomic_load_n(&ms->lost, __ATOMIC_SEQ_CST);
+  }
+
+  if (batch) {
+    omlc_reserve_writers(mp, 0);
+  }
+  omlc_mp_release(mp);
 
   /* do we need to send client instrumentation? */
-  if(mp != omlc_instance->client_instr && omlc_instance->instr_interval) {
+  if(mp != omlc_instance->client_instr && mp != omlc_instance->stream_instr &&
+      omlc_instance->instr_interval) {
     time_t now;
     time(&now);
     if(omlc_instance->instr_time + omlc_instance->instr_interval <= now) {
+      uint64_t spooled = 0;
+      OmlWriter* w;
+      for (w = omlc_instance->first_writer; w; w = w->next) {
+        spooled += bw_spooled_bytes(w->bufferedWriter);
+      }
       omlc_instance->instr_time = now; /* Make sure we don't loop */
-      omlc_inject_client_instr(written, dropped, xmemnew(), xmemfreed(), xmembytes(), xmaxbytes());
+      omlc_inject_client_instr(written, dropped, xmemnew(), xmemfreed(), xmembytes(), xmaxbytes(), spooled);
+      omlc_inject_stream_instr();
     }
   }
 
@@ -280,25 +711,81 @@ omlc_inject_metadata(OmlMP *mp, const char *key, const OmlValueU *value, OmlValu
  * \param bytes_freed number of previously allocated bytes freed
  * \param bytes_in_use number of bytes currently allocated
  * \param bytes_max total number of bytes allocated
+ * \param bytes_spooled number of bytes waiting in the spools of all writers
  * \return 0 on success, -1 otherwise
  *
  * \see omlc_inject
  */
 static int
 omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_dropped,
-    uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max)
+    uint64_t bytes_allocated, uint64_t bytes_freed, uint64_t bytes_in_use, uint64_t bytes_max,
+    uint64_t bytes_spooled)
 {
-  OmlValueU values[6];
-  omlc_zero_array(values, 6);
+  OmlValueU values[7];
+  omlc_zero_array(values, 7);
   omlc_set_uint32(values[0], measurements_injected);
   omlc_set_uint32(values[1], measurements_dropped);
   omlc_set_uint64(values[2], bytes_allocated);
   omlc_set_uint64(values[3], bytes_freed);
   omlc_set_uint64(values[4], bytes_in_use);
   omlc_set_uint64(values[5], bytes_max);
+  omlc_set_uint64(values[6], bytes_spooled);
   return omlc_inject(omlc_instance->client_instr, values);
 }
 
+/** Inject samples in the per-stream client instrumentation MP.
+ *
+ * One sample is injected for each MS which dropped tuples since the last
+ * report, with its total numbers of injected and dropped tuples. Dropped
+ * tuples include those refused by the filters or writers, and those lost from
+ * the writers' buffers.
+ *
+ * A sample is also injected for each periodic MS whose reports were late by
+ * more than a tenth of its interval since the last report, with the largest
+ * of these delays. It is 0 for other MSs.
+ *
+ * \see omlc_inject, omlc_inject_client_instr
+ */
+static void
+omlc_inject_stream_instr(void)
+{
+  OmlValueU values[4];
+  OmlMP *mp;
+  OmlMStream *ms;
+  uint32_t dropped;
+  double lag;
+
+  if (!omlc_instance->stream_instr) {
+    return;
+  }
+
+  omlc_zero_array(values, 4);
+  for (mp = omlc_instance->mpoints; mp; mp = mp->next) {
+    if (mp == omlc_instance->stream_instr || mp_lock(mp) == -1) {
+      continue;
+    }
+    for (ms = mp->streams; ms; ms = ms->next) {
+      dropped = ms->dropped + __atomic_load_n(&ms->lost, __ATOMIC_SEQ_CST);
+      lag = ms->scheduling_lag;
+      ms->scheduling_lag = 0.;
+      if (lag <= ms->sample_interval / 10) {
+        lag = 0.;
+      }
+      if (dropped == ms->reported_drops && lag == 0.) {
+        continue;
+      }
+      ms->reported_drops = dropped;
+
+      omlc_set_const_string(values[0], ms->table_name);
+      omlc_set_uint32(values[1], ms->written);
+      omlc_set_uint32(values[2], dropped);
+      omlc_set_double(values[3], lag);
+      omlc_inject(omlc_instance->stream_instr, values);
+    }
+    omlc_mp_release(mp);
+  }
+}
+
 /** Called when the particular MS has been filled.
  *
  * Determine whether a new sample must be issued (in per-sample reporting), and
@@ -307,17 +794,18 @@ omlc_inject_client_instr(uint32_t measurements_injected, uint32_t measurements_d
  * A lock for the MP containing that MS must be held before calling this function.
  *
  * \param ms pointer to the OmlMStream to process
- * \see filter_process
+ * \param tv time at which the last sample was injected, or NULL for now
+ * \see filter_process_at
  */
 static void
-omlc_ms_process(OmlMStream *ms)
+omlc_ms_process(OmlMStream *ms, const struct timeval *tv)
 {
   if (ms == NULL) return;
 
   if (ms->sample_thres > 0 && ++ms->sample_size >= ms->sample_thres) {
     LOGDEBUG("Generating new sample for MS '%s'\n", ms->table_name);
     // sample based filters fire
-    filter_process(ms);
+    filter_process_at(ms, tv);
   }
 
 }
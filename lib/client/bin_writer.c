@@ -14,6 +14,7 @@
 #include <stdlib.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 #include <assert.h>
 
 #include "oml2/omlc.h"
@@ -24,8 +25,33 @@
 #include "client.h"
 #include "marshal.h"
 #include "mbuf.h"
+#include "mem.h"
+#include "oml_value.h"
 #include "buffered_writer.h"
 
+/** Maximal number of rows in a batch message \ref omspbatch */
+#define OWB_BATCH_ROWS 64
+
+/** Rows of a stream held back to be written in a single batch message */
+typedef struct OwbBatch {
+  /** Stream of the rows, or NULL if there are none */
+  OmlMStream* ms;
+  /** Number of complete rows */
+  int rows;
+  /** Number of values in each row */
+  int width;
+  /** Number of values of the row being written so far, or -1 if it cannot be kept */
+  int col;
+  /** Number of OmlValues allocated for each row in values */
+  int size;
+  /** Sequence numbers of the rows */
+  int32_t seqnos[OWB_BATCH_ROWS];
+  /** Times of the rows */
+  double timestamps[OWB_BATCH_ROWS];
+  /** OWB_BATCH_ROWS rows of size OmlValues */
+  OmlValue* values;
+} OwbBatch;
+
 /** An OmlWriter using the binary marshalling functions \ref omspbin */
 typedef struct OmlBinWriter {
 
@@ -49,6 +75,12 @@ typedef struct OmlBinWriter {
   OmlWriter* next;
   /** \see OmlWriter::bufferedWriter */
   BufferedWriter* bufferedWriter;
+  /** \see OmlWriter::encoding */
+  int encoding;
+  /** \see OmlWriter::row_copy */
+  oml_writer_row_copy row_copy;
+  /** \see OmlWriter::flush */
+  oml_writer_flush flush;
 
   /*
    * Fields specific to the OmlBinWriter
@@ -66,6 +98,30 @@ typedef struct OmlBinWriter {
   /* Type of messages to generate */
   OmlBinMsgType msgtype;
 
+  /** Set to 1 to generate compact messages \ref omspcompact */
+  int compact;
+
+  /** Set to 1 to send strings of compact messages through dictionaries \ref omspstrdict */
+  int dictionaries;
+
+  /** Previous compact message of each stream, indexed by OmlMStream::index */
+  OmlCompactState* states;
+
+  /** Number of elements allocated in states */
+  int nstates;
+
+  /** State of the stream of the message being written, until it is complete */
+  OmlCompactState pending;
+
+  /** Set to 1 to hold rows back while the bufferedWriter is reserved, and write them as batch messages \ref omspbatch */
+  int batching;
+
+  /** Set to 1 while the current row is being held back */
+  int holding;
+
+  /** Rows held back */
+  OwbBatch batch;
+
 } OmlBinWriter;
 
 static int owb_meta(OmlWriter* writer, char* str);
@@ -75,6 +131,7 @@ static int owb_row_start(OmlWriter* writer, OmlMStream* ms, double now);
 static int owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count);
 static int owb_row_end(OmlWriter* writer, OmlMStream* ms);
 
+static int owb_flush(OmlWriter* writer);
 static OmlWriter *owb_close(OmlWriter* writer);
 
 /** Create a new OmlBinWriter
@@ -101,9 +158,25 @@ bin_writer_new(OmlOutStream* out_stream)
   self->row_end = owb_row_end;
   self->out = owb_row_cols;
   self->close = owb_close;
+  self->flush = owb_flush;
+  self->encoding = SE_Binary;
+  self->row_copy = oml_writer_copy_row;
 
   self->msgtype = OMB_DATA_P; // Short packets.
 
+  if (omlc_instance->protocol_version >= OMSP_COMPACT_VERSION) {
+    /* Compact messages depend on the previous ones in this writer's buffer,
+     * so they cannot be copied to other writers */
+    self->compact = 1;
+    self->row_copy = NULL;
+  }
+  if (omlc_instance->protocol_version >= OMSP_BATCH_VERSION) {
+    self->batching = 1;
+  }
+  if (omlc_instance->protocol_version >= OMSP_STRDICT_VERSION) {
+    self->dictionaries = 1;
+  }
+
   return (OmlWriter*)self;
 }
 
@@ -137,6 +210,177 @@ owb_header_done(OmlWriter* writer)
   return (owb_meta(writer, "content: binary") && owb_meta(writer, ""));
 }
 
+/** Find the OmlCompactState of a stream, growing the array as needed.
+ *
+ * If dictionaries are in use, that of the stream is created with its state.
+ * Messages of schema0 are all absolute, so it does not need one.
+ *
+ * \param self OmlBinWriter
+ * \param index OmlMStream::index of the stream
+ * \return a pointer to the OmlCompactState of the stream, or NULL on error
+ */
+static OmlCompactState*
+owb_compact_state(OmlBinWriter* self, int index)
+{
+  OmlCompactState* states;
+  int n;
+
+  if (index >= self->nstates) {
+    n = index < 8 ? 8 : 2 * index;
+    if (NULL == (states = oml_realloc(self->states, n * sizeof(OmlCompactState)))) {
+      return NULL;
+    }
+    memset(&states[self->nstates], 0, (n - self->nstates) * sizeof(OmlCompactState));
+    self->states = states;
+    self->nstates = n;
+  }
+  if (self->dictionaries && index > 0 && NULL == self->states[index].dict &&
+      NULL == (self->states[index].dict = strdict_new())) {
+    return NULL;
+  }
+  return &self->states[index];
+}
+
+/** Copy values of the row being held back into the batch.
+ *
+ * \param self OmlBinWriter
+ * \param values array of OmlValue to copy
+ * \param value_count length of the values array
+ * \return 1 on success, 0 otherwise
+ */
+static int
+owb_batch_cols(OmlBinWriter* self, OmlValue* values, int value_count)
+{
+  OwbBatch* b = &self->batch;
+  OmlValue* row = &b->values[b->rows * b->size];
+  int i;
+
+  if (b->col < 0 || b->col + value_count > b->width) {
+    b->col = -1;
+    return 0;
+  }
+  for (i = 0; i < value_count; i++) {
+    if (oml_value_set(&row[b->col + i], oml_value_get_value(&values[i]), oml_value_get_type(&values[i]))) {
+      b->col = -1;
+      return 0;
+    }
+  }
+  b->col += value_count;
+  return 1;
+}
+
+/** Write the rows held back, if any, into the BufferedWriter.
+ *
+ * Several rows are written as a batch message, a single one as a compact
+ * message. If they cannot be written, they are accounted for as lost.
+ *
+ * The BufferedWriter should be reserved by the calling thread.
+ *
+ * \param self OmlBinWriter
+ * \return 1 on success, 0 if the rows were lost
+ * \see marshal_batch, bw_reserve
+ */
+static int
+owb_batch_write(OmlBinWriter* self)
+{
+  OwbBatch* b = &self->batch;
+  OmlMStream* ms = b->ms;
+  OmlCompactState* state;
+  MBuffer* mbuf;
+  int ret = 0;
+
+  if (NULL == ms) {
+    return 1;
+  }
+  if (b->rows > 0 && NULL != (mbuf = bw_get_write_buf(self->bufferedWriter, ms))) {
+    state = &self->states[ms->index];
+    if (1 == b->rows) {
+      self->pending = *state;
+      if (0 == bw_msgcount(self->bufferedWriter, ms)) {
+        self->pending.valid = 0;
+      }
+      ret = marshal_compact_init(mbuf, &self->pending, ms->index, b->seqnos[0], b->timestamps[0]) == 1 &&
+        marshal_compact_values(mbuf, self->pending.dict, b->values, b->width) == 1 &&
+        marshal_compact_finalize(mbuf);
+    } else {
+      /* The last row of a batch is the base of the next compact message */
+      self->pending.valid = 1;
+      self->pending.seqno = b->seqnos[b->rows - 1];
+      self->pending.timestamp = llround(b->timestamps[b->rows - 1] * 1e6);
+      self->pending.dict = state->dict;
+      ret = marshal_batch(mbuf, state->dict, ms->index, b->rows, b->seqnos, b->timestamps,
+          b->values, b->width) == 1;
+    }
+
+    if (ret) {
+      *state = self->pending;
+      mbuf_begin_write(mbuf);
+      bw_msgcount_add(self->bufferedWriter, ms, b->rows);
+    } else {
+      /* The dictionary might have changed nonetheless */
+      state->valid = 0;
+    }
+    bw_release_write_buf(self->bufferedWriter);
+  }
+
+  if (!ret && b->rows > 0) {
+    logdebug("%s: Lost batch of %d samples\n", ms->table_name, b->rows);
+    __atomic_add_fetch(&ms->lost, b->rows, __ATOMIC_SEQ_CST);
+  }
+  b->ms = NULL;
+  b->rows = 0;
+  return ret;
+}
+
+/** Start holding a row back for a batch.
+ *
+ * Rows of schema0, which need to be recorded for replay, and of streams
+ * without output are not held back.
+ *
+ * \param self OmlBinWriter
+ * \param ms OmlMStream of the row
+ * \param now time of the row
+ * \return 1 if the row is held back, 0 if it should be written directly
+ */
+static int
+owb_batch_hold(OmlBinWriter* self, OmlMStream* ms, double now)
+{
+  OwbBatch* b = &self->batch;
+  OmlFilter* f;
+  OmlValue* values;
+  int width = 0;
+
+  if (0 == ms->index) {
+    return 0;
+  }
+  if (b->ms != ms) {
+    owb_batch_write(self);
+
+    for (f = ms->firstFilter; f; f = f->next) {
+      width += f->output_count;
+    }
+    if (width <= 0 || NULL == owb_compact_state(self, ms->index)) {
+      return 0;
+    }
+    if (width > b->size) {
+      oml_value_array_reset(b->values, OWB_BATCH_ROWS * b->size);
+      if (NULL == (values = oml_realloc(b->values, OWB_BATCH_ROWS * width * sizeof(OmlValue)))) {
+        return 0;
+      }
+      oml_value_array_init(values, OWB_BATCH_ROWS * width);
+      b->values = values;
+      b->size = width;
+    }
+    b->ms = ms;
+    b->width = width;
+  }
+
+  b->seqnos[b->rows] = ms->seq_no;
+  b->timestamps[b->rows] = now;
+  b->col = 0;
+  return 1;
+}
+
 /** Function called for every result value in a measurement tuple (sample)
  * \see oml_writer_out
  * \see marshal_values
@@ -146,10 +390,17 @@ owb_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
 {
   OmlBinWriter* self = (OmlBinWriter*)writer;
   MBuffer* mbuf;
+  if (self->holding) {
+    return owb_batch_cols(self, values, value_count);
+  }
   if ((mbuf = self->mbuf) == NULL) {
     return 0; /* previous use of mbuf failed */
   }
 
+  if (self->compact) {
+    return marshal_compact_values(mbuf, self->pending.dict, values, value_count) == 1;
+  }
+
   int cnt = marshal_values(mbuf, values, value_count);
   return cnt == value_count;
 }
@@ -172,10 +423,36 @@ owb_row_start(OmlWriter* writer, OmlMStream* ms, double now)
   assert(self->bufferedWriter != NULL);
 
   MBuffer* mbuf;
-  if ((mbuf = self->mbuf = bw_get_write_buf(self->bufferedWriter)) == NULL) {
+  OmlCompactState* state;
+
+  /* The BufferedWriter stays locked until the batch is flushed */
+  if (self->batching && bw_is_reserved(self->bufferedWriter) &&
+      (self->holding = owb_batch_hold(self, ms, now))) {
+    self->mbuf = NULL;
+    return 1;
+  }
+
+  if ((mbuf = self->mbuf = bw_get_write_buf(self->bufferedWriter, ms)) == NULL) {
     return 0;
   }
 
+  if (self->compact) {
+    if (NULL == (state = owb_compact_state(self, ms->index))) {
+      self->mbuf = NULL;
+      bw_release_write_buf(self->bufferedWriter);
+      return 0;
+    }
+    /* Chunks of the BufferedWriter can be dropped or spooled, and schema0 is
+     * replayed on reconnection, so the first message of a stream in each
+     * chunk, and all of schema0, must be absolute */
+    self->pending = *state;
+    if (0 == ms->index || 0 == bw_msgcount(self->bufferedWriter, ms)) {
+      self->pending.valid = 0;
+    }
+    marshal_compact_init(mbuf, &self->pending, ms->index, ms->seq_no, now);
+    return 1;
+  }
+
   marshal_init (mbuf, self->msgtype);
   marshal_measurements(mbuf, ms->index, ms->seq_no, now);
   return 1;
@@ -190,16 +467,41 @@ owb_row_start(OmlWriter* writer, OmlMStream* ms, double now)
  */
 static int
 owb_row_end(OmlWriter* writer, OmlMStream* ms) {
-  (void)ms;
   OmlBinWriter* self = (OmlBinWriter*)writer;
   MBuffer* mbuf;
+
+  if (self->holding) {
+    OwbBatch* b = &self->batch;
+    self->holding = 0;
+    if (b->col != b->width) {
+      return 0;
+    }
+    if (++b->rows == OWB_BATCH_ROWS) {
+      return owb_batch_write(self);
+    }
+    return 1;
+  }
+
   if ((mbuf = self->mbuf) == NULL) {
     return 0; /* previous use of mbuf failed */
   }
 
-  marshal_finalize(self->mbuf);
-  if (marshal_get_msgtype (self->mbuf) == OMB_LDATA_P) {
-    self->msgtype = OMB_LDATA_P; // Generate long packets from now on.
+  if (!self->compact) {
+    marshal_finalize(self->mbuf);
+    if (marshal_get_msgtype (self->mbuf) == OMB_LDATA_P) {
+      self->msgtype = OMB_LDATA_P; // Generate long packets from now on.
+    }
+
+  } else if (0 == mbuf_message_length(mbuf) || !marshal_compact_finalize(mbuf)) {
+    /* The message was reset on failure; the receiver will not get it, but
+     * the dictionary of the stream might have changed nonetheless */
+    self->states[ms->index].valid = 0;
+    self->mbuf = NULL;
+    bw_release_write_buf(self->bufferedWriter);
+    return 0;
+
+  } else {
+    self->states[ms->index] = self->pending;
   }
 
   if (0 == ms->index) {
@@ -223,14 +525,24 @@ owb_row_end(OmlWriter* writer, OmlMStream* ms) {
         mbuf_message(self->mbuf), mbuf_message_length(self->mbuf));
   }
 
+  oml_writer_keep_row(ms, mbuf);
   mbuf_begin_write(mbuf);
 
   self->mbuf = NULL;
-  bw_msgcount_add(self->bufferedWriter, 1);
+  bw_msgcount_add(self->bufferedWriter, ms, 1);
   bw_release_write_buf(self->bufferedWriter);
   return 1;
 }
 
+/** Function called to write out the rows held back for a batch.
+ * \see oml_writer_flush
+ */
+static int
+owb_flush(OmlWriter* writer)
+{
+  return owb_batch_write((OmlBinWriter*)writer);
+}
+
 /** Function called to close the writer and free its allocated objects.
  * \see oml_writer_close
  */
@@ -238,6 +550,7 @@ static OmlWriter*
 owb_close(OmlWriter* writer)
 {
   OmlWriter *next;
+  int i;
 
   if(!writer) {
     return NULL;
@@ -249,6 +562,12 @@ owb_close(OmlWriter* writer)
 
   // Blocks until the buffered writer drains
   bw_close (self->bufferedWriter);
+  oml_value_array_reset(self->batch.values, OWB_BATCH_ROWS * self->batch.size);
+  oml_free(self->batch.values);
+  for (i = 0; i < self->nstates; i++) {
+    strdict_destroy(self->states[i].dict);
+  }
+  oml_free(self->states);
   oml_free(self);
 
   return next;
@@ -17,51 +17,111 @@
 #include <assert.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
 #include <time.h>
+#include <stdint.h>
 
 #include "oml2/omlc.h"
 #include "ocomm/o_log.h"
 #include "ocomm/o_socket.h"
 
+#include "mem.h"
 #include "client.h"
 #include "buffered_writer.h"
+#include "spool.h"
 
 /** Default target size in each MBuffer of the chunk */
 #define DEF_CHAIN_BUFFER_SIZE 1024
 
-/** A chunk of data to be put in a circular chain */
-typedef struct BufferChunk {
+/** Maximal time data waits in a partially-filled chunk before being sent [ms] */
+#define BW_FLUSH_INTERVAL 100
 
-  struct BufferChunk*  next;	/**< Link to the next buffer in the chunk */
+/** Amount of spooled data replayed per BW_FLUSH_INTERVAL, when no live data is waiting [B] */
+#define BW_SPOOL_REPLAY_BUDGET (128 * 1024)
 
-  MBuffer* mbuf;		/**< MBuffer used for storage */
-  size_t   targetBufSize;	/**< Target maximal size of mbuf for that chunk */
+/* The chunk cursors and flags are shared between the producers and the reader
+ * thread without a common lock */
+#define BW_LOAD(ptr) __atomic_load_n((ptr), __ATOMIC_SEQ_CST)
+#define BW_STORE(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_SEQ_CST)
+
+/** Fraction of the ring kept for higher priority streams, as a divisor */
+#define BW_PRIORITY_RESERVE 8
+
+/** Values of BufferedWriter::sending */
+#define BW_IDLE 0
+#define BW_SENDING 1
+#define BW_EVICTING 2
+
+/** Number of messages of one OmlMStream in a BufferChunk */
+typedef struct BufferChunkStream {
+
+  OmlMStream* ms;		/**< Stream the messages belong to */
 
-  pthread_mutex_t lock;		/**< Mutex preventing access to chunk's MBuffer by both threads at once */
+  int nmessages;		/**< Number of messages of that stream */
+
+} BufferChunkStream;
+
+/** A chunk of data in the ring of a BufferedWriter */
+typedef struct BufferChunk {
+
+  MBuffer* mbuf;		/**< MBuffer used for storage */
 
   int nmessages;		/**< Number of messages contained in this chunk */
 
+  BufferChunkStream* streams;	/**< Breakdown of nmessages per stream */
+  int nstreams;			/**< Number of entries used in streams */
+  int maxstreams;		/**< Number of entries allocated in streams */
+
+  int priority;			/**< Highest OmlPriority of the messages in this chunk */
+
 } BufferChunk;
 
-/** A writer reading from a chain of BufferChunks */
+/** A writer reading from a ring of BufferChunks
+ *
+ * Producers fill the chunk at index head, one at a time under write_lock.
+ * Once it is full (or the reader asks for it), they publish it by advancing
+ * head, and move on to the next chunk. The reader thread sends the chunks
+ * from tail to head, and advances tail when one has been fully sent. Only the
+ * producers move head, and mostly the reader moves tail, so handing chunks
+ * over only takes atomic accesses to the cursors. The reader thread only sleeps
+ * when it has caught up, and is woken up when a chunk is published, or after
+ * BW_FLUSH_INTERVAL to collect whatever data is in the current chunk.
+ *
+ * If a Spool is attached, chunks which do not fit in the ring are appended to
+ * it rather than dropped. The reader thread replays them, oldest first, once
+ * it has sent all the chunks of the ring, and at most BW_SPOOL_REPLAY_BUDGET
+ * per BW_FLUSH_INTERVAL, so new data keeps precedence.
+ *
+ * Each OmlMStream may only fill a share of the ring which depends on its
+ * OmlPriority. When a stream has used its share, its OmlOverflowPolicy decides
+ * whether to drop the new tuple, wait for room, or evict the oldest chunk.
+ * Decimated streams start keeping only some of their tuples once they have
+ * used half of their share. Producers evict chunks themselves, by advancing
+ * tail, under write_lock; the sending flag keeps them from doing so while the
+ * reader is sending, in which case the new tuple is dropped instead. Chunks
+ * holding data of a higher priority are never evicted. The reader signals room
+ * when it advances tail.
+ */
 struct BufferedWriter {
   int  active;			/**< Set to !0 if buffer is active; 0 kills the thread */
 
-  long unallocatedBuffers;	/**< Number of links which can still be allocated */
   size_t bufSize;		/**< Target size of MBuffer in each chunk*/
 
   OmlOutStream*    outStream;	/**< Opaque handler to  the output stream*/
 
-  BufferChunk* writerChunk;	/**< Chunk where the data gets stored until it's pushed out */
-  BufferChunk* nextReaderChunk;	/**< Chunk where to read the data next */
-  BufferChunk* firstChunk;	/**< Immutable entry into the chain */
+  BufferChunk* chunks;		/**< Ring of preallocated chunks */
+  uint64_t nchunks;		/**< Number of chunks in the ring */
+  uint64_t head;		/**< Index (modulo nchunks) of the chunk being filled by the producers */
+  uint64_t tail;		/**< Index (modulo nchunks) of the next chunk to send */
+  int flush;			/**< Set by the reader thread to get the current chunk published on the next release */
+  int sleeping;			/**< Set while the reader thread waits for a chunk */
 
   MBuffer*     meta_buf;	/**< Buffer holding protocol headers */
-  MBuffer*     read_buf;	/**< Read buffer used to double-buffer reading */
 
-  pthread_mutex_t lock;		/**< Mutex protecting the chain structure */
+  pthread_mutex_t write_lock;	/**< Mutex giving producers exclusive access to the current chunk */
+  pthread_mutex_t lock;		/**< Mutex protecting the sleep of the reader thread */
   pthread_mutex_t meta_lock;	/**< Mutex protecting the headers buffer */
-  pthread_cond_t semaphore;	/**< Semaphore indicating that more data has been written */
+  pthread_cond_t semaphore;	/**< Semaphore indicating that a chunk has been published */
   pthread_t  readerThread;	/**< Thread in charge of reading the queue and writing the data out */
 
   time_t last_failure_time;	/**< Time of the last failure, to backoff for REATTEMP_INTERVAL before retryying **/
@@ -70,17 +130,33 @@ struct BufferedWriter {
 
   int retval;			/**< Return status from the thread */
 
-  int nlost;			/**< Number of lost messages since last query */
+  int nlost;			/**< Number of lost messages since last query, \see bw_nlost_reset */
+
+  pthread_cond_t room;		/**< Condition signalled, with write_lock, when chunks are freed */
+  int waiting;			/**< Number of producers waiting for room */
+  int sending;			/**< BW_SENDING while the reader uses the chunks from tail, BW_EVICTING while a producer evicts one */
+
+  Spool* spool;			/**< On-disk queue for chunks not fitting in the ring, or NULL */
+
+  pthread_t reserver;		/**< Thread holding the write_lock across several messages, if reserved */
+  int reserved;			/**< Number of nested reservations held by the reserver */
 
 };
 #define REATTEMP_INTERVAL 5    //! Seconds to open the stream again
 
-static BufferChunk* getNextWriteChunk(BufferedWriter* self, BufferChunk* current);
-static BufferChunk* getNextReadChunk(BufferedWriter* self);
-static BufferChunk* createBufferChunk(BufferedWriter* self);
+static BufferChunk* getNextWriteChunk(BufferedWriter* self, BufferChunk* current, OmlMStream* ms);
+static void dropChunk(BufferedWriter* self, BufferChunk* chunk, const char* reason);
+static inline uint64_t publishedChunks(BufferedWriter* self);
+static uint64_t ringShare(BufferedWriter* self, int priority);
+static int keepDecimated(BufferedWriter* self, OmlMStream* ms);
+static BufferChunk* nextWriteChunk(BufferedWriter* self, BufferChunk* current);
+static int publishWriteChunk(BufferedWriter* self);
+static int createBufferChain(BufferedWriter* self, uint64_t nchunks);
 static int destroyBufferChain(BufferedWriter* self);
 static void* bufferedWriterThread(void* handle);
-static int processChunk(BufferedWriter* self, BufferChunk* chunk);
+static int processChunks(BufferedWriter* self, uint64_t* tail, uint64_t head);
+static int evictOldestChunk(BufferedWriter* self, int priority);
+static ssize_t replaySpool(BufferedWriter* self, size_t max);
 
 /** Create a BufferedWriter instance
  *
@@ -111,23 +187,21 @@ bw_create(OmlOutStream* outStream, long  queueCapacity, long chunkSize)
     self->bufSize = chunkSize > 0 ? chunkSize : DEF_CHAIN_BUFFER_SIZE;
 
     nchunks = queueCapacity / self->bufSize;
-    self->unallocatedBuffers = (nchunks > 2) ? nchunks : 2; /* at least two chunks */
+    if (nchunks < 2) {
+      nchunks = 2; /* at least two chunks */
+    }
 
     logdebug ("%s: Buffer size %dB (%d chunks of %dB)\n",
         self->outStream->dest,
-        self->unallocatedBuffers*self->bufSize,
-        self->unallocatedBuffers, self->bufSize);
-
-    if(NULL == (self->writerChunk = self->nextReaderChunk = self->firstChunk = createBufferChunk(self))) {
-      oml_free(self);
-      self = NULL;
+        nchunks*self->bufSize,
+        nchunks, self->bufSize);
 
-    } else if(NULL == (self->meta_buf = mbuf_create())) {
+    if(createBufferChain(self, nchunks)) {
       destroyBufferChain(self);
       oml_free(self);
       self = NULL;
 
-    } else if(NULL == (self->read_buf = mbuf_create())) {
+    } else if(NULL == (self->meta_buf = mbuf_create())) {
       destroyBufferChain(self);
       oml_free(self);
       self = NULL;
@@ -135,8 +209,11 @@ bw_create(OmlOutStream* outStream, long  queueCapacity, long chunkSize)
     } else {
       /* Initialize mutex and condition variable objects */
       pthread_cond_init(&self->semaphore, NULL);
+      pthread_cond_init(&self->room, NULL);
       pthread_mutex_init(&self->lock, NULL);
       logdebug3("%s: initialised mutex %p\n", self->outStream->dest, &self->lock);
+      pthread_mutex_init(&self->write_lock, NULL);
+      logdebug3("%s: initialised mutex %p\n", self->outStream->dest, &self->write_lock);
       pthread_mutex_init(&self->meta_lock, NULL);
       logdebug3("%s: initialised mutex %p\n", self->outStream->dest, &self->meta_lock);
 
@@ -165,13 +242,18 @@ bw_close(BufferedWriter* instance)
   if(!self) { return; }
 
   if (oml_lock (&self->lock, __FUNCTION__)) { return; }
-  self->active = 0;
+  BW_STORE(&self->active, 0);
 
   loginfo ("%s: Waiting for buffered queue thread to drain...\n", self->outStream->dest);
 
   pthread_cond_signal (&self->semaphore);
   oml_unlock (&self->lock, __FUNCTION__);
 
+  /* Release producers waiting for room */
+  oml_lock (&self->write_lock, __FUNCTION__);
+  pthread_cond_broadcast (&self->room);
+  oml_unlock (&self->write_lock, __FUNCTION__);
+
   if(pthread_join (self->readerThread, (void**)&retval)) {
     logwarn ("%s: Cannot join buffered queue reader thread: %s\n",
         self->outStream->dest, strerror(errno));
@@ -186,10 +268,61 @@ bw_close(BufferedWriter* instance)
   }
 
   self->outStream->close(self->outStream);
+  spool_destroy(self->spool);
   destroyBufferChain(self);
   oml_free(self);
 }
 
+/** Spill the chunks which do not fit in the ring to disk, rather than dropping them.
+ *
+ * This should be called right after bw_create, before any data is pushed.
+ *
+ * \param instance BufferedWriter handle
+ * \param dir directory in which to create the spool segment files
+ * \param max_size maximal amount of data to spool [B], 0 for no limit
+ * \return 0 on success, -1 otherwise
+ *
+ * \see spool_new, bw_spooled_bytes
+ */
+int
+bw_spool(BufferedWriter* instance, const char* dir, uint64_t max_size)
+{
+  Spool* spool;
+
+  if (!instance || BW_LOAD(&instance->spool)) {
+    return -1;
+  }
+  if (NULL == (spool = spool_new(dir, instance->outStream->dest, max_size))) {
+    return -1;
+  }
+  BW_STORE(&instance->spool, spool);
+  return 0;
+}
+
+/** Return the amount of data currently waiting in the spool of a BufferedWriter.
+ *
+ * \param instance BufferedWriter handle
+ * \return the amount of spooled data [B], 0 if there is no spool
+ *
+ * \see bw_spool
+ */
+uint64_t
+bw_spooled_bytes(BufferedWriter* instance)
+{
+  return instance ? spool_bytes(BW_LOAD(&instance->spool)) : 0;
+}
+
+/** Return the chunk currently filled by the producers.
+ *
+ * \param self BufferedWriter pointer
+ * \return the BufferChunk at the head of the ring
+ */
+static inline BufferChunk*
+writerChunk(BufferedWriter* self)
+{
+  return &self->chunks[BW_LOAD(&self->head) % self->nchunks];
+}
+
 /** Add some data to the end of the queue (lock must be held).
  *
  * \param instance BufferedWriter handle
@@ -206,19 +339,21 @@ int
 bw_push(BufferedWriter* instance, uint8_t* data, size_t size)
 {
   BufferedWriter* self = (BufferedWriter*)instance;
-  if (!self->active) { return 0; }
+  if (!BW_LOAD(&self->active)) { return 0; }
 
-  BufferChunk* chunk = self->writerChunk;
-  if (chunk == NULL) { return 0; }
+  BufferChunk* chunk = writerChunk(self);
 
-  if (mbuf_wr_remaining(chunk->mbuf) < size) {
-    chunk = getNextWriteChunk(self, chunk);
+  if (mbuf_wr_remaining(chunk->mbuf) < size &&
+      NULL == (chunk = getNextWriteChunk(self, chunk, NULL))) {
+    /* Make room in the current chunk, only keeping the message in progress */
+    chunk = writerChunk(self);
+    dropChunk(self, chunk, "Dropping");
+    mbuf_repack_message2(chunk->mbuf);
   }
 
   if (mbuf_write(chunk->mbuf, data, size) < 0) {
     return 0;
   }
-  pthread_cond_signal(&self->semaphore);
 
   return 1;
 }
@@ -276,19 +411,60 @@ _bw_push_meta(BufferedWriter* instance, uint8_t* data, size_t size)
   return result;
 }
 
+/** Reset the message counts of a BufferChunk.
+ *
+ * \param chunk BufferChunk to reset
+ */
+static inline void
+clearChunkCounts(BufferChunk* chunk)
+{
+  chunk->nmessages = 0;
+  chunk->nstreams = 0;
+  chunk->priority = OML_PRIORITY_LOW;
+}
+
 /** Count the addition (or deletion) of a full message in the current BufferChunk.
+ *
+ * The messages are also counted per stream, so they can be accounted to the
+ * right stream if the chunk is lost, and the chunk takes the highest priority
+ * of its streams.
  *
  * \param instance BufferedWriter handle
+ * \param ms OmlMStream the messages belong to, or NULL
  * \param nmessages number of messages to count (can be negative)
  *
  * \return the (new) current number of messages in the current writer BufferChunk
  *
- * \see bw_msgcount_reset, bw_nlost_reset
+ * \see bw_msgcount_reset
  */
 int
-bw_msgcount_add(BufferedWriter* instance, int nmessages) {
-  instance->writerChunk->nmessages += nmessages;
-  return instance->writerChunk->nmessages;
+bw_msgcount_add(BufferedWriter* instance, OmlMStream* ms, int nmessages) {
+  BufferChunk* chunk = writerChunk(instance);
+  BufferChunkStream* streams;
+  int i, n;
+
+  chunk->nmessages += nmessages;
+  if (ms) {
+    for (i = 0; i < chunk->nstreams && chunk->streams[i].ms != ms; i++);
+    if (i == chunk->maxstreams) {
+      n = chunk->maxstreams ? 2 * chunk->maxstreams : 4;
+      if (NULL == (streams = oml_realloc(chunk->streams, n * sizeof(BufferChunkStream)))) {
+        return chunk->nmessages;
+      }
+      chunk->streams = streams;
+      chunk->maxstreams = n;
+    }
+    if (i == chunk->nstreams) {
+      chunk->streams[i].ms = ms;
+      chunk->streams[i].nmessages = 0;
+      chunk->nstreams++;
+    }
+    chunk->streams[i].nmessages += nmessages;
+    if (ms->priority > chunk->priority) {
+      chunk->priority = ms->priority;
+    }
+  }
+  return chunk->nmessages;
 }
 
 /** Reset the message count in the current BufferChunk and return its previous value.
@@ -297,56 +473,175 @@ bw_msgcount_add(BufferedWriter* instance, int nmessages) {
  *
  * \return the number of messages in the current writer BufferChunk before resetting
  *
- * \see bw_msgcount_add, bw_nlost_reset
+ * \see bw_msgcount_add
  */
 int
 bw_msgcount_reset(BufferedWriter* instance) {
-  int n = instance->writerChunk->nmessages;
-  instance->writerChunk->nmessages = 0;
+  BufferChunk* chunk = writerChunk(instance);
+  int n = chunk->nmessages;
+  clearChunkCounts(chunk);
   return n;
 }
 
-/** Reset the number of messages lost by the BufferedWriter and return its previous value.
+/** Return the number of messages lost by the BufferedWriter since the last call, and reset it.
  *
- * \param instance BufferedWriter handle
+ * \deprecated Lost messages are now accounted for in the lost field of their
+ * OmlMStream, which also covers those lost by other writers.
  *
- * \return the number of lost messages in the BufferedWriter before resetting
+ * \param instance BufferedWriter handle
  *
- * \see bw_msgcount_add, bw_msgcount_reset
+ * \return the number of messages dropped from the ring since the last call
  */
 int
 bw_nlost_reset(BufferedWriter* instance) {
-  int n = instance->nlost;
-  instance->nlost = 0;
-  return n;
+  return __atomic_exchange_n(&instance->nlost, 0, __ATOMIC_SEQ_CST);
 }
+
+/** Return the number of messages of a stream in the current BufferChunk.
+ *
+ * The caller should have exclusive access to the chunk, \see bw_get_write_buf.
+ *
+ * \param instance BufferedWriter handle
+ * \param ms OmlMStream the messages belong to
+ *
+ * \return the number of messages of ms in the current writer BufferChunk
+ *
+ * \see bw_msgcount_add
+ */
+int
+bw_msgcount(BufferedWriter* instance, OmlMStream* ms) {
+  BufferChunk* chunk = writerChunk(instance);
+  int i;
+
+  for (i = 0; i < chunk->nstreams; i++) {
+    if (chunk->streams[i].ms == ms) {
+      return chunk->streams[i].nmessages;
+    }
+  }
+  return 0;
+}
+
+/** Tell whether the calling thread holds a reservation on the BufferedWriter.
+ *
+ * \param self BufferedWriter pointer
+ * \return 1 if the write_lock is held through bw_reserve, 0 otherwise
+ * \see bw_reserve
+ */
+static inline int
+isReserver(BufferedWriter* self)
+{
+  return BW_LOAD(&self->reserved) && pthread_equal(BW_LOAD(&self->reserver), pthread_self());
+}
+
+/** Keep exclusive access to the BufferedWriter across several messages.
+ *
+ * The write_lock is acquired once, and bw_get_write_buf and
+ * bw_release_write_buf do not take or release it again until bw_unreserve is
+ * called. The reader thread can still send published chunks in the meantime.
+ * Reservations can be nested.
+ *
+ * \param instance BufferedWriter handle
+ * \return 0 on success, -1 if the BufferedWriter is not active anymore
+ * \see bw_unreserve, bw_get_write_buf
+ */
+int
+bw_reserve(BufferedWriter* instance)
+{
+  BufferedWriter* self = (BufferedWriter*)instance;
+  if (!BW_LOAD(&self->active)) { return -1; }
+
+  if (isReserver(self)) {
+    self->reserved++;
+    return 0;
+  }
+
+  oml_lock(&self->write_lock, __FUNCTION__);
+  BW_STORE(&self->reserver, pthread_self());
+  BW_STORE(&self->reserved, 1);
+  return 0;
+}
+
+/** Release a reservation obtained with bw_reserve.
+ *
+ * If the reader thread asked for the current chunk in the meantime, it is
+ * published when the last reservation is released.
+ *
+ * \param instance BufferedWriter handle
+ * \see bw_reserve
+ */
+void
+bw_unreserve(BufferedWriter* instance)
+{
+  BufferedWriter* self = (BufferedWriter*)instance;
+  if (!isReserver(self)) { return; }
+
+  if (self->reserved > 1) {
+    self->reserved--;
+    return;
+  }
+
+  BW_STORE(&self->reserved, 0);
+  if (BW_LOAD(&self->flush)) {
+    publishWriteChunk(self);
+  }
+  oml_unlock(&self->write_lock, __FUNCTION__);
+}
+
+/** Check whether the calling thread has reserved a BufferedWriter.
+ *
+ * \param instance BufferedWriter to check
+ * \return 1 if the calling thread holds a reservation, 0 otherwise
+ * \see bw_reserve
+ */
+int
+bw_is_reserved(BufferedWriter* instance)
+{
+  return isReserver((BufferedWriter*)instance);
+}
+
 /** Return an MBuffer with exclusive access
+ *
+ * If the stream is being decimated, some tuples are refused. If the current
+ * chunk is full, and there is no room for the next one in the share of the
+ * ring of the stream, its overflow policy is applied.
  *
  * \param instance BufferedWriter handle
+ * \param ms OmlMStream for which a message will be written
  *
- * \return an MBuffer instance if success to write in, NULL otherwise
- * \see bw_release_write_buf
+ * \return an MBuffer instance if success to write in, NULL otherwise (without exclusive access, unless reserved)
+ * \see bw_release_write_buf, getNextWriteChunk, bw_reserve
  */
 MBuffer*
-bw_get_write_buf(BufferedWriter* instance)
+bw_get_write_buf(BufferedWriter* instance, OmlMStream* ms)
 {
   BufferedWriter* self = (BufferedWriter*)instance;
-  if (!self->active) { return 0; }
+  if (!BW_LOAD(&self->active)) { return 0; }
 
-  BufferChunk* chunk = self->writerChunk;
-  if (chunk == NULL) { return 0; }
-  oml_lock(&chunk->lock, __FUNCTION__);
+  int reserved = isReserver(self);
+  if (!reserved) {
+    oml_lock(&self->write_lock, __FUNCTION__);
+  }
 
-  MBuffer* mbuf = chunk->mbuf;
-  if (mbuf_write_offset(mbuf) >= chunk->targetBufSize) {
-    chunk = getNextWriteChunk(self, chunk);
-    mbuf = chunk->mbuf;
+  BufferChunk* chunk = writerChunk(self);
+  if ((ms && OML_OVERFLOW_DECIMATE == ms->overflow && !keepDecimated(self, ms)) ||
+      ((mbuf_write_offset(chunk->mbuf) >= self->bufSize ||
+        publishedChunks(self) >= ringShare(self, ms ? ms->priority : OML_PRIORITY_NORMAL)) &&
+       NULL == (chunk = getNextWriteChunk(self, chunk, ms)))) {
+    if (!reserved) {
+      oml_unlock(&self->write_lock, __FUNCTION__);
+    }
+    return NULL;
   }
-  return mbuf;
+  return chunk->mbuf;
 }
 
 
 /** Return and unlock MBuffer
+ *
+ * The reader thread is not woken up here, but only when a chunk is full. If
+ * it asked for the current chunk in the meantime, it is published. The
+ * write_lock is kept if the calling thread holds a reservation.
+ *
  * \param instance BufferedWriter handle for which a buffer was previously obtained through bw_get_write_buf
  *
  * \see bw_get_write_buf
@@ -355,130 +650,370 @@ void
 bw_release_write_buf(BufferedWriter* instance)
 {
   BufferedWriter* self = (BufferedWriter*)instance;
-  pthread_cond_signal(&self->semaphore); /* assume we locked for a reason */
-  oml_unlock(&self->writerChunk->lock, __FUNCTION__);
+  if (BW_LOAD(&self->flush)) {
+    publishWriteChunk(self);
+  }
+  if (!isReserver(self)) {
+    oml_unlock(&self->write_lock, __FUNCTION__);
+  }
 }
 
-/** Find the next empty write chunk, sets self->writerChunk to it and returns * it.
- *
- * We only use the next one if it is empty. If not, we essentially just filled
- * up the last chunk and wrapped around to the socket reader. In that case, we
- * either create a new chunk if the overall buffer can still grow, or we drop
- * the data from the current one.
+/** Wake the reader thread up if it is waiting for a chunk.
  *
- * \warning A lock on the current writer chunk should be held prior to calling
- * this function. It will be released, and the returned writerChunk will be
- * similarly locked.
+ * \param self BufferedWriter pointer
+ * \see waitForChunk
+ */
+static void
+wakeReader(BufferedWriter* self)
+{
+  if (BW_LOAD(&self->sleeping)) {
+    oml_lock(&self->lock, __FUNCTION__);
+    pthread_cond_signal(&self->semaphore);
+    oml_unlock(&self->lock, __FUNCTION__);
+  }
+}
+
+/** Return the number of published chunks waiting to be sent.
  *
  * \param self BufferedWriter pointer
- * \param current locked BufferChunk to use or from which to find the next
- * \return a locked BufferChunk in which data can be stored
+ * \return the number of chunks between tail and head
  */
-BufferChunk*
-getNextWriteChunk(BufferedWriter* self, BufferChunk* current) {
-  int nlost;
-  BufferChunk* nextBuffer;
+static inline uint64_t
+publishedChunks(BufferedWriter* self)
+{
+  return BW_LOAD(&self->head) - BW_LOAD(&self->tail);
+}
 
-  assert(current != NULL);
-  nextBuffer = current->next;
-  oml_unlock(&current->lock, __FUNCTION__);
-  assert(nextBuffer != NULL);
+/** Return the number of published chunks a stream may leave waiting in the ring.
+ *
+ * High priority streams may use the whole ring. Normal priority streams
+ * leave 1/BW_PRIORITY_RESERVE of it, and low priority ones half of it, but
+ * may always publish at least one chunk.
+ *
+ * \param self BufferedWriter pointer
+ * \param priority OmlPriority of the stream
+ * \return the maximal value of publishedChunks() before the stream overflows
+ */
+static uint64_t
+ringShare(BufferedWriter* self, int priority)
+{
+  uint64_t max = self->nchunks - 1;
 
-  oml_lock(&self->lock, __FUNCTION__);
-  if (nextBuffer == self->nextReaderChunk) {
-    if (self->unallocatedBuffers > 0) {
-      /* The next buffer is the next to be read, but we can allocate more,
-       * allocate a new buffer, insert it after the current writer, and use it */
-      nextBuffer = createBufferChunk(self);
-      assert(nextBuffer); /** \todo Use existing buffer if allocation fails */
-      oml_unlock(&self->lock, __FUNCTION__);
+  if (priority > OML_PRIORITY_NORMAL) {
+    return max;
+  } else if (priority == OML_PRIORITY_NORMAL) {
+    return max - max / BW_PRIORITY_RESERVE;
+  }
+  return max / 2 > 0 ? max / 2 : 1;
+}
 
-      oml_lock(&current->lock, __FUNCTION__);
-      nextBuffer->next = current->next;
-      current->next = nextBuffer; /* we have a lock on this one */
-      oml_unlock(&current->lock, __FUNCTION__);
+/** Decide whether a stream being decimated may write its next tuple.
+ *
+ * Decimation starts once half of the share of the ring of the stream is used,
+ * so the tuples which are kept still find room.
+ *
+ * \param self BufferedWriter pointer
+ * \param ms OmlMStream with the OML_OVERFLOW_DECIMATE policy
+ * \return 1 if the tuple must be written, 0 if it must be dropped
+ * \see ringShare
+ */
+static int
+keepDecimated(BufferedWriter* self, OmlMStream* ms)
+{
+  if (publishedChunks(self) < ringShare(self, ms->priority) / 2) {
+    ms->overflowed = 0;
+    return 1;
+  }
+  return 0 == ms->overflowed++ % (ms->overflow_param ? ms->overflow_param : 1);
+}
 
-      oml_lock(&self->lock, __FUNCTION__);
+/** Wait until the reader thread frees enough chunks, or until a timeout.
+ *
+ * \warning The write_lock must be held prior to calling this function. It is
+ * released while waiting, so the current chunk may have changed on return.
+ *
+ * \param self BufferedWriter pointer
+ * \param limit number of published chunks under which there is room
+ * \param timeout maximal time to wait [ms]
+ * \return 1 if there is room, 0 otherwise
+ */
+static int
+waitForRoom(BufferedWriter* self, uint64_t limit, uint32_t timeout)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  ts.tv_sec += timeout / 1000;
+  ts.tv_nsec += (timeout % 1000) * 1000000;
+  if (ts.tv_nsec >= 1000000000) {
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000;
+  }
 
-    } else {
-      /* The next buffer is the next to be read, and we cannot allocate more,
-       * use it, dropping unread data, and advance the read pointer */
-      self->nextReaderChunk = nextBuffer->next;
+  __atomic_add_fetch(&self->waiting, 1, __ATOMIC_SEQ_CST);
+  while (BW_LOAD(&self->active) && publishedChunks(self) >= limit) {
+    if (pthread_cond_timedwait(&self->room, &self->write_lock, &ts)) {
+      break;
     }
   }
+  __atomic_sub_fetch(&self->waiting, 1, __ATOMIC_SEQ_CST);
 
-  self->writerChunk = nextBuffer;
-  nlost = bw_msgcount_reset(self);
-  self->nlost += nlost;
-  oml_unlock(&self->lock, __FUNCTION__);
-  oml_lock(&nextBuffer->lock, __FUNCTION__);
-  if (nlost) {
-    logwarn("%s: Dropping %d samples (%dB)\n", self->outStream->dest, nlost, mbuf_fill(nextBuffer->mbuf));
+  return publishedChunks(self) < limit;
+}
+
+/** Wake up the producers waiting for room, if any.
+ *
+ * \param self BufferedWriter pointer
+ * \see waitForRoom
+ */
+static void
+signalRoom(BufferedWriter* self)
+{
+  if (BW_LOAD(&self->waiting)) {
+    oml_lock(&self->write_lock, __FUNCTION__);
+    pthread_cond_broadcast(&self->room);
+    oml_unlock(&self->write_lock, __FUNCTION__);
+  }
+}
+
+/** Get exclusive use of the oldest published chunks.
+ *
+ * The reader claims them before sending, and producers before evicting one.
+ *
+ * \param self BufferedWriter pointer
+ * \param state BW_SENDING or BW_EVICTING
+ * \return 1 if the chunks have been claimed, 0 if they are in use
+ * \see releaseChunks
+ */
+static inline int
+claimChunks(BufferedWriter* self, int state)
+{
+  int idle = BW_IDLE;
+  return __atomic_compare_exchange_n(&self->sending, &idle, state, 0,
+      __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+/** Give up the use of the oldest published chunks.
+ *
+ * \param self BufferedWriter pointer
+ * \see claimChunks
+ */
+static inline void
+releaseChunks(BufferedWriter* self)
+{
+  BW_STORE(&self->sending, BW_IDLE);
+}
+
+/** Account for the loss of all the messages of a chunk.
+ *
+ * The messages are added to the lost count of their OmlMStream.
+ *
+ * \param self BufferedWriter pointer
+ * \param chunk BufferChunk whose messages are lost
+ * \param reason verb to use in the log message
+ */
+static void
+dropChunk(BufferedWriter* self, BufferChunk* chunk, const char* reason)
+{
+  int i;
+
+  for (i = 0; i < chunk->nstreams; i++) {
+    __atomic_add_fetch(&chunk->streams[i].ms->lost, chunk->streams[i].nmessages, __ATOMIC_SEQ_CST);
   }
-  mbuf_clear2(nextBuffer->mbuf, 0);
+  if (chunk->nmessages) {
+    __atomic_add_fetch(&self->nlost, chunk->nmessages, __ATOMIC_SEQ_CST);
+    logwarn("%s: %s %d samples (%dB)\n", self->outStream->dest, reason, chunk->nmessages,
+        mbuf_message_offset(chunk->mbuf) - mbuf_read_offset(chunk->mbuf));
+  }
+  clearChunkCounts(chunk);
+}
+
+/** Publish the current chunk to the reader thread, and move on to the next one.
+ *
+ * \warning The write_lock must be held, and the ring must not be full.
+ *
+ * \param self BufferedWriter pointer
+ * \param current locked BufferChunk at the head of the ring
+ * \return the new head BufferChunk, cleared but for any message in progress in current
+ */
+static BufferChunk*
+advanceWriteChunk(BufferedWriter* self, BufferChunk* current)
+{
+  uint64_t head = BW_LOAD(&self->head);
+  BufferChunk* next = &self->chunks[(head + 1) % self->nchunks];
 
-  // Now we just need to copy the message from current to self->writerChunk
+  mbuf_clear2(next->mbuf, 0);
+  clearChunkCounts(next);
+
+  /* Move any message in progress to the next chunk */
   int msgSize = mbuf_message_length(current->mbuf);
   if (msgSize > 0) {
-    mbuf_write(nextBuffer->mbuf, mbuf_message(current->mbuf), msgSize);
+    mbuf_write(next->mbuf, mbuf_message(current->mbuf), msgSize);
     mbuf_reset_write(current->mbuf);
   }
 
-  return nextBuffer;
+  BW_STORE(&self->head, head + 1);
+  wakeReader(self);
+
+  return next;
 }
 
-/** Get the next available reader chunck (even if there is nothing to read)
+/** Spill the complete messages of the current chunk to the spool, if any.
  *
- * This function acquires the lock on the BufferedWriter on its own.
+ * \warning The write_lock must be held prior to calling this function.
  *
- * \warning A lock on the BufferedWriter should be held prior to calling
- * this function. It will be released, and the returned writerChunk will be
- * similarly locked.
+ * \param self BufferedWriter pointer
+ * \param current BufferChunk at the head of the ring
+ * \return 0 if the chunk has been spooled and can be reused, -1 otherwise
+ */
+static int
+spillWriteChunk(BufferedWriter* self, BufferChunk* current)
+{
+  Spool* spool = BW_LOAD(&self->spool);
+  size_t len = mbuf_message_offset(current->mbuf) - mbuf_read_offset(current->mbuf);
+  int first;
+
+  if (!spool || !current->nmessages) {
+    return -1;
+  }
+
+  first = (0 == spool_bytes(spool));
+  if (spool_append(spool, mbuf_rdptr(current->mbuf), len)) {
+    return -1;
+  }
+  if (first) {
+    loginfo("%s: Spooling samples to disk until they can be sent\n", self->outStream->dest);
+  }
+  logdebug("%s: Spooled %d samples (%dB)\n", self->outStream->dest, current->nmessages, len);
+
+  clearChunkCounts(current);
+  /* Only keep the message in progress, if any */
+  mbuf_repack_message2(current->mbuf);
+  return 0;
+}
+
+/** Find the next empty write chunk, publish the current one, and return the new one.
+ *
+ * This is called when the current chunk is full, or when the stream has used
+ * its share of the ring (the current chunk is then left to higher priority
+ * streams). We only use the next one if the stream has not used its share of
+ * the ring yet. Otherwise, its overflow policy may give it some room, by waiting for
+ * the reader thread to send some chunks, or evicting the oldest one, without
+ * waiting, if the reader is not sending it. If that fails, the complete
+ * messages of the current chunk are spooled, if possible, and the current
+ * chunk is reused. Otherwise, the new message must be dropped.
+ *
+ * \warning The write_lock must be held prior to calling this function. It
+ * might be released and reacquired while waiting for room.
  *
  * \param self BufferedWriter pointer
- * \return a BufferChunk frome which data can next be read
+ * \param current BufferChunk at the head of the ring
+ * \param ms OmlMStream for which a message will be written, or NULL
+ * \return a BufferChunk in which data can be stored, or NULL if the message must be dropped
+ *
+ * \see ringShare, OmlOverflowPolicy
  */
 static BufferChunk*
-getNextReadChunk(BufferedWriter* self) {
-  BufferChunk* chunk;
-  chunk = self->nextReaderChunk;
-  self->nextReaderChunk = chunk->next;
-  return chunk;
+getNextWriteChunk(BufferedWriter* self, BufferChunk* current, OmlMStream* ms) {
+  int priority = ms ? ms->priority : OML_PRIORITY_NORMAL;
+  uint64_t limit = ringShare(self, priority);
+
+  assert(current != NULL);
+
+  if (publishedChunks(self) < limit) {
+    return advanceWriteChunk(self, current);
+  }
+
+  switch (ms ? ms->overflow : OML_OVERFLOW_DROP_NEWEST) {
+  case OML_OVERFLOW_BLOCK:
+    waitForRoom(self, limit, ms->overflow_param);
+    break;
+
+  case OML_OVERFLOW_DROP_OLDEST:
+    evictOldestChunk(self, priority);
+    break;
+
+  }
+
+  /* Other producers may have moved on while the write_lock was released */
+  current = writerChunk(self);
+  if (publishedChunks(self) < limit) {
+    return nextWriteChunk(self, current);
+  } else if (mbuf_write_offset(current->mbuf) < self->bufSize) {
+    /* The current chunk belongs to the share of higher priority streams,
+     * unless it will be spooled when full */
+    return BW_LOAD(&self->spool) ? current : NULL;
+  } else if (!spillWriteChunk(self, current)) {
+    return current;
+  }
+
+  return NULL;
 }
 
-/** Initialise a BufferChunk for a BufferedWriter.
+/** Return the current chunk, or publish it and return the next one if it is full.
  *
- * \warning A lock on the BufferedWriter should be held if the readerThread
- * has already been started.
+ * \warning The write_lock must be held, and the ring must not be full.
  *
  * \param self BufferedWriter pointer
- * \return a pointer to the newly-created BufferChunk, or NULL on error
+ * \param current locked BufferChunk at the head of the ring
+ * \return a BufferChunk in which data can be stored
+ * \see advanceWriteChunk
  */
-BufferChunk*
-createBufferChunk(BufferedWriter* self)
+static BufferChunk*
+nextWriteChunk(BufferedWriter* self, BufferChunk* current)
 {
-  size_t initsize = 0.1 * self->bufSize;
-  MBuffer* buf = mbuf_create2(self->bufSize, initsize);
-  if (buf == NULL) { return NULL; }
+  if (mbuf_write_offset(current->mbuf) < self->bufSize) {
+    return current;
+  }
+  return advanceWriteChunk(self, current);
+}
 
-  BufferChunk* chunk = (BufferChunk*)oml_malloc(sizeof(BufferChunk));
-  if (chunk == NULL) {
-    mbuf_destroy(buf);
-    return NULL;
+/** Publish the current chunk if it holds any message, and there is room for it.
+ *
+ * \warning The write_lock must be held prior to calling this function.
+ *
+ * \param self BufferedWriter pointer
+ * \return 1 if the chunk was published, 0 otherwise
+ */
+static int
+publishWriteChunk(BufferedWriter* self)
+{
+  BufferChunk* chunk = writerChunk(self);
+
+  BW_STORE(&self->flush, 0);
+  if (mbuf_message_offset(chunk->mbuf) > 0 &&
+      publishedChunks(self) < self->nchunks - 1) {
+    advanceWriteChunk(self, chunk);
+    return 1;
   }
-  memset(chunk, 0, sizeof(BufferChunk));
+  return 0;
+}
+
+/** Allocate the ring of BufferChunks of a BufferedWriter.
+ *
+ * \param self BufferedWriter pointer
+ * \param nchunks number of BufferChunks to allocate
+ * \return 0 on success, -1 otherwise
+ */
+static int
+createBufferChain(BufferedWriter* self, uint64_t nchunks)
+{
+  uint64_t i;
+  size_t initsize = 0.1 * self->bufSize;
 
-  // set state
-  chunk->mbuf = buf;
-  chunk->targetBufSize = self->bufSize;
-  chunk->next = chunk;
-  pthread_mutex_init(&chunk->lock, NULL);
-  logdebug3("%s: initialised chunk mutex %p\n", self->outStream->dest, &chunk->lock);
+  if (NULL == (self->chunks = oml_calloc(nchunks, sizeof(BufferChunk)))) {
+    return -1;
+  }
+  self->nchunks = nchunks;
 
-  self->unallocatedBuffers--;
-  logdebug("Allocated chunk of size %dB (up to %d), %d remaining\n",
-        initsize, self->bufSize, self->unallocatedBuffers);
-  return chunk;
+  for (i = 0; i < nchunks; i++) {
+    if (NULL == (self->chunks[i].mbuf = mbuf_create2(self->bufSize, initsize))) {
+      return -1;
+    }
+    clearChunkCounts(&self->chunks[i]);
+  }
+  logdebug("Allocated %d chunks of size %dB\n", nchunks, self->bufSize);
+  return 0;
 }
 
 
@@ -490,33 +1025,123 @@ createBufferChunk(BufferedWriter* self)
  */
 int
 destroyBufferChain(BufferedWriter* self) {
-  BufferChunk *chunk, *start;
+  uint64_t i;
 
   if (!self) {
     return -1;
   }
 
-  /* BufferChunk is a circular buffer */
-  start = self->firstChunk;
-  while( (chunk = self->firstChunk) && chunk!=start) {
-    logdebug("Destroying BufferChunk at %p\n", chunk);
-    self->firstChunk = chunk->next;
-
-    mbuf_destroy(chunk->mbuf);
-    pthread_mutex_destroy(&chunk->lock);
-    oml_free(chunk);
+  if (self->chunks) {
+    for (i = 0; i < self->nchunks; i++) {
+      if (self->chunks[i].mbuf) {
+        mbuf_destroy(self->chunks[i].mbuf);
+      }
+      if (self->chunks[i].streams) {
+        oml_free(self->chunks[i].streams);
+      }
+    }
+    oml_free(self->chunks);
+    self->chunks = NULL;
   }
 
-  mbuf_destroy(self->meta_buf);
-  mbuf_destroy(self->read_buf);
+  if (self->meta_buf) {
+    mbuf_destroy(self->meta_buf);
+  }
 
   pthread_cond_destroy(&self->semaphore);
+  pthread_cond_destroy(&self->room);
   pthread_mutex_destroy(&self->meta_lock);
+  pthread_mutex_destroy(&self->write_lock);
   pthread_mutex_destroy(&self->lock);
 
   return 0;
 }
 
+/** Get the current time from a monotonic clock.
+ * \return the time in milliseconds
+ */
+static uint64_t
+bw_now(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Wait until a chunk is published after head, or until deadline.
+ *
+ * \param self BufferedWriter pointer
+ * \param head value of the head cursor last seen by the reader thread
+ * \param deadline time at which to stop waiting [ms]
+ * \see bw_now
+ */
+static void
+waitForChunk(BufferedWriter* self, uint64_t head, uint64_t deadline)
+{
+  struct timespec ts;
+  uint64_t now = bw_now();
+
+  if (now >= deadline) {
+    return;
+  }
+
+  oml_lock(&self->lock, __FUNCTION__);
+  BW_STORE(&self->sleeping, 1);
+  if (BW_LOAD(&self->head) == head && BW_LOAD(&self->active)) {
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += (deadline - now) / 1000;
+    ts.tv_nsec += ((deadline - now) % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&self->semaphore, &self->lock, &ts);
+  }
+  BW_STORE(&self->sleeping, 0);
+  oml_unlock(&self->lock, __FUNCTION__);
+}
+
+/** Evict the oldest published chunk, to make room for a new one.
+ *
+ * The chunk is only evicted if the reader is not sending it, it holds no data
+ * of a higher priority than that of the requesting stream, and it has not
+ * been partially sent on the current connection. This never waits.
+ *
+ * \warning The write_lock must be held prior to calling this function.
+ *
+ * \param self BufferedWriter pointer
+ * \param priority OmlPriority of the stream needing room
+ * \return 1 if a chunk was evicted, 0 otherwise
+ * \see getNextWriteChunk, OML_OVERFLOW_DROP_OLDEST
+ */
+static int
+evictOldestChunk(BufferedWriter* self, int priority)
+{
+  uint64_t tail;
+  BufferChunk* chunk;
+  int evicted = 0;
+
+  if (!claimChunks(self, BW_EVICTING)) {
+    /* The reader is busy sending; the new tuple will be dropped instead */
+    return 0;
+  }
+
+  tail = BW_LOAD(&self->tail);
+  chunk = &self->chunks[tail % self->nchunks];
+  if (tail != BW_LOAD(&self->head) &&
+      chunk->priority <= priority &&
+      (self->backoff || 0 == mbuf_read_offset(chunk->mbuf))) {
+    dropChunk(self, chunk, "Evicting");
+    BW_STORE(&self->tail, tail + 1);
+    evicted = 1;
+  }
+  releaseChunks(self);
+
+  if (evicted && BW_LOAD(&self->waiting)) {
+    pthread_cond_broadcast(&self->room);
+  }
+  return evicted;
+}
 
 /** Writing thread.
  *
@@ -527,134 +1152,245 @@ static void*
 bufferedWriterThread(void* handle)
 {
   int allsent = 1;
+  int published;
   BufferedWriter* self = (BufferedWriter*)handle;
-  BufferChunk* chunk = self->firstChunk;
+  uint64_t head, tail = 0;
+  uint64_t now, deadline = bw_now() + BW_FLUSH_INTERVAL;
+  size_t replay_left = BW_SPOOL_REPLAY_BUDGET;
+  ssize_t sent;
+
+  while (BW_LOAD(&self->active)) {
+    /* Producers may have evicted chunks */
+    tail = BW_LOAD(&self->tail);
+    head = BW_LOAD(&self->head);
+    if (tail != head) {
+      if ((allsent = processChunks(self, &tail, head)) > 0) {
+        continue;
+      }
 
-  while (self->active) {
-    oml_lock(&self->lock, __FUNCTION__);
-    pthread_cond_wait(&self->semaphore, &self->lock);
-    // Process all chunks which have data in them
-    do {
-      oml_unlock(&self->lock, __FUNCTION__);
-      allsent = processChunk(self, chunk);
-
-      oml_lock(&self->lock, __FUNCTION__);
-      /* Stop if we caught up to the writer... */
-      if (chunk == self->writerChunk) { break; }
-      /* ...otherwise, move on to the next chunk */
-      if (allsent>0) {
-        chunk = getNextReadChunk(self);
+    } else if (replay_left > 0 && bw_spooled_bytes(self) > 0) {
+      /* Only replay spooled data once the live data has been sent */
+      if ((sent = replaySpool(self, replay_left)) > 0) {
+        replay_left -= (size_t)sent < replay_left ? (size_t)sent : replay_left;
+        continue;
       }
-    } while(allsent > 0);
-    oml_unlock(&self->lock, __FUNCTION__);
+    }
+
+    now = bw_now();
+    if (now >= deadline) {
+      deadline = now + BW_FLUSH_INTERVAL;
+      replay_left = BW_SPOOL_REPLAY_BUDGET;
+      if (tail == head) {
+        /* Collect the data in the current chunk, or have the next producer
+         * publish it if one is busy with it */
+        BW_STORE(&self->flush, 1);
+        if (!pthread_mutex_trylock(&self->write_lock)) {
+          published = publishWriteChunk(self);
+          pthread_mutex_unlock(&self->write_lock);
+          if (published) { continue; }
+        }
+      }
+    }
+    waitForChunk(self, head, deadline);
   }
+
   /* Drain this writer before terminating */
   /* XXX: “Backing-off for ...” messages might confuse the user as
    * we don't actually wait after a failure when draining at the end */
-  while ((allsent=processChunk(self, chunk))>=-1) {
-    if(allsent>0) {
-      if (chunk == self->writerChunk) { break; };
-
-      oml_lock(&self->lock, __FUNCTION__);
-      chunk = getNextReadChunk(self);
-      oml_unlock(&self->lock, __FUNCTION__);
+  do {
+    while ((allsent = processChunks(self, &tail, BW_LOAD(&self->head))) == -1);
+    if (allsent < -1) {
+      goto drained;
+    }
+    oml_lock(&self->write_lock, __FUNCTION__);
+    published = publishWriteChunk(self);
+    oml_unlock(&self->write_lock, __FUNCTION__);
+  } while (published);
+
+  while (bw_spooled_bytes(self) > 0) {
+    if ((sent = replaySpool(self, SIZE_MAX)) < -1) {
+      allsent = sent;
+      break;
     }
-  };
+  }
+
+drained:
   self->retval = allsent;
   pthread_exit(&(self->retval));
 }
 
-/** Send data contained in one chunk.
+/** Write data out, with the headers if they need to be (re)sent.
+ *
+ * After a failure, no attempt is made for an exponentially increasing
+ * back-off period.
+ *
+ * \param self BufferedWriter to write for
+ * \param iov array of buffers to write
+ * \param n number of elements in iov
+ *
+ * \return the number of bytes of data written, -1 on continuing back-off, -2 on failure
+ * \see out_stream_writev
+ */
+static ssize_t
+writeData(BufferedWriter* self, const struct iovec* iov, int n)
+{
+  time_t now;
+  ssize_t cnt;
+
+  time(&now);
+  if (difftime(now, self->last_failure_time) < self->backoff) {
+    logdebug("%s: Still in back-off period (%ds)\n", self->outStream->dest, self->backoff);
+    return -1;
+  }
+
+  oml_lock(&self->meta_lock, __FUNCTION__);
+  cnt = out_stream_writev(self->outStream, iov, n,
+      mbuf_rdptr(self->meta_buf), mbuf_fill(self->meta_buf));
+  oml_unlock(&self->meta_lock, __FUNCTION__);
+
+  if (cnt <= 0) {
+    self->last_failure_time = now;
+    if (!self->backoff) {
+      self->backoff = 1;
+    } else if (self->backoff < UINT8_MAX) {
+      self->backoff *= 2;
+    }
+    logwarn("%s: Error sending, backing off for %ds\n", self->outStream->dest, self->backoff);
+    return -2;
+  }
+
+  if (self->backoff) {
+    self->backoff = 0;
+    loginfo("%s: Connected\n", self->outStream->dest);
+  }
+
+  return cnt;
+}
+
+/** Send the data contained in the chunks published up to head.
  *
- * \warning This function acquires the lock on the BufferedWriter for the time
- * it takes to check the double-buffer.
+ * The unsent data of up to OML_OUTS_MAX_IOV chunks is gathered and handed to
+ * the OmlOutStream in one vectored write, along with the headers if they need
+ * to be (re)sent. After a partial write, each chunk is advanced by what was
+ * written of it, and the next write resumes from there. The tail cursor is
+ * advanced past every chunk as soon as it has been fully sent.
  *
- * \warning This function acquires the lock on the chunk being processed for
- * the time it takes to check it and swap the double buffer.
+ * The chunks must have been published by the producers. The reader thread
+ * claims them before each write, so producers do not evict them meanwhile.
  *
  * \bug The meta buffer should also be protected.
  *
  * \param self BufferedWriter to process
- * \param chunk link of the chunk to process
+ * \param tail pointer to the index of the first chunk to process, updated as chunks are sent
+ * \param head index of the chunk currently filled by the producers
  *
- * \return 1 if chunk has been fully sent, 0 if not, -1 on continuing back-off, -2 otherwise
- * \see oml_outs_write_f
+ * \return 1 if all chunks have been fully sent, -1 on continuing back-off, -2 otherwise
+ * \see out_stream_writev, oml_outs_writev_f
  */
 static int
-processChunk(BufferedWriter* self, BufferChunk* chunk)
+processChunks(BufferedWriter* self, uint64_t* tail, uint64_t head)
 {
-  time_t now;
-  int ret = -2;
+  struct iovec iov[OML_OUTS_MAX_IOV];
   ssize_t cnt = 0;
-  MBuffer *read_buf = NULL;
+  size_t len;
+  uint64_t end, start = *tail;
+  MBuffer *read_buf;
+  int n;
   assert(self);
   assert(self->meta_buf);
-  assert(self->read_buf);
-  assert(chunk);
-  assert(chunk->mbuf);
 
-  oml_lock(&self->lock, __FUNCTION__);
-  if (mbuf_message(self->read_buf) > mbuf_rdptr(self->read_buf)) {
-    /* There is unread data in the double buffer */
-    read_buf = self->read_buf;
-  }
-  oml_unlock(&self->lock, __FUNCTION__);
-
-  oml_lock(&chunk->lock, __FUNCTION__);
-  if ((NULL == read_buf) && (mbuf_message(chunk->mbuf) >= mbuf_rdptr(chunk->mbuf))) {
-    /* There is unread data in the read buffer, swap MBuffers */
-    read_buf = chunk->mbuf;
-    chunk->mbuf = self->read_buf;
-  }
-  oml_unlock(&chunk->lock, __FUNCTION__);
+  while (1) {
+    while (!claimChunks(self, BW_SENDING)) {
+      /* A producer is evicting the oldest chunk */
+      sched_yield();
+    }
+    if (*tail != BW_LOAD(&self->tail)) {
+      *tail = start = BW_LOAD(&self->tail);
+      if (*tail > head) {
+        /* Chunks published since have been evicted too */
+        head = BW_LOAD(&self->head);
+      }
+    }
+    if (*tail == head) {
+      releaseChunks(self);
+      break;
+    }
 
-  oml_lock(&self->lock, __FUNCTION__);
-  self->read_buf = read_buf;
-  oml_unlock(&self->lock, __FUNCTION__);
+    for (n = 0, end = *tail; end != head && n < OML_OUTS_MAX_IOV; end++) {
+      read_buf = self->chunks[end % self->nchunks].mbuf;
+      if (mbuf_message_offset(read_buf) > mbuf_read_offset(read_buf)) {
+        iov[n].iov_base = mbuf_rdptr(read_buf);
+        iov[n].iov_len = mbuf_message_offset(read_buf) - mbuf_read_offset(read_buf);
+        n++;
+      }
+    }
 
-  if (NULL == read_buf) {
-    /* The current message is not after the read pointer,
-     * we must be on the writer chunk */
-    ret = 1;
-    goto processChunk_cleanup;
-  }
+    if (n > 0 && (cnt = writeData(self, iov, n)) < 0) {
+      releaseChunks(self);
+      return cnt;
+    }
 
-  time(&now);
-  if (difftime(now, self->last_failure_time) < self->backoff) {
-    logdebug("%s: Still in back-off period (%ds)\n", self->outStream->dest, self->backoff);
-    ret = -1;
-    goto processChunk_cleanup;
+    /* Account for what was sent, chunk by chunk */
+    while (*tail != end) {
+      read_buf = self->chunks[*tail % self->nchunks].mbuf;
+      len = mbuf_message_offset(read_buf) - mbuf_read_offset(read_buf);
+      if ((size_t)cnt < len) {
+        mbuf_read_skip(read_buf, cnt);
+        cnt = 0;
+        break;
+      }
+      mbuf_read_skip(read_buf, len);
+      cnt -= len;
+      BW_STORE(&self->tail, ++(*tail));
+    }
+    releaseChunks(self);
+    if (*tail != start) {
+      signalRoom(self);
+      start = *tail;
+    }
   }
 
-  while (mbuf_write_offset(read_buf) > mbuf_read_offset(read_buf)) {
-    oml_lock(&self->meta_lock, __FUNCTION__);
-    cnt = self->outStream->write(self->outStream,
-        mbuf_rdptr(read_buf), mbuf_message_offset(read_buf) - mbuf_read_offset(read_buf),
-        mbuf_rdptr(self->meta_buf), mbuf_fill(self->meta_buf));
-    oml_unlock(&self->meta_lock, __FUNCTION__);
-
-    if (cnt > 0) {
-      mbuf_read_skip(read_buf, cnt);
-      if (self->backoff) {
-        self->backoff = 0;
-        loginfo("%s: Connected\n", self->outStream->dest);
-      }
+  return 1;
+}
 
-    } else {
-      self->last_failure_time = now;
-      if (!self->backoff) {
-        self->backoff = 1;
-      } else if (self->backoff < UINT8_MAX) {
-        self->backoff *= 2;
-      }
-      logwarn("%s: Error sending, backing off for %ds\n", self->outStream->dest, self->backoff);
-      goto processChunk_cleanup;
+/** Send some of the data held in the spool.
+ *
+ * Records are sent oldest first, in vectored writes of up to OML_OUTS_MAX_IOV
+ * records. If the last record is only partially written, the rest of it is
+ * sent before returning, so no other data gets interleaved in its messages.
+ *
+ * \param self BufferedWriter to process
+ * \param max amount of data to send, unless a single record is larger [B]
+ *
+ * \return the number of bytes sent, -1 on continuing back-off, -2 on failure
+ * \see spool_peek, spool_consume
+ */
+static ssize_t
+replaySpool(BufferedWriter* self, size_t max)
+{
+  struct iovec iov[OML_OUTS_MAX_IOV];
+  Spool* spool = BW_LOAD(&self->spool);
+  ssize_t cnt, sent = 0;
+  int n;
+
+  do {
+    if (0 == (n = spool_peek(spool, iov, OML_OUTS_MAX_IOV, max))) {
+      break;
+    }
+    if ((cnt = writeData(self, iov, n)) < 0) {
+      return cnt;
     }
+    spool_consume(spool, cnt);
+    sent += cnt;
+    /* Only complete the current record from now on */
+    max = 0;
+  } while (spool_partial(spool));
+
+  if (0 == spool_bytes(spool)) {
+    loginfo("%s: All spooled samples sent\n", self->outStream->dest);
   }
-  ret = 1;
 
-processChunk_cleanup:
-  return ret;
+  return sent;
 }
 
 /*
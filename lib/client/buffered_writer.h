@@ -27,14 +27,23 @@ int _bw_push(BufferedWriter* instance, uint8_t* data, size_t size);
 int bw_push_meta(BufferedWriter* instance, uint8_t* data, size_t size);
 int _bw_push_meta(BufferedWriter* instance, uint8_t* data, size_t size);
 
-int bw_msgcount_add(BufferedWriter* instance, int nmessages);
+int bw_msgcount_add(BufferedWriter* instance, OmlMStream* ms, int nmessages);
 int bw_msgcount_reset(BufferedWriter* instance);
-int bw_nlost_reset(BufferedWriter* instance);
+int bw_msgcount(BufferedWriter* instance, OmlMStream* ms);
+/* XXX: Deprecated, use the lost field of the OmlMStream instead */
+int bw_nlost_reset(BufferedWriter* instance) __attribute__ ((deprecated));
 
-MBuffer* bw_get_write_buf(BufferedWriter* instance);
+int bw_spool(BufferedWriter* instance, const char* dir, uint64_t max_size);
+uint64_t bw_spooled_bytes(BufferedWriter* instance);
+
+MBuffer* bw_get_write_buf(BufferedWriter* instance, OmlMStream* ms);
 
 void bw_release_write_buf(BufferedWriter* instance);
 
+int bw_reserve(BufferedWriter* instance);
+void bw_unreserve(BufferedWriter* instance);
+int bw_is_reserved(BufferedWriter* instance);
+
 #endif // OML_BUFFERED_WRITER_H_
 
 /*
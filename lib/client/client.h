@@ -16,6 +16,7 @@
 
 #include <stdio.h>
 #include <time.h>
+#include <sys/time.h>
 #include <oml2/omlc.h>
 #include <oml2/oml_filter.h>
 #include <oml2/oml_writer.h>
@@ -25,6 +26,49 @@
 
 #define COLLECTION_URI_MAX_LENGTH 64
 
+/** Priority of the tuples of an OmlMStream when the buffers of its writers are full
+ *
+ * Lower priority streams are refused room earlier, so some is left for
+ * higher priority ones.
+ */
+enum OmlPriority {
+  OML_PRIORITY_LOW = -1,
+  OML_PRIORITY_NORMAL = 0,
+  OML_PRIORITY_HIGH = 1,
+};
+
+/** What to do with a tuple when the buffer of a writer has no room left for its stream */
+enum OmlOverflowPolicy {
+  /** Drop the new tuple (default) */
+  OML_OVERFLOW_DROP_NEWEST = 0,
+  /** Drop the oldest buffered data, if not of a higher priority, to make room */
+  OML_OVERFLOW_DROP_OLDEST,
+  /** Wait for room, for at most overflow_param ms, then drop the new tuple */
+  OML_OVERFLOW_BLOCK,
+  /** Once half of the share is used, keep one out of every overflow_param tuples, and drop the others */
+  OML_OVERFLOW_DECIMATE,
+};
+
+/** Default time to wait for room with OML_OVERFLOW_BLOCK [ms] */
+#define OML_OVERFLOW_BLOCK_TIMEOUT 1000
+/** Default decimation factor of OML_OVERFLOW_DECIMATE */
+#define OML_OVERFLOW_DECIMATE_FACTOR 10
+
+/** Overflow settings requested on the command line for some streams */
+typedef struct OmlStreamPolicy {
+  /** Name of the MP or MS this applies to, or NULL for all streams */
+  char* name;
+  /** OmlPriority to set, if set_priority */
+  int priority;
+  int set_priority;
+  /** OmlOverflowPolicy to set, and its parameter, if set_overflow */
+  int overflow;
+  uint32_t overflow_param;
+  int set_overflow;
+
+  struct OmlStreamPolicy* next;
+} OmlStreamPolicy;
+
 /** Internal data structure holding OML parameters */
 typedef struct OmlClient {
   /** Application name */
@@ -80,6 +124,24 @@ typedef struct OmlClient {
   /** Minimum period between client instrumentation reports [s] (0 == disabled) */
   uint32_t instr_interval;
 
+  /** Directory in which to spool data which cannot be sent in time, or NULL */
+  const char* spool_dir;
+
+  /** Maximal amount of data spooled by each writer [B] (0 == no limit) */
+  uint64_t spool_max;
+
+  /** Measurement point for per-stream client instrumentation */
+  OmlMP *stream_instr;
+
+  /** Overflow settings from the command line, in order */
+  OmlStreamPolicy *stream_policies;
+
+  /** Version of the protocol announced to the collection points */
+  int protocol_version;
+
+  /** True if the streams to collection points are compressed with deflate */
+  int compress;
+
 } OmlClient;
 
 /** Global OmlClient instance */
@@ -102,18 +164,26 @@ OmlMP *destroy_mp(OmlMP *mp);
 OmlMStream *create_mstream( const char * name, OmlMP* mp, OmlWriter* writer, double sample_interval, int sample_thres);
 OmlMStream *destroy_ms(OmlMStream *ms);
 
+int oml_parse_priority(const char *str, int *priority);
+int oml_parse_overflow(const char *str, int *policy, uint32_t *param);
+
 void create_default_filters(OmlMP* mp, OmlMStream* ms);
 OmlFilter* create_default_filter(OmlMPDef* def, OmlMStream* ms, int index);
 
 /* from filter.c */
 
 void filter_engine_start(OmlMStream* mp);
+void filter_engine_stop(void);
 extern int filter_process(OmlMStream* mp);
+int filter_process_at(OmlMStream* ms, const struct timeval* tv);
 
 /* from misc.c */
 
 int mp_lock(OmlMP* mp);
+int mp_trylock(OmlMP* mp);
 void mp_unlock(OmlMP* mp);
+void omlc_mp_drain(OmlMP* mp);
+void omlc_mp_release(OmlMP* mp);
 
 int oml_lock(pthread_mutex_t* mutexP, const char* mutexName);
 void oml_unlock(pthread_mutex_t* mutexP, const char* mutexName);
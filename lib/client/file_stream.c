@@ -26,6 +26,8 @@
 
 static ssize_t file_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length);
 static ssize_t file_stream_write_flush(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length);
+static ssize_t file_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
+static ssize_t file_stream_writev_flush(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
 static int file_stream_close(OmlOutStream* hdl);
 
 /** Create a new out stream for writing into a local file.
@@ -59,6 +61,7 @@ file_stream_new(const char *file)
   mstring_delete(dest);
 
   self->write = file_stream_write;
+  self->writev = file_stream_writev;
   self->close = file_stream_close;
   return (OmlOutStream*)self;
 }
@@ -126,6 +129,61 @@ file_stream_write_flush(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8
   return count;
 }
 
+/** Write several chunks of data to a file
+ *
+ * The data is handed to the stdio buffers in order; fwrite(3) is a better
+ * fit than writev(2) here, as it coalesces small writes on its own.
+ *
+ * \param hdl pointer to the OmlOutStream
+ * \param iov array of buffers to write
+ * \param iovcnt number of buffers in iov
+ * \param header pointer to an optional buffer containing headers to be sent after (re)connecting
+ * \param header_length length of the header to write; must be 0 if header is NULL
+ * \return amount of data written, or -1 on error
+ */
+static ssize_t
+file_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  OmlFileOutStream* self = (OmlFileOutStream*)hdl;
+  ssize_t count = 0;
+  size_t written;
+  int i;
+
+  /* The header can be NULL, but header_length MUST be 0 in that case */
+  assert(header || !header_length);
+
+  if (!self) return -1;
+  if (!self->f) return -1;
+
+  out_stream_write_header(hdl, _file_stream_write, header, header_length);
+
+  for (i = 0; i < iovcnt; i++) {
+    written = _file_stream_write(hdl, iov[i].iov_base, iov[i].iov_len);
+    count += written;
+    if (written < iov[i].iov_len) {
+      break;
+    }
+  }
+  return count;
+}
+
+/** Write several chunks of data to a file and flush it afterwards
+ *
+ * Use fflush(3) once all chunks have been written.
+ *
+ * \copydetails file_stream_writev
+ */
+static ssize_t
+file_stream_writev_flush(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  OmlFileOutStream* self = (OmlFileOutStream*)hdl;
+
+  ssize_t count = file_stream_writev(hdl, iov, iovcnt, header, header_length);
+  fflush(self->f);
+
+  return count;
+}
+
 /** * Set the buffering startegy of an OmlOutStream
  *
  * Tell whether fflush(3) should be used after each write.
@@ -143,8 +201,10 @@ file_stream_set_buffered(OmlOutStream* hdl, int buffered)
 
   if(buffered) {
     hdl->write=file_stream_write;
+    hdl->writev=file_stream_writev;
   } else {
     hdl->write=file_stream_write_flush;
+    hdl->writev=file_stream_writev_flush;
   }
 
   return 0;
@@ -37,112 +37,561 @@
 #include "oml2/oml_filter.h"
 #include "oml2/oml_writer.h"
 #include "ocomm/o_log.h"
+#include "mem.h"
+#include "mbuf.h"
 #include "client.h"
 
 static void* thread_start(void* handle);
+static int filter_snapshot(OmlMStream* ms, double* now);
+static void filter_write(OmlMStream* ms, double now, int from_snapshot);
 
 extern OmlClient* omlc_instance;
 
+/** Periodic reporting schedule of an MS */
+typedef struct FilterSchedule {
+  OmlMStream* ms;               /**< MS to report */
+  OmlMP* mp;                    /**< MP of the MS, which outlives it */
+  struct timespec deadline;     /**< Next report is due at this time, on CLOCK_MONOTONIC */
+  struct timespec period;       /**< OmlMStream::sample_interval */
+} FilterSchedule;
+
+/** State of the filter scheduler, shared by all interval MSs */
+static struct {
+  pthread_mutex_t lock;         /**< Protects all the fields below */
+  pthread_cond_t wakeup;        /**< Signalled when the schedule changes, on CLOCK_MONOTONIC */
+  pthread_t thread;             /**< Scheduler thread, if started */
+  int started;                  /**< Set when the thread and wakeup exist */
+  int stopping;                 /**< Set when the thread must return */
+
+  FilterSchedule* heap;         /**< Binary min-heap of schedules, by deadline */
+  int size;                     /**< Number of schedules in heap */
+  int capacity;                 /**< Allocated length of heap */
+} engine = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+/** Add a duration to a time; both must be normalised.
+ * \param[in,out] ts time to advance
+ * \param d duration to add
+ */
+static void
+timespec_add(struct timespec* ts, const struct timespec* d)
+{
+  ts->tv_sec += d->tv_sec;
+  ts->tv_nsec += d->tv_nsec;
+  if (ts->tv_nsec >= 1000000000L) {
+    ts->tv_sec++;
+    ts->tv_nsec -= 1000000000L;
+  }
+}
+
+/** Compute the difference between two times.
+ * \return t1 - t2 [s]
+ */
+static double
+timespec_diff(const struct timespec* t1, const struct timespec* t2)
+{
+  return (double)(t1->tv_sec - t2->tv_sec) + 1e-9 * (t1->tv_nsec - t2->tv_nsec);
+}
+
+/** Compare two times.
+ * \return non-zero if t1 is strictly before t2, 0 otherwise
+ */
+static int
+timespec_before(const struct timespec* t1, const struct timespec* t2)
+{
+  return t1->tv_sec < t2->tv_sec || (t1->tv_sec == t2->tv_sec && t1->tv_nsec < t2->tv_nsec);
+}
+
+/** Add a schedule to the heap; engine.lock must be held.
+ * \return 0 on success, -1 on error
+ */
+static int
+schedule_push(const FilterSchedule* fs)
+{
+  FilterSchedule* heap;
+  int i, parent;
+
+  if (engine.size == engine.capacity) {
+    heap = oml_realloc(engine.heap, 2 * (engine.capacity + 1) * sizeof(FilterSchedule));
+    if (!heap) {
+      return -1;
+    }
+    engine.heap = heap;
+    engine.capacity = 2 * (engine.capacity + 1);
+  }
+
+  for (i = engine.size++; i > 0; i = parent) {
+    parent = (i - 1) / 2;
+    if (!timespec_before(&fs->deadline, &engine.heap[parent].deadline)) {
+      break;
+    }
+    engine.heap[i] = engine.heap[parent];
+  }
+  engine.heap[i] = *fs;
+  return 0;
+}
+
+/** Remove the schedule with the earliest deadline from the heap; engine.lock must be held.
+ * \param[out] fs where to copy the removed schedule
+ */
+static void
+schedule_pop(FilterSchedule* fs)
+{
+  FilterSchedule last;
+  int i, child;
+
+  *fs = engine.heap[0];
+  last = engine.heap[--engine.size];
+
+  for (i = 0; (child = 2 * i + 1) < engine.size; i = child) {
+    if (child + 1 < engine.size &&
+        timespec_before(&engine.heap[child + 1].deadline, &engine.heap[child].deadline)) {
+      child++;
+    }
+    if (!timespec_before(&engine.heap[child].deadline, &last.deadline)) {
+      break;
+    }
+    engine.heap[i] = engine.heap[child];
+  }
+  engine.heap[i] = last;
+}
+
 /** Start the filtering engine on the given MS
+ *
+ * All MSs reporting at regular time intervals are served by a single
+ * scheduler thread, started with the first of them. Reports are due at
+ * absolute times on CLOCK_MONOTONIC, every OmlMStream::sample_interval from
+ * the call to this function, so they do not drift by the time spent
+ * generating them.
+ *
  * \param ms pointer to OmlMStream to start filtering on
+ * \see filter_engine_stop
  */
 void
 filter_engine_start(OmlMStream* ms)
 {
-  logdebug ("Starting filtering thread for MS '%s'\n", ms->table_name);
-  pthread_create(&ms->filter_thread, NULL, thread_start, (void*)ms);
+  FilterSchedule fs;
+  pthread_condattr_t attr;
+
+  logdebug ("Scheduling filters of MS '%s' every %fs\n", ms->table_name, ms->sample_interval);
+
+  fs.ms = ms;
+  fs.mp = ms->mp;
+  fs.period.tv_sec = (time_t)ms->sample_interval;
+  fs.period.tv_nsec = (long)(1e9 * (ms->sample_interval - fs.period.tv_sec));
+  if (fs.period.tv_sec == 0 && fs.period.tv_nsec < 1000) {
+    fs.period.tv_nsec = 1000;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &fs.deadline);
+  timespec_add(&fs.deadline, &fs.period);
+
+  pthread_mutex_lock(&engine.lock);
+  if (!engine.started) {
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&engine.wakeup, &attr);
+    pthread_condattr_destroy(&attr);
+    engine.stopping = 0;
+    if (pthread_create(&engine.thread, NULL, thread_start, NULL)) {
+      logerror ("Cannot start filter scheduler thread: %s\n", strerror(errno));
+      pthread_cond_destroy(&engine.wakeup);
+      pthread_mutex_unlock(&engine.lock);
+      return;
+    }
+    engine.started = 1;
+  }
+  if (schedule_push(&fs)) {
+    logerror ("%s: Cannot schedule periodic reports\n", ms->table_name);
+  }
+  pthread_cond_signal(&engine.wakeup);
+  pthread_mutex_unlock(&engine.lock);
 }
 
-/** Filtering thread
+/** Stop the filtering engine, and forget all scheduled MSs.
  *
- * Loops until the stream is not active anymore, or an error occurs
+ * This waits for any report being written to complete, so it must be called
+ * before the MSs are destroyed.
  *
- * \param handle pointer to OmlMStream to use the filters on (cast as void*)
+ * \see filter_engine_start
+ */
+void
+filter_engine_stop(void)
+{
+  pthread_mutex_lock(&engine.lock);
+  if (!engine.started) {
+    pthread_mutex_unlock(&engine.lock);
+    return;
+  }
+  engine.stopping = 1;
+  pthread_cond_signal(&engine.wakeup);
+  pthread_mutex_unlock(&engine.lock);
+
+  if (!pthread_equal(engine.thread, pthread_self())) {
+    pthread_join(engine.thread, NULL);
+  } else {
+    pthread_detach(engine.thread);
+  }
+
+  pthread_mutex_lock(&engine.lock);
+  pthread_cond_destroy(&engine.wakeup);
+  oml_free(engine.heap);
+  engine.heap = NULL;
+  engine.size = engine.capacity = 0;
+  engine.started = 0;
+  pthread_mutex_unlock(&engine.lock);
+}
+
+/** Generate the periodic report of an MS.
+ *
+ * The output of the filters is captured into snapshots, and their window
+ * reset, while the lock of the MP is held. The snapshots are then written
+ * once the lock has been released, so injecting threads do not wait for the
+ * marshalling of the report. OmlMStream::reporting is set in the meantime.
+ *
+ * \param fs FilterSchedule of the MS
+ * \param lag delay of this report behind its deadline [s]
+ * \return 0 if the MS should be reported again, -1 otherwise
+ *
+ * \see filter_snapshot, filter_write, oml_filter_snapshot
+ */
+static int
+filter_report(FilterSchedule* fs, double lag)
+{
+  OmlMStream* ms = fs->ms;
+  OmlMP* mp = fs->mp;
+  int status = 0;
+  double now;
+
+  if (mp_lock(mp)) {
+    return 0;
+  }
+  if (!mp->active) {
+    mp_unlock(mp);
+    return -1;  // we are done
+  }
+
+  if (lag > ms->scheduling_lag) {
+    ms->scheduling_lag = lag;
+  }
+  /* Samples staged while the MP was busy belong to this period */
+  omlc_mp_drain(mp);
+  status = filter_snapshot(ms, &now);
+  if (!status) {
+    __atomic_store_n(&ms->reporting, 1, __ATOMIC_SEQ_CST);
+  }
+  omlc_mp_release(mp);
+
+  if (!status) {
+    filter_write(ms, now, 1);
+    __atomic_store_n(&ms->reporting, 0, __ATOMIC_SEQ_CST);
+  }
+
+  return status;
+}
+
+/** Filter scheduler thread
  *
- * \return NULL, inconditionally; shouldn't return in normal operation
+ * Sleeps until the earliest deadline of all scheduled MSs, then reports all
+ * MSs due by then, and schedules their next report one period after their
+ * previous deadline. Reports which are more than a period late are skipped.
+ *
+ * Loops until filter_engine_stop is called. MSs are dropped from the schedule
+ * when their MP is not active anymore, or if an error occurs.
+ *
+ * \param handle unused
+ *
+ * \return NULL, when the engine is stopped
+ *
+ * \see filter_report
  */
 static void*
 thread_start(void* handle)
 {
-  OmlMStream* ms = (OmlMStream*)handle;
-  OmlMP* mp = ms->mp;
-  useconds_t usec = (useconds_t)(1000000 * ms->sample_interval);
-  int status = 0;
+  FilterSchedule fs;
+  struct timespec now;
+  double lag;
+  long missed;
 
-  while (1) {
-    usleep(usec);
-    if (!mp_lock(mp)) {
-      if (!mp->active) {
-        mp_unlock(mp);
-        return NULL;  // we are done
-      }
+  (void)handle;
 
-      status = filter_process(ms);
-      mp_unlock(mp);
+  pthread_mutex_lock(&engine.lock);
+  while (!engine.stopping) {
+    if (!engine.size) {
+      pthread_cond_wait(&engine.wakeup, &engine.lock);
+      continue;
     }
 
-    if (status == -1) {
-      return NULL; // Fatal error --> exit thread
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (timespec_before(&now, &engine.heap[0].deadline)) {
+      pthread_cond_timedwait(&engine.wakeup, &engine.lock, &engine.heap[0].deadline);
+      continue;
     }
 
+    /* Report all MSs due at this tick */
+    while (engine.size && !engine.stopping &&
+        !timespec_before(&now, &engine.heap[0].deadline)) {
+      schedule_pop(&fs);
+      pthread_mutex_unlock(&engine.lock);
+
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      lag = timespec_diff(&now, &fs.deadline);
+      if (filter_report(&fs, lag)) {
+        pthread_mutex_lock(&engine.lock);
+        continue;
+      }
+
+      /* Next deadline is relative to the previous one, not to now */
+      timespec_add(&fs.deadline, &fs.period);
+      for (missed = 0; !timespec_before(&now, &fs.deadline); missed++) {
+        timespec_add(&fs.deadline, &fs.period);
+      }
+      if (missed) {
+        logdebug("%s: Periodic report %fs late, skipping %ld period(s)\n", fs.ms->table_name, lag, missed);
+      }
+
+      pthread_mutex_lock(&engine.lock);
+      if (schedule_push(&fs)) {
+        logerror("%s: Cannot schedule periodic reports\n", fs.ms->table_name);
+      }
+    }
   }
+  pthread_mutex_unlock(&engine.lock);
+
+  return NULL;
 }
 
-/** Run filters associated to an MS.
- *
- * Get the writer associated to the MS, and generate and write initial metadata
- * (seqno and time). Then, instruct all the filters, in sequence, to write
- * their filtered sample to this writer before finalising the write.
+/** Check that an MS can be processed, and get the time of its next sample.
  *
  * \param ms MS to generate output for
+ * \param sample_tv time of the sample, or NULL for the current time
+ * \param[out] now time of the sample, relative to the start of the client
  * \return 0 if success, -1 otherwise
- *
- * \see OmlWriter, oml_writer_row_start, oml_writer_out, oml_writer_row_end
  */
-int
-filter_process(OmlMStream* ms)
+static int
+filter_start(OmlMStream* ms, const struct timeval* sample_tv, double* now)
 {
   struct timeval tv;
-  double now;
-  int i;
-  OmlFilter *f;
-  OmlWriter *writer;
 
   /* Get the time as soon as possible */
-  gettimeofday(&tv, NULL);
+  if (sample_tv) {
+    tv = *sample_tv;
+  } else {
+    gettimeofday(&tv, NULL);
+  }
 
   if (ms == NULL || omlc_instance == NULL || ms->writers == NULL) {
     logerror("Could not process filters because of null measurement stream, instance or writers array\n");
     return -1;
   }
 
-  now = tv.tv_sec - omlc_instance->start_time + 0.000001 * tv.tv_usec;
+  *now = tv.tv_sec - omlc_instance->start_time + 0.000001 * tv.tv_usec;
   ms->seq_no++;
 
+  return 0;
+}
+
+/** Capture the output of the filters associated to an MS, and start a new
+ * sampling window.
+ *
+ * The lock of the MP must be held. The output is left in the
+ * OmlFilter::snapshot_result of each filter, for filter_write.
+ *
+ * \param ms MS to generate output for
+ * \param[out] now time of the sample, relative to the start of the client
+ * \return 0 if success, -1 otherwise
+ *
+ * \see oml_filter_snapshot, filter_write
+ */
+static int
+filter_snapshot(OmlMStream* ms, double* now)
+{
+  OmlFilter *f;
+
+  if (filter_start(ms, NULL, now)) {
+    return -1;
+  }
+
+  for (f = ms->firstFilter; f != NULL; f = f->next) {
+    if (f->snapshot(f, f->snapshot_result)) {
+      logwarn("%s: Filter %s could not capture its output\n", ms->table_name, f->name);
+    }
+  }
+  ms->sample_size = 0;
+
+  return 0;
+}
+
+/** Check whether two writers encode samples into the same bytes.
+ *
+ * \param w1 first OmlWriter
+ * \param w2 second OmlWriter
+ * \return 1 if a sample encoded by one can be copied to the other, 0 otherwise
+ * \see oml_writer_row_copy
+ */
+static int
+filter_same_encoding(OmlWriter* w1, OmlWriter* w2)
+{
+  return w1 && w2 && w1->row_copy && w1->row_copy == w2->row_copy &&
+    w1->encoding == w2->encoding;
+}
+
+/** Prepare to keep a copy of the sample encoded by a writer of an MS, if
+ * another writer further down the list uses the same encoding.
+ *
+ * \param ms MS to generate output for
+ * \param index index of the writer about to encode the sample
+ * \return 1 if the sample should be kept in OmlMStream::encoded_row, 0 otherwise
+ */
+static int
+filter_keep_row(OmlMStream* ms, int index)
+{
+  int i;
+
+  for (i = index + 1; i < ms->nwriters &&
+      !filter_same_encoding(ms->writers[index], ms->writers[i]); i++);
+  if (i == ms->nwriters) {
+    return 0;
+  }
+
+  if (!ms->encoded_row && NULL == (ms->encoded_row = mbuf_create())) {
+    return 0;
+  }
+  mbuf_clear2(ms->encoded_row, 0);
+  return 1;
+}
+
+/** Encode the output of the filters associated to an MS with one writer.
+ *
+ * \param ms MS to generate output for
+ * \param writer OmlWriter to use
+ * \param now time of the sample, relative to the start of the client
+ * \param from_snapshot if set, write the output captured by filter_snapshot, otherwise ask each filter for its current output
+ * \return 1 if the writer accepted the sample, 0 otherwise
+ *
+ * \see OmlWriter, oml_writer_row_start, oml_writer_out, oml_writer_row_end
+ */
+static int
+filter_write_row(OmlMStream* ms, OmlWriter* writer, double now, int from_snapshot)
+{
+  OmlFilter *f;
+  int ret;
+
+  /* Be aware that row_start is obtaining a lock on the writer
+   * which is released in row_end. Always ensure that row_end is
+   * called, even if there is a problem somewhere along the way.
+   * \see oml_writer_row_start, oml_writer_out, oml_writer_row_end
+   */
+  ret = (writer->row_start(writer, ms, now) == 1);
+
+  f = ms->firstFilter;
+  for (; f != NULL; f = f->next) {
+    if (from_snapshot) {
+      writer->out(writer, f->snapshot_result, f->output_count);
+    } else {
+      f->output(f, writer);
+    }
+  }
+  writer->row_end(writer, ms);
+
+  return ret;
+}
+
+/** Write the output of the filters associated to an MS to all its writers.
+ *
+ * The output is encoded once for all the writers using the same encoding: the
+ * first of them keeps a copy of the encoded sample, which is then written to
+ * the others. If the first writer drops the sample, the next one encodes it.
+ *
+ * \param ms MS to generate output for
+ * \param now time of the sample, relative to the start of the client
+ * \param from_snapshot if set, write the output captured by filter_snapshot, otherwise ask each filter for its current output
+ *
+ * \see filter_write_row, oml_writer_row_copy
+ */
+static void
+filter_write(OmlMStream* ms, double now, int from_snapshot)
+{
+  int i, j, encoded, written;
+  OmlWriter *writer, *w;
+
   for (i=0; i<ms->nwriters; i++) {
     writer = ms->writers[i];
 
     if (writer == NULL) {
       logwarn("%s: Sending data NULL writer (at %d)\n", ms->table_name, i);
+      continue;
+    }
 
-    } else {
-      /* Be aware that row_start is obtaining a lock on the writer
-       * which is released in row_end. Always ensure that row_end is
-       * called, even if there is a problem somewhere along the way.
-       * \see oml_writer_row_start, oml_writer_out, oml_writer_row_end
-       */
-      if(writer->row_start(writer, ms, now) == 1)
+    /* Skip writers which got the sample along with a previous one */
+    for (j = 0; j < i && !filter_same_encoding(ms->writers[j], writer); j++);
+    if (j < i) {
+      continue;
+    }
+
+    encoded = 0;
+    for (j = i; j < ms->nwriters; j++) {
+      w = ms->writers[j];
+      if (j > i && !filter_same_encoding(writer, w)) {
+        continue;
+      }
+
+      if (encoded) {
+        written = w->row_copy(w, ms, ms->encoded_row);
+
+      } else {
+        ms->keep_row = filter_keep_row(ms, j);
+        written = filter_write_row(ms, w, now, from_snapshot);
+        encoded = ms->keep_row && mbuf_message_length(ms->encoded_row) > 0;
+        ms->keep_row = 0;
+      }
+
+      if (written)
         ms->written++;
       else
         ms->dropped++;
-
-      f = ms->firstFilter;
-      for (; f != NULL; f = f->next) {
-        f->output(f, writer);
-      }
-      writer->row_end(writer, ms);
     }
   }
+}
+
+/** Run filters associated to an MS.
+ *
+ * Get the writer associated to the MS, and generate and write initial metadata
+ * (seqno and time). Then, instruct all the filters, in sequence, to write
+ * their filtered sample to this writer before finalising the write.
+ *
+ * \param ms MS to generate output for
+ * \return 0 if success, -1 otherwise
+ *
+ * \see OmlWriter, oml_writer_row_start, oml_writer_out, oml_writer_row_end
+ * \see filter_process_at
+ */
+int
+filter_process(OmlMStream* ms)
+{
+  return filter_process_at(ms, NULL);
+}
+
+/** Run filters associated to an MS, for a sample taken at a given time.
+ *
+ * This is used to output samples which were staged before being processed,
+ * with the time at which they were injected.
+ *
+ * \param ms MS to generate output for
+ * \param sample_tv time of the sample, or NULL for the current time
+ * \return 0 if success, -1 otherwise
+ *
+ * \see filter_process
+ */
+int
+filter_process_at(OmlMStream* ms, const struct timeval* sample_tv)
+{
+  double now;
+  OmlFilter *f;
+
+  if (filter_start(ms, sample_tv, &now)) {
+    return -1;
+  }
+
+  filter_write(ms, now, 0);
 
   f = ms->firstFilter;
   for (; f != NULL; f = f->next) {
@@ -28,6 +28,7 @@ typedef struct FilterType {
   oml_filter_output output;
   oml_filter_newwindow newwindow;
   oml_filter_meta meta;
+  oml_filter_snapshot snapshot;
 
   OmlFilterDef* definition;
   int output_count;
@@ -37,6 +38,8 @@ typedef struct FilterType {
 
 static FilterType* filter_types = NULL;
 
+static int default_filter_snapshot (OmlFilter* filter, OmlValue* snapshot);
+
 const char*
 next_filter_name(void)
 {
@@ -118,7 +121,9 @@ create_filter(
   f->meta = ft->meta;
   f->definition = ft->definition;   /* FIXME:  Copy and substitute OML_INPUT_VALUE types */
   f->output_count = ft->output_count;
+  f->snapshot = ft->snapshot ? ft->snapshot : default_filter_snapshot;
   f->result = create_filter_result_vector (f->definition, type, ft->output_count);
+  f->snapshot_result = create_filter_result_vector (f->definition, type, ft->output_count);
   f->instance_data = ft->create(type, f->result);
 
   return f;
@@ -147,6 +152,10 @@ OmlFilter *destroy_filter(OmlFilter* f) {
     oml_value_array_reset(f->result, f->output_count);
     oml_free(f->result);
   }
+  if(f->snapshot_result) {
+    oml_value_array_reset(f->snapshot_result, f->output_count);
+    oml_free(f->snapshot_result);
+  }
   if(f->instance_data)
     oml_free(f->instance_data);
   oml_free(f);
@@ -189,6 +198,59 @@ default_filter_meta (OmlFilter* filter,
   return 0;
 }
 
+/** Writer collecting the output of a filter into a snapshot vector */
+typedef struct SnapshotWriter {
+  OmlWriter writer;     /**< Must be first, so filters can use it as any OmlWriter */
+  OmlFilter* filter;    /**< Filter whose output is collected */
+  OmlValue* snapshot;   /**< Where to copy the output */
+  int count;            /**< Number of values copied so far */
+} SnapshotWriter;
+
+static int
+snapshot_writer_out (OmlWriter* writer, OmlValue* values, int values_count)
+{
+  SnapshotWriter* self = (SnapshotWriter*)writer;
+  int i, ret = 0;
+
+  for (i = 0; i < values_count && self->count < self->filter->output_count; i++, self->count++) {
+    OmlValue* to = &self->snapshot[self->count];
+    OmlValueU* v = oml_value_get_value(&values[i]);
+    OmlValueT type = oml_value_get_type(&values[i]);
+
+    if ((omlc_is_string_type(type) && !omlc_get_string_ptr(*v)) ||
+        (omlc_is_blob_type(type) && !omlc_get_blob_ptr(*v)) ||
+        (omlc_is_vector_type(type) && !omlc_get_vector_ptr(*v))) {
+      /* Nothing was sampled in this window */
+      oml_value_reset (to);
+      oml_value_set_type (to, type);
+
+    } else if (oml_value_set (to, v, type)) {
+      ret = -1;
+    }
+  }
+  return ret;
+}
+
+/** Default oml_filter_snapshot function, relying on oml_filter_output and
+ * oml_filter_newwindow. */
+static int
+default_filter_snapshot (OmlFilter* filter, OmlValue* snapshot)
+{
+  SnapshotWriter sw;
+  int ret;
+
+  memset (&sw, 0, sizeof(sw));
+  sw.writer.out = snapshot_writer_out;
+  sw.filter = filter;
+  sw.snapshot = snapshot;
+
+  ret = filter->output (filter, &sw.writer);
+  if (filter->newwindow) {
+    filter->newwindow (filter);
+  }
+  return ret;
+}
+
 static OmlFilterDef* copy_filter_definition (OmlFilterDef* def,
                          int count)
 {
@@ -250,6 +312,26 @@ omlf_register_filter(const char* filter_name,
   return 0;
 }
 
+/*! Set the snapshot function of a registered filter type.
+ */
+int
+omlf_register_filter_snapshot(const char* filter_name,
+             oml_filter_snapshot snapshot)
+{
+  FilterType* ft = filter_types;
+  for (; ft != NULL; ft = ft->next) {
+    if (strcmp (filter_name, ft->name) == 0) break;
+  }
+  if (ft == NULL) {
+    logerror ("Cannot set snapshot function of unknown filter '%s'.\n", filter_name);
+    return -1;
+  }
+
+  ft->snapshot = snapshot;
+
+  return 0;
+}
+
 /* Builtin filter registration functions */
 void omlf_register_filter_average (void);
 void omlf_register_filter_first (void);
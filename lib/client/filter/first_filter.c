@@ -94,7 +94,9 @@ sample(OmlFilter* f, OmlValue * value)
   self->sample_count++;
   if (self->is_first) {
     self->is_first = 0;
-    return oml_value_set(&self->result[0], v, type);
+    return f->borrow_input ?
+      oml_value_borrow(&self->result[0], v, type) :
+      oml_value_set(&self->result[0], v, type);
   }
 
   return 0;
@@ -90,7 +90,9 @@ sample(
   }
   self->sample_count++;
   /* Overwrite previously stored value */
-  return oml_value_set(&self->result[0], v, type);
+  return f->borrow_input ?
+    oml_value_borrow(&self->result[0], v, type) :
+    oml_value_set(&self->result[0], v, type);
 }
 
 static int
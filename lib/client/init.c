@@ -26,12 +26,13 @@
  *  default_writer
  *  mpoints
  * }
- * note "omlc_inject() acquires OmlMP::mutex,\ncalls OmlFiter::input() for each filter of each MS,\ncalls filter_process()if OmlMP::sample_size>OmlMP::sample_thres,\nthen releases OmlMP::mutex" as omlc_inject
+ * note "omlc_inject() acquires OmlMP::mutex (or stages the sample\nin OmlMP::staging if it is busy), calls OmlFiter::input() for each filter of each MS,\ncalls filter_process()if OmlMP::sample_size>OmlMP::sample_thres,\nthen releases OmlMP::mutex and processes staged samples" as omlc_inject
  * omlc_inject .. OmlMP
  * class OmlMP {
  *   name
  *   streams
  *   mutex
+ *   staging
  *   next
  *   param_count
  *   table_count
@@ -55,7 +56,7 @@
  *    filters
  *    filter_thread()
  *   }
- *   note "filter_thread() is started if OmlMP::sample_interval>0;\nit calls filter_process() every OmlMP::sample_interval" as filter_thread #ff6600
+ *   note "a single filter_thread() serves all MSs with OmlMP::sample_interval>0;\nat each of their deadlines, it snapshots the filters\nunder OmlMP::mutex, then writes the snapshot after releasing it" as filter_thread #ff6600
  *   OmlMStream .. filter_thread
  *
  *   note "filter_process() calls OmlWriter::row_{start,end}(),\nand OmlFilter::output(), which calls OmlWriter::out()" as filter_process
@@ -76,12 +77,17 @@
  * class OmlWriter {
  *  bufferedWriter
  *  next
+ *  encoding
  *  row_start()
  *  row_end()
  *  out()
+ *  row_copy()
  * }
  * note "row_start() calls bw_get_write_buf()\nwith exclusive access" as row_start
  * note "row_end() calls bw_release_write_buf()" as row_end
+ * note "row_copy() writes the sample encoded by the first\nwriter with the same encoding, kept in OmlMStream::encoded_row" as row_copy
+ * row_copy <-- filter_process
+ * OmlWriter .. row_copy
  * row_start <-- filter_process
  * row_end <-- filter_process
  * OmlWriter .. row_start
@@ -93,19 +99,19 @@
  *  BufferedWriter .. row_end
  *   class BufferedWriter {
  *    outStream
- *    writerChunk
- *    firstChunk
- *    lock
+ *    chunks
+ *    head
+ *    tail
+ *    write_lock
  *    semaphore
  *    readerThread()
  *    bw_get_write_buf()
  *    bw_release_write_buf()
  *   }
- *   BufferedWriter *-- "1..*" BufferChunk: writerchunk, firstchunk
- *   BufferChunk -- "1..*" BufferChunk: next
- *   note "readerThread() wakes up on semaphore, holds lock,\nand empties processes the BufferChunk\nlist with outStream::write()" as readerThread #ff6600
- *  note "bw_get_write_buf() acquires lock,\nand returns writerChunk" as bw_get_write_buf
- *  note "bw_release_write_buf() releases lock,\nand signals semaphore" as bw_unlock_buf
+ *   BufferedWriter *-- "2..*" BufferChunk: chunks
+ *   note "readerThread() wakes up on semaphore or every BW_FLUSH_INTERVAL,\nand sends the BufferChunks from tail to head\nwith outStream::write()" as readerThread #ff6600
+ *  note "bw_get_write_buf() acquires write_lock,\nand returns the chunk at head" as bw_get_write_buf
+ *  note "bw_release_write_buf() releases write_lock;\nfull chunks are published by advancing head,\nwhich signals semaphore" as bw_unlock_buf
  *  BufferedWriter .. readerThread
  *  OmlOutStream .. readerThread
  *  BufferedWriter .. bw_get_write_buf
@@ -133,6 +139,7 @@
 #include <stdlib.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <sched.h>
 
 #include "oml2/omlc.h"
 #include "oml2/oml_filter.h"
@@ -140,11 +147,14 @@
 #include "ocomm/o_log.h"
 #include "mem.h"
 #include "mstring.h"
+#include "mbuf.h"
 #include "oml_value.h"
 #include "validate.h"
 #include "filter/factory.h"
 #include "oml_utils.h"
 #include "client.h"
+#include "staging.h"
+#include "marshal.h"
 
 #define OMLC_COPYRIGHT "Copyright 2007-2015, NICTA"
 
@@ -168,6 +178,15 @@ static OmlMPDef _client_instrumentation[] = {
   {"bytes_freed", OML_UINT64_VALUE },
   {"bytes_in_use", OML_UINT64_VALUE },
   {"bytes_max", OML_UINT64_VALUE },
+  {"bytes_spooled", OML_UINT64_VALUE },
+  {NULL, (OmlValueT)0}
+};
+
+static OmlMPDef _client_stream_instrumentation[] = {
+  {"stream", OML_STRING_VALUE },
+  {"measurements_injected", OML_UINT32_VALUE },
+  {"measurements_dropped", OML_UINT32_VALUE },
+  {"scheduling_lag", OML_DOUBLE_VALUE },
   {NULL, (OmlValueT)0}
 };
 
@@ -183,6 +202,8 @@ static int  write_schema(OmlMStream* ms, int index);
 static void termination_handler(int signum);
 static void install_close_handler(sighandler sig_hdl);
 static void setup_features(const char * const features);
+static int  add_stream_policy(OmlStreamPolicy **policies, const char *option, const char *arg);
+static void apply_stream_policies(OmlMStream *ms);
 
 extern int parse_config(char* config_file);
 
@@ -217,6 +238,11 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
   double sample_interval = 0.0;
   int max_queue = 0;
   uint32_t instr_interval = 1;
+  const char* spool_dir = NULL;
+  uint64_t spool_max = 0;
+  OmlStreamPolicy* stream_policies = NULL;
+  int protocol_version = OML_DEFAULT_PROTOCOL_VERSION;
+  int compress = 0;
   const char** arg = argv;
 
   if (!app_name) {
@@ -332,6 +358,68 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
         }
         max_queue = atoi(*++arg);
         *pargc -= 2;
+      } else if (strcmp(*arg, "--oml-spool") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-spool'\n");
+          return -1;
+        }
+        spool_dir = *++arg;
+        *pargc -= 2;
+      } else if (strcmp(*arg, "--oml-spool-max") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-spool-max'\n");
+          return -1;
+        }
+        start = (char *)*++arg; /* XXX: Drop arg's const */
+        end = NULL;
+        spool_max = strtoull(start, &end, 10);
+        if(end == *arg || *end != '\0') {
+          logwarn("Invalid argument to '--oml-spool-max', not limiting spool size\n");
+          spool_max = 0;
+        }
+        *pargc -= 2;
+      } else if (strcmp(*arg, "--oml-protocol") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-protocol'\n");
+          return -1;
+        }
+        start = (char *)*++arg; /* XXX: Drop arg's const */
+        end = NULL;
+        protocol_version = strtol(start, &end, 10);
+        if(end == *arg || *end != '\0' ||
+            protocol_version < OML_DEFAULT_PROTOCOL_VERSION ||
+            protocol_version > OML_PROTOCOL_VERSION) {
+          logwarn("Invalid argument to '--oml-protocol', should be between %d and %d; using %d\n",
+              OML_DEFAULT_PROTOCOL_VERSION, OML_PROTOCOL_VERSION, OML_DEFAULT_PROTOCOL_VERSION);
+          protocol_version = OML_DEFAULT_PROTOCOL_VERSION;
+        }
+        *pargc -= 2;
+      } else if (strcmp(*arg, "--oml-compress") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '--oml-compress'\n");
+          return -1;
+        }
+        arg++;
+        if (strcmp(*arg, "deflate") == 0) {
+          compress = 1;
+        } else if (strcmp(*arg, "none") == 0) {
+          compress = 0;
+        } else {
+          logwarn("Invalid argument to '--oml-compress', should be 'deflate' or 'none'; not compressing\n");
+          compress = 0;
+        }
+        *pargc -= 2;
+      } else if (strcmp(*arg, "--oml-priority") == 0 ||
+          strcmp(*arg, "--oml-overflow") == 0) {
+        if (--i <= 0) {
+          logerror("Missing argument to '%s'\n", *arg);
+          return -1;
+        }
+        if (add_stream_policy(&stream_policies, *arg, *(arg+1))) {
+          return -1;
+        }
+        arg++;
+        *pargc -= 2;
       } else if (strcmp(*arg, "--oml-instr-interval") == 0) {
         start = (char *)*++arg; /* XXX: Drop arg's const */
         end = NULL;
@@ -409,6 +497,12 @@ omlc_init(const char* application, int* pargc, const char** argv, o_log_fn custo
   omlc_instance->max_queue = max_queue;
   omlc_instance->instr_time = 0;
   omlc_instance->instr_interval = instr_interval;
+  omlc_instance->spool_dir = spool_dir;
+  omlc_instance->spool_max = spool_max;
+  omlc_instance->stream_policies = stream_policies;
+  omlc_instance->protocol_version = protocol_version;
+  marshal_set_protocol_version(protocol_version);
+  omlc_instance->compress = compress;
 
   if (local_data_file != NULL) {
     // dump every sample into local_data_file
@@ -502,6 +596,11 @@ omlc_add_mp (const char* mp_name, OmlMPDef* mp_def)
   mp->param_count = pc;
   mp->active = 1;  // True if there is an attached MS.
 
+  /* Injecting threads stage their samples while the MP is locked */
+  mp->mutexP = &mp->mutex;
+  pthread_mutex_init(mp->mutexP, NULL);
+  mp->staging = staging_new(mp);
+
   if(omlc_instance->start_time > 0) {
     /* omlc_start has already been called, declare MP through schema0 */
     meta = mstring_create();
@@ -527,6 +626,7 @@ omlc_add_mp (const char* mp_name, OmlMPDef* mp_def)
 
     if (!oml_mp_get_default_ms(mp)) {
       logerror("Failed to create default MS for MP %s\n", mp_name);
+      staging_destroy(mp->staging);
       oml_free(mp);
       return NULL;
     }
@@ -571,9 +671,18 @@ destroy_mp(OmlMP *mp)
   next = mp->next;
 
   if (!mp_lock(mp)) {
+    omlc_mp_drain(mp);
     mp->active = 0;
+    /* Filtering threads may still be writing their last report without the lock */
+    for (ms = mp->streams; ms; ms = ms->next) {
+      while (__atomic_load_n(&ms->reporting, __ATOMIC_SEQ_CST)) {
+        sched_yield();
+      }
+    }
     ms = mp->streams;
     while( (ms=destroy_ms(ms)) );
+    staging_destroy(mp->staging);
+    mp->staging = NULL;
     mp_unlock(mp);
   }
 
@@ -606,6 +715,12 @@ omlc_start()
 {
   if (omlc_instance == NULL) { return -1; }
 
+  /* Registered after the application's MPs, so their stream indices do not
+   * change, and only if the instrumentation is enabled */
+  if (omlc_instance->instr_interval && !omlc_instance->stream_instr) {
+    omlc_instance->stream_instr = omlc_add_mp("_client_stream_instrumentation", _client_stream_instrumentation);
+  }
+
   struct timeval tv;
   gettimeofday(&tv, NULL);
   omlc_instance->start_time = tv.tv_sec;
@@ -712,6 +827,7 @@ omlc_close(void)
 
     install_close_handler(SIG_DFL);
 
+    filter_engine_stop();
     while( (mp = destroy_mp(mp)) );
     if (w) {
       while( (w =  w->close(w)) );
@@ -719,6 +835,15 @@ omlc_close(void)
 
     unregister_filters ();
 
+    while (omlc_instance->stream_policies) {
+      OmlStreamPolicy *p = omlc_instance->stream_policies;
+      omlc_instance->stream_policies = p->next;
+      if (p->name) {
+        oml_free(p->name);
+      }
+      oml_free(p);
+    }
+
     oml_free(omlc_instance);
   }
 
@@ -749,6 +874,15 @@ usage(void)
   printf("  --oml-text             .. Use text encoding for all output streams\n");
   printf("  --oml-binary           .. Use binary encoding for all output streams\n");
   printf("  --oml-bufsize size     .. Set size of internal buffers to 'size' bytes\n");
+  printf("  --oml-spool dir        .. Spool data which does not fit in the buffers to 'dir'\n");
+  printf("  --oml-spool-max size   .. Spool at most 'size' bytes per output stream\n");
+  printf("  --oml-priority [mp=]p  .. Priority of the streams (of 'mp') when buffers are full\n");
+  printf("                            (low, normal, high)\n");
+  printf("  --oml-overflow [mp=]p  .. Handling of the streams (of 'mp') when buffers are full\n");
+  printf("                            (drop-newest, drop-oldest, block[:ms], decimate[:k])\n");
+  printf("  --oml-protocol version .. Version of the protocol to use (%d to %d)\n",
+           OML_DEFAULT_PROTOCOL_VERSION, OML_PROTOCOL_VERSION);
+  printf("  --oml-compress method  .. Compress the data sent to servers (deflate, none)\n");
   printf("  --oml-log-file file    .. Writes log messages to 'file'\n");
   printf("  --oml-log-level level  .. Log level used (error: -2 .. info: 0 .. debug4: 4)\n");
   printf("  --oml-noop             .. Do not collect measurements\n");
@@ -940,7 +1074,8 @@ create_mstream (const char *name, OmlMP* mp, OmlWriter* writer, double sample_in
    *
    */
   namestr = mstring_create();
-  if ((mp != schema0) && (mp != omlc_instance->client_instr)) {
+  if ((mp != schema0) && (mp != omlc_instance->client_instr) &&
+      (mp != omlc_instance->stream_instr)) {
     mstring_set (namestr, omlc_instance->app_name);
     mstring_cat (namestr, "_");
   }
@@ -979,6 +1114,8 @@ create_mstream (const char *name, OmlMP* mp, OmlWriter* writer, double sample_in
       }
       ms->sample_thres = 0;
     }
+
+    apply_stream_policies(ms);
   }
   mstring_delete (namestr);
 
@@ -1032,6 +1169,162 @@ oml_ms_add_writer(OmlMStream *ms, OmlWriter *w)
   return 0;
 }
 
+/** Parse the name of a stream priority.
+ *
+ * \param str name of the priority (low, normal or high)
+ * \param priority pointer to store the OmlPriority in
+ * \return 0 on success, -1 if str is not a valid priority
+ *
+ * \see OmlPriority
+ */
+int
+oml_parse_priority(const char *str, int *priority)
+{
+  if (!str) {
+    return -1;
+  } else if (!strcmp(str, "low")) {
+    *priority = OML_PRIORITY_LOW;
+  } else if (!strcmp(str, "normal")) {
+    *priority = OML_PRIORITY_NORMAL;
+  } else if (!strcmp(str, "high")) {
+    *priority = OML_PRIORITY_HIGH;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/** Parse the description of an overflow policy.
+ *
+ * The policy is one of drop-newest, drop-oldest, block[:TIMEOUT] (in
+ * milliseconds), or decimate[:FACTOR].
+ *
+ * \param str description of the policy
+ * \param policy pointer to store the OmlOverflowPolicy in
+ * \param param pointer to store the parameter of the policy in
+ * \return 0 on success, -1 if str is not a valid policy
+ *
+ * \see OmlOverflowPolicy, OML_OVERFLOW_BLOCK_TIMEOUT, OML_OVERFLOW_DECIMATE_FACTOR
+ */
+int
+oml_parse_overflow(const char *str, int *policy, uint32_t *param)
+{
+  const char *colon;
+  char *end = NULL;
+  size_t len;
+  unsigned long val = 0;
+
+  if (!str) {
+    return -1;
+  }
+
+  colon = strchr(str, ':');
+  len = colon ? (size_t)(colon - str) : strlen(str);
+  if (colon) {
+    val = strtoul(colon + 1, &end, 10);
+    if (end == colon + 1 || *end != '\0' || 0 == val || val > UINT32_MAX) {
+      return -1;
+    }
+  }
+
+  if (!strncmp(str, "drop-newest", len) && len == strlen("drop-newest") && !colon) {
+    *policy = OML_OVERFLOW_DROP_NEWEST;
+    *param = 0;
+  } else if (!strncmp(str, "drop-oldest", len) && len == strlen("drop-oldest") && !colon) {
+    *policy = OML_OVERFLOW_DROP_OLDEST;
+    *param = 0;
+  } else if (!strncmp(str, "block", len) && len == strlen("block")) {
+    *policy = OML_OVERFLOW_BLOCK;
+    *param = colon ? val : OML_OVERFLOW_BLOCK_TIMEOUT;
+  } else if (!strncmp(str, "decimate", len) && len == strlen("decimate")) {
+    *policy = OML_OVERFLOW_DECIMATE;
+    *param = colon ? val : OML_OVERFLOW_DECIMATE_FACTOR;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+/** Record a --oml-priority or --oml-overflow option.
+ *
+ * \param policies pointer to the list of OmlStreamPolicy to append to
+ * \param option name of the option
+ * \param arg argument of the option, as [MP=]VALUE
+ * \return 0 on success, -1 on error
+ *
+ * \see apply_stream_policies
+ */
+static int
+add_stream_policy(OmlStreamPolicy **policies, const char *option, const char *arg)
+{
+  OmlStreamPolicy *p, **last;
+  const char *eq = strchr(arg, '=');
+  const char *value = eq ? eq + 1 : arg;
+  int ret;
+
+  if (NULL == (p = oml_malloc(sizeof(OmlStreamPolicy)))) {
+    return -1;
+  }
+
+  if (!strcmp(option, "--oml-priority")) {
+    p->set_priority = 1;
+    ret = oml_parse_priority(value, &p->priority);
+  } else {
+    p->set_overflow = 1;
+    ret = oml_parse_overflow(value, &p->overflow, &p->overflow_param);
+  }
+  if (ret) {
+    logerror("Invalid argument '%s' to '%s'\n", arg, option);
+    oml_free(p);
+    return -1;
+  }
+
+  if (eq && NULL == (p->name = oml_strndup(arg, eq - arg))) {
+    oml_free(p);
+    return -1;
+  }
+
+  for (last = policies; *last; last = &(*last)->next);
+  *last = p;
+  return 0;
+}
+
+/** Set the priority and overflow policy of a new MS.
+ *
+ * The internal streams get a high priority by default. Options from the
+ * command line are then applied in order, if they name either the MP or the
+ * MS, or no stream at all (except for internal streams).
+ *
+ * \param ms OmlMStream to configure
+ *
+ * \see add_stream_policy
+ */
+static void
+apply_stream_policies(OmlMStream *ms)
+{
+  OmlStreamPolicy *p;
+  int internal = (ms->mp == schema0 || ms->mp == omlc_instance->client_instr ||
+      ms->mp == omlc_instance->stream_instr);
+
+  if (internal) {
+    ms->priority = OML_PRIORITY_HIGH;
+  }
+
+  for (p = omlc_instance->stream_policies; p; p = p->next) {
+    /* Policies for all streams do not apply to the automatic MPs */
+    if (p->name ? (strcmp(p->name, ms->mp->name) && strcmp(p->name, ms->table_name)) : internal) {
+      continue;
+    }
+    if (p->set_priority) {
+      ms->priority = p->priority;
+    }
+    if (p->set_overflow) {
+      ms->overflow = p->overflow;
+      ms->overflow_param = p->overflow_param;
+    }
+  }
+}
+
 /** Destroy a Measurement Stream, and deep free allocated memory (filters.
  *
  * This function is designed so it can be used in a while loop to clean up the
@@ -1064,6 +1357,9 @@ destroy_ms(OmlMStream *ms)
 
   while( (ft = destroy_filter(ft)) );
 
+  if (ms->encoded_row) {
+    mbuf_destroy(ms->encoded_row);
+  }
   oml_free(ms->writers);
   oml_free(ms);
 
@@ -1243,7 +1539,7 @@ write_meta(void)
   OmlWriter* writer = omlc_instance->first_writer;
   for (; writer != NULL; writer = writer->next) {
     char s[128];
-    sprintf(s, "protocol: %d", OML_PROTOCOL_VERSION);
+    sprintf(s, "protocol: %d", omlc_instance->protocol_version);
     writer->meta(writer, s);
     sprintf(s, "domain: %s", omlc_instance->domain);
     writer->meta(writer, s);
@@ -32,6 +32,20 @@ mp_lock(OmlMP* mp)
   return oml_lock(mp->mutexP, mp->name);
 }
 
+/** Try to lock a measurement point mutex, without waiting
+ * \param mp OmlMP to lock
+ * \return 0 if successful, -1 if the mutex is already locked
+ * \see mp_lock, mp_unlock
+ */
+int
+mp_trylock(OmlMP* mp)
+{
+  if (mp->mutexP && pthread_mutex_trylock(mp->mutexP)) {
+    return -1;
+  }
+  return 0;
+}
+
 /** Unlock a measurement point mutex
  * \param mp OmlMP to unlock
  * \see mp_lock, oml_unlock
@@ -28,6 +28,7 @@
 #include "net_stream.h"
 
 static ssize_t net_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* header, size_t  header_length);
+static ssize_t net_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
 static int net_stream_close(OmlOutStream* hdl);
 
 /** Create a new out stream for sending over the network
@@ -65,6 +66,7 @@ net_stream_new(const char *transport, const char *hostname, const char *service)
   /* } */
 
   self->write = net_stream_write;
+  self->writev = net_stream_writev;
   self->close = net_stream_close;
   return (OmlOutStream*)self;
 }
@@ -173,6 +175,29 @@ socket_write(OmlOutStream* outs, uint8_t* buffer, size_t  length)
   return result;
 }
 
+/** Do the actual vectored writing into the OComm Socket, with error handling
+ * \param self OmlNetOutStream through which the data should be written
+ * \param iov array of buffers to write
+ * \param iovcnt number of buffers in iov
+ *
+ * \return the size of data written, or -1 on error
+ *
+ * \see socket_write, socket_sendmsg
+ */
+static ssize_t
+socket_writev(OmlOutStream* outs, const struct iovec* iov, int iovcnt)
+{
+  OmlNetOutStream *self = (OmlNetOutStream*) outs;
+  ssize_t result = socket_sendmsg(self->socket, iov, iovcnt);
+
+  if (result == -1 && socket_is_disconnected (self->socket)) {
+    logwarn ("%s: Connection lost\n", self->dest);
+    socket_free(self->socket);
+    self->socket = NULL;      // Server closed the connection
+  }
+  return result;
+}
+
 /** Called to write into the socket
  * \see oml_outs_write_f
  *
@@ -215,6 +240,70 @@ net_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t  length, uint8_t* he
   return count;
 }
 
+/** Called to write several chunks into the socket
+ * \see oml_outs_writev_f
+ *
+ * If the connection needs to be re-established, header is sent first, in the
+ * same call as the data.
+ *
+ * \see open_socket, socket_writev
+ */
+static ssize_t
+net_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  OmlNetOutStream* self = (OmlNetOutStream*)hdl;
+  struct iovec vec[OML_OUTS_MAX_IOV + 1];
+  size_t pending_header = 0;
+  ssize_t count;
+  int i, n = 0;
+
+  /* The header can be NULL, but header_length MUST be 0 in that case */
+  assert(header || !header_length);
+  assert(iovcnt <= OML_OUTS_MAX_IOV);
+
+  /* Initialise the socket the first time */
+  while (self->socket == NULL) {
+    logdebug ("%s: Connecting to server\n", self->dest);
+    if (!open_socket(self)) {
+      logdebug("%s: Connection attempt failed\n", self->dest);
+      return 0;
+    }
+  }
+
+  /* If the underlying socket has registered a disconnection, it will reconnect on its own
+   * however, we need to check it to make sure we send the headers before anything else */
+  if(socket_is_disconnected(self->socket)) {
+    self->header_written = 0;
+  }
+
+  if (!self->header_written && header_length > 0) {
+    vec[n].iov_base = header;
+    vec[n].iov_len = header_length;
+    pending_header = header_length;
+    n++;
+  }
+  for (i = 0; i < iovcnt; i++) {
+    if(o_log_level_active(O_LOG_DEBUG4)) {
+      char *out = to_octets(iov[i].iov_base, iov[i].iov_len);
+      logdebug("%s: Sending data %s\n", self->dest, out);
+      oml_free(out);
+    }
+    vec[n++] = iov[i];
+  }
+
+  count = socket_writev(hdl, vec, n);
+  if (count <= 0) {
+    return count;
+  }
+
+  self->header_written = 1;
+  if ((size_t)count < pending_header) {
+    logwarn("%s: Only wrote parts of the header; this might cause problem later on\n", self->dest);
+    return 0;
+  }
+  return count - pending_header;
+}
+
 /*
  Local Variables:
  mode: C
@@ -44,6 +44,10 @@ typedef void* (*oml_filter_create)(OmlValueT type, OmlValue* result);
 typedef int (*oml_filter_set)(struct OmlFilter* filter, const char* name, OmlValue* value);
 
 /** Function called whenever a new sample is to be delivered to the filter.
+ *
+ * The content of strings, blobs and vectors in value is only valid until this
+ * function returns. Filters must oml_value_set a copy of what they need to
+ * keep, unless OmlFilter::borrow_input is set.
  *
  * \param filter pointer to OmlFilter instance
  * \param value new sample, as a pointer to an OmlValue
@@ -69,6 +73,25 @@ typedef int (*oml_filter_output)(struct OmlFilter* filter, struct OmlWriter* wri
  */
 typedef int (*oml_filter_newwindow)(struct OmlFilter* filter);
 
+/** Function called, with the lock of the MP held, to capture the aggregated
+ * output of the filter and start a new sampling window.
+ *
+ * The captured output is written to the writers once the lock has been
+ * released, so injecting threads are not kept waiting while it is marshalled.
+ * This function should therefore be cheap, and must not keep references to the
+ * state of the filter in snapshot.
+ *
+ * Filters registered without such a function get a default one, which calls
+ * oml_filter_output() with a writer copying its output into snapshot, then
+ * oml_filter_newwindow().
+ *
+ * \param filter pointer to OmlFilter instance
+ * \param[out] snapshot vector of OmlFilter::output_count OmlValue, typed as the output of the filter, where to copy the output
+ * \return 0 on success, -1 otherwise
+ * \see omlf_register_filter_snapshot, oml_value_set
+ */
+typedef int (*oml_filter_snapshot)(struct OmlFilter* filter, OmlValue* snapshot);
+
 /** Optional function returning metainformation for complex outputs.
  *
  * XXX: This function will probably go at some point soon. Don't use it.
@@ -141,6 +164,16 @@ typedef struct OmlFilter {
 
   /** Function to start a new sampling period \see oml_filter_newwindow */
   oml_filter_newwindow newwindow; /* XXX: To be pulled up after output on the next ABI version change */
+
+  /** Set while the output of this filter is generated for every input, before
+   * the injection returns; the filter can then keep references to string,
+   * blob or vector inputs rather than copying them \see oml_value_borrow */
+  int borrow_input;
+
+  /** Function to capture the output and start a new sampling period \see oml_filter_snapshot */
+  oml_filter_snapshot snapshot;
+  /** Array of OmlFilter::output_count results captured by the last snapshot, allocated by the factory */
+  OmlValue *snapshot_result;
 } OmlFilter;
 
 /** Register a new filter type.
@@ -174,6 +207,20 @@ int
 omlf_register_filter(const char* filter_name, oml_filter_create create, oml_filter_set set, oml_filter_input input,
     oml_filter_output output, oml_filter_newwindow newwindow, oml_filter_meta meta, OmlFilterDef* filter_def);
 
+/** Set the snapshot function of a registered filter type.
+ *
+ * Instances of the filter type created afterwards use this function, rather
+ * than the default one, to capture their output at the end of each sampling
+ * period.
+ *
+ * \param filter_name name of the filter type, as passed to omlf_register_filter()
+ * \param snapshot oml_filter_snapshot() function, or NULL to use the default one
+ * \return 0 on success, -1 if no such filter type has been registered
+ * \see omlf_register_filter, oml_filter_snapshot
+ */
+int
+omlf_register_filter_snapshot(const char* filter_name, oml_filter_snapshot snapshot);
+
 #ifdef __cplusplus
 }
 #endif
@@ -19,6 +19,7 @@
 
 #include <unistd.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -40,6 +41,26 @@ struct OmlOutStream;
  */
 typedef ssize_t (*oml_outs_write_f)(struct OmlOutStream* outs, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length);
 
+/** Maximal number of buffers passed at once to an oml_outs_writev_f */
+#define OML_OUTS_MAX_IOV 64
+
+/** Write several chunks into the lower level out stream at once
+ *
+ * The buffers are written in order, as if they were contiguous, preferably
+ * with a single system call. Like writev(2), this may only write part of the
+ * data; the caller must then resume from the first byte not written.
+ *
+ * \param outs OmlOutStream to write into
+ * \param iov array of buffers to write
+ * \param iovcnt number of buffers in iov (at most OML_OUTS_MAX_IOV)
+ * \param header pointer to the beginning of header data to write in case of disconnection
+ * \param header_length length of header data to write in case of disconnection
+ *
+ * \return the number of bytes sent from iov (excluding the header) on success, -1 otherwise
+ * \see oml_outs_write_f, out_stream_writev
+ */
+typedef ssize_t (*oml_outs_writev_f)(struct OmlOutStream* outs, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
+
 /** Close an OmlOutStream
  *
  * \param writer OmlOutStream to close
@@ -80,6 +101,16 @@ struct OmlOutStream* create_out_stream(const char *uri);
  */
 ssize_t out_stream_write_header(struct OmlOutStream* outs, oml_outs_write_f_immediate writefp, uint8_t* header, size_t header_length);
 
+/** Write several chunks into an OmlOutStream
+ *
+ * This uses the writev method of the OmlOutStream if it has one, and falls
+ * back to calling its write method for each buffer otherwise.
+ *
+ * \copydetails oml_outs_writev_f
+ * \see oml_outs_writev_f, oml_outs_write_f
+ */
+ssize_t out_stream_writev(struct OmlOutStream* outs, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
+
 /** A low-level output stream */
 typedef struct OmlOutStream {
   /** Pointer to a function in charge of writing into the stream \see oml_outs_write_f */
@@ -90,6 +121,8 @@ typedef struct OmlOutStream {
   char* dest;
   /** True if header has been written to the stream */
   int   header_written;
+  /** Pointer to a function in charge of writing several chunks at once, or NULL \see oml_outs_writev_f */
+  oml_outs_writev_f writev;
 } OmlOutStream;
 
 extern OmlOutStream *file_stream_new(const char *file);
@@ -101,6 +134,10 @@ int file_stream_get_buffered(OmlOutStream* hdl);
 
 extern OmlOutStream *net_stream_new(const char *transport, const char *hostname, const char *port);
 
+/* from zlib_stream.c */
+
+extern OmlOutStream *zlib_stream_new(OmlOutStream *os);
+
 #ifdef __cplusplus
 }
 #endif
@@ -28,11 +28,27 @@
  * This also defines the highest protocol revision that the oml2-server built
  * along can understand.
  */
-#define OML_PROTOCOL_VERSION 5
+#define OML_PROTOCOL_VERSION 9
+
+/** The OMSP version announced by default.
+ *
+ * The server cannot tell the client which versions it understands, and
+ * servers older than OML_PROTOCOL_VERSION reject clients announcing it, so the
+ * newest version has to be selected explicitly (--oml-protocol).
+ */
+#define OML_DEFAULT_PROTOCOL_VERSION 5
 
 struct OmlWriter;
+struct MBuffer;
 typedef struct BufferedWriter BufferedWriter; /* XXX: From buffered_writer.h */
 
+/** Stream encoding type, for use with create_writer */
+enum StreamEncoding {
+  SE_None, // Not explicitly specified by the user
+  SE_Text,
+  SE_Binary
+};
+
 /** Function called whenever some header metadata needs to be added.
  * \param writer pointer to OmlWriter instance
  * \param string character string to add to headers
@@ -83,6 +99,37 @@ typedef int (*oml_writer_row_end)(struct OmlWriter* writer, OmlMStream* ms);
  */
 typedef int (*oml_writer_out)( struct OmlWriter* writer, OmlValue* values, int values_count);
 
+/** Function called to write a sample already encoded by another writer.
+ *
+ * Writers with the same encoding produce the same bytes for a sample. When
+ * several of them serve an MS, the sample is only encoded by the first one,
+ * which keeps a copy in OmlMStream::encoded_row, and the others write that
+ * copy with this function, instead of row_start, out and row_end.
+ *
+ * \param writer pointer to OmlWriter instance
+ * \param ms OmlMStream for which the sample is
+ * \param row MBuffer holding the encoded sample as its current message
+ *
+ * \return 1 on success, 0 on error
+ *
+ * \see oml_writer_row_end, oml_writer_keep_row
+ */
+typedef int (*oml_writer_row_copy)(struct OmlWriter* writer, OmlMStream* ms, struct MBuffer* row);
+
+/** Function called before a batch of samples injected at once is released.
+ *
+ * While the BufferedWriter is reserved for a batch (\see bw_reserve), a
+ * writer may hold samples back to encode them together. This function should
+ * then write them out.
+ *
+ * \param writer pointer to OmlWriter instance
+ *
+ * \return 1 on success, 0 if some samples were lost
+ *
+ * \see omlc_inject_batch
+ */
+typedef int (*oml_writer_flush)(struct OmlWriter* writer);
+
 /** Function called to close the writer and free its allocated objects.
  *
  * This function is designed so it can be used in a while loop to clean up the
@@ -120,20 +167,22 @@ typedef struct OmlWriter {
   /** Buffered writer into which the serialised data is written */
   BufferedWriter* bufferedWriter;
 
-} OmlWriter;
+  /** Encoding of the samples, as an enum StreamEncoding */
+  int encoding;
+  /** Pointer to function writing a sample encoded by another writer with the same encoding (optional) \see oml_writer_row_copy */
+  oml_writer_row_copy row_copy;
+  /** Pointer to function writing out samples held back for a batch (optional) \see oml_writer_flush */
+  oml_writer_flush flush;
 
-/** Stream encoding type, for use with create_writer */
-enum StreamEncoding {
-  SE_None, // Not explicitly specified by the user
-  SE_Text,
-  SE_Binary
-};
+} OmlWriter;
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 OmlWriter* create_writer(const char* uri, enum StreamEncoding encoding);
+void oml_writer_keep_row(OmlMStream* ms, struct MBuffer* mbuf);
+int oml_writer_copy_row(OmlWriter* writer, OmlMStream* ms, struct MBuffer* row);
 
 /* from (bin|text)_writer.c */
 
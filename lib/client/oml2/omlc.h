@@ -685,6 +685,9 @@ typedef struct OmlMP {
   /* FIXME: to be taken up aftern streams on the next library major bump */
   struct OmlMStream* default_ms;
 
+  /** Per-thread rings of samples injected while the MP was locked */
+  struct OmlStaging* staging;
+
 } OmlMP;
 
 /* Forward declaration from oml_filter.h */
@@ -733,7 +736,7 @@ typedef struct OmlMStream {
 
   /** Condition variable for sample-mode filter (XXX: Never used) */
   pthread_cond_t  condVar;
-  /** Filtering thread */
+  /** Filtering thread (XXX: Never used, all periodic reports are generated by a single scheduler thread) */
   pthread_t  filter_thread;
 
   /** Outputting function
@@ -757,6 +760,31 @@ typedef struct OmlMStream {
   /** Number of tuples dropped */
   uint32_t dropped;
 
+  /** Number of tuples lost after having been buffered (updated atomically) */
+  uint32_t lost;
+
+  /** Priority of the tuples of this stream when buffers are full \see OmlPriority */
+  int priority;
+  /** Handling of the tuples of this stream when buffers are full \see OmlOverflowPolicy */
+  int overflow;
+  /** Parameter of the overflow policy: timeout [ms] for blocking, or decimation factor */
+  uint32_t overflow_param;
+  /** Number of tuples offered to the buffers since decimation started */
+  uint32_t overflowed;
+  /** Value of dropped + lost at the last instrumentation report */
+  uint32_t reported_drops;
+
+  /** Set while the filtering thread writes a report after releasing the lock of the MP (updated atomically) */
+  int reporting;
+
+  /** Largest delay of a periodic report behind its deadline since the last instrumentation report [s] */
+  double scheduling_lag;
+
+  /** Copy of the last sample encoded while keep_row was set, for the other writers with the same encoding \see oml_writer_row_copy */
+  struct MBuffer* encoded_row;
+  /** Set while a sample is encoded by the first of several writers with the same encoding */
+  int keep_row;
+
 } OmlMStream;
 
 /* Initialise the measurement library. */
@@ -771,6 +799,25 @@ int omlc_start(void);
 /*  Inject a measurement sample into a Measurement Point.  */
 int omlc_inject(OmlMP *mp, OmlValueU *values);
 
+/*  Inject several measurement samples into a Measurement Point.  */
+int omlc_inject_batch(OmlMP *mp, const OmlValueU *rows, size_t nrows);
+int omlc_inject_batch_columns(OmlMP *mp, const OmlValueU *const *columns, size_t nrows);
+
+/*  Reusable samples, borrowing their strings and blobs.  */
+typedef struct OmlSample OmlSample;
+OmlSample *omlc_sample_new(OmlMP *mp);
+void omlc_sample_free(OmlSample *sample);
+int omlc_sample_set_int32(OmlSample *sample, unsigned int index, int32_t value);
+int omlc_sample_set_uint32(OmlSample *sample, unsigned int index, uint32_t value);
+int omlc_sample_set_int64(OmlSample *sample, unsigned int index, int64_t value);
+int omlc_sample_set_uint64(OmlSample *sample, unsigned int index, uint64_t value);
+int omlc_sample_set_double(OmlSample *sample, unsigned int index, double value);
+int omlc_sample_set_bool(OmlSample *sample, unsigned int index, int value);
+int omlc_sample_set_guid(OmlSample *sample, unsigned int index, oml_guid_t value);
+int omlc_sample_set_string(OmlSample *sample, unsigned int index, const char *str);
+int omlc_sample_set_blob(OmlSample *sample, unsigned int index, const void *data, size_t length);
+int omlc_sample_inject(OmlSample *sample);
+
 /** Inject metadata (key/value) for a specific MP.  */
 int omlc_inject_metadata(OmlMP *mp, const char *key, const OmlValueU *value, OmlValueT type, const char *fname);
 
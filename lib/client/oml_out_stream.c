@@ -132,6 +132,33 @@ out_stream_write_header(OmlOutStream* self, oml_outs_write_f_immediate writefp,
   return count;
 }
 
+/** Write several chunks into an OmlOutStream */
+ssize_t
+out_stream_writev(OmlOutStream* self, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  ssize_t count, total = 0;
+  int i;
+
+  assert(self);
+  assert(iovcnt <= OML_OUTS_MAX_IOV);
+
+  if (self->writev) {
+    return self->writev(self, iov, iovcnt, header, header_length);
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    count = self->write(self, iov[i].iov_base, iov[i].iov_len, header, header_length);
+    if (count < 0) {
+      return total > 0 ? total : count;
+    }
+    total += count;
+    if ((size_t)count < iov[i].iov_len) {
+      break;
+    }
+  }
+  return total;
+}
+
 /*
  Local Variables:
  mode: C
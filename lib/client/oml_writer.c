@@ -13,6 +13,9 @@
 #include "oml2/oml_writer.h"
 #include "oml2/oml_out_stream.h"
 #include "oml_utils.h"
+#include "client.h"
+#include "buffered_writer.h"
+#include "mbuf.h"
 
 /** Create an OmlWriter for the specified URI
  *
@@ -20,12 +23,17 @@
  * \param encoding StreamEncoding to use for the output, either SE_Text or SE_Binary
  * \return a pointer to the new OmlWriter, or NULL on error
  *
- * \see create_out_stream
+ * If a spool directory was given, data which cannot be sent to a network
+ * URI in time is spooled there. If compression was requested, data sent to a
+ * network URI is compressed.
+ *
+ * \see create_out_stream, zlib_stream_new, bw_spool
  */
 OmlWriter*
 create_writer(const char* uri, enum StreamEncoding encoding)
 {
   OmlOutStream* out_stream = NULL;
+  OmlOutStream* zlib_stream = NULL;
   OmlWriter* writer = NULL;
 
   out_stream = create_out_stream(uri);
@@ -34,6 +42,16 @@ create_writer(const char* uri, enum StreamEncoding encoding)
     return NULL;
   }
 
+  if (omlc_instance && omlc_instance->compress &&
+      !oml_uri_is_file(oml_uri_type(uri))) {
+    if (NULL == (zlib_stream = zlib_stream_new(out_stream))) {
+      logerror ("Failed to create compressed stream for URI %s\n", uri);
+      out_stream->close(out_stream);
+      return NULL;
+    }
+    out_stream = zlib_stream;
+  }
+
   if (SE_None == encoding) {
     if (oml_uri_is_file(oml_uri_type(uri))) {
       encoding = SE_Text; /* default encoding */
@@ -56,10 +74,79 @@ create_writer(const char* uri, enum StreamEncoding encoding)
     return NULL;
   }
 
+  if (omlc_instance && omlc_instance->spool_dir &&
+      !oml_uri_is_file(oml_uri_type(uri)) &&
+      bw_spool(writer->bufferedWriter, omlc_instance->spool_dir, omlc_instance->spool_max)) {
+    logwarn ("Cannot spool data for URI %s; samples will be dropped when it is unavailable\n", uri);
+  }
+
   writer->next = NULL;
   return writer;
 }
 
+/** Keep a copy of the sample just encoded by a writer, if the MS needs it.
+ *
+ * Writers call this function in their row_end, once the sample is complete
+ * as the current message of their MBuffer.
+ *
+ * \param ms OmlMStream for which the sample is
+ * \param mbuf MBuffer holding the encoded sample as its current message
+ * \see oml_writer_row_copy, OmlMStream::keep_row
+ */
+void
+oml_writer_keep_row(OmlMStream* ms, MBuffer* mbuf)
+{
+  if (!ms->keep_row || !ms->encoded_row) {
+    return;
+  }
+
+  mbuf_clear2(ms->encoded_row, 0);
+  if (mbuf_write(ms->encoded_row, mbuf_message(mbuf), mbuf_message_length(mbuf))) {
+    mbuf_clear2(ms->encoded_row, 0);
+  }
+}
+
+/** Write a sample encoded by another writer with the same encoding.
+ *
+ * This is the oml_writer_row_copy function of the text and binary writers.
+ *
+ * \param writer pointer to OmlWriter instance
+ * \param ms OmlMStream for which the sample is
+ * \param row MBuffer holding the encoded sample as its current message
+ * \return 1 on success, 0 on error
+ * \see oml_writer_row_copy, oml_writer_keep_row
+ */
+int
+oml_writer_copy_row(OmlWriter* writer, OmlMStream* ms, MBuffer* row)
+{
+  MBuffer* mbuf;
+  int res;
+
+  if ((mbuf = bw_get_write_buf(writer->bufferedWriter, ms)) == NULL) {
+    return 0;
+  }
+
+  mbuf_begin_write(mbuf);
+  if ((res = mbuf_write(mbuf, mbuf_message(row), mbuf_message_length(row))) != 0) {
+    mbuf_reset_write(mbuf);
+
+  } else {
+    if (0 == ms->index) {
+      /* This is schema0, also push the data into the meta_buf
+       * to be replayed after a disconnection, as in the row_end functions
+       * of the writers (see #1101).
+       */
+      _bw_push_meta(writer->bufferedWriter,
+          mbuf_message(mbuf), mbuf_message_length(mbuf));
+    }
+    mbuf_begin_write(mbuf);
+  }
+
+  bw_msgcount_add(writer->bufferedWriter, ms, 1);
+  bw_release_write_buf(writer->bufferedWriter);
+  return res == 0;
+}
+
 /*
  Local Variables:
  mode: C
@@ -35,6 +35,8 @@ enum ConfToken {
   CT_STREAM_SOURCE,
   CT_STREAM_SAMPLES,
   CT_STREAM_INTERVAL,
+  CT_STREAM_PRIORITY,
+  CT_STREAM_OVERFLOW,
   CT_FILTER,
   CT_FILTER_FIELD,
   CT_FILTER_OPER,
@@ -95,6 +97,8 @@ init_tokens (void)
   setcurtok (CT_STREAM_SOURCE),    mksyn ("source"), mksyn ("mp");
   setcurtok (CT_STREAM_SAMPLES),   mksyn ("samples");
   setcurtok (CT_STREAM_INTERVAL),  mksyn ("interval");
+  setcurtok (CT_STREAM_PRIORITY),  mksyn ("priority");
+  setcurtok (CT_STREAM_OVERFLOW),  mksyn ("overflow");
   setcurtok (CT_FILTER),           mksyn ("f"), mksyn ("filter");
   setcurtok (CT_FILTER_FIELD),     mksyn ("pname"), mksyn ("field");
   setcurtok (CT_FILTER_OPER),      mksyn ("fname"), mksyn ("operation");
@@ -491,6 +495,26 @@ parse_stream_filters (xmlNodePtr el, OmlWriter *writer,
   if (!ms)
     return -6;
 
+  char *priority_str = get_xml_attr (el, CT_STREAM_PRIORITY);
+  char *overflow_str = get_xml_attr (el, CT_STREAM_OVERFLOW);
+  int ret = 0;
+  if (priority_str != NULL && oml_parse_priority (priority_str, &ms->priority)) {
+    logerror("Config line %hu: Invalid priority '%s' for <%s ...>; use low, normal or high.\n",
+             el->line, priority_str, el->name);
+    ret = -7;
+  }
+  if (overflow_str != NULL &&
+      oml_parse_overflow (overflow_str, &ms->overflow, &ms->overflow_param)) {
+    logerror("Config line %hu: Invalid overflow policy '%s' for <%s ...>; "
+             "use drop-newest, drop-oldest, block[:TIMEOUT] or decimate[:FACTOR].\n",
+             el->line, overflow_str, el->name);
+    ret = -7;
+  }
+  if (priority_str) { oml_free (priority_str); }
+  if (overflow_str) { oml_free (overflow_str); }
+  if (ret)
+    return ret;
+
   xmlNodePtr el2 = el->children;
   for (; el2 != NULL; el2 = el2->next) {
     if (match_xml_elt (el2, CT_FILTER)) {
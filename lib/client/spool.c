@@ -0,0 +1,420 @@
+/*
+ * Copyright 2011-2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file spool.c
+ * \brief An on-disk spill queue made of memory-mapped segment files.
+ *
+ * When the ring of a BufferedWriter is full, the chunks which would otherwise
+ * be dropped are appended to a Spool, so they can be sent later. The Spool is
+ * a list of segment files, each of which is mapped in memory and holds a
+ * sequence of records. Each record is one chunk of complete messages,
+ * preceded by its length. Records are appended at the end of the newest
+ * segment, and read back from the start of the oldest one. A segment is
+ * unlinked as soon as all its records have been sent.
+ *
+ * Producers append records (with the write_lock of the BufferedWriter held),
+ * while the reader thread consumes them, so both sides take the lock of the
+ * Spool. The reader then sends the records directly from the mapping, without
+ * the lock, as the data of complete records is never modified.
+ *
+ * The segments only live as long as the process: they are not replayed if it
+ * is restarted.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <inttypes.h>
+#include <sys/mman.h>
+
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "spool.h"
+
+/** Size of the length header of each record [B] */
+#define SPOOL_RECORD_HEADER sizeof(uint32_t)
+
+/** A memory-mapped segment file of a Spool */
+typedef struct SpoolSegment {
+
+  struct SpoolSegment* next;	/**< Next (newer) segment */
+
+  char* path;			/**< Path of the segment file */
+  int fd;			/**< File descriptor of the segment file */
+  uint8_t* map;			/**< Mapping of the segment file */
+  size_t size;			/**< Size of the segment file and mapping [B] */
+
+  size_t wr;			/**< Offset at which the next record will be appended */
+  size_t rd;			/**< Offset of the first record not fully sent */
+  size_t rd_off;		/**< Number of bytes of the record at rd already sent */
+
+} SpoolSegment;
+
+struct Spool {
+  char* dir;			/**< Directory in which segment files are created */
+  char* name;			/**< Name of the spooled stream, for logging */
+  uint64_t max_size;		/**< Maximal amount of data in the spool [B], 0 for no limit */
+
+  uint64_t bytes;		/**< Amount of data in the spool and not yet sent [B], read without the lock */
+  uint64_t nseg;		/**< Sequence number of the next segment file */
+  int instance;			/**< Number of this Spool in the process, to name segments */
+
+  SpoolSegment* first;		/**< Oldest segment, from which records are read */
+  SpoolSegment* last;		/**< Newest segment, to which records are appended */
+
+  pthread_mutex_t lock;		/**< Mutex protecting the list of segments */
+};
+
+static int spool_instances = 0;
+
+/** Create a new Spool.
+ *
+ * No file is created until data is first appended.
+ *
+ * \param dir directory in which to create the segment files (copied locally)
+ * \param name name of the spooled stream, used in log messages (copied locally)
+ * \param max_size maximal amount of data to keep in the spool [B], 0 for no limit
+ * \return a new Spool, or NULL on error
+ *
+ * \see spool_destroy
+ */
+Spool*
+spool_new(const char* dir, const char* name, uint64_t max_size)
+{
+  Spool* self;
+
+  if (!dir || !name) {
+    return NULL;
+  }
+
+  if (access(dir, W_OK | X_OK)) {
+    logerror("%s: Cannot use spool directory '%s': %s\n", name, dir, strerror(errno));
+    return NULL;
+  }
+
+  if (NULL == (self = oml_malloc(sizeof(Spool)))) {
+    return NULL;
+  }
+  self->dir = oml_strndup(dir, strlen(dir));
+  self->name = oml_strndup(name, strlen(name));
+  self->max_size = max_size;
+  self->instance = __atomic_fetch_add(&spool_instances, 1, __ATOMIC_SEQ_CST);
+  pthread_mutex_init(&self->lock, NULL);
+
+  if (!self->dir || !self->name) {
+    spool_destroy(self);
+    return NULL;
+  }
+
+  logdebug("%s: Spooling overflowing data to %s (%" PRIu64 "B max)\n",
+      self->name, self->dir, max_size);
+
+  return self;
+}
+
+/** Unmap, close and unlink a segment file, and free its descriptor.
+ *
+ * \param seg SpoolSegment to remove
+ */
+static void
+segment_remove(SpoolSegment* seg)
+{
+  if (seg->map && MAP_FAILED != seg->map) {
+    munmap(seg->map, seg->size);
+  }
+  if (seg->fd >= 0) {
+    close(seg->fd);
+  }
+  if (seg->path) {
+    unlink(seg->path);
+    oml_free(seg->path);
+  }
+  oml_free(seg);
+}
+
+/** Create and map a new segment file.
+ *
+ * The file is fully allocated on disk, so the mapping cannot fault when
+ * written to if the filesystem later fills up.
+ *
+ * \param self Spool in which to create the segment
+ * \param size size of the segment [B]
+ * \return a new SpoolSegment, or NULL on error
+ */
+static SpoolSegment*
+segment_new(Spool* self, size_t size)
+{
+  SpoolSegment* seg;
+  size_t len;
+  int err;
+
+  if (NULL == (seg = oml_malloc(sizeof(SpoolSegment)))) {
+    return NULL;
+  }
+  seg->fd = -1;
+  seg->size = size;
+
+  len = strlen(self->dir) + 64;
+  if (NULL == (seg->path = oml_malloc(len))) {
+    segment_remove(seg);
+    return NULL;
+  }
+  snprintf(seg->path, len, "%s/oml-%d-%d-%" PRIu64 ".spool",
+      self->dir, (int)getpid(), self->instance, self->nseg++);
+
+  if ((seg->fd = open(seg->path, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0) {
+    logwarn("%s: Cannot create spool segment '%s': %s\n",
+        self->name, seg->path, strerror(errno));
+    oml_free(seg->path);
+    seg->path = NULL;
+    segment_remove(seg);
+    return NULL;
+  }
+
+  if ((err = posix_fallocate(seg->fd, 0, size))) {
+    logwarn("%s: Cannot allocate %zuB for spool segment '%s': %s\n",
+        self->name, size, seg->path, strerror(err));
+    segment_remove(seg);
+    return NULL;
+  }
+
+  seg->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+  if (MAP_FAILED == seg->map) {
+    logwarn("%s: Cannot map spool segment '%s': %s\n",
+        self->name, seg->path, strerror(errno));
+    segment_remove(seg);
+    return NULL;
+  }
+
+  logdebug("%s: Created spool segment '%s'\n", self->name, seg->path);
+  return seg;
+}
+
+/** Destroy a Spool, removing all its segment files.
+ *
+ * \param self Spool to destroy
+ */
+void
+spool_destroy(Spool* self)
+{
+  SpoolSegment *seg, *next;
+
+  if (!self) {
+    return;
+  }
+
+  if (self->bytes > 0) {
+    logwarn("%s: Discarding %" PRIu64 "B of spooled data\n", self->name, self->bytes);
+  }
+
+  for (seg = self->first; seg; seg = next) {
+    next = seg->next;
+    segment_remove(seg);
+  }
+
+  pthread_mutex_destroy(&self->lock);
+  if (self->dir) { oml_free(self->dir); }
+  if (self->name) { oml_free(self->name); }
+  oml_free(self);
+}
+
+/** Append a record to a Spool.
+ *
+ * A new segment is started when the record does not fit in the newest one.
+ * Segments are SPOOL_SEGMENT_SIZE, unless a single record needs more.
+ *
+ * \param self Spool to append to
+ * \param data data of the record
+ * \param size size of the data [B]
+ * \return 0 on success, -1 if the spool is full or cannot be written to
+ *
+ * \see SPOOL_SEGMENT_SIZE
+ */
+int
+spool_append(Spool* self, const uint8_t* data, size_t size)
+{
+  SpoolSegment* seg;
+  size_t needed = SPOOL_RECORD_HEADER + size;
+  uint32_t len = size;
+  int ret = -1;
+
+  if (!self || !size || size > UINT32_MAX) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&self->lock);
+
+  if (self->max_size && self->bytes + size > self->max_size) {
+    goto unlock;
+  }
+
+  seg = self->last;
+  if (!seg || seg->size - seg->wr < needed) {
+    if (seg) {
+      msync(seg->map, seg->size, MS_ASYNC);
+    }
+    if (NULL == (seg = segment_new(self, needed > SPOOL_SEGMENT_SIZE ? needed : SPOOL_SEGMENT_SIZE))) {
+      goto unlock;
+    }
+    if (self->last) {
+      self->last->next = seg;
+    } else {
+      self->first = seg;
+    }
+    self->last = seg;
+  }
+
+  memcpy(seg->map + seg->wr, &len, SPOOL_RECORD_HEADER);
+  memcpy(seg->map + seg->wr + SPOOL_RECORD_HEADER, data, size);
+  seg->wr += needed;
+  __atomic_add_fetch(&self->bytes, size, __ATOMIC_SEQ_CST);
+  ret = 0;
+
+unlock:
+  pthread_mutex_unlock(&self->lock);
+  return ret;
+}
+
+/** Describe the oldest unsent data of a Spool.
+ *
+ * The iovecs point to the mapped records, starting with the unsent part of the
+ * oldest one. Only whole records are added after the first, up to iovcnt
+ * records and max_bytes of data, but at least one record is always described.
+ * Records are only taken from the oldest segment.
+ *
+ * \param self Spool to read from
+ * \param iov array of iovecs to fill
+ * \param iovcnt number of elements in iov
+ * \param max_bytes soft limit on the amount of data to describe [B]
+ * \return the number of iovecs filled, 0 if the spool is empty
+ *
+ * \see spool_consume
+ */
+int
+spool_peek(Spool* self, struct iovec* iov, int iovcnt, size_t max_bytes)
+{
+  SpoolSegment* seg;
+  size_t off, total = 0;
+  uint32_t len;
+  int n = 0;
+
+  if (!self) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&self->lock);
+  if ((seg = self->first)) {
+    for (off = seg->rd; off < seg->wr && n < iovcnt; off += SPOOL_RECORD_HEADER + len) {
+      memcpy(&len, seg->map + off, SPOOL_RECORD_HEADER);
+      if (n > 0 && total + len > max_bytes) {
+        break;
+      }
+      iov[n].iov_base = seg->map + off + SPOOL_RECORD_HEADER;
+      iov[n].iov_len = len;
+      if (0 == n) {
+        iov[n].iov_base = (uint8_t*)iov[n].iov_base + seg->rd_off;
+        iov[n].iov_len -= seg->rd_off;
+      }
+      total += iov[n].iov_len;
+      n++;
+    }
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  return n;
+}
+
+/** Mark data at the head of a Spool as sent.
+ *
+ * Segments are unlinked as soon as all their records have been consumed.
+ *
+ * \param self Spool to consume from
+ * \param size amount of data sent [B], as described by spool_peek
+ *
+ * \see spool_peek
+ */
+void
+spool_consume(Spool* self, size_t size)
+{
+  SpoolSegment* seg;
+  uint32_t len;
+  size_t left;
+
+  if (!self) {
+    return;
+  }
+
+  pthread_mutex_lock(&self->lock);
+  while (size > 0 && (seg = self->first)) {
+    memcpy(&len, seg->map + seg->rd, SPOOL_RECORD_HEADER);
+    left = len - seg->rd_off;
+    if (size < left) {
+      seg->rd_off += size;
+      __atomic_sub_fetch(&self->bytes, size, __ATOMIC_SEQ_CST);
+      break;
+    }
+    size -= left;
+    __atomic_sub_fetch(&self->bytes, left, __ATOMIC_SEQ_CST);
+    seg->rd += SPOOL_RECORD_HEADER + len;
+    seg->rd_off = 0;
+
+    if (seg->rd >= seg->wr) {
+      self->first = seg->next;
+      if (self->last == seg) {
+        self->last = NULL;
+      }
+      logdebug("%s: Removing sent spool segment '%s'\n", self->name, seg->path);
+      segment_remove(seg);
+    }
+  }
+  pthread_mutex_unlock(&self->lock);
+}
+
+/** Check whether the oldest record of a Spool has only been partially sent.
+ *
+ * \param self Spool to check
+ * \return 1 if the rest of the record must be sent before any other data, 0 otherwise
+ */
+int
+spool_partial(Spool* self)
+{
+  int ret = 0;
+
+  if (self) {
+    pthread_mutex_lock(&self->lock);
+    ret = self->first && self->first->rd_off > 0;
+    pthread_mutex_unlock(&self->lock);
+  }
+
+  return ret;
+}
+
+/** Return the amount of data in a Spool not yet sent.
+ *
+ * \param self Spool to query
+ * \return the amount of spooled data [B]
+ */
+uint64_t
+spool_bytes(Spool* self)
+{
+  return self ? __atomic_load_n(&self->bytes, __ATOMIC_SEQ_CST) : 0;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,43 @@
+/*
+ * Copyright 2011-2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file spool.h
+ * \brief Interface of the on-disk spill queue of the BufferedWriter.
+ */
+
+#ifndef OML_SPOOL_H_
+#define OML_SPOOL_H_
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/** Default size of a spool segment file [B] */
+#define SPOOL_SEGMENT_SIZE (4 * 1024 * 1024)
+
+typedef struct Spool Spool;
+
+Spool* spool_new(const char* dir, const char* name, uint64_t max_size);
+void spool_destroy(Spool* self);
+
+int spool_append(Spool* self, const uint8_t* data, size_t size);
+int spool_peek(Spool* self, struct iovec* iov, int iovcnt, size_t max_bytes);
+void spool_consume(Spool* self, size_t size);
+int spool_partial(Spool* self);
+uint64_t spool_bytes(Spool* self);
+
+#endif // OML_SPOOL_H_
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
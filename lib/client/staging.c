@@ -0,0 +1,286 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file staging.c
+ * \brief Per-thread rings in which samples wait while their MP is busy.
+ *
+ * When a thread injects a sample into an MP which is locked by another
+ * thread, e.g., the filtering thread of an interval MS, it does not wait for
+ * the lock. Instead, it copies the sample into a ring of its own, and returns.
+ * Each ring has a single producer, the injecting thread, and a single
+ * consumer, whichever thread holds the lock of the MP, so neither side needs
+ * another lock.
+ *
+ * The holder of the lock drains the rings before processing its own samples,
+ * and after releasing the lock, \see omlc_mp_release. Staged samples from all
+ * rings are processed in order of their injection time.
+ *
+ * Rings are created the first time a thread stages a sample for the MP, and
+ * are kept until the MP is destroyed. A ring is found again from the ID of
+ * its thread, so a thread reusing the ID of a terminated thread also reuses
+ * its ring.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "oml2/omlc.h"
+#include "ocomm/o_log.h"
+#include "oml_value.h"
+#include "mem.h"
+#include "staging.h"
+
+/** A ring of samples staged by one thread */
+typedef struct StagingRing {
+
+  struct StagingRing* next;	/**< Next ring of the OmlStaging, set before publication */
+  pthread_t owner;		/**< Thread staging samples into this ring */
+
+  unsigned int head;		/**< Number of samples processed, written by the consumer */
+  unsigned int tail;		/**< Number of samples staged, written by the producer */
+  unsigned int snap;		/**< Value of tail when the current drain started, for the consumer */
+
+  struct timeval tv[OML_STAGING_SLOTS];	/**< Injection time of each slot */
+  OmlValue* values;		/**< OML_STAGING_SLOTS arrays of OmlMP::param_count values */
+
+} StagingRing;
+
+struct OmlStaging {
+  OmlMP* mp;			/**< MP whose samples are staged */
+
+  StagingRing* rings;		/**< List of rings, only ever prepended to */
+  int nrings;			/**< Number of rings in the list */
+
+  OmlValueU* row;		/**< Scratch sample passed to the staging_process function */
+};
+
+/** Create the staging rings of an MP.
+ *
+ * No ring is created until a sample is first staged.
+ *
+ * \param mp OmlMP whose samples are to be staged
+ * \return a new OmlStaging, or NULL on error
+ * \see staging_destroy
+ */
+OmlStaging*
+staging_new(OmlMP *mp)
+{
+  OmlStaging* self;
+
+  if (!mp || mp->param_count <= 0) {
+    return NULL;
+  }
+  if (NULL == (self = oml_malloc(sizeof(OmlStaging)))) {
+    return NULL;
+  }
+  if (NULL == (self->row = oml_malloc(mp->param_count * sizeof(OmlValueU)))) {
+    oml_free(self);
+    return NULL;
+  }
+  self->mp = mp;
+
+  return self;
+}
+
+/** Destroy the staging rings of an MP.
+ *
+ * Samples still in the rings are discarded: they should have been drained
+ * first. No thread may be staging samples when this function is called.
+ *
+ * \param self OmlStaging to destroy
+ */
+void
+staging_destroy(OmlStaging *self)
+{
+  StagingRing *r, *next;
+  unsigned int n;
+
+  if (!self) {
+    return;
+  }
+
+  for (r = self->rings; r; r = next) {
+    next = r->next;
+    if ((n = r->tail - r->head) > 0) {
+      logwarn("%s: Discarding %u staged samples\n", self->mp->name, n);
+    }
+    oml_value_array_reset(r->values, OML_STAGING_SLOTS * self->mp->param_count);
+    oml_free(r->values);
+    oml_free(r);
+  }
+
+  oml_free(self->row);
+  oml_free(self);
+}
+
+/** Find, or create, the ring of the calling thread.
+ *
+ * \param self OmlStaging in which to look
+ * \return the ring of the calling thread, or NULL if it cannot have one
+ */
+static StagingRing*
+staging_ring(OmlStaging *self)
+{
+  pthread_t me = pthread_self();
+  StagingRing* r;
+
+  for (r = __atomic_load_n(&self->rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    if (pthread_equal(r->owner, me)) {
+      return r;
+    }
+  }
+
+  if (__atomic_load_n(&self->nrings, __ATOMIC_SEQ_CST) >= OML_STAGING_MAX_RINGS) {
+    return NULL;
+  }
+  if (NULL == (r = oml_malloc(sizeof(StagingRing)))) {
+    return NULL;
+  }
+  if (NULL == (r->values = oml_malloc(OML_STAGING_SLOTS * self->mp->param_count * sizeof(OmlValue)))) {
+    oml_free(r);
+    return NULL;
+  }
+  oml_value_array_init(r->values, OML_STAGING_SLOTS * self->mp->param_count);
+  r->owner = me;
+
+  r->next = __atomic_load_n(&self->rings, __ATOMIC_ACQUIRE);
+  while (!__atomic_compare_exchange_n(&self->rings, &r->next, r, 0,
+        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+  logdebug("%s: Created staging ring %d\n", self->mp->name,
+      __atomic_add_fetch(&self->nrings, 1, __ATOMIC_SEQ_CST));
+  return r;
+}
+
+/** Copy a sample into the ring of the calling thread.
+ *
+ * Strings, blobs and vectors are copied into storage which is reused from
+ * one sample to the next.
+ *
+ * \param self OmlStaging into which to stage the sample
+ * \param values array of OmlValueU for all the fields of the MP
+ * \return 0 on success, -1 if the ring is full or the sample cannot be copied
+ * \see staging_drain
+ */
+int
+staging_push(OmlStaging *self, const OmlValueU *values)
+{
+  StagingRing* r;
+  OmlValue* slot;
+  unsigned int tail, i;
+
+  if (!self || NULL == (r = staging_ring(self))) {
+    return -1;
+  }
+
+  tail = r->tail;
+  if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) >= OML_STAGING_SLOTS) {
+    return -1;
+  }
+
+  slot = &r->values[(tail % OML_STAGING_SLOTS) * self->mp->param_count];
+  for (i = 0; i < (unsigned int)self->mp->param_count; i++) {
+    if (oml_value_set(&slot[i], &values[i], self->mp->param_defs[i].param_types)) {
+      return -1;
+    }
+  }
+  gettimeofday(&r->tv[tail % OML_STAGING_SLOTS], NULL);
+
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_SEQ_CST);
+  /* Make the sample visible before the caller checks the lock of the MP */
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+  return 0;
+}
+
+/** Check whether samples are waiting in any ring.
+ *
+ * \param self OmlStaging to check
+ * \return 1 if some samples have been staged but not yet drained, 0 otherwise
+ */
+int
+staging_pending(OmlStaging *self)
+{
+  StagingRing* r;
+
+  if (!self) {
+    return 0;
+  }
+
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  for (r = __atomic_load_n(&self->rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != __atomic_load_n(&r->head, __ATOMIC_SEQ_CST)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Process the samples staged in all rings, in order of injection.
+ *
+ * Only the samples staged before this function is called are drained, so it
+ * terminates even if other threads keep staging samples.
+ *
+ * Only one thread may drain the rings at a time, i.e., the lock of the MP
+ * must be held.
+ *
+ * \param self OmlStaging to drain
+ * \param process function called for each sample, in order of injection time
+ * \param arg opaque argument passed to process
+ * \return the number of samples processed
+ */
+size_t
+staging_drain(OmlStaging *self, staging_process process, void *arg)
+{
+  StagingRing *r, *first = NULL;
+  OmlValue* slot;
+  size_t n = 0;
+  int i;
+
+  if (!self) {
+    return 0;
+  }
+
+  for (r = __atomic_load_n(&self->rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+    r->snap = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+  }
+
+  do {
+    first = NULL;
+    for (r = __atomic_load_n(&self->rings, __ATOMIC_ACQUIRE); r; r = r->next) {
+      if (r->head != r->snap && (!first ||
+            timercmp(&r->tv[r->head % OML_STAGING_SLOTS],
+              &first->tv[first->head % OML_STAGING_SLOTS], <))) {
+        first = r;
+      }
+    }
+
+    if (first) {
+      slot = &first->values[(first->head % OML_STAGING_SLOTS) * self->mp->param_count];
+      for (i = 0; i < self->mp->param_count; i++) {
+        self->row[i] = slot[i].value;
+      }
+      process(arg, self->row, &first->tv[first->head % OML_STAGING_SLOTS]);
+      __atomic_store_n(&first->head, first->head + 1, __ATOMIC_RELEASE);
+      n++;
+    }
+  } while (first);
+
+  return n;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
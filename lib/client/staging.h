@@ -0,0 +1,52 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file staging.h
+ * \brief Interface of the per-thread staging rings of an OmlMP.
+ */
+
+#ifndef OML_STAGING_H_
+#define OML_STAGING_H_
+
+#include <sys/time.h>
+
+#include "oml2/omlc.h"
+
+/** Number of samples each thread can stage for an MP */
+#define OML_STAGING_SLOTS 128
+/** Maximal number of threads which can stage samples for an MP */
+#define OML_STAGING_MAX_RINGS 64
+
+typedef struct OmlStaging OmlStaging;
+
+/** Function called on each staged sample by staging_drain.
+ *
+ * \param arg opaque argument given to staging_drain
+ * \param values array of OmlValueU for all the fields of the MP, only valid until this function returns
+ * \param tv time at which the sample was injected
+ */
+typedef void (*staging_process)(void *arg, const OmlValueU *values, const struct timeval *tv);
+
+OmlStaging* staging_new(OmlMP *mp);
+void staging_destroy(OmlStaging *self);
+
+int staging_push(OmlStaging *self, const OmlValueU *values);
+int staging_pending(OmlStaging *self);
+size_t staging_drain(OmlStaging *self, staging_process process, void *arg);
+
+#endif // OML_STAGING_H_
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
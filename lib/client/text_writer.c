@@ -50,6 +50,12 @@ typedef struct OmlTextWriter {
   OmlWriter* next;
   /** \see OmlWriter::bufferedWriter */
   BufferedWriter* bufferedWriter;
+  /** \see OmlWriter::encoding */
+  int encoding;
+  /** \see OmlWriter::row_copy */
+  oml_writer_row_copy row_copy;
+  /** \see OmlWriter::flush */
+  oml_writer_flush flush;
 
   /*
    * Fields specific to the OmlTextWriter
@@ -95,6 +101,8 @@ text_writer_new(OmlOutStream* out_stream)
   self->row_end = owt_row_end;
   self->out = owt_row_cols;
   self->close = owt_close;
+  self->encoding = SE_Text;
+  self->row_copy = oml_writer_copy_row;
 
 
   return (OmlWriter*)self;
@@ -138,7 +146,6 @@ owt_header_done(OmlWriter* writer)
 static int
 owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
 {
-  char *enc;
   OmlTextWriter* self = (OmlTextWriter*)writer;
   MBuffer* mbuf;
   if ((mbuf = self->mbuf) == NULL) {
@@ -179,10 +186,13 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
     case OML_STRING_VALUE:
       if(omlc_get_string_ptr(*oml_value_get_value(v)) &&
           0 < omlc_get_string_length(*oml_value_get_value(v))) {
-        enc = oml_malloc(backslash_encode_size(omlc_get_string_size(v->value)));
-        backslash_encode(omlc_get_string_ptr(v->value), enc);
-        res = mbuf_print(mbuf, "\t%s", enc);
-        oml_free(enc);
+        /* Encode straight into the MBuffer, the string may only be borrowed */
+        if (0 == (res = mbuf_print(mbuf, "\t")) &&
+            0 == (res = mbuf_check_resize(mbuf,
+                backslash_encode_size(omlc_get_string_length(v->value))))) {
+          res = mbuf_write_advance(mbuf,
+              backslash_encode(omlc_get_string_ptr(v->value), (char*)mbuf_wrptr(mbuf)));
+        }
 
       } else {
         logdebug ("Attempting to send NULL or empty string; string of length 0 will be sent\n");
@@ -193,10 +203,13 @@ owt_row_cols(OmlWriter* writer, OmlValue* values, int value_count)
     case OML_BLOB_VALUE: {
       if(omlc_get_blob_ptr(*oml_value_get_value(v)) &&
           0 < omlc_get_blob_length(*oml_value_get_value(v))) {
-        enc = oml_malloc(base64_size_string(omlc_get_blob_length(*oml_value_get_value(v))));
-        base64_encode_blob(omlc_get_blob_length(*oml_value_get_value(v)), omlc_get_blob_ptr(*oml_value_get_value(v)), enc);
-        res = mbuf_print(mbuf, "\t%s", enc);
-        oml_free(enc);
+        if (0 == (res = mbuf_print(mbuf, "\t")) &&
+            0 == (res = mbuf_check_resize(mbuf,
+                base64_size_string(omlc_get_blob_length(*oml_value_get_value(v)))))) {
+          res = mbuf_write_advance(mbuf,
+              base64_encode_blob(omlc_get_blob_length(*oml_value_get_value(v)),
+                omlc_get_blob_ptr(*oml_value_get_value(v)), (char*)mbuf_wrptr(mbuf)));
+        }
 
       } else {
         logdebug ("Attempting to send NULL or empty blob; blob of length 0 will be sent\n");
@@ -298,7 +311,7 @@ owt_row_start(OmlWriter* writer, OmlMStream* ms, double now)
   assert(self->bufferedWriter != NULL);
 
   MBuffer* mbuf;
-  if ((mbuf = self->mbuf = bw_get_write_buf(self->bufferedWriter)) == NULL) {
+  if ((mbuf = self->mbuf = bw_get_write_buf(self->bufferedWriter, ms)) == NULL) {
     return 0;
   }
 
@@ -351,11 +364,12 @@ owt_row_end(OmlWriter* writer, OmlMStream* ms)
           mbuf_message(self->mbuf), mbuf_message_length(self->mbuf));
     }
 
+    oml_writer_keep_row(ms, mbuf);
     mbuf_begin_write (mbuf);
   }
 
   self->mbuf = NULL;
-  bw_msgcount_add(self->bufferedWriter, 1);
+  bw_msgcount_add(self->bufferedWriter, ms, 1);
   bw_release_write_buf(self->bufferedWriter);
   return res == 0;
 }
@@ -0,0 +1,320 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/**\file zlib_stream.c
+ * \brief An OmlOutStream compressing the data it writes into another OmlOutStream.
+ *
+ * The headers are passed through uncompressed, with an "encoding: deflate"
+ * line added before the empty line ending them. All the data written after
+ * them is a single raw deflate stream (RFC 1951), including the schema 0
+ * messages which the writers add to the headers to replay them on
+ * reconnection.
+ *
+ * Each write is compressed completely, and ends with a full flush. The
+ * receiver can therefore decode everything written so far, and a new
+ * decompressor can start at the beginning of any write. As the
+ * BufferedWriter writes whole chunks, flushes are aligned with chunk
+ * boundaries.
+ *
+ * If the compressed data of a write cannot all be written, the rest is
+ * dropped, and the next write starts a new block, e.g., on a new connection,
+ * after the headers. Each block starts with an empty stored block, so a
+ * receiver missing the end of a block can skip to the start of the next one
+ * with inflateSync(3).
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "oml2/omlc.h"
+#include "oml2/oml_out_stream.h"
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "zlib_stream.h"
+
+/** Amount of room to make for each call to deflate(3) [B] */
+#define ZLIB_STREAM_CHUNK 16384
+
+/** Empty stored deflate block, ending with the marker inflateSync(3) looks for */
+static const uint8_t zlib_stream_sync[] = { 0x00, 0x00, 0x00, 0xff, 0xff };
+
+static ssize_t zlib_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length);
+static ssize_t zlib_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length);
+static int zlib_stream_close(OmlOutStream* hdl);
+
+/** Create a new out stream compressing data into another one.
+ *
+ * \param os OmlOutStream into which the compressed data is written; it is closed with the new stream
+ * \return a new OmlOutStream instance, or NULL on error, in which case os is left untouched
+ */
+OmlOutStream*
+zlib_stream_new(OmlOutStream* os)
+{
+  OmlZlibOutStream* self;
+
+  assert(os != NULL);
+
+  if (NULL == (self = (OmlZlibOutStream*)oml_malloc(sizeof(OmlZlibOutStream)))) {
+    return NULL;
+  }
+
+  /* Negative window bits for a raw deflate stream, without zlib header */
+  if (deflateInit2(&self->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8,
+        Z_DEFAULT_STRATEGY) != Z_OK) {
+    logerror("%s: Cannot initialise compression: %s\n", os->dest, self->zs.msg ? self->zs.msg : "unknown error");
+    oml_free(self);
+    return NULL;
+  }
+
+  if (NULL == (self->out = mbuf_create()) || NULL == (self->header = mbuf_create())) {
+    mbuf_destroy(self->out);
+    deflateEnd(&self->zs);
+    oml_free(self);
+    return NULL;
+  }
+
+  self->os = os;
+  self->dest = os->dest;
+
+  logdebug("%s: Created OmlZlibOutStream\n", self->dest);
+
+  self->write = zlib_stream_write;
+  self->writev = zlib_stream_writev;
+  self->close = zlib_stream_close;
+  return (OmlOutStream*)self;
+}
+
+/** Called to close the stream, and the one it writes into
+ * \see oml_outs_close_f
+ */
+static int
+zlib_stream_close(OmlOutStream* hdl)
+{
+  OmlZlibOutStream* self = (OmlZlibOutStream*)hdl;
+  int ret;
+
+  logdebug("%s: Destroying OmlZlibOutStream at %p\n", self->dest, self);
+
+  if (mbuf_rd_remaining(self->out) > 0) {
+    logwarn("%s: Dropping %zu bytes of compressed data\n", self->dest, mbuf_rd_remaining(self->out));
+  }
+  deflateEnd(&self->zs);
+  mbuf_destroy(self->out);
+  mbuf_destroy(self->header);
+
+  ret = self->os->close(self->os);
+  oml_free(self);
+  return ret;
+}
+
+/** Compress a block of data, with a full flush at the end.
+ *
+ * As the previous block also ended with a full flush, the new one does not
+ * depend on it, and can be stored separately. It starts at a byte boundary,
+ * where an empty stored block is added to mark it.
+ *
+ * \param self OmlZlibOutStream
+ * \param out MBuffer into which the compressed data is written
+ * \param iov array of buffers to compress
+ * \param iovcnt number of buffers in iov
+ * \return 0 on success, -1 on error
+ */
+static int
+zlib_stream_deflate(OmlZlibOutStream* self, MBuffer* out, const struct iovec* iov, int iovcnt)
+{
+  z_stream* zs = &self->zs;
+  size_t room;
+  int i, flush, ret;
+
+  if (mbuf_write(out, zlib_stream_sync, sizeof(zlib_stream_sync))) {
+    return -1;
+  }
+
+  for (i = 0; i <= iovcnt; i++) {
+    if (i < iovcnt) {
+      zs->next_in = (Bytef*)iov[i].iov_base;
+      zs->avail_in = iov[i].iov_len;
+      flush = Z_NO_FLUSH;
+    } else {
+      zs->next_in = NULL;
+      zs->avail_in = 0;
+      flush = Z_FULL_FLUSH;
+    }
+
+    do {
+      if (mbuf_check_resize(out, ZLIB_STREAM_CHUNK)) {
+        return -1;
+      }
+      room = mbuf_wr_remaining(out);
+      zs->next_out = mbuf_wrptr(out);
+      zs->avail_out = room;
+      if ((ret = deflate(zs, flush)) == Z_STREAM_ERROR) {
+        return -1;
+      }
+      mbuf_write_advance(out, room - zs->avail_out);
+    } while (zs->avail_in > 0 || 0 == zs->avail_out);
+  }
+
+  return 0;
+}
+
+/** Add the encoding to the headers, and compress what follows them.
+ *
+ * The headers are only rebuilt when they change. As the BufferedWriter only
+ * appends to them, their length is enough to tell.
+ *
+ * \param self OmlZlibOutStream
+ * \param header headers given by the BufferedWriter
+ * \param header_length length of header
+ * \return 0 on success, -1 on error
+ */
+static int
+zlib_stream_header(OmlZlibOutStream* self, uint8_t* header, size_t header_length)
+{
+  struct iovec iov;
+  size_t end;
+
+  if (header_length == self->header_length && mbuf_rd_remaining(self->header) > 0) {
+    return 0;
+  }
+
+  mbuf_clear2(self->header, 0);
+  self->header_length = 0;
+  if (0 == header_length) {
+    return 0;
+  }
+
+  /* Find the empty line ending the headers, if they are complete */
+  for (end = 1; end < header_length; end++) {
+    if ('\n' == header[end] && '\n' == header[end - 1]) {
+      break;
+    }
+  }
+
+  if (mbuf_write(self->header, header, end) ||
+      mbuf_write(self->header, (uint8_t*)ZLIB_STREAM_ENCODING, strlen(ZLIB_STREAM_ENCODING))) {
+    return -1;
+  }
+  if (end < header_length) {
+    if (mbuf_write(self->header, (uint8_t*)"\n", 1)) {
+      return -1;
+    }
+    if (++end < header_length) {
+      iov.iov_base = header + end;
+      iov.iov_len = header_length - end;
+      if (zlib_stream_deflate(self, self->header, &iov, 1)) {
+        mbuf_clear2(self->header, 0);
+        deflateReset(&self->zs);
+        return -1;
+      }
+    }
+  }
+
+  self->header_length = header_length;
+  return 0;
+}
+
+/** Write the compressed data in self->out into the underlying stream.
+ *
+ * \param self OmlZlibOutStream
+ * \param header headers given by the BufferedWriter
+ * \param header_length length of header
+ * \return 0 if all the data was written, 1 if only part of it, or -1 on error, in which case the rest of the data is dropped
+ */
+static int
+zlib_stream_flush(OmlZlibOutStream* self, uint8_t* header, size_t header_length)
+{
+  struct iovec iov;
+  ssize_t cnt;
+
+  if (zlib_stream_header(self, header, header_length)) {
+    mbuf_clear2(self->out, 0);
+    return -1;
+  }
+
+  iov.iov_base = mbuf_rdptr(self->out);
+  iov.iov_len = mbuf_rd_remaining(self->out);
+  cnt = out_stream_writev(self->os, &iov, 1, mbuf_rdptr(self->header), mbuf_rd_remaining(self->header));
+  if (cnt <= 0) {
+    /* The rest of the block cannot be decoded without its start */
+    mbuf_clear2(self->out, 0);
+    return -1;
+  }
+
+  mbuf_read_skip(self->out, cnt);
+  if (mbuf_rd_remaining(self->out) > 0) {
+    return 1;
+  }
+  mbuf_clear2(self->out, 0);
+  return 0;
+}
+
+/** Called to compress and write several chunks
+ * \see oml_outs_writev_f
+ *
+ * The compressed data of the previous call is written first, if it could not
+ * all be. The chunks are then all reported as written as soon as some of
+ * their compressed data is.
+ *
+ * \see zlib_stream_deflate, zlib_stream_flush
+ */
+static ssize_t
+zlib_stream_writev(OmlOutStream* hdl, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  OmlZlibOutStream* self = (OmlZlibOutStream*)hdl;
+  size_t length = 0;
+  int i;
+
+  assert(header || !header_length);
+
+  if (mbuf_rd_remaining(self->out) > 0 && zlib_stream_flush(self, header, header_length) != 0) {
+    return -1;
+  }
+
+  for (i = 0; i < iovcnt; i++) {
+    length += iov[i].iov_len;
+  }
+  if (0 == length) {
+    return 0;
+  }
+
+  if (zlib_stream_deflate(self, self->out, iov, iovcnt)) {
+    logerror("%s: Error compressing data: %s\n", self->dest, self->zs.msg ? self->zs.msg : "unknown error");
+    mbuf_clear2(self->out, 0);
+    deflateReset(&self->zs);
+    return -1;
+  }
+
+  if (zlib_stream_flush(self, header, header_length) < 0) {
+    return -1;
+  }
+  return length;
+}
+
+/** Called to compress and write a chunk
+ * \see oml_outs_write_f, zlib_stream_writev
+ */
+static ssize_t
+zlib_stream_write(OmlOutStream* hdl, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length)
+{
+  struct iovec iov;
+
+  iov.iov_base = buffer;
+  iov.iov_len = length;
+  return zlib_stream_writev(hdl, &iov, 1, header, header_length);
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
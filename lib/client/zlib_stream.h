@@ -0,0 +1,76 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/**\file zlib_stream.h
+ * \brief Interface for the compressing OmlOutStream.
+ * \see OmlOutStream
+ */
+#ifndef ZLIB_STREAM_H_
+#define ZLIB_STREAM_H_
+
+#include <zlib.h>
+
+#include "oml2/oml_out_stream.h"
+#include "mbuf.h"
+
+/** Header line announcing the compressed data */
+#define ZLIB_STREAM_ENCODING "encoding: deflate\n"
+
+/** OmlOutStream compressing data into another OmlOutStream */
+typedef struct OmlZlibOutStream {
+
+  /*
+   * Fields from OmlOutStream interface
+   */
+
+  /** \see OmlOutStream::write, oml_outs_write_f */
+  oml_outs_write_f write;
+  /** \see OmlOutStream::close, oml_outs_close_f */
+  oml_outs_close_f close;
+
+  /** \see OmlOutStream::dest */
+  char *dest;
+
+  /** \see OmlOutStream::header_written */
+  int   header_written;
+
+  /** \see OmlOutStream::writev, oml_outs_writev_f */
+  oml_outs_writev_f writev;
+
+  /*
+   * Fields specific to the OmlZlibOutStream
+   */
+
+  /** OmlOutStream into which the compressed data is written */
+  OmlOutStream* os;
+
+  /** State of the compressor */
+  z_stream    zs;
+
+  /** Compressed data not yet written into os */
+  MBuffer*    out;
+
+  /** Headers passed to os, with ZLIB_STREAM_ENCODING added \see zlib_stream_header */
+  MBuffer*    header;
+
+  /** Length of the headers from which header was built */
+  size_t      header_length;
+
+} OmlZlibOutStream;
+
+#endif /* ZLIB_STREAM_H_ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
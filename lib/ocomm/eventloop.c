@@ -13,19 +13,31 @@
  * \see eventloop_init, eventloop_run, eventloop_stop
  * \eventloop_on_stdin, eventloop_on_monitor_in_channel, eventloop_on_read_in_channel, eventloop_on_out_channel
  * \see o_el_timer_callback, o_el_read_socket_callback, o_el_monitor_socket_callback, o_el_state_socket_callback, o_el_timer_callback
- * \see poll(3)
+ * \see poll(3), epoll(7)
  */
 
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <poll.h>
 #include <assert.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <time.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
 #include "mem.h"
 #include "ocomm/o_log.h"
@@ -36,9 +48,18 @@
 /** Initial expected number of socket event sources */
 #define DEF_FDS_LENGTH 10
 #define MAX_READ_BUFFER_SIZE 512
+/** Maximum number of iovecs a read-buffer callback can provide */
+#define MAX_READ_IOVECS 4
+/** Default number of bytes read from a channel per iteration of the EventLoop
+ * \see eventloop_socket_set_read_budget */
+#define DEF_READ_BUDGET (64 * 1024)
+/** Maximum number of ready descriptors retrieved from one epoll_wait(2) */
+#define MAX_EPOLL_EVENTS 256
 
 /** Default time, in second, after which an idle socket is cleaned up */
 #define DEF_SOCKET_TIMEOUT 60
+/** Initial size of the timer heap */
+#define DEF_TIMERS_LENGTH 8
 
 /* A quick hace to avoid having to repeat too much */
 #define case_string(val)  case val: { return #val; break; }
@@ -58,24 +79,27 @@ const char* socket_status_string(SocketStatus status)
 
 /** Instance of a TimerEvtSource with callbacks.
  *
- * \see eventloop_every
+ * \see eventloop_every, eventloop_every_ms
  */
 typedef struct _timerInt {
   /** \see TimerEvtSource */
   char *name;
 
-  /** If non zero, channel is currently monitored by the EventLoop \see
-   * eventloop_socket_activate */
+  /** If non zero, the timer is currently scheduled in the EventLoop
+   * \see timer_schedule */
   int is_active;
 
   /** Non zero if the timer is periodic */
   int is_periodic;
 
-  /** Period of the timer: in seconds */
-  int period;
+  /** Period of the timer [ms] */
+  unsigned int period;
+
+  /** Next time [ms] when the timer will expire \see monotonic_ms */
+  uint64_t due_time;
 
-  /** Next UNIX time when the timer will expire */
-  time_t due_time;
+  /** Index of the timer in the heap, or -1 if not scheduled */
+  int heap_index;
 
   /** Function pointer to the timeout callback \see o_el_timer_callback */
   o_el_timer_callback callback;
@@ -83,14 +107,27 @@ typedef struct _timerInt {
   /** Pointer to application-provided data */
   void *handle;
 
-  /** Pointer to next TimerInt in the linked-list */
-  struct _timerInt* next;
-
   /** Buffer where name is actually stored */
   char nameBuf[64];
 
 } TimerInt;
 
+/** Task posted to an EventLoop from another thread.
+ *
+ * \see eventloop_post
+ */
+typedef struct _taskInt {
+  /** Function pointer to the task \see o_el_task_callback */
+  o_el_task_callback callback;
+
+  /** Pointer to application-provided data */
+  void *handle;
+
+  /** Pointer to next TaskInt in the linked-list */
+  struct _taskInt* next;
+
+} TaskInt;
+
 /** Instance of a SockEvtSource with data storage and callbacks.
  *
  * \see channel_new, channel_free
@@ -117,6 +154,14 @@ typedef struct _channel {
   /** Function pointer to the read callback for this channel */
   o_el_read_socket_callback read_cbk;
 
+  /** Function pointer to the read-buffer callback for this channel
+   * \see eventloop_socket_set_buffer_callback */
+  o_el_buffer_socket_callback buffer_cbk;
+
+  /** Maximum number of bytes to read before yielding to other channels
+   * \see eventloop_socket_set_read_budget */
+  size_t read_budget;
+
   /** Function pointer to the monitoring callback for this channel */
   o_el_monitor_socket_callback monitor_cbk;
 
@@ -134,20 +179,54 @@ typedef struct _channel {
 
   /** Pointer to next Channel in the linked-list */
   struct _channel* next;
+  /** Pointer to previous Channel in the linked-list */
+  struct _channel* prev;
+  /** Pointer to next Channel in the list of those to remove
+   * \see eventloop_socket_release */
+  struct _channel* next_removable;
 
   /** Buffer where name is actually stored */
   char nameBuf[64];
 
-  /** Last UNIX time this channel was active */
-  time_t last_activity;
+  /** Last time [ms] this channel was active, 0 if activity is not tracked
+   * \see monotonic_ms */
+  uint64_t last_activity;
+
+  /** Timer checking whether this channel has become idle
+   * \see channel_check_idle */
+  TimerInt idle_timer;
 } Channel;
 
+/** Mechanisms available to wait for events on file descriptors
+ * \see eventloop_set_backend */
+typedef enum _eventLoopBackend {
+  /** Rebuild an array of all active descriptors, and scan it after each poll(3) */
+  EL_BACKEND_POLL = 0,
+  /** Register descriptors incrementally, and only get the ready ones from epoll_wait(2) */
+  EL_BACKEND_EPOLL,
+} EventLoopBackend;
+
 /** EventLoop object storing the internal internal state */
-typedef struct _eventLoop {
+struct _eventLoop {
   /** Linked list of registered channels */
   Channel* channels;
-  /** Linked list registered timers */
-  TimerInt* timers;
+  /** Linked list of channels released but not yet removed
+   * \see eventloop_socket_release */
+  Channel* removables;
+  /** Binary min-heap of scheduled timers, ordered by due_time
+   * \see timer_schedule, timer_unschedule */
+  TimerInt** timers;
+  /** Number of timers in the heap */
+  int timers_size;
+  /** Allocated size of the timers heap */
+  int timers_length;
+
+  /** Mechanism used to wait for events \see eventloop_set_backend */
+  EventLoopBackend backend;
+  /** epoll(7) descriptor, or -1 if the poll(3) backend is used */
+  int epfd;
+  /** Non zero while callbacks for ready channels are being run */
+  int dispatching;
 
   /** Array of descriptors to monitor
    * \see update_fds */
@@ -157,7 +236,8 @@ typedef struct _eventLoop {
   /** If non zero, fds structure needs to get recomputed
    * \see eventloop_socket_activate */
   int fds_dirty;
-  /** Number of active descriptors in the fds array */
+  /** Number of active descriptors (in the fds array for poll(3), or in the
+   * epoll(7) set) */
   int size;
   /** Allocated size of fds and fds_channels arrays */
   int length;
@@ -171,17 +251,24 @@ typedef struct _eventLoop {
   /** If set to 1, the eventloop will not wait for active FDs to be closed */
   int force_stop;
 
-  /** UNIX Time when the EventLoop was started
-   * \see time(3) */
-  time_t start;
-  /** Current UNIX time (updated whenever poll() returns)
-   * \see time(3)*/
-  time_t now;
-  /** Last UNIX time idle sockets were reaped
-   * \see time(3) */
-  time_t last_reaped;
+  /** Time [ms] when the EventLoop was started
+   * \see monotonic_ms */
+  uint64_t start;
+  /** Current time [ms] (updated whenever poll() returns)
+   * \see monotonic_ms */
+  uint64_t now;
+
+  /** Pipe used by other threads to wake this EventLoop up, or {-1, -1}
+   * \see eventloop_post */
+  int wakeup_fds[2];
+  /** Lock protecting the list of posted tasks */
+  pthread_mutex_t tasks_lock;
+  /** Linked list of tasks posted by other threads, oldest first */
+  TaskInt* tasks;
+  /** Last element of the tasks list */
+  TaskInt* tasks_last;
 
-} EventLoop;
+};
 
 
 /* Local helpers, defined at the end of this file */
@@ -194,34 +281,218 @@ static Channel* eventloop_on_out_fd( char* name, int fd, o_el_state_socket_callb
 
 static int update_fds(void);
 static void terminate_fds(void);
+static void dispatch_events(Channel *ch, int revents);
+static void remove_released_channels(void);
 
+static uint64_t monotonic_ms(void);
+static int timers_timeout(void);
+static void run_timers(void);
+static void timer_schedule(TimerInt *t);
+static void timer_unschedule(TimerInt *t);
+static void channel_arm_idle_timer(Channel *ch);
+static void channel_check_idle(TimerEvtSource *source, void *handle);
+
+static void eventloop_timer_free(TimerInt* timer);
+
+static int wakeup_setup(void);
+static void run_tasks(SockEvtSource* source, void* handle);
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_setup(void);
+static int epoll_update(Channel *ch, int flag);
+#endif
+
+static ssize_t channel_read(Channel *ch, size_t budget);
 static void do_read_callback (Channel *ch, void *buffer, int buf_size);
 static void do_monitor_callback (Channel *ch);
 static void do_status_callback (Channel *ch, SocketStatus status, int error);
 
 
-/** Global EventLoop object */
-static EventLoop self;
+/** Default EventLoop object */
+static EventLoop default_loop;
+
+/** EventLoop used by the current thread, all eventloop_* functions operate on
+ * it \see eventloop_make_current */
+static __thread EventLoop *self = &default_loop;
 
 
-/** Initialise the global EventLoop
+/** Initialise the EventLoop of the current thread
+ *
+ * Unless eventloop_make_current() has been called, this is the default
+ * EventLoop, shared by all threads.
+ *
  * \see eventloop_run, eventloop_stop, eventloop_terminate
  */
 void eventloop_init()
 {
-  memset(&self, 0, sizeof(EventLoop));
+  memset(self, 0, sizeof(EventLoop));
+
+  self->fds = NULL;
+  self->channels = NULL;
+  self->timers = NULL;
 
-  self.fds = NULL;
-  self.channels = NULL;
-  self.timers = NULL;
+  self->size = 0;
+  self->length = 0;
 
-  self.size = 0;
-  self.length = 0;
+  self->epfd = -1;
+  self->wakeup_fds[0] = self->wakeup_fds[1] = -1;
+  pthread_mutex_init(&self->tasks_lock, NULL);
+#ifdef HAVE_SYS_EPOLL_H
+  self->backend = EL_BACKEND_EPOLL;
+#else
+  self->backend = EL_BACKEND_POLL;
+#endif
 
   eventloop_set_socket_timeout(DEF_SOCKET_TIMEOUT);
 
-  /* Just to be sure we initialise everything */
-  self.start = self.now = self.last_reaped = -1;
+  self->start = self->now = monotonic_ms();
+}
+
+/** Create a new EventLoop, to be run by another thread.
+ *
+ * The new EventLoop uses the same backend and socket timeout as that of the
+ * current thread. Unlike the default one, it can receive tasks from other
+ * threads through eventloop_post().
+ *
+ * The thread running it should first call eventloop_make_current(), then
+ * eventloop_run(). All channels and timers created by that thread are
+ * registered in the new EventLoop.
+ *
+ * \return a pointer to the new EventLoop, or NULL on error
+ * \see eventloop_make_current, eventloop_post, eventloop_free
+ */
+EventLoop* eventloop_new(void)
+{
+  EventLoop *current = self;
+  EventLoop *loop = (EventLoop*)oml_malloc(sizeof(EventLoop));
+
+  if (loop == NULL) {
+    return NULL;
+  }
+
+  self = loop;
+  eventloop_init();
+  self->backend = current->backend;
+  self->socket_timeout = current->socket_timeout;
+  if (wakeup_setup()) {
+    self = current;
+    eventloop_free(loop);
+    return NULL;
+  }
+  self = current;
+
+  return loop;
+}
+
+/** Free an EventLoop created with eventloop_new().
+ *
+ * The EventLoop must not be running anymore. Remaining channels and timers are
+ * freed, but not the Sockets they relate to.
+ *
+ * \param loop EventLoop to free
+ * \see eventloop_new
+ */
+void eventloop_free(EventLoop *loop)
+{
+  EventLoop *current = self;
+  TaskInt *task;
+  int i;
+
+  if (loop == NULL || loop == &default_loop) {
+    return;
+  }
+
+  self = loop;
+  while (self->channels) {
+    self->dispatching = 0;
+    eventloop_socket_remove((SockEvtSource*)self->channels);
+  }
+  for (i = 0; i < self->timers_size; i++) {
+    eventloop_timer_free(self->timers[i]);
+  }
+  while ((task = self->tasks)) {
+    self->tasks = task->next;
+    oml_free(task);
+  }
+  for (i = 0; i < 2; i++) {
+    if (self->wakeup_fds[i] >= 0) {
+      close(self->wakeup_fds[i]);
+    }
+  }
+  if (self->epfd >= 0) {
+    close(self->epfd);
+  }
+  pthread_mutex_destroy(&self->tasks_lock);
+  if (self->timers) oml_free(self->timers);
+  if (self->fds) free(self->fds);
+  if (self->fds_channels) free(self->fds_channels);
+  self = current;
+
+  oml_free(loop);
+}
+
+/** Get the EventLoop used by the current thread.
+ * \return a pointer to the current EventLoop
+ * \see eventloop_make_current
+ */
+EventLoop* eventloop_current(void)
+{
+  return self;
+}
+
+/** Select the EventLoop used by the current thread.
+ *
+ * \param loop EventLoop to use, or NULL for the default one
+ * \see eventloop_new, eventloop_current
+ */
+void eventloop_make_current(EventLoop *loop)
+{
+  self = loop ? loop : &default_loop;
+}
+
+/** Ask an EventLoop to run a function from its own thread.
+ *
+ * This function can be called from any thread. The task is run during the
+ * next iteration of the target EventLoop, after the tasks posted before it.
+ *
+ * \param loop EventLoop to run the task, created with eventloop_new()
+ * \param callback function to run
+ * \param handle pointer to opaque data passed to the callback
+ * \return 0 on success, -1 on error
+ * \see eventloop_new, o_el_task_callback
+ */
+int eventloop_post(EventLoop *loop, o_el_task_callback callback, void *handle)
+{
+  TaskInt *task;
+  int wakeup;
+
+  if (loop == NULL || loop->wakeup_fds[1] < 0) {
+    o_log(O_LOG_ERROR, "EventLoop: Cannot post tasks to an EventLoop not created with eventloop_new()\n");
+    return -1;
+  }
+
+  if (!(task = (TaskInt*)oml_malloc(sizeof(TaskInt)))) {
+    return -1;
+  }
+  task->callback = callback;
+  task->handle = handle;
+
+  pthread_mutex_lock(&loop->tasks_lock);
+  wakeup = (loop->tasks == NULL);
+  if (loop->tasks_last) {
+    loop->tasks_last->next = task;
+  } else {
+    loop->tasks = task;
+  }
+  loop->tasks_last = task;
+  pthread_mutex_unlock(&loop->tasks_lock);
+
+  /* A full pipe is fine, the EventLoop will wake up anyway */
+  if (wakeup && write(loop->wakeup_fds[1], "", 1) < 0 && EAGAIN != errno) {
+    o_log(O_LOG_WARN, "EventLoop: Could not wake up EventLoop: %s\n", strerror(errno));
+  }
+
+  return 0;
 }
 
 /** Set the timeout, in seconds, after which idle sockets are reaped.
@@ -230,20 +501,84 @@ void eventloop_init()
  */
 void eventloop_set_socket_timeout(unsigned int to)
 {
+  Channel *ch;
+
   o_log(O_LOG_DEBUG2, "EventLoop: Setting socket idleness timeout to %ds\n", to);
-  self.socket_timeout = to;
+  self->socket_timeout = to;
+
+  for (ch = self->channels; ch != NULL; ch = ch->next) {
+    if (ch->last_activity != 0 && !ch->is_removable) {
+      channel_arm_idle_timer(ch);
+    }
+  }
+}
+
+/** Select the mechanism used to wait for events on file descriptors.
+ *
+ * The epoll(7) backend registers and unregisters channels incrementally, so
+ * the cost of each iteration depends only on the number of ready descriptors.
+ * It is the default when available at build time. The poll(3) backend rebuilds
+ * an array of all active descriptors whenever it changes, and scans it after
+ * each poll(3); it is used when epoll(7) is not available, or if it cannot
+ * monitor one of the descriptors (e.g., STDIN redirected from a file).
+ *
+ * This must be called after eventloop_init(), and before any channel is
+ * registered.
+ *
+ * \param name name of the backend ("epoll" or "poll")
+ * \return 0 on success, -1 if the backend is unknown or unavailable
+ *
+ * \see eventloop_get_backend
+ */
+int eventloop_set_backend(const char *name)
+{
+  if (self->channels) {
+    o_log(O_LOG_WARN, "EventLoop: Cannot change backend once channels are registered\n");
+    return -1;
+  }
+
+  if (!strcmp(name, "poll")) {
+    self->backend = EL_BACKEND_POLL;
+#ifdef HAVE_SYS_EPOLL_H
+  } else if (!strcmp(name, "epoll")) {
+    self->backend = EL_BACKEND_EPOLL;
+#endif
+  } else {
+    o_log(O_LOG_ERROR, "EventLoop: Unknown or unavailable backend '%s'\n", name);
+    return -1;
+  }
+
+  o_log(O_LOG_DEBUG, "EventLoop: Using the %s backend\n", name);
+  return 0;
+}
+
+/** Get the name of the mechanism used to wait for events.
+ *
+ * \return "epoll" or "poll"
+ * \see eventloop_set_backend
+ */
+const char* eventloop_get_backend(void)
+{
+  return (EL_BACKEND_EPOLL == self->backend) ? "epoll" : "poll";
 }
 
 /** Run the global EventLoop until eventloop_stop() or eventloop_terminate() is called.
  *
- * The loop is based around the poll(3) system call. It monitor event sources
- * such as Channel or Timers, registered in the respective fields of the global
- * EventLoop object self. It first consider all timers to find whether some
- * have expired and to set the timeout for the poll(3) call. It then calls
- * poll(3) on the file descriptors (STDIN or sockets) related to active
- * Channels, and runs the relevant callbacks for those with pending events.  It
- * finally executes the callback functions of the expired timers.  The loop
- * will not return until eventloop_stop() or eventloop_terminate() is called.
+ * The loop is based around the epoll(7) or poll(3) system calls (see
+ * eventloop_set_backend()). It monitors event sources such as Channels or
+ * Timers, registered in the respective fields of the current EventLoop. Each
+ * iteration first uses the earliest timer deadline as the timeout for the
+ * epoll_wait(2) or poll(3) call. It then waits for events on the file
+ * descriptors (STDIN or sockets) related to active Channels, and runs the
+ * relevant callbacks for those with pending events. It then executes the
+ * callback functions of the expired timers, and finally removes the released
+ * channels.
+ *
+ * Idle channels are not scanned for; each channel tracking its activity has
+ * its own idle timer (see channel_arm_idle_timer()), which releases it when it
+ * fires after the socket timeout without activity (see channel_check_idle()).
+ *
+ * The loop will not return until eventloop_stop() or eventloop_terminate() is called.
  * In the former case, it will try to wait until all active sockets are close,
  * while not in the latter.
  *
@@ -252,190 +587,75 @@ void eventloop_set_socket_timeout(unsigned int to)
  * \see eventloop_init, eventloop_stop, eventloop_terminate
  * \eventloop_on_stdin, eventloop_on_monitor_in_channel, eventloop_on_read_in_channel, eventloop_on_out_channel
  * \see o_el_timer_callback, o_el_read_socket_callback, o_el_monitor_socket_callback, o_el_state_socket_callback, o_el_timer_callback
- * \see poll(3)
+ * \see poll(3), epoll(7)
  */
 int eventloop_run()
 {
   int i;
-  self.stopping = 0;
-  self.force_stop = 0;
-  self.start = self.now = self.last_reaped = time(NULL);
-  while (!self.stopping || (self.size>0 && !self.force_stop)) {
+  self->stopping = 0;
+  self->force_stop = 0;
+  self->start = self->now = monotonic_ms();
+#ifdef HAVE_SYS_EPOLL_H
+  if (EL_BACKEND_EPOLL == self->backend && self->epfd < 0) {
+    epoll_setup();
+  }
+#endif
+  while (!self->stopping || (self->size>0 && !self->force_stop)) {
     // Check for active timers
-    int timeout = -1;
-    TimerInt* t = self.timers;
-    while (t != NULL) {
-      if (t->is_active) {
-        int delta = 1000 * (t->due_time - self.now);
-        if (delta < 0) delta = 0; // overdue
-        if (delta < timeout || timeout < 0) timeout = delta;
-      }
-      t = t->next;
-    }
+    int timeout = timers_timeout();
     if (timeout != -1)
       o_log(O_LOG_DEBUG3, "EventLoop: Timeout = %d\n", timeout);
 
-    if (self.fds_dirty)
-      if (update_fds()<1 && timeout < 0) /* No FD nor timeout */
-        continue;
-    o_log(O_LOG_DEBUG4, "EventLoop: About to poll() on %d FDs with a timeout of %ds\n", self.size, timeout);
-    /* for(i=0; i < self.size; i++) {
-      o_log(O_LOG_DEBUG4, "EventLoop: FD %d->%s\n", self.fds[i].fd, self.fds_channels[i]->name);
-    } */
+    if (EL_BACKEND_POLL == self->backend) {
+      if (self->fds_dirty)
+        if (update_fds()<1 && timeout < 0) /* No FD nor timeout */
+          continue;
+      o_log(O_LOG_DEBUG4, "EventLoop: About to poll() on %d FDs with a timeout of %dms\n", self->size, timeout);
 
-    int count = poll(self.fds, self.size, timeout);
-    self.now = time(NULL);
+      int count = poll(self->fds, self->size, timeout);
+      self->now = monotonic_ms();
 
-    if (count < 1) {
-      o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
-    } else {
-    // Check sockets
-      i = 0;
-      o_log(O_LOG_DEBUG4, "EventLoop: Got events\n");
-      for (; i < self.size; i++) {
-        Channel* ch = self.fds_channels[i];
-        if (self.fds[i].revents & POLLERR) {
-          char buf[32];
-          SocketStatus status;
-          int len;
-
-          if ((len = recv(self.fds[i].fd, buf, 32, 0)) <= 0) {
-            switch (errno) {
-            case ECONNREFUSED:
-              status = SOCKET_CONN_REFUSED;
-              break;
-            default:
-              status = SOCKET_UNKNOWN;
-              if (!ch->status_cbk) {
-                o_log(O_LOG_ERROR, "EventLoop: While reading from socket '%s': (%d) %s\n",
-                      ch->name, errno, strerror(errno));
-              }
-            }
-            eventloop_socket_activate((SockEvtSource*)ch, 0);
-            do_status_callback (ch, status, errno);
-          } else {
-            o_log(O_LOG_ERROR, "EventLoop: Expected error on socket '%s' but read '%s'\n", ch->name, buf);
-          }
-        } else if (self.fds[i].revents & POLLHUP) {
-          eventloop_socket_activate((SockEvtSource*)ch, 0);
-
-          /* Client closed the connection, but there might still be bytes
-             for us to read from our end of the connection. */
-          int len;
-          int fd = self.fds[i].fd;
-          char buf[MAX_READ_BUFFER_SIZE];
-          do {
-            if (fd == 0) {
-              len = read(fd, buf, MAX_READ_BUFFER_SIZE);
-            } else {
-              len = recv(fd, buf, 512, 0);
-            }
-            if (len > 0) {
-              o_log(O_LOG_DEBUG3, "EventLoop: Received last %i bytes\n", len);
-              do_read_callback (ch, buf, len);
-            }
-          } while (len > 0);
-          do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
-        } else if (self.fds[i].revents & POLLIN) {
-          char buf[MAX_READ_BUFFER_SIZE];
-          if (ch->read_cbk) {
-            int len;
-            int fd = self.fds[i].fd;
-            if (fd == 0) {
-              // stdin
-              len = read(fd, buf, MAX_READ_BUFFER_SIZE);
-            } else {
-              // socket
-              len = recv(fd, buf, 512, 0);
-            }
-            ch->last_activity = self.now;
-            if (len > 0) {
-              o_log(O_LOG_DEBUG3, "EventLoop: Received %i bytes\n", len);
-              do_read_callback (ch, buf, len);
-            } else if (len == 0 && ch->socket != NULL) {  // skip stdin
-              // closed down
-              eventloop_socket_activate((SockEvtSource*)ch, 0);
-              do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
-            } else if (len < 0) {
-              if (errno == ENOTSOCK) {
-                o_log(O_LOG_ERROR,
-                      "EventLoop: Monitored socket '%s' is now invalid; "
-                      "removing from monitored set\n",
-                      ch->name);
-                eventloop_socket_remove ((SockEvtSource*)ch);
-              } else {
-                o_log(O_LOG_ERROR, "EventLoop: Unrecognized read error not handled (errno=%d)\n",
-                      errno);
-              }
-            }
-          } else {
-            do_monitor_callback (ch);
-          }
-        } else if (ch->is_shutting_down) {
-          /* The socket was shutting down, and nothing new has appeared;
-           * We flushed the buffers, mark it as removable */
-          eventloop_socket_release((SockEvtSource*)ch);
+      if (count < 1) {
+        o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
+      } else {
+        o_log(O_LOG_DEBUG4, "EventLoop: Got events\n");
+        self->dispatching = 1;
+        for (i = 0; i < self->size; i++) {
+          dispatch_events(self->fds_channels[i], self->fds[i].revents);
         }
+        self->dispatching = 0;
+      }
 
-        if (self.fds[i].revents & POLLOUT) {
-          do_status_callback(ch, SOCKET_WRITEABLE, 0);
-          if (0 != ch->last_activity) {
-            /* If we track the activity of this socket */
-            ch->last_activity = self.now;
-          }
-        }
+#ifdef HAVE_SYS_EPOLL_H
+    } else {
+      struct epoll_event events[MAX_EPOLL_EVENTS];
+      o_log(O_LOG_DEBUG4, "EventLoop: About to epoll_wait() on %d FDs with a timeout of %dms\n", self->size, timeout);
 
-        if (self.fds[i].revents & POLLNVAL) {
-          o_log(O_LOG_WARN, "EventLoop: socket '%s' invalid, deactivating...\n", ch->name);
-          eventloop_socket_activate((SockEvtSource*)ch, 0);
-          do_status_callback(ch, SOCKET_DROPPED, 0);
-        }
+      int count = epoll_wait(self->epfd, events, MAX_EPOLL_EVENTS, timeout);
+      self->now = monotonic_ms();
 
-        /* We reap idle channels as we go through the list.  XXX: There might
-         * be a corner case where all FDs are already used, and some of them
-         * idle, however a new a new connection (on one listening socket early
-         * in the list) would be dropped before cleanup triggered by its
-         * arrival freed the resources it needs (from the idle sockets further
-         * towards the end of the list. See #959.*/
-        if (ch->last_activity != 0 &&
-            self.socket_timeout > 0 &&
-            self.now - ch->last_activity > self.socket_timeout) {
-            o_log(O_LOG_DEBUG2, "EventLoop: Socket '%s' idle for %ds, reaping...\n", ch->name, self.now - ch->last_activity);
-          do_status_callback(ch, SOCKET_IDLE, 0);
-        }
-      }
-      for (i = 0; i < self.size; i++) {
-        Channel* ch = self.fds_channels[i];
-        if (ch->is_removable)
-          eventloop_socket_remove ((SockEvtSource*)ch);
-      }
-    }
-    if (timeout >= 0) {
-      // check timers
-      TimerInt* t = self.timers;
-      while (t != NULL) {
-        if (t->is_active) {
-          if (t->due_time <= self.now) {
-            // fires
-            o_log(O_LOG_DEBUG2, "EventLoop: Timer '%s' fired\n", t->name);
-            if (t->callback) t->callback((TimerEvtSource*)t, t->handle);
-
-            if (t->is_periodic) {
-              while ((t->due_time += t->period) < self.now) {
-                // should really only happen during debugging
-                o_log(O_LOG_WARN, "EventLoop: Skipped timer period for '%s'\n",
-                      t->name);
-              }
-            } else {
-              t->is_active = 0;
-            }
-          }
+      if (count < 1) {
+        o_log(O_LOG_DEBUG4, "EventLoop: Timeout\n");
+      } else {
+        o_log(O_LOG_DEBUG4, "EventLoop: Got %d events\n", count);
+        self->dispatching = 1;
+        for (i = 0; i < count; i++) {
+          int revents = 0;
+          if (events[i].events & EPOLLIN) revents |= POLLIN;
+          if (events[i].events & EPOLLOUT) revents |= POLLOUT;
+          if (events[i].events & EPOLLERR) revents |= POLLERR;
+          if (events[i].events & EPOLLHUP) revents |= POLLHUP;
+          dispatch_events((Channel*)events[i].data.ptr, revents);
         }
-        t = t->next;
+        self->dispatching = 0;
       }
+#endif
     }
+
+    run_timers();
+    remove_released_channels();
   }
-  return self.stopping;
+  return self->stopping;
 }
 
 /** Stop the eventloop,
@@ -447,10 +667,10 @@ int eventloop_run()
 void eventloop_stop(int reason)
 {
   if(reason) {
-    self.stopping = reason;
+    self->stopping = reason;
   } else {
     o_log(O_LOG_WARN, "EventLoop: Tried to stop with no reason, defaulting to 1");
-    self.stopping = 1;
+    self->stopping = 1;
   }
   terminate_fds();
 }
@@ -461,7 +681,7 @@ void eventloop_stop(int reason)
  */
 void eventloop_terminate(int reason)
 {
-    self.force_stop = 1;
+    self->force_stop = 1;
     eventloop_stop(reason);
 }
 
@@ -472,7 +692,11 @@ void eventloop_terminate(int reason)
  */
 void eventloop_report (int loglevel)
 {
-  o_log(loglevel, "EventLoop: Open file descriptors: %d/%d\n", self.size, self.length);
+  if (EL_BACKEND_POLL == self->backend) {
+    o_log(loglevel, "EventLoop: Open file descriptors: %d/%d (poll)\n", self->size, self->length);
+  } else {
+    o_log(loglevel, "EventLoop: Open file descriptors: %d (epoll)\n", self->size);
+  }
   o_log(loglevel, "EventLoop: Memory usage: %s\n", oml_memsummary());
 }
 
@@ -485,29 +709,52 @@ void eventloop_report (int loglevel)
  * \param handle pointer to opaque data passed to callback functions
  * \return a pointer to the newly-created TimerInt, cast as a TimerEvtSource
  *
- * \see o_el_timer_callback, eventloop_timer_stop
+ * \see eventloop_every_ms, o_el_timer_callback, eventloop_timer_stop
  */
 TimerEvtSource* eventloop_every(
   char* name,
   int period,
   o_el_timer_callback callback,
   void* handle
+) {
+  return eventloop_every_ms(name, period > 0 ? 1000 * period : 0, callback, handle);
+}
+
+/** Register a new periodic timer to the event loop, with a period in milliseconds
+ *
+ * \param name name of this object, used for debugging
+ * \param period period [ms] of the timer, at least 1
+ * \param timer_cbk function called when the state of the timer expires
+ * \param handle pointer to opaque data passed to callback functions
+ * \return a pointer to the newly-created TimerInt, cast as a TimerEvtSource
+ *
+ * \see o_el_timer_callback, eventloop_timer_stop
+ */
+TimerEvtSource* eventloop_every_ms(
+  char* name,
+  unsigned int period,
+  o_el_timer_callback callback,
+  void* handle
 ) {
   TimerInt* t = (TimerInt*)oml_malloc(sizeof(TimerInt));
   memset(t, 0, sizeof(TimerInt));
 
   t->name = t->nameBuf;
-  strcpy(t->name, name);
+  strncpy(t->name, name, sizeof(t->nameBuf) - 1);
+
+  if (period < 1) {
+    o_log(O_LOG_WARN, "EventLoop: Invalid period for timer '%s', using 1ms\n", t->name);
+    period = 1;
+  }
 
-  t->is_active = 1;
   t->is_periodic = 1;
   t->period = period;
-  t->due_time = time(NULL) + period;
+  t->due_time = monotonic_ms() + period;
   t->callback = callback;
   t->handle = handle;
+  t->heap_index = -1;
 
-  t->next = self.timers;
-  self.timers = t;
+  timer_schedule(t);
 
   return (TimerEvtSource*)t;
 }
@@ -534,25 +781,7 @@ static void eventloop_timer_free(TimerInt* timer) {
 void eventloop_timer_stop(TimerEvtSource* timer) {
   TimerInt *t = (TimerInt *)timer;
 
-  /* Update the linked list */
-  if (self.timers == t) {
-    self.timers = t->next;
-
-  } else {
-    TimerInt* prev = self.timers;
-    TimerInt* p = prev->next;
-
-    while (p != NULL) {
-
-      if (p == t) {
-        prev->next = t->next;
-        p = NULL; /* We're done */
-      } else {
-        prev = p;
-        p = p->next;
-      }
-    }
-  }
+  timer_unschedule(t);
 
   eventloop_timer_free(t);
 }
@@ -603,7 +832,8 @@ SockEvtSource* eventloop_on_read_in_channel(
   ch = eventloop_on_in_fd(socket->name, socket->get_sockfd(socket),
               data_cbk, NULL, status_cbk, handle);
   ch->socket = socket;
-  ch->last_activity = self.now;
+  ch->last_activity = self->now;
+  channel_arm_idle_timer(ch);
   return (SockEvtSource*)ch;
 }
 
@@ -665,19 +895,28 @@ SockEvtSource* eventloop_on_out_channel(
 
 /** Mark socket event source (channel) as active or not.
  *
- * This triggers FD update if need be.
+ * This triggers FD update if need be. With the epoll(7) backend, the
+ * descriptor is added to, or removed from, the monitored set immediately.
  *
  * \param source SockEvtSource to (de)activate
- * \param flag 0 to deactivate, anything else to activate (use 1)
+ * \param flag 0 to deactivate, 1 to activate
  *
- * \see update_fds
+ * \see update_fds, epoll_update
  */
 void eventloop_socket_activate(SockEvtSource* source, int flag)
 {
   Channel* ch = (Channel*)source;
   if (ch->is_active != flag) {
     ch->is_active = flag;
-    self.fds_dirty = 1;
+#ifdef HAVE_SYS_EPOLL_H
+    if (EL_BACKEND_EPOLL == self->backend) {
+      if (!epoll_update(ch, flag)) {
+        return;
+      }
+      /* epoll_update() fell back to poll(3) */
+    }
+#endif
+    self->fds_dirty = 1;
   }
 }
 
@@ -685,8 +924,8 @@ void eventloop_socket_activate(SockEvtSource* source, int flag)
  *
  *  This marks the socket as "removable", but does not remove it
  *  immediately.  The next time the event loop finishes processing
- *  events, it will scan the list of channels/sockets for ones that
- *  are removable, and will call eventloop_socket_remove() on them.
+ *  events, it will go through the list of channels/sockets released
+ *  this way, and will call eventloop_socket_remove() on them.
  *
  *  At that point, the socket data structure will be destroyed.
  *
@@ -699,7 +938,11 @@ void eventloop_socket_release(SockEvtSource* source)
 {
   Channel *ch = (Channel*)source;
   eventloop_socket_activate(source, 0);
-  ch->is_removable = 1;
+  if (!ch->is_removable) {
+    ch->is_removable = 1;
+    ch->next_removable = self->removables;
+    self->removables = ch;
+  }
   ch->handle = NULL;
 }
 
@@ -708,6 +951,10 @@ void eventloop_socket_release(SockEvtSource* source)
  * The EventLoop calls this function on its own when sockets have been released
  * using eventloop_socket_release(). You probably want to use that one instead.
  *
+ * If called from a callback while the EventLoop is processing events, the
+ * channel is only released, and will be freed once all events have been
+ * processed, as it may still be referenced until then.
+ *
  * \param source SockEvtSource to remove and free
  * \see eventloop_socket_release, channel_free
  */
@@ -715,30 +962,74 @@ void eventloop_socket_remove(SockEvtSource* source)
 {
   Channel* ch = (Channel*)source;
 
-  eventloop_socket_activate(source, 0);
-
-  /* Update the linked list */
-  if (self.channels == ch) {
-    self.channels = ch->next;
+  if (self->dispatching) {
+    eventloop_socket_release(source);
+    return;
+  }
 
-  } else {
-    Channel* prev = self.channels;
-    Channel* p = prev->next;
+  eventloop_socket_activate(source, 0);
+  timer_unschedule(&ch->idle_timer);
 
-    while (p != NULL) {
-      if (p == ch) {
-        prev->next = ch->next;
-        p = NULL; /* We're done */
-      } else {
-        prev = p;
-        p = p->next;
-      }
+  if (ch->is_removable) {
+    /* Update the list of channels pending removal */
+    Channel **p = &self->removables;
+    while (*p != NULL && *p != ch) {
+      p = &(*p)->next_removable;
+    }
+    if (*p) {
+      *p = ch->next_removable;
     }
   }
 
+  /* Update the linked list */
+  if (ch->prev) {
+    ch->prev->next = ch->next;
+  } else if (self->channels == ch) {
+    self->channels = ch->next;
+  }
+  if (ch->next) {
+    ch->next->prev = ch->prev;
+  }
+
   channel_free(ch);
 }
 
+/** Let the application provide the storage for data read from a channel.
+ *
+ * When set, the EventLoop reads data directly into the space returned by
+ * buffer_cbk, instead of an intermediate buffer, then calls the read callback
+ * with a NULL buffer.
+ *
+ * \param source SockEvtSource to configure
+ * \param buffer_cbk read-buffer callback, or NULL to use the internal buffer
+ *
+ * \see o_el_buffer_socket_callback, o_el_read_socket_callback
+ */
+void eventloop_socket_set_buffer_callback(
+  SockEvtSource* source,
+  o_el_buffer_socket_callback buffer_cbk
+) {
+  ((Channel*)source)->buffer_cbk = buffer_cbk;
+}
+
+/** Set the maximum amount of data read from a channel in one go.
+ *
+ * When woken up, the EventLoop keeps reading from a socket until no more data
+ * is immediately available, or budget bytes have been read; the rest is left
+ * for the next iteration, so other channels are not starved.
+ *
+ * \param source SockEvtSource to configure
+ * \param budget number of bytes, 0 to only do a single read
+ *
+ * \see DEF_READ_BUDGET
+ */
+void eventloop_socket_set_read_budget(
+  SockEvtSource* source,
+  size_t budget
+) {
+  ((Channel*)source)->read_budget = budget;
+}
+
 
 /** Create a new channel and register it to the EventLoop.
  *
@@ -774,9 +1065,14 @@ static Channel* channel_new(
 
   ch->status_cbk = status_cbk;
   ch->handle = handle;
+  ch->read_budget = DEF_READ_BUDGET;
+  ch->idle_timer.heap_index = -1;
 
-  ch->next = self.channels;
-  self.channels = ch;
+  ch->next = self->channels;
+  if (self->channels) {
+    self->channels->prev = ch;
+  }
+  self->channels = ch;
 
   eventloop_socket_activate((SockEvtSource*)ch, 1); /* Updates ch->is_active */
 
@@ -858,33 +1154,477 @@ static Channel* eventloop_on_out_fd(
  */
 static int update_fds(void)
 {
-  Channel* ch = self.channels;
+  Channel* ch = self->channels;
   int i = 0;
 
   while (ch != NULL) {
     if (ch->is_active) {
-      if (self.length <= i) {
+      if (self->length <= i) {
         // Need to increase size of fds array
-        int l = (self.length > 0 ? 2 * self.length : DEF_FDS_LENGTH);
-        self.fds = (struct pollfd *)realloc(self.fds, l * sizeof(struct pollfd));
-        self.fds_channels = (Channel **)realloc(self.fds_channels, l * sizeof(Channel*));
-        self.length = l;
+        int l = (self->length > 0 ? 2 * self->length : DEF_FDS_LENGTH);
+        self->fds = (struct pollfd *)realloc(self->fds, l * sizeof(struct pollfd));
+        self->fds_channels = (Channel **)realloc(self->fds_channels, l * sizeof(Channel*));
+        self->length = l;
       }
-      self.fds[i].fd = ch->fds_fd;
-      self.fds[i].events = ch->fds_events;
-      self.fds_channels[i] = ch;
+      self->fds[i].fd = ch->fds_fd;
+      self->fds[i].events = ch->fds_events;
+      self->fds_channels[i] = ch;
       i++;
     }
     ch = ch->next;
   }
   o_log(O_LOG_DEBUG, "EventLoop: %d active channel%s\n", i, i>1?"s":"");
 
-  self.size = i;
-  self.fds_dirty = 0;
+  self->size = i;
+  self->fds_dirty = 0;
 
   return i;
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/** Create the epoll(7) descriptor, falling back to poll(3) on failure.
+ * \return 0 on success, -1 otherwise
+ */
+static int epoll_setup(void)
+{
+  if ((self->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+    o_log(O_LOG_WARN, "EventLoop: Could not create epoll descriptor, falling back to poll(): %s\n",
+          strerror(errno));
+    self->backend = EL_BACKEND_POLL;
+    self->fds_dirty = 1;
+    return -1;
+  }
+  return 0;
+}
+
+/** Add or remove a channel from the epoll(7) set.
+ *
+ * If a descriptor cannot be monitored with epoll(7) (e.g., STDIN redirected
+ * from a regular file), the whole EventLoop falls back to poll(3).
+ *
+ * \param ch Channel to (un)register
+ * \param flag 0 to unregister, 1 to register
+ * \return 0 on success, -1 if the EventLoop fell back to poll(3)
+ */
+static int epoll_update(Channel *ch, int flag)
+{
+  struct epoll_event ev;
+
+  if (self->epfd < 0 && epoll_setup()) {
+    return -1;
+  }
+
+  memset(&ev, 0, sizeof(ev));
+  ev.data.ptr = ch;
+  if (ch->fds_events & POLLIN) ev.events |= EPOLLIN;
+  if (ch->fds_events & POLLOUT) ev.events |= EPOLLOUT;
+
+  if (flag) {
+    if (epoll_ctl(self->epfd, EPOLL_CTL_ADD, ch->fds_fd, &ev)) {
+      o_log(O_LOG_WARN, "EventLoop: Cannot monitor '%s' with epoll, falling back to poll(): %s\n",
+            ch->name, strerror(errno));
+      close(self->epfd);
+      self->epfd = -1;
+      self->backend = EL_BACKEND_POLL;
+      return -1;
+    }
+    self->size++;
+
+  } else {
+    /* The descriptor might already have been closed, and automatically removed
+     * from the set; this is not a problem */
+    if (epoll_ctl(self->epfd, EPOLL_CTL_DEL, ch->fds_fd, &ev) && EBADF != errno && ENOENT != errno) {
+      o_log(O_LOG_DEBUG, "EventLoop: Error removing '%s' from the epoll set: %s\n",
+            ch->name, strerror(errno));
+    }
+    self->size--;
+  }
+  o_log(O_LOG_DEBUG, "EventLoop: %d active channel%s\n", self->size, self->size>1?"s":"");
+
+  return 0;
+}
+#endif
+
+/** Process the events reported for one channel, and run its callbacks.
+ *
+ * \param ch Channel on which events were reported
+ * \param revents mask of events (POLLIN, POLLOUT, ...) \see poll(3)
+ */
+static void dispatch_events(Channel *ch, int revents)
+{
+  if (ch->is_removable) {
+    /* Released by a previous callback in this iteration */
+    return;
+
+  } else if (revents & POLLERR) {
+    char buf[32];
+    SocketStatus status;
+    int len;
+
+    if ((len = recv(ch->fds_fd, buf, 32, 0)) <= 0) {
+      switch (errno) {
+      case ECONNREFUSED:
+        status = SOCKET_CONN_REFUSED;
+        break;
+      default:
+        status = SOCKET_UNKNOWN;
+        if (!ch->status_cbk) {
+          o_log(O_LOG_ERROR, "EventLoop: While reading from socket '%s': (%d) %s\n",
+                ch->name, errno, strerror(errno));
+        }
+      }
+      eventloop_socket_activate((SockEvtSource*)ch, 0);
+      do_status_callback (ch, status, errno);
+    } else {
+      o_log(O_LOG_ERROR, "EventLoop: Expected error on socket '%s' but read '%s'\n", ch->name, buf);
+    }
+  } else if (revents & POLLHUP) {
+    eventloop_socket_activate((SockEvtSource*)ch, 0);
+
+    /* Client closed the connection, but there might still be bytes
+       for us to read from our end of the connection. */
+    ssize_t len;
+    do {
+      len = channel_read(ch, ch->read_budget);
+      if (len > 0) {
+        o_log(O_LOG_DEBUG3, "EventLoop: Received last %zd bytes\n", len);
+      }
+    } while (len > 0 && !ch->is_removable);
+    do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
+  } else if (revents & POLLIN) {
+    if (ch->read_cbk) {
+      ssize_t len = channel_read(ch, ch->read_budget);
+      ch->last_activity = self->now;
+      if (len > 0) {
+        o_log(O_LOG_DEBUG3, "EventLoop: Received %zd bytes\n", len);
+      } else if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        /* Spurious wakeup, nothing to read after all */
+      } else if (len < 0 && errno == ENOBUFS) {
+        /* Paused by channel_read until the application makes room */
+      } else if (len < 0 && errno == ENOMEM) {
+        /* The application could not provide a buffer; this will not get better */
+        do_status_callback (ch, SOCKET_DROPPED, errno);
+      } else if (len == 0 && ch->socket != NULL) {  // skip stdin
+        // closed down
+        eventloop_socket_activate((SockEvtSource*)ch, 0);
+        do_status_callback (ch, SOCKET_CONN_CLOSED, 0);
+      } else if (len < 0) {
+        if (errno == ENOTSOCK) {
+          o_log(O_LOG_ERROR,
+                "EventLoop: Monitored socket '%s' is now invalid; "
+                "removing from monitored set\n",
+                ch->name);
+          eventloop_socket_remove ((SockEvtSource*)ch);
+        } else {
+          o_log(O_LOG_ERROR, "EventLoop: Unrecognized read error not handled (errno=%d)\n",
+                errno);
+        }
+      }
+    } else {
+      do_monitor_callback (ch);
+    }
+  } else if (ch->is_shutting_down) {
+    /* The socket was shutting down, and nothing new has appeared;
+     * We flushed the buffers, mark it as removable */
+    eventloop_socket_release((SockEvtSource*)ch);
+  }
+
+  if (revents & POLLOUT && !ch->is_removable) {
+    do_status_callback(ch, SOCKET_WRITEABLE, 0);
+    if (0 != ch->last_activity) {
+      /* If we track the activity of this socket */
+      ch->last_activity = self->now;
+    }
+  }
+
+  if (revents & POLLNVAL && !ch->is_removable) {
+    o_log(O_LOG_WARN, "EventLoop: socket '%s' invalid, deactivating...\n", ch->name);
+    eventloop_socket_activate((SockEvtSource*)ch, 0);
+    do_status_callback(ch, SOCKET_DROPPED, 0);
+  }
+}
+
+/** Create the pipe through which other threads wake this EventLoop up.
+ *
+ * \return 0 on success, -1 otherwise
+ * \see eventloop_post, run_tasks
+ */
+static int wakeup_setup(void)
+{
+  int i;
+
+  if (pipe(self->wakeup_fds)) {
+    o_log(O_LOG_ERROR, "EventLoop: Could not create wakeup pipe: %s\n", strerror(errno));
+    self->wakeup_fds[0] = self->wakeup_fds[1] = -1;
+    return -1;
+  }
+  for (i = 0; i < 2; i++) {
+    fcntl(self->wakeup_fds[i], F_SETFL, fcntl(self->wakeup_fds[i], F_GETFL) | O_NONBLOCK);
+    fcntl(self->wakeup_fds[i], F_SETFD, FD_CLOEXEC);
+  }
+
+  eventloop_on_in_fd("wakeup", self->wakeup_fds[0], NULL, run_tasks, NULL, NULL);
+
+  return 0;
+}
+
+/** Run the tasks posted by other threads.
+ *
+ * This is the monitoring callback of the wakeup pipe.
+ *
+ * \param source channel of the wakeup pipe
+ * \param handle unused
+ * \see eventloop_post
+ */
+static void run_tasks(SockEvtSource* source, void* handle)
+{
+  char buf[64];
+  TaskInt *task, *next;
+  (void)source;
+  (void)handle;
+
+  while (read(self->wakeup_fds[0], buf, sizeof(buf)) > 0);
+
+  pthread_mutex_lock(&self->tasks_lock);
+  task = self->tasks;
+  self->tasks = self->tasks_last = NULL;
+  pthread_mutex_unlock(&self->tasks_lock);
+
+  for (; task != NULL; task = next) {
+    next = task->next;
+    task->callback(task->handle);
+    oml_free(task);
+  }
+}
+
+/** Get the current time on a monotonic clock.
+ *
+ * \return a time [ms], only meaningful relative to other values from this function
+ * \see clock_gettime(3)
+ */
+static uint64_t monotonic_ms(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Compute how long to wait for events before the next timer is due.
+ *
+ * \return a timeout [ms] suitable for poll(3), or -1 if there are no active timers
+ */
+static int timers_timeout(void)
+{
+  uint64_t due;
+
+  if (self->timers_size < 1) {
+    return -1;
+  }
+
+  self->now = monotonic_ms();
+  due = self->timers[0]->due_time;
+  if (due <= self->now) {
+    return 0; // overdue
+  } else if (due - self->now > INT_MAX) {
+    return INT_MAX;
+  }
+  return (int)(due - self->now);
+}
+
+/** Fire all timers which are due, and reschedule the periodic ones.
+ *
+ * Removal of channels requested from callbacks is deferred, as for events.
+ *
+ * \see eventloop_socket_remove
+ */
+static void run_timers(void)
+{
+  TimerInt *t;
+  uint64_t skipped;
+
+  self->dispatching = 1;
+  while (self->timers_size > 0 && (t = self->timers[0])->due_time <= self->now) {
+    /* Reschedule first, so the callback can safely stop the timer */
+    if (t->is_periodic) {
+      t->due_time += t->period;
+      if (t->due_time <= self->now) {
+        // should really only happen during debugging
+        skipped = (self->now - t->due_time) / t->period + 1;
+        o_log(O_LOG_WARN, "EventLoop: Skipped %" PRIu64 " timer period(s) for '%s'\n",
+              skipped, t->name);
+        t->due_time += skipped * t->period;
+      }
+      timer_schedule(t);
+    } else {
+      timer_unschedule(t);
+    }
+
+    o_log(O_LOG_DEBUG2, "EventLoop: Timer '%s' fired\n", t->name);
+    if (t->callback) t->callback((TimerEvtSource*)t, t->handle);
+  }
+  self->dispatching = 0;
+}
+
+/** Swap two timers in the heap.
+ * \param i index of the first timer
+ * \param j index of the second timer
+ */
+static void timer_heap_swap(int i, int j)
+{
+  TimerInt *t = self->timers[i];
+
+  self->timers[i] = self->timers[j];
+  self->timers[j] = t;
+  self->timers[i]->heap_index = i;
+  self->timers[j]->heap_index = j;
+}
+
+/** Restore the heap property by moving a timer towards the root or the leaves.
+ * \param i index of the timer to move
+ */
+static void timer_heap_sift(int i)
+{
+  int parent, child;
+
+  while (i > 0 && self->timers[(parent = (i - 1) / 2)]->due_time > self->timers[i]->due_time) {
+    timer_heap_swap(i, parent);
+    i = parent;
+  }
+
+  while ((child = 2 * i + 1) < self->timers_size) {
+    if (child + 1 < self->timers_size &&
+        self->timers[child + 1]->due_time < self->timers[child]->due_time) {
+      child++;
+    }
+    if (self->timers[i]->due_time <= self->timers[child]->due_time) {
+      break;
+    }
+    timer_heap_swap(i, child);
+    i = child;
+  }
+}
+
+/** Schedule a timer to fire at its due_time.
+ *
+ * If the timer is already scheduled, it is moved to the position
+ * corresponding to its updated due_time.
+ *
+ * \param t TimerInt to schedule
+ */
+static void timer_schedule(TimerInt *t)
+{
+  if (t->heap_index < 0) {
+    if (self->timers_size >= self->timers_length) {
+      int length = self->timers_length > 0 ? 2 * self->timers_length : DEF_TIMERS_LENGTH;
+      TimerInt **timers = (TimerInt**)oml_realloc(self->timers, length * sizeof(TimerInt*));
+      if (timers == NULL) {
+        o_log(O_LOG_ERROR, "EventLoop: Cannot allocate memory to schedule timer '%s'\n", t->name);
+        return;
+      }
+      self->timers = timers;
+      self->timers_length = length;
+    }
+    t->heap_index = self->timers_size++;
+    self->timers[t->heap_index] = t;
+  }
+  t->is_active = 1;
+  timer_heap_sift(t->heap_index);
+}
+
+/** Remove a timer from the schedule, if it was scheduled.
+ * \param t TimerInt to unschedule
+ */
+static void timer_unschedule(TimerInt *t)
+{
+  int i = t->heap_index;
+
+  t->is_active = 0;
+  if (i < 0) {
+    return;
+  }
+
+  t->heap_index = -1;
+  if (i != --self->timers_size) {
+    self->timers[i] = self->timers[self->timers_size];
+    self->timers[i]->heap_index = i;
+    timer_heap_sift(i);
+  }
+}
+
+/** Schedule the check for idleness of a channel, or cancel it if the socket
+ * timeout is disabled.
+ *
+ * \param ch Channel which activity is tracked
+ * \see channel_check_idle, eventloop_set_socket_timeout
+ */
+static void channel_arm_idle_timer(Channel *ch)
+{
+  TimerInt *t = &ch->idle_timer;
+
+  if (self->socket_timeout > 0) {
+    t->name = ch->name;
+    t->callback = channel_check_idle;
+    t->handle = ch;
+    t->due_time = ch->last_activity + 1000 * (uint64_t)self->socket_timeout;
+    timer_schedule(t);
+  } else {
+    timer_unschedule(t);
+  }
+}
+
+/** Report a channel which has not seen any activity for more than the socket
+ * timeout as idle.
+ *
+ * The timer is not updated on every activity; rather, when it fires, it is
+ * rescheduled for the socket timeout after the last activity, if any.
+ *
+ * XXX: There might be a corner case where all FDs are already used, and some
+ * of them idle, however a new a new connection would be dropped before
+ * cleanup freed the resources it needs. See #959.
+ *
+ * \param source idle_timer of the Channel, cast as a TimerEvtSource
+ * \param handle Channel to check
+ * \see channel_arm_idle_timer, eventloop_set_socket_timeout
+ */
+static void channel_check_idle(TimerEvtSource *source, void *handle)
+{
+  Channel *ch = (Channel*)handle;
+  uint64_t idle = self->now - ch->last_activity;
+  (void)source;
+
+  if (ch->is_removable) {
+    return;
+  }
+
+  if (ch->is_active && idle >= 1000 * (uint64_t)self->socket_timeout) {
+    o_log(O_LOG_DEBUG2, "EventLoop: Socket '%s' idle for %" PRIu64 "ms, reaping...\n",
+          ch->name, idle);
+    do_status_callback(ch, SOCKET_IDLE, 0);
+    if (ch->is_removable) {
+      return;
+    }
+    /* Check again after another timeout */
+    ch->last_activity = self->now;
+
+  } else if (!ch->is_active) {
+    /* Don't count inactive time */
+    ch->last_activity = self->now;
+  }
+
+  channel_arm_idle_timer(ch);
+}
+
+/** Remove all channels released since the last iteration.
+ * \see eventloop_socket_release, eventloop_socket_remove
+ */
+static void remove_released_channels(void)
+{
+  while (self->removables != NULL) {
+    eventloop_socket_remove ((SockEvtSource*)self->removables);
+  }
+}
+
 /** Terminate sources.
  *
  * Close listening Sockets and shutdown() others
@@ -897,17 +1637,17 @@ static int update_fds(void)
  */
 static void terminate_fds(void)
 {
-  Channel *ch = self.channels, *next;
+  Channel *ch = self->channels, *next;
 
   while (ch != NULL) {
     next = ch->next;
     o_log(O_LOG_DEBUG4, "EventLoop: Terminating channel %s\n", ch->name);
-    if (!ch->is_active ||
+    if (!ch->is_active || !ch->socket ||
         socket_is_disconnected(ch->socket) ||
         socket_is_listening(ch->socket)) {
       o_log(O_LOG_DEBUG3, "EventLoop: Releasing listening channel %s\n", ch->name);
       eventloop_socket_release((SockEvtSource*)ch);
-    } else if (self.force_stop) {
+    } else if (self->force_stop) {
       o_log(O_LOG_DEBUG3, "EventLoop: Closing down %s\n", ch->name);
       eventloop_socket_release((SockEvtSource*)ch);
       socket_close(ch->socket);
@@ -919,7 +1659,87 @@ static void terminate_fds(void)
     ch = next;
   }
 
-  update_fds();
+  if (EL_BACKEND_POLL == self->backend) {
+    update_fds();
+  }
+}
+
+/** Read available data from a channel, and pass it to its read callback.
+ *
+ * Data is read into the space provided by the channel's
+ * o_el_buffer_socket_callback, if any, or an internal buffer otherwise. Reads
+ * are repeated as long as they fill all the space provided, until budget bytes
+ * have been read, or the read callback deactivates the channel. Sockets are
+ * read without blocking; only one read is done from STDIN.
+ *
+ * If the o_el_buffer_socket_callback provides no space, the channel is
+ * deactivated, and -1 is returned with errno set to ENOBUFS. If it reports an
+ * error, the channel is also deactivated, and -1 is returned with errno set to
+ * ENOMEM.
+ *
+ * \param ch Channel to read from
+ * \param budget number of bytes after which to stop reading
+ * \return the number of bytes read if any, or the result of the last read
+ * (0 if the peer closed the connection, -1 on error, with errno set)
+ *
+ * \see o_el_buffer_socket_callback, do_read_callback
+ * \see recvmsg(2), readv(2)
+ */
+static ssize_t channel_read(Channel *ch, size_t budget)
+{
+  char buf[MAX_READ_BUFFER_SIZE];
+  struct iovec iov[MAX_READ_IOVECS];
+  struct msghdr msg;
+  int fd = ch->fds_fd;
+  size_t total = 0, want;
+  ssize_t len;
+  int i, iovcnt;
+
+  do {
+    if (ch->buffer_cbk) {
+      iovcnt = ch->buffer_cbk((SockEvtSource*)ch, ch->handle, iov, MAX_READ_IOVECS);
+      if (iovcnt < 0) {
+        o_log(O_LOG_ERROR, "EventLoop: No buffer could be provided to read from '%s'\n", ch->name);
+        eventloop_socket_activate((SockEvtSource*)ch, 0);
+        errno = ENOMEM;
+        len = -1;
+        break;
+      } else if (iovcnt == 0) {
+        /* Stop polling the channel, or it would be reported readable forever */
+        o_log(O_LOG_DEBUG, "EventLoop: No buffer space to read from '%s', pausing it\n", ch->name);
+        eventloop_socket_activate((SockEvtSource*)ch, 0);
+        errno = ENOBUFS;
+        len = -1;
+        break;
+      }
+    } else {
+      iov[0].iov_base = buf;
+      iov[0].iov_len = MAX_READ_BUFFER_SIZE;
+      iovcnt = 1;
+    }
+    for (want = 0, i = 0; i < iovcnt; i++) {
+      want += iov[i].iov_len;
+    }
+
+    if (fd == 0) {
+      // stdin
+      len = readv(fd, iov, iovcnt);
+    } else {
+      // socket
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iovcnt;
+      len = recvmsg(fd, &msg, MSG_DONTWAIT);
+    }
+
+    if (len > 0) {
+      total += len;
+      do_read_callback (ch, ch->buffer_cbk ? NULL : buf, len);
+    }
+  } while (len > 0 && (size_t)len == want && total < budget &&
+           fd != 0 && ch->is_active && !ch->is_removable);
+
+  return total > 0 ? (ssize_t)total : len;
 }
 
 /** Execute the data-read callback of a channel, if defined.
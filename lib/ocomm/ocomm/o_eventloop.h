@@ -30,13 +30,14 @@
  * \see eventloop_init, eventloop_run, eventloop_stop
  * \eventloop_on_stdin, eventloop_on_monitor_in_channel, eventloop_on_read_in_channel, eventloop_on_out_channel
  * \see o_el_timer_callback, o_el_read_socket_callback, o_el_monitor_socket_callback, o_el_state_socket_callback, o_el_timer_callback
- * \see poll(3)
+ * \see poll(3), epoll(7)
  */
 
 #ifndef O_EVENTLOOP_H
 #define O_EVENTLOOP_H
 
 #include <time.h>
+#include <sys/uio.h>
 
 #include "ocomm/o_socket.h"
 
@@ -44,6 +45,10 @@
 extern "C" {
 #endif
 
+/** An opaque data type for EventLoops
+ * \see eventloop_new, eventloop_make_current */
+typedef struct _eventLoop EventLoop;
+
 /** Timer-based event source base class for the EventLoop. */
 typedef struct _TimerEvtSource {
   /** Name of the source, used for debugging */
@@ -97,6 +102,14 @@ const char* socket_status_string(SocketStatus status);
 typedef void (*o_el_timer_callback)(TimerEvtSource* source, void* handle);
 
 
+/** Task callback prototype for functions posted to another thread's EventLoop.
+ *
+ * \param handle pointer to application-supplied data
+ * \see eventloop_post
+ */
+typedef void (*o_el_task_callback)(void* handle);
+
+
 /** Data-read callback prototype for sockets.
  *
  * The EventLoop takes care of recv(2)ing data from a socket ready to be read,
@@ -107,14 +120,43 @@ typedef void (*o_el_timer_callback)(TimerEvtSource* source, void* handle);
  *
  * \param source SockEvtSource from which the event originated
  * \param handle pointer to application-supplied data
- * \param buffer pointer to a buffer containing the read data
+ * \param buffer pointer to a buffer containing the read data, or NULL if the
+ * data has been stored in the space provided by the o_el_buffer_socket_callback
  * \param buf_size size of data in buffer
  *
- * \see o_el_state_socket_callback
+ * \see o_el_state_socket_callback, o_el_buffer_socket_callback
  * \see poll(3)
  */
 typedef void (*o_el_read_socket_callback)(SockEvtSource* source, void* handle, void* buffer, int buf_size);
 
+/** Read-buffer callback prototype for sockets.
+ *
+ * If registered with eventloop_socket_set_buffer_callback, the EventLoop calls
+ * this function before reading from the socket, to learn where the
+ * application wants the data to be stored. The data is then read(2) (or
+ * readv(2)) directly there, and the o_el_read_socket_callback is called with a
+ * NULL buffer and the number of bytes stored, in order, in the iovecs filled
+ * in here.
+ *
+ * If no space is available, the channel is deactivated, and no more data is
+ * read from it until the application calls eventloop_socket_activate(source, 1)
+ * once it has made room. If space cannot be made at all (e.g., memory
+ * allocation failed), the channel is deactivated, and reported as
+ * SOCKET_DROPPED to its o_el_state_socket_callback.
+ *
+ * \param source SockEvtSource from which the event originated
+ * \param handle pointer to application-supplied data
+ * \param iov array of iovecs to fill with the locations where to store data
+ * \param iovcnt maximal number of iovecs which can be filled in iov
+ * \return the number of iovecs filled in iov, 0 if no space is available yet,
+ * or -1 on error
+ *
+ * \see o_el_read_socket_callback, eventloop_socket_set_buffer_callback
+ * \see eventloop_socket_activate
+ * \see readv(2)
+ */
+typedef int (*o_el_buffer_socket_callback)(SockEvtSource* source, void* handle, struct iovec *iov, int iovcnt);
+
 /** Monitoring callback prototype for sockets.
  *
  * This callback is a fallback when no data-read callback. Listening sockets,
@@ -152,12 +194,21 @@ typedef void (*o_el_state_socket_callback)(SockEvtSource* source, SocketStatus s
 
 void eventloop_init(void);
 void eventloop_set_socket_timeout(unsigned int to);
+int eventloop_set_backend(const char *name);
+const char* eventloop_get_backend(void);
 int eventloop_run(void);
 void eventloop_stop(int reason);
 void eventloop_terminate(int reason);
 void eventloop_report (int loglevel);
 
+EventLoop* eventloop_new(void);
+void eventloop_free(EventLoop *loop);
+EventLoop* eventloop_current(void);
+void eventloop_make_current(EventLoop *loop);
+int eventloop_post(EventLoop *loop, o_el_task_callback callback, void *handle);
+
 TimerEvtSource* eventloop_every(char* name, int period, o_el_timer_callback callback, void* handle);
+TimerEvtSource* eventloop_every_ms(char* name, unsigned int period, o_el_timer_callback callback, void* handle);
 void eventloop_timer_stop(TimerEvtSource* timer);
 
 /* These functions create new channels around either STDIN or an OComm socket,
@@ -171,6 +222,8 @@ SockEvtSource* eventloop_on_out_channel( Socket* socket, o_el_state_socket_callb
 void eventloop_socket_activate(SockEvtSource* source, int flag);
 void eventloop_socket_release(SockEvtSource* source);
 void eventloop_socket_remove(SockEvtSource* source);
+void eventloop_socket_set_buffer_callback(SockEvtSource* source, o_el_buffer_socket_callback buffer_cbk);
+void eventloop_socket_set_read_budget(SockEvtSource* source, size_t budget);
 
 #ifdef __cplusplus
 }
@@ -20,6 +20,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
 
 #ifdef __cplusplus
@@ -105,6 +106,9 @@ void socket_free (Socket* socket);
 /** Send a message through the socket */
 int socket_sendto(Socket* socket, char* buf, int buf_size);
 
+/** Send data gathered from several buffers through the socket */
+ssize_t socket_sendmsg(Socket* socket, const struct iovec* iov, int iovcnt);
+
 /* Return the file descripter associated with this socket */
 int socket_get_sockfd(Socket* socket);
 
@@ -17,6 +17,7 @@
 #include <sys/stat.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <errno.h>
@@ -515,26 +516,18 @@ socket_close(Socket* socket)
   return 0;
 }
 
-/** Send a message through the socket
- *
- * If a disconnection occurs, 0 will be returned, as no data was sent.  To
- * differentiate from cases where data couldn't be written just yet, the socket
- * should be inspected with socket_is_disconnected().
+/** Make sure a Socket is connected before sending data through it.
  *
- * \param socket Socket to send message through
- * \param buf data to send
- * \param buf_size amount of data to read from buf
- * \return the amount of data sent, or -1 on error
+ * \param self SocketInt to check
+ * \return 1 if data can be sent, 0 if the socket is (or just got) disconnected
  *
- * \see socket_is_disconnected, sendto(3)
+ * \see socket_sendto, socket_sendmsg
  */
-int
-socket_sendto(Socket* socket, char* buf, int buf_size)
+static int
+s_check_connected(SocketInt* self)
 {
-  SocketInt *self = (SocketInt*)socket;
   int sent;
 
-
   if (self->is_disconnected) {
     if(!s_connect(self)) {
       return 0;
@@ -553,31 +546,105 @@ socket_sendto(Socket* socket, char* buf, int buf_size)
     }
 
   }
+  return 1;
+}
+
+/** Handle a failure to send data through a Socket, as reported in errno.
+ *
+ * \param self SocketInt which failed to send
+ * \return 0 if the failure is due to a disconnection, or is transient, -1 otherwise
+ *
+ * \see socket_sendto, socket_sendmsg
+ */
+static int
+s_send_failed(SocketInt* self)
+{
+  if (errno == EPIPE || errno == ECONNRESET) {
+    // The other end closed the connection.
+    self->is_disconnected = 1;
+    o_log(O_LOG_ERROR, "socket(%s): The remote peer closed the connection: %s\n",
+          self->name, strerror(errno));
+    return 0;
+  } else if (errno == ECONNREFUSED) {
+    self->is_disconnected = 1;
+    o_log(O_LOG_DEBUG, "socket(%s): Connection refused, trying next AI\n",
+          self->name);
+    self->rp = self->rp->ai_next;
+    return 0;
+  } else if (errno == EINTR) {
+    o_log(O_LOG_WARN, "socket(%s): Sending data interrupted: %s\n",
+          self->name, strerror(errno));
+    return 0;
+  } else {
+    o_log(O_LOG_ERROR, "socket(%s): Sending data failed: %s\n",
+          self->name, strerror(errno));
+  }
+  return -1;
+}
+
+/** Send a message through the socket
+ *
+ * If a disconnection occurs, 0 will be returned, as no data was sent.  To
+ * differentiate from cases where data couldn't be written just yet, the socket
+ * should be inspected with socket_is_disconnected().
+ *
+ * \param socket Socket to send message through
+ * \param buf data to send
+ * \param buf_size amount of data to read from buf
+ * \return the amount of data sent, or -1 on error
+ *
+ * \see socket_is_disconnected, sendto(3)
+ */
+int
+socket_sendto(Socket* socket, char* buf, int buf_size)
+{
+  SocketInt *self = (SocketInt*)socket;
+  int sent;
+
+  if (!s_check_connected(self)) {
+    return 0;
+  }
 
   if ((sent = sendto(self->sockfd, buf, buf_size, MSG_NOSIGNAL,
                     &(self->servAddr.sa),
                     sizeof(self->servAddr.sa_stor))) < 0) {
-    if (errno == EPIPE || errno == ECONNRESET) {
-      // The other end closed the connection.
-      self->is_disconnected = 1;
-      o_log(O_LOG_ERROR, "socket(%s): The remote peer closed the connection: %s\n",
-            self->name, strerror(errno));
-      return 0;
-    } else if (errno == ECONNREFUSED) {
-      self->is_disconnected = 1;
-      o_log(O_LOG_DEBUG, "socket(%s): Connection refused, trying next AI\n",
-            self->name);
-      self->rp = self->rp->ai_next;
-      return 0;
-    } else if (errno == EINTR) {
-      o_log(O_LOG_WARN, "socket(%s): Sending data interrupted: %s\n",
-            self->name, strerror(errno));
-      return 0;
-    } else {
-      o_log(O_LOG_ERROR, "socket(%s): Sending data failed: %s\n",
-            self->name, strerror(errno));
-    }
-    return -1;
+    return s_send_failed(self);
+  }
+  return sent;
+}
+
+/** Send data gathered from several buffers through the socket in one call
+ *
+ * This behaves like socket_sendto(), but sends the buffers described by iov
+ * in order, as if they were contiguous. Like sendmsg(2), it may send only
+ * part of the data.
+ *
+ * \param socket Socket to send message through
+ * \param iov array of buffers to send
+ * \param iovcnt number of buffers in iov (at most IOV_MAX)
+ * \return the amount of data sent, or -1 on error
+ *
+ * \see socket_sendto, socket_is_disconnected, sendmsg(2)
+ */
+ssize_t
+socket_sendmsg(Socket* socket, const struct iovec* iov, int iovcnt)
+{
+  SocketInt *self = (SocketInt*)socket;
+  struct msghdr msg;
+  ssize_t sent;
+
+  if (!s_check_connected(self)) {
+    return 0;
+  }
+
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_name = &(self->servAddr.sa);
+  msg.msg_namelen = sizeof(self->servAddr.sa_stor);
+  msg.msg_iov = (struct iovec*)iov;
+  msg.msg_iovlen = iovcnt;
+
+  if ((sent = sendmsg(self->sockfd, &msg, MSG_NOSIGNAL)) < 0) {
+    return s_send_failed(self);
   }
   return sent;
 }
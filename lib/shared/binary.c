@@ -91,6 +91,38 @@ bin_value_size (OmlValue *value)
   }
 }
 
+/*
+ * Read the start of a compact or batch message, from its first sync byte.
+ *
+ * Without the state of the stream, the sequence number and timestamp
+ * are stored as read, i.e., as deltas from the previous message of the
+ * stream, unless the message is absolute. For batch messages, they are
+ * those of the first row.
+ *
+ * Return values are as for bin_read_msg_start().
+ */
+static int
+bin_read_compact_msg_start (struct oml_message *msg, MBuffer *mbuf)
+{
+  OmlBinaryHeader header;
+  int result = unmarshal_init (mbuf, &header);
+
+  if (result < 0) {
+    return 0; /* Not enough bytes for the full message */
+  } else if (result == 0) {
+    return -1;
+  }
+
+  msg->type = OMB_BATCH_P == header.type ? MSG_COLUMNAR : MSG_COMPACT;
+  msg->stream = header.stream;
+  msg->length = (mbuf_rdptr (mbuf) - mbuf_message (mbuf)) + header.length;
+  msg->count = -1; /* As many as in the schema */
+  msg->seqno = header.seqno;
+  msg->timestamp = header.timestamp;
+
+  return msg->length;
+}
+
 /*
  * Read the start of the new message; detect which stream it belongs
  * to, what the length of the message is, the sequence number, and the
@@ -143,6 +175,10 @@ bin_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
     length = ntohl (length);
     header_length = 7;
     break;
+  case OMB_CDATA_P:
+  case OMB_BATCH_P:
+    mbuf_reset_read (mbuf);
+    return bin_read_compact_msg_start (msg, mbuf);
   default:
     return -1; // Unknown packet type
   }
@@ -183,13 +219,23 @@ bin_read_msg_values (struct oml_message *msg, MBuffer *mbuf, struct schema *sche
 {
   int i = 0;
 
-  if (msg->count != schema->nfields)
+  if (msg->type == MSG_COLUMNAR) {
+    return -1; /* Rows of a batch are interleaved, see unmarshal_batch() */
+  } else if (msg->type != MSG_COMPACT && msg->count != schema->nfields) {
     return -1;
+  }
 
   for (i = 0; i < schema->nfields; i++) {
     int bytes;
 
-    bytes = bin_read_value (mbuf, &values[i]);
+    if (msg->type == MSG_COMPACT) {
+      /* Compact messages only have the values, in schema order; without
+       * the dictionary of the stream, this only works up to OMSPv8 */
+      oml_value_set_type (&values[i], schema->fields[i].type);
+      bytes = unmarshal_compact_value (mbuf, NULL, &values[i]) ? 0 : -1;
+    } else {
+      bytes = bin_read_value (mbuf, &values[i]);
+    }
 
     if (bytes == -1)
       return -1;
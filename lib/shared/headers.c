@@ -34,7 +34,7 @@
  *
  * \section Generalities
  *
- * There are 5 versions of the OML protocol.
+ * There are 9 versions of the OML protocol.
  *
  * - OMSP V1 was the initial protocol, inherited from OML (version 1!);
  * - OMSP V2 introduced more precise types (<a
@@ -47,10 +47,16 @@
  * - OMSP V4 was introduced with OML 2.10.0; its main additions are the support
  *   for the definition of new Measurement Points (and Measurement Stream
  *   Schemas) at any time, and the ability to inject metadata.
- * - OMSP V5 which is the current, most recent and implemented version (since
- *   OML 2.11); its main advantages are the support for vectors, and the
- *   introduction of a DOUBLE64_T IEEE 754 binary64 for more precision in
- *   representing doubles in binary mode (vectors only).
+ * - OMSP V5 was introduced with OML 2.11; its main advantages are the support
+ *   for vectors, and the introduction of a DOUBLE64_T IEEE 754 binary64 for
+ *   more precision in representing doubles in binary mode (vectors only).
+ * - OMSP V6 extends the use of DOUBLE64_T to all doubles in binary mode.
+ * - OMSP V7 introduces \ref omspcompact "compact binary messages".
+ * - OMSP V8 introduces \ref omspbatch "batch binary messages".
+ * - OMSP V9 is the most recent version; it sends repeated strings of compact
+ *   and batch messages as references to \ref omspstrdict "string
+ *   dictionaries". As older servers reject V6 and above, clients still
+ *   announce V5 unless told otherwise.
  *
  * The protocol is loosely modelled after HTTP. The client first start
  * with a few \ref omspheaders "textual headers", then switches into
@@ -97,6 +103,9 @@
  * - `content`: encoding of forthcoming tuples, can be either `binary` for
  *     the \ref omspbin "binary protocol" or `text` for the \ref omsptext "text protocol".
  * - `schema`: describes the \ref omspschema "schema of each measurement stream".
+ * - `encoding` (optional): compression of everything following the headers,
+ *     either `identity` (the default), or `deflate` for a raw deflate stream
+ *     (RFC 1951), \ref omspencoding "see below".
  *
  * These parameters can only be set as part of the \ref omspheaders "headers",
  * and are not valid once the server expects serialised measurements (V<4).
@@ -166,6 +175,18 @@
  *     
  *     0.163925        0       1       .       schema  2 generator_d_sin label:string phase:double value:double
  *
+ * \subsection omspencoding Compression
+ *
+ * With an `encoding: deflate` header, all the bytes following the empty line
+ * ending the headers form a single raw deflate stream (RFC 1951), in which
+ * the text or binary messages are serialised as usual. The sender does a full
+ * flush at the end of each write, so every block it sends can be decompressed
+ * without the previous ones; after a corruption or a lost write, the receiver
+ * skips to the start of the next block (see inflateSync(3)).
+ *
+ * The header is ignored by servers which do not know it, so compression
+ * should only be used with servers supporting it.
+ *
  */
 
 #include <stdlib.h>
@@ -189,6 +210,7 @@ static const struct {
   { "sender-id",     9,  H_SENDER_ID },
   { "start-time",    10, H_START_TIME },
   { "start_time",    10, H_START_TIME }, /* This one will be deprecated at some point */
+  { "encoding",      8,  H_ENCODING },
   { NULL, 0, H_NONE }
 };
 
@@ -92,6 +92,20 @@
  *       |  mant-byte-LL |   exponent    |
  *       +---------------+---------------+--
  *
+ * Since OMSPv6, doubles are instead sent as their IEEE 754 binary64
+ * representation, in network byte order, with the \ref DOUBLE64_T type already
+ * used for the elements of vectors (see below). This is exact, and NaN needs
+ * no special casing. The older representation is still used when marshalling
+ * for an earlier version of the protocol, \see marshal_set_protocol_version.
+ *
+ *     --+---------------+---------------+---------------+---------------+
+ *       |  DOUBLE64_T   |  dbl-MS-byte  |   dbl-byte-7  |   dbl-byte-6  |
+ *     --+---------------+---------------+---------------+---------------+
+ *       |   dbl-byte-5  |   dbl-byte-4  |   dbl-byte-3  |   dbl-byte-2  |
+ *       +---------------+---------------+---------------+---------------+
+ *       |  dbl-LS-byte  |
+ *       +---------------+--
+ *
  * Strings (\ref STRING_T) and blobs (\ref BLOB_T) are serialised as bytes,
  * with the second byte (i.e., first after the type), being their length.
  *
@@ -159,10 +173,94 @@
  *       +---------------+-----------------+---------------+---------------+--
  *
  * \see marshal_init, marshal_header_short, marshal_header_long, marshal_measurements, marshal_values, marshal_finalize
+ *
+ * \section omspcompact OMSP Compact Binary Marshalling
+ *
+ * Since OMSPv7, clients send compact messages (\ref OMB_CDATA_P) instead. As
+ * both sides know the schema of each stream, values are written in schema
+ * order without type bytes. Integers are written as varints: 7 bits per
+ * byte, least significant group first, with the high bit set on all but the
+ * last byte; signed integers are first zig-zag encoded (0, -1, 1, -2, ...
+ * become 0, 1, 2, 3, ...) so small negative numbers stay short.
+ *
+ *     0                   1                   2                   3
+ *     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *     +---------------+---------------+---------------+---------------+
+ *     |   SYNC_BYTE   |   SYNC_BYTE   | OMB_CDATA_P   | length (var)  |
+ *     +---------------+---------------+---------------+---------------+
+ *     |   ms-index    | seq-no (var)  |timestamp (var)|  values ...   |
+ *     +---------------+---------------+---------------+---------------+
+ *
+ * The length counts the bytes following it. The low bit of the seq-no varint
+ * is set if the message is absolute, the other bits are the zig-zag encoded
+ * sequence number. The timestamp is a zig-zag encoded number of
+ * microseconds. If the message is not absolute, both are deltas against the
+ * previous message of the same stream, \see OmlCompactState. Senders make a
+ * message absolute whenever the receiver may not have the previous one, e.g.,
+ * the first message of each stream in every chunk of a BufferedWriter, so
+ * chunks can be dropped or spooled independently. Receivers discard
+ * non-absolute messages until they have an absolute one for their stream.
+ *
+ * Doubles are 8-byte IEEE 754 binary64 as \ref DOUBLE64_T, GUIDs are 8 bytes
+ * in network byte order, and booleans one byte (0 or 1). Strings and blobs
+ * are a varint length followed by their bytes, and vectors a varint number of
+ * elements followed by the elements, each encoded as a scalar of its type.
+ *
+ * \see marshal_compact_init, marshal_compact_values, marshal_compact_finalize, unmarshal_compact_resolve
+ *
+ * \section omspbatch OMSP Batch Binary Marshalling
+ *
+ * Since OMSPv8, several rows of the same stream can be sent in a single batch
+ * message (\ref OMB_BATCH_P), so the framing and header parsing are only done
+ * once for all of them. The header is as for compact messages, followed by
+ * the number of rows; the sequence numbers, timestamps and values then follow
+ * by column.
+ *
+ *     0                   1                   2                   3
+ *     0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+ *     +---------------+---------------+---------------+---------------+
+ *     |   SYNC_BYTE   |   SYNC_BYTE   | OMB_BATCH_P   | length (var)  |
+ *     +---------------+---------------+---------------+---------------+
+ *     |   ms-index    |  rows (var)   | seq-no (var)  |timestamp (var)|
+ *     +---------------+---------------+---------------+---------------+
+ *     | rows-1 seq-no deltas (var) ...| rows-1 timestamp deltas (var).|
+ *     +---------------+---------------+---------------+---------------+
+ *     | rows values of the first field ...| rows values of the next...|
+ *     +---------------+---------------+---------------+---------------+
+ *
+ * The sequence number and timestamp of the first row are zig-zag encoded,
+ * and absolute; those of the following rows are zig-zag encoded deltas from
+ * the previous row. Values are encoded as in compact messages. A batch
+ * message does not depend on any previous message, but is the base of the
+ * next compact message of its stream, as if it were its last row.
+ *
+ * \see marshal_batch, unmarshal_batch
+ *
+ * \section omspstrdict OMSP String Dictionaries
+ *
+ * Since OMSPv9, each end of a connection keeps a dictionary of the strings
+ * recently sent in each stream (\ref OmlStringDict), so a string which is
+ * sent again only takes the varint ID of its entry. In compact and batch
+ * messages, strings are then preceded by a varint tag instead of their
+ * length. If its low bit is set, the other bits are the ID of a string of
+ * the dictionary. Otherwise, they are the length of the string which follows.
+ * Unless it is empty or longer than \ref STRDICT_MAX_LENGTH, that string is
+ * added to the dictionary, with the first unused ID, or replacing the least
+ * recently used entry once the \ref STRDICT_SIZE entries are in use. Entries
+ * which were used in the current message are not replaced; if all are, the
+ * string is not added.
+ *
+ * Both ends apply the same rules, in the order in which the values are
+ * marshalled, i.e., column by column for batch messages. To keep chunks of
+ * messages independent, the dictionary of a stream is cleared by absolute
+ * compact messages, before their values, and by batch messages.
+ *
+ * \see strdict_find, strdict_get, strdict_add
  */
 
 #define _GNU_SOURCE  /* For NAN */
 #include <math.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -223,6 +321,7 @@
 
 #define LONG_T_SIZE       4
 #define DOUBLE_T_SIZE     5
+#define DOUBLE64_T_SIZE   8
 /** Marshalled strings are limited to 254 characters */
 #define STRING_T_MAX_SIZE 254
 #define INT32_T_SIZE      4
@@ -237,6 +336,20 @@
 
 #define MIN_LENGTH 64
 
+/** Size of compact marshalled message headers (OMB_CDATA_P) up to the first byte of the length */
+#define COMPACT_HEADER_SIZE 4
+/** Maximal size of a varint-encoded 64-bit integer */
+#define VARINT_MAX_SIZE 10
+
+/** Zig-zag encode a signed integer, so that small magnitudes map to small values */
+#define ZIGZAG(n) (((uint64_t)(n) << 1) ^ (uint64_t)((int64_t)(n) >> 63))
+/** Decode a zig-zag encoded integer \see ZIGZAG */
+#define UNZIGZAG(v) ((int64_t)((v) >> 1) ^ -(int64_t)((v) & 1))
+
+/** Version of the protocol for which values are marshalled
+ * \see marshal_set_protocol_version */
+static int marshal_protocol = OMSP_DOUBLE64_VERSION - 1;
+
 /** Map from OML_*_VALUE types to protocol types.
  *
  * This array must be ordered identically to the conrete OmlValueT types in
@@ -359,6 +472,26 @@ static const OmlValueT vector_type_map[] = {
   [BOOL_T]   = OML_VECTOR_BOOL_VALUE,
 };
 
+/** Select the version of the protocol for which values are marshalled.
+ *
+ * From \ref OMSP_DOUBLE64_VERSION, doubles are marshalled exactly as \ref
+ * DOUBLE64_T, which earlier versions cannot unmarshal; they are otherwise
+ * marshalled as \ref DOUBLE_T. This applies to all subsequent marshalling
+ * in the process, and should match the protocol announced in the headers.
+ * Unmarshalling accepts both representations whatever the version.
+ *
+ * \param version version of the protocol announced to the receiver
+ * \return the previous version
+ * \see marshal_value
+ */
+int
+marshal_set_protocol_version(int version)
+{
+  int old = marshal_protocol;
+  marshal_protocol = version;
+  return old;
+}
+
 /** Find two synchronisation bytes (SYNC_BYTE) back to back.
  *
  * \param buf buffer to search for SYNC_BYTEs
@@ -378,6 +511,79 @@ uint8_t* find_sync (const uint8_t *buf, int len)
   return NULL;
 }
 
+/** Encode an unsigned integer as a varint.
+ *
+ * \param buf buffer of at least VARINT_MAX_SIZE bytes to write into
+ * \param v value to encode
+ * \return the number of bytes written
+ */
+static size_t
+varint_encode(uint8_t *buf, uint64_t v)
+{
+  size_t n = 0;
+
+  while (v >= 0x80) {
+    buf[n++] = (uint8_t)(v | 0x80);
+    v >>= 7;
+  }
+  buf[n++] = (uint8_t)v;
+  return n;
+}
+
+/** Marshal an unsigned integer as a varint into an MBuffer.
+ *
+ * \param mbuf MBuffer to write to
+ * \param v value to marshal
+ * \return 0 on success, -1 on failure (\see mbuf_write)
+ */
+static int
+marshal_varint(MBuffer *mbuf, uint64_t v)
+{
+  uint8_t buf[VARINT_MAX_SIZE];
+  return mbuf_write(mbuf, buf, varint_encode(buf, v));
+}
+
+/** Unmarshal a varint from an MBuffer.
+ *
+ * \param mbuf MBuffer to read from
+ * \param v pointer to where the value should be stored
+ * \return 0 on success, -1 if there is not enough data, -2 if the varint is too long
+ */
+static int
+unmarshal_varint(MBuffer *mbuf, uint64_t *v)
+{
+  int b, shift = 0;
+
+  *v = 0;
+  do {
+    if (shift > 63) {
+      return -2;
+    } else if (-1 == (b = mbuf_read_byte(mbuf))) {
+      return -1;
+    }
+    *v |= (uint64_t)(b & 0x7f) << shift;
+    shift += 7;
+  } while (b & 0x80);
+
+  return 0;
+}
+
+/** Marshal a double as IEEE 754 binary64 in network byte order, without type.
+ *
+ * \param mbuf MBuffer to write to
+ * \param v value to marshal
+ * \return 0 on success, -1 on failure (\see mbuf_write)
+ */
+static int
+marshal_double64(MBuffer *mbuf, double v)
+{
+  uint64_t nv64;
+
+  memcpy(&nv64, &v, sizeof(nv64));
+  nv64 = htonll(nv64);
+  return mbuf_write(mbuf, (uint8_t*)&nv64, sizeof(nv64));
+}
+
 /** Prepare a short marshalling header into an MBuffer.
  *
  * \param mbuf MBuffer to write the mbuf marshalling header to
@@ -454,6 +660,10 @@ marshal_init(MBuffer *mbuf, OmlBinMsgType msgtype)
   switch (msgtype) {
   case OMB_DATA_P:  result = marshal_header_short (mbuf); break;
   case OMB_LDATA_P: result = marshal_header_long (mbuf); break;
+  default:
+    logerror("Cannot marshal packets of type %d with marshal_init()\n", msgtype);
+    mbuf_reset_write (mbuf);
+    return -1;
   }
 
   if (result == -1) {
@@ -550,6 +760,7 @@ int marshal_values(MBuffer* mbuf, OmlValue* values, int value_count)
   switch (type) {
   case OMB_DATA_P: buf[5] += value_count; break;
   case OMB_LDATA_P: buf[7] += value_count; break;
+  default: break;
   }
   return 1;
 }
@@ -629,8 +840,29 @@ marshal_value(MBuffer* mbuf, OmlValueT val_type, OmlValueU* val)
     uint8_t type = DOUBLE_T;
     double v = omlc_get_double(*val);
     int exp;
-    double mant = frexp(v, &exp);
-    int8_t nexp = (int8_t)exp;
+    double mant;
+    int8_t nexp;
+
+    if (marshal_protocol >= OMSP_DOUBLE64_VERSION) {
+      uint8_t buf[DOUBLE64_T_SIZE+1];
+      uint64_t nv64;
+
+      memcpy(&nv64, &v, sizeof(nv64));
+      nv64 = htonll(nv64);
+      buf[0] = DOUBLE64_T;
+      memcpy(&buf[1], &nv64, sizeof(nv64));
+
+      logdebug3("Marshalling double64 %f\n", v);
+      if (-1 == mbuf_write(mbuf, buf, LENGTH(buf))) {
+        logerror("Failed to marshal OML_DOUBLE_VALUE (mbuf_write())\n");
+        mbuf_reset_write(mbuf);
+        return 0;
+      }
+      break;
+    }
+
+    mant = frexp(v, &exp);
+    nexp = (int8_t)exp;
     logdebug3("Marshalling double %f\n", v);
     if (isnan(v)) {
       type = DOUBLE_NAN;
@@ -893,8 +1125,427 @@ marshal_finalize(MBuffer*  mbuf)
     uint32_t nlen32 = htonl (len); // pure data length
     memcpy (&buf[3], &nlen32, sizeof (nlen32));
     break;
+  default:
+    break;
+  }
+
+  return 1;
+}
+
+/** Initialise the MBuffer to serialise a new compact measurement packet.
+ *
+ * The header, sequence number and timestamp are written as in \ref
+ * omspcompact. If state is valid, they are written as deltas against it,
+ * otherwise the message is absolute. In both cases, state is then updated to
+ * describe this message; callers which may not send the message should pass
+ * a copy. An absolute message also starts a new dictionary of strings, if
+ * state has one; as strings are added to it while marshalling the values, a
+ * message which is not sent should be followed by an absolute one.
+ *
+ * The timestamp is rounded to the microsecond.
+ *
+ * \param mbuf MBuffer to serialize into
+ * \param state OmlCompactState of the stream, describing the previous message the receiver will have
+ * \param stream Measurement Stream's index
+ * \param seqno message sequence number
+ * \param now message time
+ * \return 1 if successful, -1 otherwise
+ * \see marshal_compact_values, marshal_compact_finalize
+ */
+int
+marshal_compact_init(MBuffer* mbuf, OmlCompactState* state, int stream, int seqno, double now)
+{
+  uint8_t buf[] = { SYNC_BYTE, SYNC_BYTE, OMB_CDATA_P, 0, (uint8_t)stream };
+  int64_t ts = llround(now * 1e6);
+  int64_t dseqno = seqno, dts = ts;
+
+  if (mbuf == NULL || state == NULL) return -1;
+
+  if (mbuf_begin_write (mbuf) == -1) {
+    logerror("Couldn't start marshalling packet (mbuf_begin_write())\n");
+    return -1;
+  }
+
+  if (state->valid) {
+    dseqno -= state->seqno;
+    dts -= state->timestamp;
+  } else {
+    strdict_clear (state->dict);
+  }
+  strdict_begin (state->dict);
+
+  logdebug2("Marshalling compact sample %d for stream %d\n", seqno, stream);
+  if (mbuf_write (mbuf, buf, LENGTH (buf)) == -1 ||
+      marshal_varint (mbuf, ZIGZAG(dseqno) << 1 | !state->valid) == -1 ||
+      marshal_varint (mbuf, ZIGZAG(dts)) == -1) {
+    logerror("Unable to marshal compact packet header (mbuf_write())\n");
+    mbuf_reset_write (mbuf);
+    return -1;
+  }
+
+  state->valid = 1;
+  state->seqno = seqno;
+  state->timestamp = ts;
+
+  return 1;
+}
+
+/** Marshal a single OmlValueU of type OmlValueT into mbuf, without type.
+ *
+ * On failure, the whole message writing is reset using mbuf_reset_write().
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param dict OmlStringDict of the stream, or NULL \ref omspstrdict
+ * \param val_type OmlValueT representing the type of val
+ * \param val pointer to OmlValueU, of type val_type, to marshall
+ * \return 1 on success, or 0 otherwise
+ * \see marshal_compact_values, unmarshal_compact_value
+ */
+int
+marshal_compact_value(MBuffer* mbuf, OmlStringDict* dict, OmlValueT val_type, OmlValueU* val)
+{
+  int result = 0, id;
+  size_t i, n;
+
+  switch (val_type) {
+  case OML_LONG_VALUE:
+    result = marshal_varint(mbuf, ZIGZAG(oml_value_clamp_long(omlc_get_long(*val))));
+    break;
+  case OML_INT32_VALUE:
+    result = marshal_varint(mbuf, ZIGZAG(omlc_get_int32(*val)));
+    break;
+  case OML_INT64_VALUE:
+    result = marshal_varint(mbuf, ZIGZAG(omlc_get_int64(*val)));
+    break;
+  case OML_UINT32_VALUE:
+    result = marshal_varint(mbuf, omlc_get_uint32(*val));
+    break;
+  case OML_UINT64_VALUE:
+    result = marshal_varint(mbuf, omlc_get_uint64(*val));
+    break;
+  case OML_DOUBLE_VALUE:
+    result = marshal_double64(mbuf, omlc_get_double(*val));
+    break;
+
+  case OML_GUID_VALUE: {
+    uint64_t nv64 = htonll(omlc_get_guid(*val));
+    result = mbuf_write(mbuf, (uint8_t*)&nv64, sizeof(nv64));
+    break;
+  }
+
+  case OML_BOOL_VALUE: {
+    uint8_t b = omlc_get_bool(*val) ? 1 : 0;
+    result = mbuf_write(mbuf, &b, 1);
+    break;
+  }
+
+  case OML_STRING_VALUE: {
+    char* str = omlc_get_string_ptr(*val);
+    if (str == NULL) {
+      str = "";
+    }
+    n = strlen(str);
+    if (n > STRING_T_MAX_SIZE) {
+      logerror("Truncated string '%s'\n", str);
+      n = STRING_T_MAX_SIZE;
+    }
+    if (!dict) {
+      result = marshal_varint(mbuf, n);
+    } else if ((id = strdict_find(dict, str, n)) >= 0) {
+      result = marshal_varint(mbuf, (uint64_t)id << 1 | 1);
+      break;
+    } else if (strdict_add(dict, str, n, NULL) == -2) {
+      result = -1;
+    } else {
+      result = marshal_varint(mbuf, (uint64_t)n << 1);
+    }
+    if (-1 != result) {
+      result = mbuf_write(mbuf, (uint8_t*)str, n);
+    }
+    break;
+  }
+
+  case OML_BLOB_VALUE: {
+    void *blob = omlc_get_blob_ptr(*val);
+    n = blob ? omlc_get_blob_length(*val) : 0;
+    if (-1 != (result = marshal_varint(mbuf, n)) && n > 0) {
+      result = mbuf_write(mbuf, blob, n);
+    }
+    break;
+  }
+
+  case OML_VECTOR_DOUBLE_VALUE:
+  case OML_VECTOR_INT32_VALUE:
+  case OML_VECTOR_UINT32_VALUE:
+  case OML_VECTOR_INT64_VALUE:
+  case OML_VECTOR_UINT64_VALUE:
+  case OML_VECTOR_BOOL_VALUE: {
+    void *v = omlc_get_vector_ptr(*val);
+    n = omlc_get_vector_nof_elts(*val);
+    result = marshal_varint(mbuf, n);
+    for (i = 0; i < n && -1 != result; i++) {
+      switch (val_type) {
+      case OML_VECTOR_DOUBLE_VALUE: result = marshal_double64(mbuf, ((double*)v)[i]); break;
+      case OML_VECTOR_INT32_VALUE:  result = marshal_varint(mbuf, ZIGZAG(((int32_t*)v)[i])); break;
+      case OML_VECTOR_UINT32_VALUE: result = marshal_varint(mbuf, ((uint32_t*)v)[i]); break;
+      case OML_VECTOR_INT64_VALUE:  result = marshal_varint(mbuf, ZIGZAG(((int64_t*)v)[i])); break;
+      case OML_VECTOR_UINT64_VALUE: result = marshal_varint(mbuf, ((uint64_t*)v)[i]); break;
+      default: {
+        uint8_t b = ((bool*)v)[i] ? 1 : 0;
+        result = mbuf_write(mbuf, &b, 1);
+        break;
+      }
+      }
+    }
+    break;
+  }
+
+  default:
+    logerror("%s(): Unsupported value type '%d'\n", __func__, val_type);
+    mbuf_reset_write(mbuf);
+    return 0;
+  }
+
+  if (result == -1) {
+    logerror("Failed to marshal compact %s (mbuf_write())\n", oml_type_to_s(val_type));
+    mbuf_reset_write(mbuf);
+    return 0;
+  }
+  return 1;
+}
+
+/** Marshal the array of values into a compact message in an MBuffer.
+ *
+ * \param mbuf MBuffer to write marshalled data to
+ * \param dict OmlStringDict of the stream, as in the OmlCompactState given to marshal_compact_init()
+ * \param values array of OmlValue of length value_count, in schema order
+ * \param value_count length the values array
+ * \return 1 on success, or -1 otherwise (marshalling should then restart from marshal_compact_init())
+ * \see marshal_compact_init, marshal_compact_value, marshal_compact_finalize
+ */
+int
+marshal_compact_values(MBuffer* mbuf, OmlStringDict* dict, OmlValue* values, int value_count)
+{
+  int i;
+
+  for (i = 0; i < value_count; i++) {
+    if (!marshal_compact_value(mbuf, dict, oml_value_get_type(&values[i]), oml_value_get_value(&values[i]))) {
+      return -1;
+    }
+  }
+  return 1;
+}
+
+/** Finalise a compact marshalled message.
+ *
+ * The length is written in the header, after moving the rest of the message
+ * if it does not fit in one byte.
+ *
+ * \param mbuf MBuffer where marshalled data is
+ * \return 1 on success, 0 otherwise
+ * \see marshal_compact_init, marshal_compact_values
+ */
+int
+marshal_compact_finalize(MBuffer* mbuf)
+{
+  uint8_t lenbuf[VARINT_MAX_SIZE], pad[VARINT_MAX_SIZE] = { 0 };
+  size_t len = mbuf_message_length (mbuf) - COMPACT_HEADER_SIZE;
+  size_t n = varint_encode(lenbuf, len);
+  uint8_t* buf;
+
+  if (n > 1) {
+    if (mbuf_write (mbuf, pad, n - 1) == -1) {
+      logerror("Failed to extend compact packet for its length (mbuf_write())\n");
+      mbuf_reset_write (mbuf);
+      return 0;
+    }
+    buf = mbuf_message (mbuf);
+    memmove (&buf[COMPACT_HEADER_SIZE + n - 1], &buf[COMPACT_HEADER_SIZE], len);
+  }
+  buf = mbuf_message (mbuf);
+  memcpy (&buf[COMPACT_HEADER_SIZE - 1], lenbuf, n);
+
+  return 1;
+}
+
+/** Marshal several rows of a stream into a batch message.
+ *
+ * The whole message is written, \ref omspbatch. The timestamps are rounded to
+ * the microsecond. A batch message starts a new dictionary of strings, if
+ * dict is not NULL.
+ *
+ * On failure, the whole message writing is reset using mbuf_reset_write().
+ *
+ * \param mbuf MBuffer to serialize into
+ * \param dict OmlStringDict of the stream, or NULL \ref omspstrdict
+ * \param stream Measurement Stream's index
+ * \param rows number of rows, at least 1
+ * \param seqnos array of the sequence numbers of the rows
+ * \param timestamps array of the times of the rows
+ * \param values array of rows * value_count OmlValue, row by row
+ * \param value_count number of values in each row
+ * \return 1 if successful, -1 otherwise
+ * \see unmarshal_batch
+ */
+int
+marshal_batch(MBuffer* mbuf, OmlStringDict* dict, int stream, int rows, const int32_t* seqnos,
+    const double* timestamps, OmlValue* values, int value_count)
+{
+  uint8_t buf[] = { SYNC_BYTE, SYNC_BYTE, OMB_BATCH_P, 0, (uint8_t)stream };
+  int64_t ts, prev_ts;
+  int32_t prev_seqno;
+  int i, j, result;
+
+  if (mbuf == NULL || rows < 1) return -1;
+
+  if (mbuf_begin_write (mbuf) == -1) {
+    logerror("Couldn't start marshalling packet (mbuf_begin_write())\n");
+    return -1;
+  }
+
+  logdebug2("Marshalling batch of %d samples from %d for stream %d\n", rows, seqnos[0], stream);
+  prev_seqno = seqnos[0];
+  prev_ts = llround(timestamps[0] * 1e6);
+  result = mbuf_write (mbuf, buf, LENGTH (buf));
+  if (-1 != result &&
+      -1 != (result = marshal_varint (mbuf, rows)) &&
+      -1 != (result = marshal_varint (mbuf, ZIGZAG(prev_seqno)))) {
+    result = marshal_varint (mbuf, ZIGZAG(prev_ts));
+  }
+  for (i = 1; i < rows && -1 != result; i++) {
+    result = marshal_varint (mbuf, ZIGZAG((int64_t)seqnos[i] - prev_seqno));
+    prev_seqno = seqnos[i];
+  }
+  for (i = 1; i < rows && -1 != result; i++) {
+    ts = llround(timestamps[i] * 1e6);
+    result = marshal_varint (mbuf, ZIGZAG(ts - prev_ts));
+    prev_ts = ts;
+  }
+  if (-1 == result) {
+    logerror("Unable to marshal batch packet header (mbuf_write())\n");
+    mbuf_reset_write (mbuf);
+    return -1;
+  }
+
+  strdict_clear (dict);
+  for (j = 0; j < value_count; j++) {
+    for (i = 0; i < rows; i++) {
+      OmlValue* v = &values[i * value_count + j];
+      if (!marshal_compact_value(mbuf, dict, oml_value_get_type(v), oml_value_get_value(v))) {
+        return -1;
+      }
+    }
+  }
+
+  return marshal_compact_finalize (mbuf) ? 1 : -1;
+}
+
+/** Read the rest of the header of a compact or batch message.
+ *
+ * The sequence number and timestamp are stored as read, and might only be
+ * deltas; unmarshal_compact_resolve() should be called once the stream is
+ * known. For batch messages, they are those of the first row, and the
+ * number of rows is stored in header->rows. Unlike other messages,
+ * header->length is then the length of the rest of the message, and
+ * header->values is 0, as their number comes from the schema.
+ *
+ * \param mbuf MBuffer to read from, just after the message type
+ * \param header pointer to an OmlBinaryHeader to fill
+ * \return 1 on success, the size of the missing section as a negative number
+ *         if the buffer is too short, or 0 if something failed
+ * \see unmarshal_init
+ */
+static int
+unmarshal_compact_init(MBuffer* mbuf, OmlBinaryHeader* header)
+{
+  uint64_t len, rows, seqno, ts;
+  size_t start;
+  int stream, result;
+
+  if ((result = unmarshal_varint (mbuf, &len)) < 0) {
+    mbuf_reset_read (mbuf);
+    return result == -1 ? -1 : 0;
+  }
+
+  if (len > (uint64_t)mbuf_rd_remaining (mbuf)) {
+    result = (int)(mbuf_rd_remaining (mbuf) - len);
+    mbuf_reset_read (mbuf);
+    return result;
+  }
+
+  start = mbuf_rd_remaining (mbuf);
+  rows = 1;
+  if (-1 == (stream = mbuf_read_byte (mbuf)) ||
+      (OMB_BATCH_P == header->type && unmarshal_varint (mbuf, &rows)) ||
+      unmarshal_varint (mbuf, &seqno) ||
+      unmarshal_varint (mbuf, &ts) ||
+      start - mbuf_rd_remaining (mbuf) > len ||
+      rows < 1 || rows > len) {
+    logwarn("Invalid %s message header\n", OMB_BATCH_P == header->type ? "batch" : "compact");
+    return 0;
+  }
+
+  header->length = len - (start - mbuf_rd_remaining (mbuf));
+  header->values = 0;
+  header->stream = stream;
+  header->rows = (int)rows;
+  if (OMB_BATCH_P == header->type) {
+    /* The first row of a batch is always absolute */
+    header->absolute = 1;
+    header->seqno = (int)UNZIGZAG(seqno);
+  } else {
+    header->absolute = seqno & 1;
+    header->seqno = (int)UNZIGZAG(seqno >> 1);
+  }
+  header->utimestamp = UNZIGZAG(ts);
+  header->timestamp = header->utimestamp / 1e6;
+
+  return 1;
+}
+
+/** Resolve the sequence number and timestamp of a compact message.
+ *
+ * If the message is absolute, the OmlCompactState of its stream is reset from
+ * it. Otherwise, its sequence number and timestamp are deltas, which are added
+ * to the state, provided it is valid.
+ *
+ * An absolute compact message also clears the dictionary of strings of the
+ * state, if any, before its values are read with unmarshal_measurements().
+ *
+ * Batch messages are absolute; once read by unmarshal_batch(), the header
+ * describes their last row, from which the state is reset. Their dictionary
+ * was already cleared by unmarshal_batch().
+ *
+ * Nothing is done for other types of messages.
+ *
+ * \param header OmlBinaryHeader read by unmarshal_init(), updated with the absolute values
+ * \param state OmlCompactState of the stream of the message
+ * \return 1 on success, 0 if the previous message of the stream is unknown, and this one should be discarded
+ * \see unmarshal_init, marshal_compact_init
+ */
+int
+unmarshal_compact_resolve(OmlBinaryHeader* header, OmlCompactState* state)
+{
+  if (header->type != OMB_CDATA_P && header->type != OMB_BATCH_P) {
+    return 1;
   }
 
+  if (header->absolute) {
+    if (header->type == OMB_CDATA_P) {
+      strdict_clear(state->dict);
+    }
+    state->valid = 1;
+    state->seqno = header->seqno;
+    state->timestamp = header->utimestamp;
+  } else if (!state->valid) {
+    return 0;
+  } else {
+    state->seqno += header->seqno;
+    state->timestamp += header->utimestamp;
+  }
+
+  header->seqno = state->seqno;
+  header->timestamp = state->timestamp / 1e6;
   return 1;
 }
 
@@ -936,6 +1587,7 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
   }
 
   header->type = (OmlBinMsgType)header_str[2];
+  header->dict = NULL;
 
   if (header->type == OMB_DATA_P) {
     // Read 2 more bytes of the length field
@@ -957,6 +1609,8 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
       return n;
     }
     header->length = (int)ntohl (nv32);
+  } else if (header->type == OMB_CDATA_P || header->type == OMB_BATCH_P) {
+    return unmarshal_compact_init (mbuf, header);
   } else {
     logwarn ("Unknown packet type %d\n", (int)header->type);
     return 0;
@@ -993,12 +1647,47 @@ unmarshal_init(MBuffer* mbuf, OmlBinaryHeader* header)
   return 1;
 }
 
-/** \see unmarshal_values
+/** Unmarshal the values of a message, whichever its type.
+ *
+ * Compact messages do not carry the types of their values, so the first
+ * max_value_count elements of values should already have the types of the
+ * schema of the stream, and all of them are read. Their strings are looked up
+ * in header->dict, which should be set after unmarshal_compact_resolve().
+ *
+ * \param mbuf MBuffer to read from
+ * \param header pointer to an OmlBinaryHeader corresponding to this message
+ * \param values array of OmlValue to be filled
+ * \param max_value_count length of the array
+ * \return the number of values found, or as unmarshal_values
+ * \see unmarshal_values, unmarshal_compact_value
  */
-inline int
+int
 unmarshal_measurements( MBuffer* mbuf, OmlBinaryHeader* header, OmlValue* values, int max_value_count)
 {
-  return unmarshal_values(mbuf, header, values, max_value_count);
+  size_t start;
+  int i;
+
+  if (header->type == OMB_BATCH_P) {
+    logwarn("Batch messages should be read with unmarshal_batch()\n");
+    return -101;
+  } else if (header->type != OMB_CDATA_P) {
+    return unmarshal_values(mbuf, header, values, max_value_count);
+  }
+
+  start = mbuf_rd_remaining (mbuf);
+  strdict_begin (header->dict);
+  for (i = 0; i < max_value_count; i++) {
+    if (unmarshal_compact_value(mbuf, header->dict, &values[i]) == 0) {
+      logwarn("Could not unmarshal compact value %d of %d\n", i, max_value_count);
+      return -101;
+    }
+  }
+  if (start - mbuf_rd_remaining (mbuf) != header->length) {
+    logwarn("Compact message values took %d bytes instead of %d\n",
+        (int)(start - mbuf_rd_remaining (mbuf)), (int)header->length);
+    return -101;
+  }
+  return max_value_count;
 }
 
 /** Unmarshals the content of buffer into an array of values of size
@@ -1146,6 +1835,20 @@ unmarshal_value(MBuffer *mbuf, OmlValue *value)
     logdebug3("Unmarshalled double %f\n", omlc_get_double(*oml_value_get_value(value)));
     break;
   }
+  case DOUBLE64_T: {
+    uint64_t nv64;
+    double v;
+    if (mbuf_read(mbuf, (uint8_t*)&nv64, DOUBLE64_T_SIZE) == -1) {
+      logerror("Failed to unmarshal OML_DOUBLE_VALUE; not enough data?\n");
+      return 0;
+    }
+    nv64 = ntohll(nv64);
+    memcpy(&v, &nv64, sizeof(v));
+    oml_value_set_type(value, OML_DOUBLE_VALUE);
+    omlc_set_double(*oml_value_get_value(value), v);
+    logdebug3("Unmarshalled double64 %f\n", v);
+    break;
+  }
   case DOUBLE_NAN: {
     OmlValueT oml_type = protocol_type_map[type];
     mbuf_read_skip(mbuf, DOUBLE_T_SIZE); /* The data is irrelevant */
@@ -1156,15 +1859,20 @@ unmarshal_value(MBuffer *mbuf, OmlValue *value)
   }
   case STRING_T: {
     int len = 0;
-    uint8_t buf [STRING_T_MAX_SIZE];
+    uint8_t buf [STRING_T_MAX_SIZE + 1]; /* omlc_set_string_copy() also reads the terminator */
 
     len = mbuf_read_byte (mbuf);
 
+    if (len > STRING_T_MAX_SIZE) {
+      logerror("Failed to unmarshal OML_STRING_VALUE; length %d is over %d\n", len, STRING_T_MAX_SIZE);
+      return 0;
+    }
     if (len == -1 || mbuf_read (mbuf, buf, len) == -1)
     {
       logerror("Failed to unmarshal OML_STRING_VALUE; not enough data?\n");
       return 0;
     }
+    buf[len] = '\0';
 
     oml_value_set_type(value, OML_STRING_VALUE);
     omlc_set_string_copy(*oml_value_get_value(value), buf, len);
@@ -1305,6 +2013,244 @@ unmarshal_value(MBuffer *mbuf, OmlValue *value)
   return 1;
 }
 
+/** Unmarshals the next content of a compact message into an OmlValue.
+ *
+ * Strings found in, or added to, dict are not copied: the value points to the
+ * copy in the dictionary, as a constant string, which remains valid until the
+ * next message is unmarshalled.
+ *
+ * \param mbuf MBuffer to read from
+ * \param dict OmlStringDict of the stream, or NULL \ref omspstrdict
+ * \param value pointer to OmlValue to unmarshall the read data into, of the type of the field in the schema
+ * \return 1 if successful, 0 otherwise
+ * \see marshal_compact_value
+ */
+int
+unmarshal_compact_value(MBuffer *mbuf, OmlStringDict *dict, OmlValue *value)
+{
+  OmlValueT type = oml_value_get_type(value);
+  OmlValueU *v = oml_value_get_value(value);
+  const char *str;
+  uint64_t u;
+  size_t i, n, size;
+  double d;
+  void *elts;
+
+  switch (type) {
+  case OML_LONG_VALUE:
+  case OML_INT32_VALUE:
+  case OML_INT64_VALUE:
+  case OML_UINT32_VALUE:
+  case OML_UINT64_VALUE:
+    if (unmarshal_varint(mbuf, &u)) {
+      return 0;
+    }
+    switch (type) {
+    case OML_LONG_VALUE:   omlc_set_long(*v, (long)UNZIGZAG(u)); break;
+    case OML_INT32_VALUE:  omlc_set_int32(*v, (int32_t)UNZIGZAG(u)); break;
+    case OML_INT64_VALUE:  omlc_set_int64(*v, UNZIGZAG(u)); break;
+    case OML_UINT32_VALUE: omlc_set_uint32(*v, (uint32_t)u); break;
+    default:               omlc_set_uint64(*v, u); break;
+    }
+    break;
+
+  case OML_DOUBLE_VALUE:
+  case OML_GUID_VALUE:
+    if (mbuf_read(mbuf, (uint8_t*)&u, sizeof(u)) == -1) {
+      return 0;
+    }
+    u = ntohll(u);
+    if (type == OML_GUID_VALUE) {
+      omlc_set_guid(*v, u);
+    } else {
+      memcpy(&d, &u, sizeof(d));
+      omlc_set_double(*v, d);
+    }
+    break;
+
+  case OML_BOOL_VALUE: {
+    int b = mbuf_read_byte(mbuf);
+    if (b == -1) {
+      return 0;
+    }
+    omlc_set_bool(*v, b ? OMLC_BOOL_TRUE : OMLC_BOOL_FALSE);
+    break;
+  }
+
+  case OML_STRING_VALUE:
+  case OML_BLOB_VALUE:
+    if (dict && type == OML_STRING_VALUE) {
+      if (unmarshal_varint(mbuf, &u)) {
+        return 0;
+      } else if (u & 1) {
+        if (u >> 1 > INT_MAX || NULL == (str = strdict_get(dict, (int)(u >> 1), &n))) {
+          logwarn("Unknown string %" PRIu64 " in dictionary\n", u >> 1);
+          return 0;
+        }
+        omlc_set_const_string(*v, str);
+        break;
+      } else if ((u >>= 1) > mbuf_rd_remaining(mbuf)) {
+        return 0;
+      }
+      switch (strdict_add(dict, (char*)mbuf_rdptr(mbuf), u, &str)) {
+      case -2:
+        return 0;
+      case -1:
+        omlc_set_string_copy(*v, mbuf_rdptr(mbuf), u);
+        break;
+      default:
+        omlc_set_const_string(*v, str);
+        break;
+      }
+      mbuf_read_skip(mbuf, u);
+      break;
+    }
+    if (unmarshal_varint(mbuf, &u) || u > mbuf_rd_remaining(mbuf)) {
+      return 0;
+    }
+    if (type == OML_STRING_VALUE) {
+      omlc_set_string_copy(*v, mbuf_rdptr(mbuf), u);
+    } else {
+      omlc_set_blob(*v, mbuf_rdptr(mbuf), u);
+    }
+    mbuf_read_skip(mbuf, u);
+    break;
+
+  case OML_VECTOR_DOUBLE_VALUE:
+  case OML_VECTOR_INT32_VALUE:
+  case OML_VECTOR_UINT32_VALUE:
+  case OML_VECTOR_INT64_VALUE:
+  case OML_VECTOR_UINT64_VALUE:
+  case OML_VECTOR_BOOL_VALUE:
+    /* Each element takes at least one byte */
+    if (unmarshal_varint(mbuf, &u) || u > mbuf_rd_remaining(mbuf) || u > UINT16_MAX) {
+      return 0;
+    }
+    n = u;
+    switch (type) {
+    case OML_VECTOR_INT32_VALUE:
+    case OML_VECTOR_UINT32_VALUE: size = sizeof(uint32_t); break;
+    case OML_VECTOR_BOOL_VALUE:   size = sizeof(bool); break;
+    default:                      size = sizeof(uint64_t); break;
+    }
+    if (NULL == (elts = oml_calloc(n ? n : 1, size))) {
+      return 0;
+    }
+    for (i = 0; i < n; i++) {
+      if (type == OML_VECTOR_DOUBLE_VALUE) {
+        if (mbuf_read(mbuf, (uint8_t*)&u, sizeof(u)) == -1) {
+          break;
+        }
+        u = ntohll(u);
+        memcpy(&((double*)elts)[i], &u, sizeof(double));
+      } else if (type == OML_VECTOR_BOOL_VALUE) {
+        int b = mbuf_read_byte(mbuf);
+        if (b == -1) {
+          break;
+        }
+        ((bool*)elts)[i] = b ? true : false;
+      } else if (unmarshal_varint(mbuf, &u)) {
+        break;
+      } else {
+        switch (type) {
+        case OML_VECTOR_INT32_VALUE:  ((int32_t*)elts)[i] = (int32_t)UNZIGZAG(u); break;
+        case OML_VECTOR_UINT32_VALUE: ((uint32_t*)elts)[i] = (uint32_t)u; break;
+        case OML_VECTOR_INT64_VALUE:  ((int64_t*)elts)[i] = UNZIGZAG(u); break;
+        default:                      ((uint64_t*)elts)[i] = u; break;
+        }
+      }
+    }
+    if (i < n) {
+      oml_free(elts);
+      return 0;
+    }
+    /* Release the vector from a previous message */
+    oml_value_reset(value);
+    oml_value_set_type(value, type);
+    omlc_set_vector_ptr(*v, elts);
+    omlc_set_vector_length(*v, n * size);
+    omlc_set_vector_size(*v, n * size);
+    omlc_set_vector_nof_elts(*v, n);
+    omlc_set_vector_elt_size(*v, size);
+    break;
+
+  default:
+    logerror("%s: Unsupported value type '%d'\n", __FUNCTION__, type);
+    return 0;
+  }
+
+  logdebug3("Unmarshalled compact %s\n", oml_type_to_s(type));
+  return 1;
+}
+
+/** Unmarshal the rows of a batch message.
+ *
+ * As for compact messages, values should already have the types of the
+ * schema of the stream, for each of the header->rows rows. Once all rows are
+ * read, header->seqno and header->timestamp are those of the last one.
+ *
+ * If header->dict is set, it is cleared before strings are looked up in it.
+ *
+ * \param mbuf MBuffer to read from, just after the header read by unmarshal_init()
+ * \param header OmlBinaryHeader of the message
+ * \param seqnos array of header->rows elements, filled with the sequence numbers of the rows
+ * \param timestamps array of header->rows elements, filled with the times of the rows
+ * \param values array of header->rows * value_count OmlValue, filled row by row
+ * \param value_count number of values in each row
+ * \return the number of rows read, or -1 if the message is invalid
+ * \see marshal_batch, unmarshal_compact_resolve
+ */
+int
+unmarshal_batch(MBuffer* mbuf, OmlBinaryHeader* header, int32_t* seqnos, double* timestamps,
+    OmlValue* values, int value_count)
+{
+  size_t start = mbuf_rd_remaining (mbuf);
+  int64_t ts = header->utimestamp;
+  int32_t seqno = header->seqno;
+  uint64_t u;
+  int i, j;
+
+  if (header->type != OMB_BATCH_P) {
+    return -1;
+  }
+
+  seqnos[0] = seqno;
+  for (i = 1; i < header->rows; i++) {
+    if (unmarshal_varint (mbuf, &u)) {
+      return -1;
+    }
+    seqnos[i] = seqno += (int32_t)UNZIGZAG(u);
+  }
+  timestamps[0] = ts / 1e6;
+  for (i = 1; i < header->rows; i++) {
+    if (unmarshal_varint (mbuf, &u)) {
+      return -1;
+    }
+    ts += UNZIGZAG(u);
+    timestamps[i] = ts / 1e6;
+  }
+
+  strdict_clear (header->dict);
+  for (j = 0; j < value_count; j++) {
+    for (i = 0; i < header->rows; i++) {
+      if (!unmarshal_compact_value (mbuf, header->dict, &values[i * value_count + j])) {
+        logwarn("Could not unmarshal value %d of row %d of batch\n", j, i);
+        return -1;
+      }
+    }
+  }
+  if (start - mbuf_rd_remaining (mbuf) != header->length) {
+    logwarn("Batch message took %d bytes instead of %d\n",
+        (int)(start - mbuf_rd_remaining (mbuf)), (int)header->length);
+    return -1;
+  }
+
+  header->seqno = seqno;
+  header->utimestamp = ts;
+  header->timestamp = ts / 1e6;
+  return header->rows;
+}
+
 /** Unmarshals the next content of an MBuffer into an OmlValue with
  * type-checking.
  *
@@ -27,6 +27,16 @@
 
 #include "oml2/omlc.h"
 #include "mbuf.h"
+#include "strdict.h"
+
+/** First version of the protocol in which doubles are marshalled as IEEE 754 binary64 */
+#define OMSP_DOUBLE64_VERSION 6
+/** First version of the protocol in which measurements are sent as compact messages */
+#define OMSP_COMPACT_VERSION 7
+/** First version of the protocol in which several measurements of a stream can be sent in one message */
+#define OMSP_BATCH_VERSION 8
+/** First version of the protocol in which strings of compact and batch messages can refer to a dictionary */
+#define OMSP_STRDICT_VERSION 9
 
 /** Represent whether a marshalled packet is short or long */
 typedef enum {
@@ -34,6 +44,10 @@ typedef enum {
   OMB_DATA_P = 0x1,
   /** Long packet of size \ref PACKET_HEADER_SIZE + \ref STREAM_HEADER_SIZE bytes */
   OMB_LDATA_P = 0x2,
+  /** Compact packet, without types, and with delta-encoded metadata \ref omspcompact */
+  OMB_CDATA_P = 0x3,
+  /** Batch packet, with the values of several rows of a stream by column \ref omspbatch */
+  OMB_BATCH_P = 0x4,
 } OmlBinMsgType;
 
 
@@ -44,8 +58,29 @@ typedef struct {
     int stream;
     int seqno;
     double timestamp;
+    /** For OMB_CDATA_P, whether seqno and timestamp are absolute rather than deltas */
+    int absolute;
+    /** For OMB_CDATA_P, timestamp (or delta) as read [us] */
+    int64_t utimestamp;
+    /** For OMB_BATCH_P, number of rows in the message */
+    int rows;
+    /** For OMB_CDATA_P and OMB_BATCH_P, dictionary of strings of the stream, set by the caller, or NULL \ref omspstrdict */
+    OmlStringDict* dict;
 } OmlBinaryHeader;
 
+/** Sequence number and timestamp of the previous compact message of a stream */
+typedef struct {
+    /** Set once the fields describe a message; the next one is absolute otherwise */
+    int valid;
+    /** Sequence number of the previous message */
+    int32_t seqno;
+    /** Timestamp of the previous message [us] */
+    int64_t timestamp;
+    /** Dictionary of the strings of the stream, or NULL not to use one \ref omspstrdict */
+    OmlStringDict* dict;
+} OmlCompactState;
+
+int marshal_set_protocol_version(int version);
 int marshal_measurements(MBuffer* mbuf, int stream, int seqno, double now);
 int marshal_init(MBuffer* mbuf, OmlBinMsgType msgtype);
 int marshal_values(MBuffer* mbuffer, OmlValue* values, int value_count);
@@ -53,6 +88,13 @@ int marshal_value(MBuffer* mbuf, OmlValueT val_type,  OmlValueU* val);
 int marshal_finalize(MBuffer*  mbuf);
 OmlBinMsgType marshal_get_msgtype (MBuffer *mbuf);
 
+int marshal_compact_init(MBuffer* mbuf, OmlCompactState* state, int stream, int seqno, double now);
+int marshal_compact_values(MBuffer* mbuf, OmlStringDict* dict, OmlValue* values, int value_count);
+int marshal_compact_value(MBuffer* mbuf, OmlStringDict* dict, OmlValueT val_type, OmlValueU* val);
+int marshal_compact_finalize(MBuffer* mbuf);
+int marshal_batch(MBuffer* mbuf, OmlStringDict* dict, int stream, int rows, const int32_t* seqnos,
+                  const double* timestamps, OmlValue* values, int value_count);
+
 
 int unmarshal_init(MBuffer*  mbuf, OmlBinaryHeader* header);
 int unmarshal_measurements(MBuffer* mbuf, OmlBinaryHeader* header,
@@ -61,6 +103,10 @@ int unmarshal_values(MBuffer*  mbuffer, OmlBinaryHeader* header,
                       OmlValue* values, int max_value_count);
 int unmarshal_value(MBuffer* mbuffer, OmlValue* value);
 int unmarshal_typed_value (MBuffer* mbuf, const char* name, OmlValueT type, OmlValue* value);
+int unmarshal_compact_resolve(OmlBinaryHeader* header, OmlCompactState* state);
+int unmarshal_compact_value(MBuffer* mbuf, OmlStringDict* dict, OmlValue* value);
+int unmarshal_batch(MBuffer* mbuf, OmlBinaryHeader* header, int32_t* seqnos, double* timestamps,
+                    OmlValue* values, int value_count);
 
 uint8_t* find_sync (const uint8_t* buf, int len);
 
@@ -184,16 +184,14 @@ mbuf_rd_remaining (MBuffer* mbuf)
 }
 
 /** Get the remaining amount of data to write in MBuffer
- *
- * XXX: Shall we use wr_remaining directly?
  *
  * \param mbuf MBuffer to manipulate
- * \return the number of unread bytes in the buffer
+ * \return the number of unfilled bytes at the end of the buffer
  */
 size_t
 mbuf_wr_remaining (MBuffer* mbuf)
 {
-  return mbuf->wrptr - mbuf->rdptr;
+  return mbuf->wr_remaining;
 }
 
 
@@ -438,6 +436,38 @@ mbuf_write (MBuffer* mbuf, const uint8_t* buf, size_t len)
   return 0;
 }
 
+/** Account for data written directly at the write pointer of an MBuffer.
+ *
+ * This allows to fill the MBuffer without an intermediate copy, e.g., by
+ * read(2)ing into the space between mbuf_wrptr and the end of the buffer
+ * (mbuf_wr_remaining bytes, which mbuf_check_resize can extend beforehand).
+ * The write pointer is then advanced by len bytes.
+ *
+ * \param mbuf MBuffer into which data was written
+ * \param len number of bytes written at the write pointer
+ * \return 0 on success, -1 on failure (e.g., len larger than mbuf_wr_remaining)
+ * \see mbuf_wrptr, mbuf_wr_remaining, mbuf_check_resize, mbuf_write
+ */
+int
+mbuf_write_advance (MBuffer* mbuf, size_t len)
+{
+  if (mbuf == NULL) return -1;
+
+  mbuf_check_invariant (mbuf);
+
+  if (len > mbuf->wr_remaining)
+    return -1;
+
+  mbuf->wrptr += len;
+  mbuf->fill += len;
+  mbuf->wr_remaining -= len;
+  mbuf->rd_remaining += len;
+
+  mbuf_check_invariant (mbuf);
+
+  return 0;
+}
+
 /**  Append the printed string described by format to the MBuffer.
  *
  * Write the string described by a format string and arguments to the MBuffer,
@@ -470,8 +500,9 @@ mbuf_print(MBuffer* mbuf, const char* format, ...)
     va_start(arglist, format);
     len = vsnprintf((char*)mbuf->wrptr, mbuf->wr_remaining, format, arglist);
     va_end(arglist);
-    if (! (success = (len <= (int)mbuf->wr_remaining))) {
-      if (mbuf_check_resize(mbuf, len) == -1)
+    /* vsnprintf(3) also needs room for the terminating '\0' */
+    if (! (success = (len < (int)mbuf->wr_remaining))) {
+      if (mbuf_check_resize(mbuf, len + 1) == -1)
     return -1;
     }
   } while (! success);
@@ -21,7 +21,9 @@
 
 enum MessageType {
   MSG_BINARY,
-  MSG_TEXT
+  MSG_TEXT,
+  MSG_COMPACT, // Compact binary message; seqno and timestamp may be deltas
+  MSG_COLUMNAR // Columnar batch binary message; seqno and timestamp are those of the first row
 };
 
 struct oml_message {
@@ -188,6 +188,72 @@ oml_value_set(OmlValue *to, const OmlValueU *value, OmlValueT type)
   return 0;
 }
 
+/** Make an OmlValue refer to the content of an OmlValueU, without copying it.
+ *
+ * Simple types are copied as with oml_value_set. For strings, blobs and
+ * vectors, however, to is made to point to the storage of value, and marked
+ * as not owning it (its size is 0), so oml_value_reset will not free it. Any
+ * storage previously owned by to is released first.
+ *
+ * The borrowed content is only valid as long as that of value is. It is the
+ * responsibility of the caller not to use to past that point, or to
+ * oml_value_set a private copy of it beforehand.
+ *
+ * \param to pointer to OmlValue which should refer to value
+ * \param value pointer to original OmlValueU
+ * \param type OmlValueT of value
+ * \return 0 if successful, -1 otherwise
+ * \see oml_value_set, oml_value_reset
+ */
+int
+oml_value_borrow(OmlValue *to, const OmlValueU *value, OmlValueT type)
+{
+  switch (type) {
+  case OML_STRING_VALUE:
+    if (!omlc_get_string_ptr(*value)) {
+      logwarn("Trying to borrow OML_STRING_VALUE from a NULL source\n");
+      return -1;
+    }
+    oml_value_reset(to);
+    to->type = type;
+    to->value = *value;
+    omlc_set_string_size(to->value, 0);
+    omlc_set_string_is_const(to->value, 1);
+    break;
+
+  case OML_BLOB_VALUE:
+    if (!omlc_get_blob_ptr(*value)) {
+      logwarn("Trying to borrow OML_BLOB_VALUE from a NULL source\n");
+      return -1;
+    }
+    oml_value_reset(to);
+    to->type = type;
+    to->value = *value;
+    omlc_set_blob_size(to->value, 0);
+    break;
+
+  case OML_VECTOR_DOUBLE_VALUE:
+  case OML_VECTOR_INT32_VALUE:
+  case OML_VECTOR_UINT32_VALUE:
+  case OML_VECTOR_INT64_VALUE:
+  case OML_VECTOR_UINT64_VALUE:
+  case OML_VECTOR_BOOL_VALUE:
+    if (!omlc_get_vector_ptr(*value)) {
+      logwarn("Trying to borrow OML_VECTOR_*_VALUE from a NULL source\n");
+      return -1;
+    }
+    oml_value_reset(to);
+    to->type = type;
+    to->value = *value;
+    omlc_set_vector_size(to->value, 0);
+    break;
+
+  default:
+    return oml_value_set(to, value, type);
+  }
+  return 0;
+}
+
 /** DEPRECATED \see oml_value_set */
 int
 oml_value_copy(OmlValueU *value, OmlValueT type, OmlValue *to)
@@ -61,6 +61,7 @@ static inline int32_t oml_value_clamp_long (long value)
   ((OmlValueT)(v)->type)
 
 int oml_value_set(OmlValue* to, const OmlValueU* value, OmlValueT type);
+int oml_value_borrow(OmlValue* to, const OmlValueU* value, OmlValueT type);
 int oml_value_copy(OmlValueU* value, OmlValueT type, OmlValue* to) __attribute__ ((deprecated));
 
 void oml_value_init(OmlValue* v);
@@ -0,0 +1,254 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file strdict.c
+ * \brief Bounded dictionaries of the strings recently sent in a stream.
+ *
+ * The sender and the receiver of a stream each keep a dictionary, and update
+ * it in the same way for every string they marshal or unmarshal, so an entry
+ * has the same ID on both ends. The sender can then send the ID of a string
+ * it already sent, rather than the string itself, \ref omspstrdict.
+ *
+ * When the dictionary is full, a new string replaces the least recently used
+ * one, unless all the entries have been used since strdict_begin() was last
+ * called. This keeps the strings of the message being unmarshalled valid
+ * until it has been processed completely.
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "mem.h"
+#include "strdict.h"
+
+/** Number of hash buckets to find strings; a power of 2 */
+#define STRDICT_BUCKETS 256
+
+/** A string of an OmlStringDict */
+typedef struct {
+  char *str;          /**< Nul-terminated copy of the string */
+  size_t len;         /**< Length of the string */
+  size_t size;        /**< Allocated size of str */
+  uint32_t hash;      /**< Hash of the string */
+  uint64_t used;      /**< Value of the clock when the entry was last added or used */
+  int next;           /**< Next entry in the same bucket, or -1 */
+} StrDictEntry;
+
+struct OmlStringDict {
+  StrDictEntry entries[STRDICT_SIZE];
+  int count;                      /**< Number of entries in use */
+  int buckets[STRDICT_BUCKETS];   /**< First entry of each bucket, or -1 */
+  uint64_t clock;                 /**< Incremented whenever an entry is added or used */
+  uint64_t mark;                  /**< Value of the clock at the last strdict_begin() */
+};
+
+/** Hash a string (FNV-1a)
+ * \param str string to hash
+ * \param len length of str
+ * \return the hash of the string
+ */
+static uint32_t
+strdict_hash (const char *str, size_t len)
+{
+  uint32_t h = 2166136261U;
+  size_t i;
+
+  for (i = 0; i < len; i++) {
+    h = (h ^ (uint8_t)str[i]) * 16777619U;
+  }
+  return h;
+}
+
+/** Create an empty dictionary.
+ *
+ * \return a new OmlStringDict, or NULL on error
+ * \see strdict_destroy
+ */
+OmlStringDict*
+strdict_new (void)
+{
+  OmlStringDict *dict = oml_malloc (sizeof (OmlStringDict));
+
+  if (dict) {
+    strdict_clear (dict);
+  }
+  return dict;
+}
+
+/** Free a dictionary and its strings.
+ *
+ * \param dict OmlStringDict to free
+ */
+void
+strdict_destroy (OmlStringDict *dict)
+{
+  int i;
+
+  if (!dict) {
+    return;
+  }
+  for (i = 0; i < STRDICT_SIZE; i++) {
+    oml_free (dict->entries[i].str);
+  }
+  oml_free (dict);
+}
+
+/** Remove all the strings of a dictionary.
+ *
+ * The storage of the entries is kept for reuse.
+ *
+ * \param dict OmlStringDict to clear
+ */
+void
+strdict_clear (OmlStringDict *dict)
+{
+  if (!dict) {
+    return;
+  }
+  dict->count = 0;
+  dict->clock = dict->mark = 0;
+  memset (dict->buckets, -1, sizeof (dict->buckets));
+}
+
+/** Mark the start of a new message.
+ *
+ * Entries used from now on are not replaced until the next call.
+ *
+ * \param dict OmlStringDict
+ */
+void
+strdict_begin (OmlStringDict *dict)
+{
+  if (dict) {
+    dict->mark = dict->clock;
+  }
+}
+
+/** Look up a string, and mark it as used if found.
+ *
+ * \param dict OmlStringDict to look into
+ * \param str string to look up
+ * \param len length of str
+ * \return the ID of the string, or -1 if it is not in the dictionary
+ */
+int
+strdict_find (OmlStringDict *dict, const char *str, size_t len)
+{
+  uint32_t hash = strdict_hash (str, len);
+  StrDictEntry *e;
+  int i;
+
+  for (i = dict->buckets[hash & (STRDICT_BUCKETS - 1)]; i >= 0; i = e->next) {
+    e = &dict->entries[i];
+    if (e->hash == hash && e->len == len && !memcmp (e->str, str, len)) {
+      e->used = ++dict->clock;
+      return i;
+    }
+  }
+  return -1;
+}
+
+/** Get the string of an ID, and mark it as used.
+ *
+ * \param dict OmlStringDict to look into
+ * \param id ID of the string
+ * \param[out] len set to the length of the string
+ * \return the nul-terminated string, valid until it is replaced, or NULL if the ID is not in use
+ */
+const char*
+strdict_get (OmlStringDict *dict, int id, size_t *len)
+{
+  if (!dict || id < 0 || id >= dict->count) {
+    return NULL;
+  }
+  dict->entries[id].used = ++dict->clock;
+  *len = dict->entries[id].len;
+  return dict->entries[id].str;
+}
+
+/** Add a string to a dictionary.
+ *
+ * The string is not added if it is empty or longer than STRDICT_MAX_LENGTH,
+ * or if the dictionary is full and all its entries have been used since
+ * strdict_begin(). The caller should have checked that the string was not
+ * already in the dictionary.
+ *
+ * On error, the dictionary is cleared, and the message being marshalled or
+ * unmarshalled should be abandoned.
+ *
+ * \param dict OmlStringDict to add to
+ * \param str string to add
+ * \param len length of str
+ * \param[out] copy if not NULL, set to the nul-terminated copy of the string in the dictionary, valid until it is replaced
+ * \return the ID of the string, -1 if it was not added, or -2 on error
+ * \see strdict_find
+ */
+int
+strdict_add (OmlStringDict *dict, const char *str, size_t len, const char **copy)
+{
+  StrDictEntry *e;
+  int id, i, *link;
+
+  if (len == 0 || len > STRDICT_MAX_LENGTH) {
+    return -1;
+  }
+
+  if (dict->count < STRDICT_SIZE) {
+    id = dict->count;
+  } else {
+    /* Replace the least recently used entry */
+    for (id = 0, i = 1; i < STRDICT_SIZE; i++) {
+      if (dict->entries[i].used < dict->entries[id].used) {
+        id = i;
+      }
+    }
+    if (dict->entries[id].used > dict->mark) {
+      return -1;
+    }
+    for (link = &dict->buckets[dict->entries[id].hash & (STRDICT_BUCKETS - 1)];
+        *link != id; link = &dict->entries[*link].next);
+    *link = dict->entries[id].next;
+  }
+
+  e = &dict->entries[id];
+  if (e->size < len + 1) {
+    oml_free (e->str);
+    e->size = 0;
+    if (!(e->str = oml_malloc (len + 1))) {
+      /* The other end will not know; start afresh on both sides */
+      strdict_clear (dict);
+      return -2;
+    }
+    e->size = len + 1;
+  }
+  memcpy (e->str, str, len);
+  e->str[len] = '\0';
+  e->len = len;
+  e->hash = strdict_hash (str, len);
+  e->used = ++dict->clock;
+  e->next = dict->buckets[e->hash & (STRDICT_BUCKETS - 1)];
+  dict->buckets[e->hash & (STRDICT_BUCKETS - 1)] = id;
+  if (id == dict->count) {
+    dict->count++;
+  }
+  if (copy) {
+    *copy = e->str;
+  }
+
+  return id;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,46 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file strdict.h
+ * \brief Interface of the bounded string dictionaries of compact binary messages.
+ * \see omspstrdict
+ */
+
+#ifndef OML_STRDICT_H_
+#define OML_STRDICT_H_
+
+#include <stddef.h>
+
+/** Number of entries of a dictionary; both ends of a connection must agree */
+#define STRDICT_SIZE 128
+/** Length of the longest string which can be added to a dictionary */
+#define STRDICT_MAX_LENGTH 255
+
+typedef struct OmlStringDict OmlStringDict;
+
+OmlStringDict* strdict_new (void);
+void strdict_destroy (OmlStringDict *dict);
+
+void strdict_clear (OmlStringDict *dict);
+void strdict_begin (OmlStringDict *dict);
+
+int strdict_find (OmlStringDict *dict, const char *str, size_t len);
+const char* strdict_get (OmlStringDict *dict, int id, size_t *len);
+int strdict_add (OmlStringDict *dict, const char *str, size_t len, const char **copy);
+
+#endif // OML_STRDICT_H_
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
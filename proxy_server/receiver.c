@@ -53,6 +53,35 @@ read_line(char** line_p, int* length_p, MBuffer* mbuf)
 }
 
 
+/** Check whether a client compresses the data following its headers.
+ *
+ * \param self the client
+ * \return 1 if the data is compressed, 0 otherwise
+ */
+static int
+is_compressed (Client *self)
+{
+  struct header *encoding = self->header_table[H_ENCODING];
+
+  return encoding != NULL && strcmp (encoding->value, "identity") != 0;
+}
+
+/** Read compressed data as a single message.
+ *
+ * The proxy does not decompress the data, so it cannot find the boundaries of
+ * the messages; it simply forwards all the data it has, as is.
+ *
+ * \param msg the message to fill
+ * \param mbuf the buffer that contains the data to be read
+ * \return the number of bytes available, or 0 if there are none
+ */
+static int
+raw_read_msg_start (struct oml_message *msg, MBuffer *mbuf)
+{
+  memset (msg, 0, sizeof (*msg));
+  msg->length = mbuf_rd_remaining (mbuf);
+  return msg->length;
+}
 
 int
 read_header (Client *self, MBuffer *mbuf)
@@ -72,7 +101,10 @@ read_header (Client *self, MBuffer *mbuf)
   if (len == 0) {
     // Empty line denotes separator between header and body
     int skip_count = mbuf_find_not (mbuf, '\n');
-    if (skip_count == -1) {
+    if (is_compressed (self)) {
+      /* Compressed data might start with newlines */
+      mbuf_read_skip (mbuf, 1);
+    } else if (skip_count == -1) {
       while (mbuf_find (mbuf, '\n') != (size_t)-1)
         mbuf_read_skip (mbuf, 1);
     } else {
@@ -204,6 +236,11 @@ proxy_message_loop (const char *client_id, Client *client, void *buf, size_t siz
       logerror ("Client content is not TEXT or BINARY\n");
       break;
     }
+    if (is_compressed (client)) {
+      logdebug ("Forwarding data compressed with '%s'\n",
+                client->header_table[H_ENCODING]->value);
+      client->msg_start = raw_read_msg_start;
+    }
     mbuf_consume_message (mbuf); // Next message starts after the headers.
     client->state = C_DATA;
     break;
@@ -132,6 +132,10 @@ client_send_headers (Client *client)
     header = header->next;
   }
 
+  if (client->header_table[H_ENCODING] != NULL &&
+      client_send_header (client, client->header_table[H_ENCODING]) == -1)
+    return -1;
+
   if (client_send_header (client, client->header_table[H_CONTENT]) == -1)
     return -1;
 
@@ -33,13 +33,34 @@
 #include "binary.h"
 #include "schema.h"
 #include "client_handler.h"
+#include "workers.h"
+#include "storage.h"
 
 #define DEF_TABLE_COUNT 10
+/** Minimum free space to make available in the MBuffer before reading from a client */
+#define MIN_READ_SPACE 16384
+/** Maximum amount of decompressed data to add to the MBuffer before processing it */
+#define MAX_INFLATE_SIZE (4 * MIN_READ_SPACE)
+/** Interval between checks of the storage queue while a client is throttled [ms] */
+#define RESUME_CHECK_PERIOD 10
 
 /* XXX: This cannot be static anymore if we want to test it... */
 void
 client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size);
 
+static int
+buffer_callback(SockEvtSource* source, void* handle, struct iovec *iov, int iovcnt);
+
+static int
+process_buffer(ClientHandler* self, SockEvtSource* source);
+
+static void
+process_input(ClientHandler* self, SockEvtSource* source);
+
+static int
+client_handler_store(ClientHandler* self, DbTable* table, int32_t* seqnos, double* timestamps,
+    OmlValue* values, int value_count, int rows);
+
 static void
 status_callback(SockEvtSource* source, SocketStatus status, int errcode, void* handle);
 
@@ -88,6 +109,7 @@ client_event_report(ClientHandler *self, const char *event, const char *message)
  *  * self->seq_no_offsets -- the seq_no offet of each table
  *  * self->values_vectors -- values vectors -- one for each table
  *  * self->values_vector_counts -- size of each of the values_vectors
+ *  * self->compact_states -- state of the compact messages of each table
  *
  *  There should be at least ntables of each of these.  For the size of each of
  *  the values_vectors[i], see client_realloc_values().
@@ -116,8 +138,9 @@ client_realloc_tables (ClientHandler *self, int ntables)
     int *new_so = oml_realloc (self->seqno_offsets, ntables*sizeof(int));
     OmlValue **new_vv = oml_realloc (self->values_vectors, ntables*sizeof(OmlValue*));
     int *new_vv_counts = oml_realloc (self->values_vector_counts, ntables * sizeof (int));
+    OmlCompactState *new_cs = oml_realloc (self->compact_states, ntables * sizeof (OmlCompactState));
 
-    if (!new_tables || !new_so || !new_vv || !new_vv_counts) {
+    if (!new_tables || !new_so || !new_vv || !new_vv_counts || !new_cs) {
       logdebug ("%s: Failed to allocate memory for %d more client tables (current %d)\n",
           self->name, (ntables - self->table_count), self->table_count);
       // Don't free anything because whatever got successfully oml_realloc'd is still ok
@@ -133,6 +156,11 @@ client_realloc_tables (ClientHandler *self, int ntables)
     if (new_so) self->seqno_offsets = new_so;
     if (new_vv) self->values_vectors = new_vv;
     if (new_vv_counts) self->values_vector_counts = new_vv_counts;
+    if (new_cs) {
+      self->compact_states = new_cs;
+      /* No compact message has been received yet for the new tables */
+      memset(&self->compact_states[self->table_count], 0, (ntables - self->table_count) * sizeof(OmlCompactState));
+    }
 
     /* If the values vectors succeeded, we need to create the new ones */
     if (new_vv && new_vv_counts) {
@@ -216,6 +244,7 @@ client_handler_new(Socket* new_sock)
   self->socket = new_sock;
   self->event = eventloop_on_read_in_channel(new_sock, client_callback,
       status_callback, (void*)self);
+  eventloop_socket_set_buffer_callback(self->event, buffer_callback);
   strncpy (self->name, self->event->name, MAX_STRING_SIZE);
 
   const char *event = "Connect";
@@ -226,8 +255,191 @@ client_handler_new(Socket* new_sock)
   return self;
 }
 
+/** Continue handling a client in the worker thread owning its domain.
+ *
+ * This is run by the EventLoop of the new thread, which now monitors the
+ * client's socket. The database is opened, and whatever was left in the
+ * buffer is processed.
+ *
+ * \param handle the ClientHandler being handed over
+ * \see client_handler_migrate, eventloop_post
+ */
+static void
+client_handler_adopt(void* handle)
+{
+  ClientHandler* self = (ClientHandler*)handle;
+
+  self->event = eventloop_on_read_in_channel(self->socket, client_callback,
+      status_callback, (void*)self);
+  eventloop_socket_set_buffer_callback(self->event, buffer_callback);
+  logdebug("%s: Now handled by thread for domain '%s'\n",
+      self->name, self->migrating_domain);
+
+  if (!(self->database = database_find(self->migrating_domain))) {
+    self->state = C_PROTOCOL_ERROR;
+  }
+  oml_free(self->migrating_domain);
+  self->migrating_domain = NULL;
+
+  process_input(self, self->event);
+}
+
+/** Hand a client over to the worker thread owning its domain.
+ *
+ * The socket is removed from the current EventLoop, and the ClientHandler must
+ * not be used by the current thread after this function returns.
+ *
+ * \param self ClientHandler to hand over, with migrating_domain set
+ * \return 0 on success, -1 otherwise
+ * \see workers_for_domain, client_handler_adopt
+ */
+static int
+client_handler_migrate(ClientHandler* self)
+{
+  EventLoop* loop = workers_for_domain(self->migrating_domain);
+
+  eventloop_socket_release(self->event);
+  self->event = NULL;
+
+  return eventloop_post(loop, client_handler_adopt, self);
+}
+
+/** Check whether the storage thread has caught up with a throttled client.
+ *
+ * If so, the rows which did not fit in the storage queue are queued, and
+ * reading from the client resumes, starting with the data left in its buffer.
+ *
+ * \param source timer checking the client
+ * \param handle the ClientHandler
+ * \see client_handler_throttle
+ */
+static void
+client_handler_resume(TimerEvtSource* source, void* handle)
+{
+  ClientHandler* self = (ClientHandler*)handle;
+
+  if (storage_is_throttled(self->database)) {
+    return;
+  }
+  if (self->pending_rows > 0 &&
+      client_handler_store(self, self->pending_table, self->pending_seqnos,
+        self->pending_timestamps, self->pending_values, self->pending_value_count,
+        self->pending_rows) > 0) {
+    return;
+  }
+
+  eventloop_timer_stop(source);
+  self->resume_timer = NULL;
+  logdebug("%s: Resuming reading from client\n", self->name);
+  eventloop_socket_activate(self->event, 1);
+  process_input(self, self->event);
+}
+
+/** Stop reading from a client until its Database's storage queue drains.
+ *
+ * \param self ClientHandler to throttle
+ * \see storage_is_throttled, client_handler_resume
+ */
+static void
+client_handler_throttle(ClientHandler* self)
+{
+  if (self->resume_timer) {
+    return;
+  }
+
+  logdebug("%s: Storage queue full, suspending reading from client\n", self->name);
+  eventloop_socket_activate(self->event, 0);
+  self->resume_timer = eventloop_every_ms(self->name, RESUME_CHECK_PERIOD,
+      client_handler_resume, self);
+}
+
+/** Queue decoded rows for storage, keeping those which do not fit.
+ *
+ * If the storage queue is full, the remaining rows are recorded as pending,
+ * and the client is throttled. They must not be modified until
+ * client_handler_resume() manages to queue them.
+ *
+ * \param self ClientHandler the rows come from
+ * \param table DbTable to insert the rows in
+ * \param seqnos array of the sequence numbers of the rows
+ * \param timestamps array of the timestamps of the rows
+ * \param values array of rows * value_count OmlValues, row by row
+ * \param value_count number of values in each row
+ * \param rows number of rows
+ * \return 0 if all rows were queued, 1 if some are pending, -1 on error, in which case they are dropped
+ * \see storage_insert_batch, client_handler_throttle
+ */
+static int
+client_handler_store(ClientHandler* self, DbTable* table, int32_t* seqnos, double* timestamps,
+    OmlValue* values, int value_count, int rows)
+{
+  int n;
+
+  self->pending_rows = 0;
+  n = storage_insert_batch(self->database, table, self->sender_id, seqnos, timestamps,
+      values, value_count, rows);
+  if (n < 0) {
+    logerror("%s: Could not queue %d rows for storage in table '%s', dropping them\n",
+        self->name, rows, table->schema->name);
+    return -1;
+
+  } else if (n < rows) {
+    logdebug("%s: Storage queue full, keeping %d rows for later\n", self->name, rows - n);
+    self->pending_table = table;
+    self->pending_seqnos = &seqnos[n];
+    self->pending_timestamps = &timestamps[n];
+    self->pending_values = &values[n * value_count];
+    self->pending_value_count = value_count;
+    self->pending_rows = rows - n;
+    client_handler_throttle(self);
+    return 1;
+  }
+
+  return 0;
+}
+
+/** Check whether a client should stop sending data, and throttle it if so.
+ *
+ * \param self ClientHandler to check
+ * \return 1 if the client has been throttled, 0 otherwise
+ * \see client_handler_throttle
+ */
+static int
+client_handler_check_throttle(ClientHandler* self)
+{
+  if (self->resume_timer) {
+    return 1;
+  }
+  if (self->database && storage_is_throttled(self->database)) {
+    client_handler_throttle(self);
+    return 1;
+  }
+  return 0;
+}
+
+/** Free a ClientHandler and all its resources.
+ *
+ * Rows left pending by a throttled client are queued for storage first,
+ * waiting for room in the queue if needed.
+ *
+ * \param self ClientHandler to free
+ * \see storage_insert_batch_wait
+ */
 void client_handler_free (ClientHandler* self)
 {
+  if (self->pending_rows > 0 && self->database) {
+    /* These rows were acknowledged, and must not be lost with the client */
+    logdebug ("%s: Waiting for room to queue %d rows for storage\n", self->name, self->pending_rows);
+    if (storage_insert_batch_wait (self->database, self->pending_table, self->sender_id,
+          self->pending_seqnos, self->pending_timestamps, self->pending_values,
+          self->pending_value_count, self->pending_rows) < 0) {
+      logerror ("%s: Could not queue %d rows for storage in table '%s', dropping them\n",
+          self->name, self->pending_rows, self->pending_table->schema->name);
+    }
+    self->pending_rows = 0;
+  }
+  if (self->resume_timer)
+    eventloop_timer_stop (self->resume_timer);
   if (self->event)
     eventloop_socket_release (self->event);
   if (self->database)
@@ -239,6 +451,11 @@ void client_handler_free (ClientHandler* self)
   if (self->seqno_offsets)
     oml_free (self->seqno_offsets);
   mbuf_destroy (self->mbuf);
+  if (self->inflater) {
+    inflateEnd (self->inflater);
+    oml_free (self->inflater);
+  }
+  mbuf_destroy (self->zbuf);
   int i, j;
   for (i = 0; i < self->table_count; i++) {
     for (j = 0; j < self->values_vector_counts[i]; j++) {
@@ -248,10 +465,20 @@ void client_handler_free (ClientHandler* self)
   }
   oml_free (self->values_vectors);
   oml_free (self->values_vector_counts);
+  for (i = 0; self->compact_states && i < self->table_count; i++) {
+    strdict_destroy (self->compact_states[i].dict);
+  }
+  oml_free (self->compact_states);
+  oml_value_array_reset (self->batch_values, self->batch_values_count);
+  oml_free (self->batch_values);
+  oml_free (self->batch_seqnos);
+  oml_free (self->batch_timestamps);
   if (self->sender_name)
     oml_free (self->sender_name);
   if (self->app_name)
     oml_free (self->app_name);
+  if (self->migrating_domain)
+    oml_free (self->migrating_domain);
   oml_free (self);
 
   //  oml_memreport ();
@@ -291,6 +518,56 @@ validate_schema_names (struct schema *schema, char **invalid)
   return 1;
 }
 
+/** Arguments and result of call_find_or_create_table
+ * \see storage_call */
+typedef struct TableCall {
+  /** Schema of the table to find or create */
+  struct schema *schema;
+  /** Table found or created, NULL on error */
+  DbTable *table;
+} TableCall;
+
+/** Find or create a table, in the storage thread of a Database.
+ *
+ * \param db Database to search
+ * \param arg pointer to a TableCall
+ * \return 0 if a table was found or created, -1 otherwise
+ * \see database_find_or_create_table, storage_call
+ */
+static int
+call_find_or_create_table(Database *db, void *arg)
+{
+  TableCall *call = (TableCall*)arg;
+  call->table = database_find_or_create_table(db, call->schema);
+  return call->table ? 0 : -1;
+}
+
+/** Record the start time of a Database, in its storage thread.
+ *
+ * \param db Database to update
+ * \param arg string representation of the start time
+ * \return 0 on success, -1 otherwise
+ * \see db_adapter_set_metadata, storage_call
+ */
+static int
+call_set_start_time(Database *db, void *arg)
+{
+  return db->set_metadata (db, "start_time", (const char*)arg);
+}
+
+/** Add a sender to a Database, in its storage thread.
+ *
+ * \param db Database to update
+ * \param arg name of the sender
+ * \return the index of the sender
+ * \see db_add_sender_id, storage_call
+ */
+static int
+call_add_sender_id(Database *db, void *arg)
+{
+  return db->add_sender_id(db, (const char*)arg);
+}
+
 /** Process schema from string.
  *
  * \param self pointer to ClientHandler processing the schema
@@ -318,7 +595,13 @@ process_schema(ClientHandler* self, char* value)
   int idx = schema->index;
   loginfo("%s: New MS schema %s\n", self->name, value); /* Value contains the index */
 
-  DbTable* table = database_find_or_create_table(self->database, schema);
+  TableCall call = { schema, NULL };
+  /* This blocks the EventLoop until the storage thread finishes its current
+   * batch; see storage_call() */
+  if (self->database) {
+    storage_call(self->database, call_find_or_create_table, &call);
+  }
+  DbTable* table = call.table;
   if (table == NULL) {
     logerror("%s: Can't find table '%s' or client schema '%s' doesn't match any of the existing tables.\n",
         self->name, schema->name, value);
@@ -381,6 +664,7 @@ process_meta(ClientHandler* self, char* key, char* value)
       return -2;
 
     } else {
+      self->protocol = protocol;
       return 0;
     }
 
@@ -390,6 +674,12 @@ process_meta(ClientHandler* self, char* key, char* value)
           self->name, key);
       return -1;
 
+    } else if (workers_count() > 0 &&
+        workers_for_domain(value) != eventloop_current()) {
+      /* The database will be opened by the thread owning this domain */
+      self->migrating_domain = oml_strndup(value, strlen(value));
+      return 0;
+
     } else if (!(self->database = database_find(value))) {
       self->state = C_PROTOCOL_ERROR;
       return -2;
@@ -471,7 +761,7 @@ process_meta(ClientHandler* self, char* key, char* value)
         self->database->start_time = start_time;// - 100;
         char s[64];
         snprintf (s, LENGTH(s), "%u", start_time);
-        self->database->set_metadata (self->database, "start_time", s);
+        storage_call(self->database, call_set_start_time, s);
       }
       self->time_offset = start_time - self->database->start_time;
       return 0;
@@ -490,7 +780,7 @@ process_meta(ClientHandler* self, char* key, char* value)
       return -2;
 
     } else {
-      self->sender_id = self->database->add_sender_id(self->database, value);
+      self->sender_id = storage_call(self->database, call_add_sender_id, value);
       self->sender_name = oml_strndup (value, strlen (value));
       return 0;
     }
@@ -536,6 +826,42 @@ process_meta(ClientHandler* self, char* key, char* value)
       return -2;
     }
 
+  } else if (strcmp(key, "encoding") == 0) {
+    if (self->state != C_HEADER) {
+      logwarn("%s: Meta '%s' is only valid in the headers, ignoring\n",
+          self->name, key);
+      return -1;
+
+    } else if (strcmp(value, "identity") == 0 || self->inflater) {
+      return 0;
+
+    } else if (strcmp(value, "deflate") == 0) {
+      logdebug("%s: Decompressing data with deflate\n", self->name);
+      if (!self->zbuf && !(self->zbuf = mbuf_create())) {
+        self->state = C_PROTOCOL_ERROR;
+        return -2;
+      }
+      /* Zeroed, so zlib uses its default allocation functions */
+      if (!(self->inflater = oml_malloc(sizeof(z_stream)))) {
+        self->state = C_PROTOCOL_ERROR;
+        return -2;
+      }
+      /* Negative window bits for a raw deflate stream, without zlib header */
+      if (inflateInit2(self->inflater, -MAX_WBITS) != Z_OK) {
+        logerror("%s: Cannot initialise decompression\n", self->name);
+        oml_free(self->inflater);
+        self->inflater = NULL;
+        self->state = C_PROTOCOL_ERROR;
+        return -2;
+      }
+      return 0;
+
+    } else {
+      logerror("%s: Unknown encoding '%s'\n", self->name, value);
+      self->state = C_PROTOCOL_ERROR;
+      return -2;
+    }
+
   } else {
     /* Unknown key, let the caller deal with it */
     return 1;
@@ -573,6 +899,96 @@ read_line(char** line_p, int* length_p, MBuffer* mbuf)
   return 1;
 }
 
+/** Decompress the data received from a client into its MBuffer.
+ *
+ * The compressed data available in the client's zbuf is inflated, except for
+ * the end of an incomplete block, until MAX_INFLATE_SIZE bytes have been
+ * added to the MBuffer. As deflate can expand data about a thousandfold, the
+ * rest is left in the zbuf, and self->inflate_more is set, until the messages
+ * have been processed. On corrupted data, the data is skipped up to the next
+ * block the client started after a full flush, see inflateSync(3).
+ *
+ * \param self ClientHandler with an inflater
+ * \return 0 on success, -1 on error
+ * \see process_meta, process_input
+ */
+static int
+client_inflate(ClientHandler* self)
+{
+  z_stream* zs = self->inflater;
+  MBuffer* zbuf = self->zbuf;
+  size_t room, avail, produced = 0;
+  int i, ret = Z_OK;
+
+  /* The inflater might still hold output which did not fit last time */
+  while (produced < MAX_INFLATE_SIZE &&
+      (mbuf_rd_remaining (zbuf) > 0 || self->inflate_full)) {
+    avail = mbuf_rd_remaining (zbuf);
+    zs->next_in = mbuf_rdptr (zbuf);
+    zs->avail_in = avail;
+
+    if (Z_DATA_ERROR == ret || Z_STREAM_ERROR == ret) {
+      /* Z_STREAM_ERROR: still searching for a new block */
+      ret = inflateSync (zs);
+      mbuf_read_skip (zbuf, avail - zs->avail_in);
+      if (ret != Z_OK) {
+        ret = Z_STREAM_ERROR;
+        break;
+      }
+      continue;
+    }
+
+    if (mbuf_check_resize (self->mbuf, MIN_READ_SPACE) == -1) {
+      logerror("%s: Failed to make room for decompressed data in message buffer\n",
+          self->name);
+      return -1;
+    }
+    room = mbuf_wr_remaining (self->mbuf);
+    if (room > MAX_INFLATE_SIZE - produced) {
+      room = MAX_INFLATE_SIZE - produced;
+    }
+    zs->next_out = mbuf_wrptr (self->mbuf);
+    zs->avail_out = room;
+
+    ret = inflate (zs, Z_SYNC_FLUSH);
+    mbuf_read_skip (zbuf, avail - zs->avail_in);
+    mbuf_write_advance (self->mbuf, room - zs->avail_out);
+    produced += room - zs->avail_out;
+    self->inflate_full = (0 == zs->avail_out);
+
+    if (Z_STREAM_END == ret) {
+      /* The client ended the stream; a new one might follow */
+      inflateReset (zs);
+
+    } else if (Z_DATA_ERROR == ret) {
+      logwarn("%s: Corrupted compressed data (%s), searching for a new block\n",
+          self->name, zs->msg ? zs->msg : "unknown error");
+      /* The lost data might have been the base of the next compact messages */
+      for (i = 0; self->compact_states && i < self->table_count; i++) {
+        self->compact_states[i].valid = 0;
+      }
+
+    } else if (Z_MEM_ERROR == ret) {
+      logerror("%s: Out of memory decompressing data\n", self->name);
+      return -1;
+
+    } else if (Z_BUF_ERROR == ret) {
+      /* No progress possible */
+      self->inflate_full = 0;
+      break;
+    }
+  }
+  self->inflate_more = produced >= MAX_INFLATE_SIZE &&
+    (mbuf_rd_remaining (zbuf) > 0 || self->inflate_full);
+
+  if (mbuf_rd_remaining (zbuf) > 0) {
+    mbuf_repack (zbuf);
+  } else {
+    mbuf_clear2 (zbuf, 0);
+  }
+  return 0;
+}
+
 /** Process one line of header.
  *
  * \param self pointer to ClientHandler processing the header
@@ -591,9 +1007,25 @@ process_header(ClientHandler* self, MBuffer* mbuf)
 
   if (len == 0) {
     // empty line denotes separator between header and body
-    int skip_count = mbuf_find_not (mbuf, '\n');
-    mbuf_read_skip (mbuf, skip_count + 1);
-    mbuf_consume_message (mbuf);
+    if (self->inflater) {
+      /* The compressed data might start with newlines; move it to the zbuf */
+      mbuf_read_skip (mbuf, 1);
+      mbuf_consume_message (mbuf);
+      if (mbuf_write (self->zbuf, mbuf_rdptr (mbuf), mbuf_rd_remaining (mbuf)) == -1) {
+        logerror("%s: Failed to copy compressed data\n", self->name);
+        self->state = C_PROTOCOL_ERROR;
+        return 0;
+      }
+      mbuf_clear2 (mbuf, 0);
+      if (client_inflate (self) == -1) {
+        self->state = C_PROTOCOL_ERROR;
+        return 0;
+      }
+    } else {
+      int skip_count = mbuf_find_not (mbuf, '\n');
+      mbuf_read_skip (mbuf, skip_count + 1);
+      mbuf_consume_message (mbuf);
+    }
     self->state = self->content;
     client_event_report(self, "Ready", "");
     loginfo("%s: Client %s ready to send data\n", self->name, self->event->name);
@@ -622,12 +1054,90 @@ process_header(ClientHandler* self, MBuffer* mbuf)
   }
 
   // process_meta() might have signalled protocol error, so we have to check here.
-  if (self->state == C_PROTOCOL_ERROR)
+  if (self->state == C_PROTOCOL_ERROR || self->migrating_domain)
     return 0;
   else
     return 1; // still in header
 }
 
+/** Process the rows of a batch message, once its header and table are known.
+ *
+ * All the rows are decoded, then queued for storage at once.
+ *
+ * \param self ClientHandler
+ * \param header OmlBinaryHeader of the message
+ * \param table DbTable of the stream of the message
+ * \param table_index index of the stream of the message
+ * \see process_bin_data_message, unmarshal_batch, client_handler_store
+ */
+static void
+process_bin_batch_message(ClientHandler* self, OmlBinaryHeader* header, DbTable* table, int table_index)
+{
+  struct schema *schema = table->schema;
+  int nfields = schema->nfields;
+  int rows = header->rows;
+  int count = rows * nfields;
+  int i, j;
+
+  if (0 == table_index) {
+    logwarn("%s(bin): Ignoring batch of metadata\n", self->name);
+    mbuf_read_skip (self->mbuf, header->length);
+    mbuf_consume_message (self->mbuf);
+    return;
+  }
+
+  if (count > self->batch_values_count) {
+    OmlValue *new_values = oml_realloc (self->batch_values, count * sizeof (OmlValue));
+    if (!new_values) {
+      logerror("%s(bin): Could not allocate %d OmlValues for batch of %d rows\n",
+          self->name, count, rows);
+      return;
+    }
+    oml_value_array_init (&new_values[self->batch_values_count], count - self->batch_values_count);
+    self->batch_values = new_values;
+    self->batch_values_count = count;
+  }
+  if (rows > self->batch_rows) {
+    int32_t *new_seqnos = oml_realloc (self->batch_seqnos, rows * sizeof (int32_t));
+    double *new_timestamps = oml_realloc (self->batch_timestamps, rows * sizeof (double));
+    if (new_seqnos) self->batch_seqnos = new_seqnos;
+    if (new_timestamps) self->batch_timestamps = new_timestamps;
+    if (!new_seqnos || !new_timestamps) {
+      logerror("%s(bin): Could not allocate metadata for batch of %d rows\n", self->name, rows);
+      return;
+    }
+    self->batch_rows = rows;
+  }
+
+  /* Values might have been swapped with previously stored ones */
+  oml_value_array_reset (self->batch_values, count);
+  for (i = 0; i < rows; i++) {
+    for (j = 0; j < nfields; j++) {
+      oml_value_set_type (&self->batch_values[i * nfields + j], schema->fields[j].type);
+    }
+  }
+  if (unmarshal_batch (self->mbuf, header, self->batch_seqnos, self->batch_timestamps,
+        self->batch_values, nfields) != rows) {
+    logerror("%s(bin): An error occured during unmarshalling of batch for schema '%s'\n",
+        self->name, schema->name);
+    /* The dictionary might not match the client's any more */
+    self->compact_states[table_index].valid = 0;
+    return;
+  }
+  mbuf_consume_message (self->mbuf);
+
+  /* The last row is the base of the next compact message of the stream */
+  unmarshal_compact_resolve (header, &self->compact_states[table_index]);
+
+  for (i = 0; i < rows; i++) {
+    self->batch_timestamps[i] += self->time_offset;
+  }
+  logdebug("%s(bin): Inserting %d rows into table index %d '%s' (seqno=%d..%d)\n",
+      self->name, rows, table_index, schema->name, self->batch_seqnos[0], header->seqno);
+  client_handler_store(self, table, self->batch_seqnos, self->batch_timestamps,
+      self->batch_values, nfields, rows);
+}
+
 /** Process contents of a message for which the header has already been
  * extracted by the marshalling code.
  *
@@ -679,17 +1189,57 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
     }
   }
 
+  if ((OMB_CDATA_P == header->type || OMB_BATCH_P == header->type) &&
+      self->protocol >= OMSP_STRDICT_VERSION && table_index > 0) {
+    OmlCompactState *cs = &self->compact_states[table_index];
+    if (!cs->dict && !(cs->dict = strdict_new ())) {
+      logerror("%s(bin): Could not allocate string dictionary for table index %d\n",
+          self->name, table_index);
+      return;
+    }
+    header->dict = cs->dict;
+  }
+
+  if (OMB_BATCH_P == header->type) {
+    process_bin_batch_message(self, header, table, table_index);
+    return;
+  }
+
+  /* Strings of compact messages may depend on the previous messages */
+  if (!unmarshal_compact_resolve(header, &self->compact_states[table_index])) {
+    logdebug("%s(bin): Discarding sample of table index %d, as the previous one was lost\n",
+        self->name, table_index);
+    mbuf_read_skip (mbuf, header->length);
+    mbuf_consume_message (mbuf);
+    return;
+  }
+
   v = self->values_vectors[table_index];
   /* These OmlValue are properly initialised by client_realloc_values,
    * however, the schema might have been redefined sinc last time */
   count = self->values_vector_counts[table_index];
   oml_value_array_reset(v, count);
-  count = unmarshal_measurements(mbuf, header, v, count);
 
   schema = table->schema;
+  if (OMB_CDATA_P == header->type) {
+    /* Compact messages carry no types, nor their number of values */
+    if (count < schema->nfields) {
+      logerror("%s(bin): Not enough OmlValues (%d) to hold received data (%d)\n",
+          self->name, count, schema->nfields);
+      return;
+    }
+    count = schema->nfields;
+    for (i = 0; i < count; i++) {
+      oml_value_set_type(&v[i], schema->fields[i].type);
+    }
+  }
+  count = unmarshal_measurements(mbuf, header, v, count);
+
   if (count<-100) {
     logerror("%s(bin): An error occured during unmarshalling (%d)\n",
         self->name, count);
+    /* The dictionary might not match the client's any more */
+    self->compact_states[table_index].valid = 0;
     return;
   } else if (schema->nfields != count) {
     logerror("%s(bin): Data item number mismatch for schema '%s' (expected %d, got %d)\n",
@@ -698,6 +1248,9 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
   }
   mbuf_consume_message (mbuf);
 
+  ts = header->timestamp + self->time_offset;
+  seqno = header->seqno;
+
   if (0 == table_index) { /* Stream 0: Metadata */
     logdebug("%s(bin): Client sending metadata at %f\n", self->name, ts);
 
@@ -745,8 +1298,10 @@ process_bin_data_message(ClientHandler* self, OmlBinaryHeader* header)
 
   logdebug("%s(bin): Inserting data into table index %d '%s' (seqno=%d, ts=%f)\n",
       self->name, table_index, table->schema->name, seqno, ts);
-  self->database->insert(self->database, table, self->sender_id, header->seqno,
-      ts, self->values_vectors[table_index], count);
+  self->row_seqno = header->seqno;
+  self->row_timestamp = ts;
+  client_handler_store(self, table, &self->row_seqno, &self->row_timestamp,
+      self->values_vectors[table_index], count, 1);
 }
 
 /** Read binary data from an MBuffer
@@ -759,12 +1314,20 @@ static int
 process_bin_message(ClientHandler* self, MBuffer* mbuf)
 {
   char *out;
-  int res;
+  int res, i;
   OmlBinaryHeader header;
 
+  if (client_handler_check_throttle(self)) {
+    return 0;
+  }
+
   res = bin_find_sync(mbuf);
   if(res>0) {
     logwarn("%s(bin): Skipped %d bytes of data searching for a new message\n", self->name, res);
+    /* The skipped data might have been the base of the next compact messages */
+    for (i = 0; self->compact_states && i < self->table_count; i++) {
+      self->compact_states[i].valid = 0;
+    }
   } else if (res == -1 && mbuf_rd_remaining(mbuf)>=2) {
     logdebug("%s(bin): Invalid or no message found in binary packet\n", self->name);
     if(o_log_level_active(O_LOG_DEBUG4)) {
@@ -788,6 +1351,8 @@ process_bin_message(ClientHandler* self, MBuffer* mbuf)
   switch (header.type) {
   case OMB_DATA_P:
   case OMB_LDATA_P:
+  case OMB_CDATA_P:
+  case OMB_BATCH_P:
     process_bin_data_message(self, &header);
     if (self->state != C_BINARY_DATA)
       return 0;
@@ -920,8 +1485,10 @@ process_text_data_message(ClientHandler* self, char** msg, int count)
 
   logdebug("%s(txt): Inserting data into table index %d '%s' (seqno=%d, ts=%f)\n",
       self->name, table_index, table->schema->name, seqno, ts);
-  self->database->insert(self->database, table, self->sender_id, seqno,
-      ts, self->values_vectors[table_index], count - 3); /* Ignore first 3 elements */
+  self->row_seqno = seqno;
+  self->row_timestamp = ts;
+  client_handler_store(self, table, &self->row_seqno, &self->row_timestamp,
+      self->values_vectors[table_index], count - 3, 1); /* Ignore first 3 elements */
 }
 
 /** Process as many lines of data as possible from an MBuffer.
@@ -937,6 +1504,9 @@ process_text_message(ClientHandler* self, MBuffer* mbuf)
   int len;
 
   while (C_TEXT_DATA == self->state) {
+    if (client_handler_check_throttle(self)) {
+      return 0;
+    }
     if (read_line(&line, &len, mbuf) == 0) {
       return 0;
     }
@@ -980,10 +1550,43 @@ process_text_message(ClientHandler* self, MBuffer* mbuf)
   return 0;
 }
 
+/** Callback function called when the socket has data to be read.
+ *
+ * Make sure there is at least MIN_READ_SPACE bytes free at the end of the
+ * MBuffer, and let the EventLoop read directly there. Compressed data is read
+ * into the zbuf instead.
+ *
+ * \param source the socket event
+ * \param handle the client handler
+ * \param iov array of iovecs to fill
+ * \param iovcnt size of the iov array
+ * \return the number of iovecs filled, -1 on error, in which case the client
+ * is dropped
+ * \see client_callback, status_callback, o_el_buffer_socket_callback
+ */
+static int
+buffer_callback(SockEvtSource* source, void* handle, struct iovec *iov, int iovcnt)
+{
+  ClientHandler* self = (ClientHandler*)handle;
+  MBuffer* mbuf = (self->inflater && self->state != C_HEADER) ? self->zbuf : self->mbuf;
+  (void)iovcnt;
+
+  if (mbuf_check_resize (mbuf, MIN_READ_SPACE) == -1) {
+    logerror("%s: Failed to make room for incoming data in message buffer\n",
+        source->name);
+    return -1;
+  }
+
+  iov[0].iov_base = mbuf_wrptr (mbuf);
+  iov[0].iov_len = mbuf_wr_remaining (mbuf);
+  return 1;
+}
+
 /** * Callback function called when the socket receive some data
  * \param source the socket event
  * \param handle the client handler
- * \param buf data received from the socket
+ * \param buf data received from the socket, or NULL if it has already been
+ * read into the MBuffer (or the zbuf, if compressed) through buffer_callback
  * \param bufsize the size of the data set from the socket
  */
   void
@@ -991,7 +1594,17 @@ client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size)
 {
   char *in;
   ClientHandler* self = (ClientHandler*)handle;
-  MBuffer* mbuf = self->mbuf;
+  int compressed = self->inflater && self->state != C_HEADER;
+  MBuffer* mbuf = compressed ? self->zbuf : self->mbuf;
+  int result;
+
+  if (buf == NULL) {
+    /* Data has been read straight to the end of the buffer */
+    result = mbuf_write_advance (mbuf, buf_size);
+    buf = mbuf_wrptr (mbuf) - buf_size;
+  } else {
+    result = mbuf_write (mbuf, buf, buf_size);
+  }
 
   logdebug2("%s(%s): Received %d bytes of data\n",
       source->name,
@@ -1005,19 +1618,63 @@ client_callback(SockEvtSource* source, void* handle, void* buf, int buf_size)
     oml_free(in);
   }
 
-  int result = mbuf_write (mbuf, buf, buf_size);
-
   if (result == -1) {
     logerror("%s: Failed to write message from client into message buffer\n",
         source->name);
     return;
   }
 
+  if (compressed && client_inflate(self) == -1) {
+    self->state = C_PROTOCOL_ERROR;
+  }
+
+  process_input(self, source);
+}
+
+/** Process all complete messages from a client's buffer, and the data left
+ * to inflate, if any, MAX_INFLATE_SIZE at a time.
+ *
+ * \param self the client handler
+ * \param source the socket event
+ * \see process_buffer, client_inflate
+ */
+static void
+process_input(ClientHandler* self, SockEvtSource* source)
+{
+  while (process_buffer(self, source) && self->inflate_more) {
+    if (client_inflate(self) == -1) {
+      self->state = C_PROTOCOL_ERROR;
+    }
+  }
+}
+
+/** Process all complete messages from a client's buffer.
+ *
+ * \param self the client handler
+ * \param source the socket event
+ * \return 1 if more data can be processed, 0 if the client has been
+ * throttled, handed over to another thread, or freed
+ * \see client_callback, process_input
+ */
+static int
+process_buffer(ClientHandler* self, SockEvtSource* source)
+{
+  MBuffer* mbuf = self->mbuf;
+
 process:
   switch (self->state)
   {
   case C_HEADER:
     while (process_header(self, mbuf));
+    if (self->migrating_domain) {
+      mbuf_repack_message (mbuf);
+      if (client_handler_migrate(self)) {
+        logerror("%s: Failed to hand client over to thread for domain '%s'\n",
+            source->name, self->migrating_domain);
+        client_handler_free (self);
+      }
+      return 0;
+    }
     if (self->state != C_HEADER) {
       //finished header, let someone else process rest of buffer
       goto process;
@@ -1041,11 +1698,11 @@ process:
     /*
      * Protocol error --> no need to repack buffer, so just return;
      */
-    return;
+    return 0;
   default:
     logerror("%s: Unknown client state %d\n", source->name, self->state);
     mbuf_clear (mbuf);
-    return;
+    return 0;
   }
 
   if (self->state == C_PROTOCOL_ERROR)
@@ -1054,6 +1711,7 @@ process:
   // move remaining buffer content to beginning
   mbuf_repack_message (mbuf);
   logdebug2("%s: Buffer repacked to %d bytes\n", source->name, mbuf_fill(mbuf));
+  return !self->resume_timer;
 }
 /** Callback function called when the status of the socket change
  * \param source the socket event
@@ -1087,9 +1745,14 @@ status_callback(SockEvtSource* source, SocketStatus status, int errcode, void* h
       loginfo("%s: Client %s dropped due to idleness\n", self->name, source->name);
       client_handler_free (self);
       break;
+    case SOCKET_DROPPED:
+      /* The EventLoop cannot read from the client anymore */
+      client_event_report(self, event, message);
+      logwarn("%s: Client %s dropped\n", self->name, source->name);
+      client_handler_free (self);
+      break;
     case SOCKET_UNKNOWN:
     case SOCKET_CONN_REFUSED:
-    case SOCKET_DROPPED:
     default:
       client_event_report(self, event, message);
       logwarn ("%s: Client '%s' received unhandled condition %s (%d)\n", source->name,
@@ -24,10 +24,12 @@
 #define CLIENT_HANDLER_H_
 
 #include <time.h>
+#include <zlib.h>
 #include <ocomm/o_socket.h>
 #include <ocomm/o_eventloop.h>
 #include <oml2/oml_writer.h>
 #include <mbuf.h>
+#include <marshal.h>
 
 #include "database.h"
 
@@ -54,7 +56,22 @@ typedef struct _clientHandler {
   int*        seqno_offsets;
   OmlValue**  values_vectors;
   int*        values_vector_counts; // size of each vector in values_vectors
-  int         table_count;    // size of tables, seqno_offsets and values_vectors arrays
+  OmlCompactState* compact_states; // previous compact message of each table
+  int         table_count;    // size of tables, seqno_offsets, values_vectors and compact_states arrays
+  OmlValue*   batch_values;   // values of the rows of the last batch message
+  int         batch_values_count; // size of batch_values
+  int32_t*    batch_seqnos;   // sequence numbers of the rows of the last batch message
+  double*     batch_timestamps; // timestamps of the rows of the last batch message
+  int         batch_rows;     // size of batch_seqnos and batch_timestamps
+  DbTable*    pending_table;  // table of the rows decoded but not yet queued for storage
+  OmlValue*   pending_values; // values of the first of those rows
+  int32_t*    pending_seqnos; // sequence numbers of those rows
+  double*     pending_timestamps; // timestamps of those rows
+  int         pending_value_count; // number of values in each of those rows
+  int         pending_rows;   // number of rows not yet queued for storage
+  int32_t     row_seqno;      // sequence number of the last single row
+  double      row_timestamp;  // timestamp of the last single row
+  int         protocol;       // version of the protocol announced by the client
   int         sender_id;
   char*       sender_name;
   char*       app_name;
@@ -64,9 +81,16 @@ typedef struct _clientHandler {
   Socket*     socket;
   SockEvtSource *event;
   MBuffer* mbuf;
+  z_stream*   inflater;     // set if the data following the headers is compressed
+  MBuffer*    zbuf;         // compressed data not yet inflated into mbuf
+  int         inflate_more; // set if inflating stopped at MAX_INFLATE_SIZE
+  int         inflate_full; // set if the inflater filled all the output space it was given
 
   time_t      time_offset;  // value to add to remote ts to
                             // sync time across all connections
+
+  char*       migrating_domain; // domain of the worker thread this client is being handed to
+  TimerEvtSource* resume_timer; // set while reading is suspended because storage lags behind
 } ClientHandler;
 
 ClientHandler* client_handler_new (Socket* new_sock);
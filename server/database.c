@@ -56,6 +56,7 @@
 #include <time.h>
 #include <sys/time.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "ocomm/o_log.h"
 #include "oml_utils.h"
@@ -64,6 +65,7 @@
 #include "mstring.h"
 #include "database.h"
 #include "hook.h"
+#include "storage.h"
 #include "sqlite_adapter.h"
 
 #if HAVE_LIBPQ
@@ -89,6 +91,9 @@ static struct db_backend
 char* dbbackend = DEFAULT_DB_BACKEND;
 
 static Database *first_db = NULL;
+/** Lock protecting the list of databases, which can be accessed from several
+ * worker threads \see workers_setup */
+static pthread_mutex_t first_db_lock = PTHREAD_MUTEX_INITIALIZER;
 
 /** Get the list of valid database backends.
  *
@@ -195,26 +200,97 @@ database_create_function (const char *backend)
   return NULL;
 }
 
+/** Release the tables and storage backend of a Database.
+ *
+ * \param self Database to close
+ * \see db_adapter_table_free, db_adapter_release
+ */
+static void
+database_close (Database *self)
+{
+  DbTable* t_p = self->first_table;
+  while (t_p != NULL) {
+    DbTable* t = t_p->next;
+    /* Release the backend storage for this table */
+    self->table_free (self, t_p);
+    /* Release the table */
+    database_table_free(self, t_p);
+    t_p = t;
+  }
+  self->first_table = NULL;
+
+  self->release (self);
+}
+
+/** Open the storage backend of a new Database.
+ *
+ * This is run by the storage thread of the Database.
+ *
+ * \param self Database to open
+ * \param arg unused
+ * \return 0 on success, -1 otherwise
+ * \see database_find, storage_call
+ */
+static int
+database_open (Database *self, void *arg)
+{
+  char *start_time_str;
+  (void)arg;
+
+  if (self->create (self)) {
+    return -1;
+  }
+
+  if (database_init (self) == -1) {
+    database_close (self);
+    return -1;
+  }
+
+  start_time_str = self->get_metadata (self, "start_time");
+
+  if (start_time_str == NULL) {
+    /* No start time: this is probably a new database */
+    database_hook_send_event(self, HOOK_CMD_DBCREATED);
+
+  } else {
+    database_hook_send_event(self, HOOK_CMD_DBOPENED);
+    self->start_time = strtol (start_time_str, NULL, 0);
+    oml_free (start_time_str);
+    logdebug("%s: Retrieved start-time = %lu\n", self->name, self->start_time);
+  }
+
+  return 0;
+}
+
 /** Find a database instance for name.
  *
- * If no database with this name exists, a new one is created.
+ * If no database with this name exists, a new one is created, along with its
+ * storage thread, which opens it.
+ *
+ * The list of databases is locked, but not the creation of a new one. This
+ * function should therefore not be called concurrently for the same name; the
+ * server ensures this by handling all clients for a domain in the same thread.
  *
  * \param name name of the database to find
  * \return a pointer to the database
+ * \see workers_for_domain, storage_start
  */
 Database*
 database_find (const char* name)
 {
+  pthread_mutex_lock(&first_db_lock);
   Database* db = first_db;
   while (db != NULL) {
     if (!strcmp(name, db->name)) {
       loginfo ("%s: Database already open (%d client%s)\n",
                 name, db->ref_count, db->ref_count>1?"s":"");
       db->ref_count++;
+      pthread_mutex_unlock(&first_db_lock);
       return db;
     }
     db = db->next;
   }
+  pthread_mutex_unlock(&first_db_lock);
 
   // need to create a new one
   Database *self = oml_malloc(sizeof(Database));
@@ -223,40 +299,50 @@ database_find (const char* name)
   self->ref_count = 1;
   self->create = database_create_function (dbbackend);
 
-  if (self->create (self)) {
+  if (storage_start (self)) {
     oml_free(self);
     return NULL;
   }
 
-  if (database_init (self) == -1) {
-    database_release(self);
+  if (storage_call (self, database_open, NULL)) {
+    storage_stop (self);
     oml_free (self);
     return NULL;
   }
 
-  char *start_time_str = self->get_metadata (self, "start_time");
-
-  if (start_time_str == NULL) {
-    /* No start time: this is probably a new database */
-    database_hook_send_event(self, HOOK_CMD_DBCREATED);
-
-  } else {
-    database_hook_send_event(self, HOOK_CMD_DBOPENED);
-    self->start_time = strtol (start_time_str, NULL, 0);
-    oml_free (start_time_str);
-    logdebug("%s: Retrieved start-time = %lu\n", name, self->start_time);
-  }
-
   // hook this one into the list of active databases
+  pthread_mutex_lock(&first_db_lock);
   self->next = first_db;
   first_db = self;
+  pthread_mutex_unlock(&first_db_lock);
 
   return self;
 }
+/** Write all queued rows, then close and free a Database.
+ *
+ * The Database must have been unlinked from the list of active databases.
+ *
+ * \param self the database to free
+ * \see database_release, database_cleanup
+ */
+static void
+database_free (Database *self)
+{
+  storage_stop (self);
+
+  loginfo ("%s: Closing database\n", self->name);
+  database_close (self);
+
+  database_hook_send_event(self, HOOK_CMD_DBCLOSED);
+
+  oml_free(self);
+}
+
 /** One client no longer uses this database.
- * If this was the last client checking out, close database.
+ * If this was the last client checking out, write all queued rows and close
+ * the database.
  * \param self the database to release
- * \see db_adapter_release
+ * \see db_adapter_release, storage_stop
  */
 void
 database_release(Database* self)
@@ -265,7 +351,11 @@ database_release(Database* self)
     logerror("NONE: Trying to release a NULL database.\n");
     return;
   }
-  if (--self->ref_count > 0) return; // still in use
+  pthread_mutex_lock(&first_db_lock);
+  if (--self->ref_count > 0) { // still in use
+    pthread_mutex_unlock(&first_db_lock);
+    return;
+  }
 
   // unlink DB
   Database* db_p = first_db;
@@ -275,6 +365,7 @@ database_release(Database* self)
     db_p = db_p->next;
   }
   if (db_p == NULL) {
+    pthread_mutex_unlock(&first_db_lock);
     logerror("%s:  Trying to release an unknown database\n", self->name);
     return;
   }
@@ -282,40 +373,39 @@ database_release(Database* self)
     first_db = self->next; // was first
   else
     prev_p->next = self->next;
+  pthread_mutex_unlock(&first_db_lock);
 
   // no longer needed
-  DbTable* t_p = self->first_table;
-  while (t_p != NULL) {
-    DbTable* t = t_p->next;
-    /* Release the backend storage for this table */
-    self->table_free (self, t_p);
-    /* Release the table */
-    database_table_free(self, t_p);
-    t_p = t;
-  }
-
-  loginfo ("%s: Closing database\n", self->name);
-  self->release (self);
-
-  database_hook_send_event(self, HOOK_CMD_DBCLOSED);
-
-  oml_free(self);
+  database_free (self);
 }
 
-/** Close all open databases
+/** Close all open databases, even if clients still hold them.
  *
- * Useful when exiting.
+ * The rows queued for each Database are written before its storage thread is
+ * stopped. This should only be called when exiting, after all EventLoops have
+ * stopped, as the ClientHandlers are left with dangling pointers.
+ *
+ * \see database_free, storage_stop
  */
 void
 database_cleanup()
 {
-  Database *next, *db = first_db;
+  Database *next, *db;
 
   logdebug("Cleaning up databases\n");
 
+  pthread_mutex_lock(&first_db_lock);
+  db = first_db;
+  first_db = NULL;
+  pthread_mutex_unlock(&first_db_lock);
+
   while (db) {
     next = db->next;
-    database_release(db);
+    if (db->ref_count > 0) {
+      loginfo ("%s: Closing database with %d client%s still connected\n",
+          db->name, db->ref_count, db->ref_count>1?"s":"");
+    }
+    database_free (db);
     db = next;
   }
 }
@@ -480,6 +570,52 @@ database_table_free(Database *database, DbTable *table)
   }
 }
 
+/** Insert a batch of rows in a table.
+ *
+ * The adapter's insert_batch function is used if it has one, otherwise rows
+ * are inserted one by one.
+ *
+ * \param database Database to write in
+ * \param table DbTable to insert data in
+ * \param rows array of DbRow to insert
+ * \param count number of rows
+ * \return the number of rows which could not be inserted, 0 if all were
+ * \see db_adapter_insert_batch, db_adapter_insert
+ */
+int
+database_insert_batch(Database *database, DbTable *table, DbRow *rows, int count)
+{
+  int i, failed = 0;
+
+  if (database->insert_batch) {
+    return database->insert_batch (database, table, rows, count);
+  }
+
+  for (i = 0; i < count; i++) {
+    if (database->insert (database, table, rows[i].sender_id, rows[i].seq_no,
+          rows[i].time_stamp, rows[i].values, rows[i].value_count)) {
+      failed++;
+    }
+  }
+
+  return failed;
+}
+
+/** Let the adapter write out the rows it has buffered, if it does so.
+ *
+ * \param database Database to write in
+ * \return the number of previously-accepted rows which could not be written
+ * \see db_adapter_idle
+ */
+int
+database_idle(Database *database)
+{
+  if (database->idle) {
+    return database->idle (database);
+  }
+  return 0;
+}
+
 /** Prepare an INSERT statement for a given table
  *
  * The returned value is to be destroyed by the caller.
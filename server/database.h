@@ -36,8 +36,10 @@
 
 struct Database;
 struct DbTable;
+struct StorageQueue;
 typedef struct DbTable DbTable;
 typedef struct Database Database;
+typedef struct StorageQueue StorageQueue;
 
 /** Mapping from native to OML types.
  *
@@ -126,6 +128,55 @@ typedef char* (*db_adapter_prepared_var)(Database *db, unsigned int order);
  */
 typedef int (*db_adapter_insert)(Database *db, DbTable* table, int sender_id, int seq_no, double time_stamp, OmlValue* values, int value_count);
 
+/** One row of values to insert in a DbTable
+ * \see db_adapter_insert_batch
+ */
+typedef struct DbRow {
+  /** Sender ID */
+  int sender_id;
+  /** Sequence number */
+  int seq_no;
+  /** Timestamp of the sample at the sender */
+  double time_stamp;
+  /** OmlValue array to insert */
+  OmlValue *values;
+  /** Number of values */
+  int value_count;
+} DbRow;
+
+/** Insert a batch of rows in a table of a database
+ *
+ * Adapters can implement this to amortise the cost of an insertion (binding,
+ * committing, round-trips to the server) over several rows. If it is not
+ * provided, database_insert_batch() falls back to calling db_adapter_insert
+ * for each row.
+ *
+ * Adapters which buffer rows (e.g., in a COPY) may only find out later that
+ * some of them could not be written; they should then add those to the count
+ * returned by their next call to this function or to db_adapter_idle.
+ *
+ * \param db Database to write in
+ * \param table DbTable to insert data in
+ * \param rows array of DbRow to insert
+ * \param count number of rows
+ * \return the number of rows which could not be inserted, 0 if all were
+ * \see db_adapter_insert, database_insert_batch, db_adapter_idle
+ */
+typedef int (*db_adapter_insert_batch)(Database *db, DbTable* table, DbRow* rows, int count);
+
+/** Write out the rows an adapter has buffered, while no new rows come in
+ *
+ * The storage thread calls this periodically while its queue is empty, so
+ * rows held by the adapter (e.g., in a COPY, or an uncommitted transaction)
+ * reach the database even when clients stop sending data.
+ *
+ * \param db Database to write in
+ * \return the number of rows previously accepted by db_adapter_insert_batch
+ * which turned out not to be written, 0 if there were none
+ * \see db_adapter_insert_batch, database_idle
+ */
+typedef int (*db_adapter_idle)(Database *db);
+
 /** Get data from the metadata table
  *
  * The returned string should be oml_free'd by the caller when no longer needed.
@@ -206,6 +257,8 @@ struct Database{
   time_t     start_time;
   /** Opaque pointer to database implementation handle */
   void*      handle;
+  /** Rows waiting to be written by the storage thread \see storage_start */
+  StorageQueue* queue;
 
   /** Pointer to OML-to-native type conversion function */
   db_adapter_oml_to_type o2t;
@@ -227,6 +280,10 @@ struct Database{
   db_adapter_prepared_var prepared_var;
   /** Pointer to function to insert data in a table \see db_adapter_insert */
   db_adapter_insert  insert;
+  /** Pointer to function to insert several rows in a table, or NULL \see db_adapter_insert_batch */
+  db_adapter_insert_batch insert_batch;
+  /** Pointer to function to write out buffered rows when idle, or NULL \see db_adapter_idle */
+  db_adapter_idle idle;
   /** Pointer to function to get data from the metadata table \see db_adapter_get_metadata */
   db_adapter_get_metadata get_metadata;
   /** Pointer to function to set data in the metadata table \see db_adapter_set_metadata*/
@@ -262,6 +319,8 @@ DbTable *database_find_table(Database* database, const char* name);
 DbTable *database_find_or_create_table(Database *database, struct schema *schema);
 DbTable *database_create_table (Database *database, const struct schema *schema);
 void     database_table_free(Database *database, DbTable* table);
+int      database_insert_batch(Database *database, DbTable *table, DbRow *rows, int count);
+int      database_idle(Database *database);
 
 MString *database_make_sql_insert (Database *db, DbTable* table);
 
@@ -82,6 +82,24 @@ client_event_inject(const char* address, uint32_t port, const char* oml_id, cons
   }
 }
 
+/** Inject a storage queue report into the monitoring OML server.
+ *
+ * \param domain      pointer to a string containing the domain of the Database.
+ * \param depth       number of rows currently queued
+ * \param max_depth   maximal number of rows queued since the last report
+ * \param rows        number of rows written since the last report
+ * \param failed      number of rows which could not be written since the last report
+ * \param latency     average time spent in the queue by written rows [ms]
+ * \param max_latency maximal time spent in the queue by a written row [ms]
+ */
+void
+storage_event_inject(const char* domain, uint32_t depth, uint32_t max_depth, uint64_t rows, uint64_t failed, double latency, double max_latency)
+{
+  if(oml_enabled) {
+    oml_inject_storage(g_oml_mps_oml2_server->storage, domain, depth, max_depth, rows, failed, latency, max_latency);
+  }
+}
+
 /*
  Local Variables:
  mode: C
@@ -18,6 +18,8 @@ void oml_cleanup(void);
 
 void client_event_inject(const char* address, uint32_t port, const char* oml_id, const char* domain, const char* appname, const char* event, const char* message);
 
+void storage_event_inject(const char* domain, uint32_t depth, uint32_t max_depth, uint64_t rows, uint64_t failed, double latency, double max_latency);
+
 #endif /*MONITORING_SERVER_H_*/
 
 /*
@@ -47,6 +47,8 @@
 #include "database.h"
 #include "sqlite_adapter.h"
 #include "monitoring_server.h"
+#include "workers.h"
+#include "storage.h"
 
 #define V_STRING  "OML Server %s\n"
 
@@ -87,15 +89,27 @@ static int socket_timeout = 60;
 static char* logfile_name = NULL;
 static char* uidstr = NULL;
 static char* gidstr = NULL;
+static char* event_backend = NULL;
+static int threads = 0;
 
 extern char* dbbackend;
 extern char *sqlite_database_dir;
+extern char *sqlite_profile;
+extern char *sqlite_journal_mode;
+extern char *sqlite_synchronous;
+extern int sqlite_page_size;
+extern int sqlite_cache_size;
+extern long sqlite_mmap_size;
+extern int sqlite_commit_rows;
+extern int sqlite_commit_interval;
+extern int sqlite_checkpoint_pages;
 #if HAVE_LIBPQ
 extern char *pg_host;
 extern char *pg_port;
 extern char *pg_user;
 extern char *pg_pass;
 extern char *pg_conninfo;
+extern int pg_copy;
 #endif /* HAVE_LIBPQ */
 
 struct poptOption options[] = {
@@ -103,17 +117,31 @@ struct poptOption options[] = {
   { "listen", 'l', POPT_ARG_STRING, &listen_service, 0, "Service to listen for TCP based clients", DEFAULT_PORT_STR},
   { "backend", 'b', POPT_ARG_STRING, &dbbackend, 0, "Database server backend", DEFAULT_DB_BACKEND},
   { "data-dir", 'D', POPT_ARG_STRING, &sqlite_database_dir, 0, "Directory to store database files (sqlite)", "DIR" },
+  { "sqlite-profile", '\0', POPT_ARG_STRING, &sqlite_profile, 0, "Trade-off between durability and throughput of SQLite databases", "{durable,balanced,bulk}" },
+  { "sqlite-journal-mode", '\0', POPT_ARG_STRING, &sqlite_journal_mode, 0, "SQLite journal mode, overriding the profile", "{delete,truncate,persist,memory,wal,off}" },
+  { "sqlite-synchronous", '\0', POPT_ARG_STRING, &sqlite_synchronous, 0, "SQLite synchronisation level, overriding the profile", "{off,normal,full,extra}" },
+  { "sqlite-page-size", '\0', POPT_ARG_INT, &sqlite_page_size, 0, "Page size of new SQLite databases, overriding the profile", "BYTES" },
+  { "sqlite-cache-size", '\0', POPT_ARG_INT, &sqlite_cache_size, 0, "SQLite page cache size, overriding the profile", "KIB" },
+  { "sqlite-mmap-size", '\0', POPT_ARG_LONG, &sqlite_mmap_size, 0, "Amount of SQLite database files to map in memory, overriding the profile", "BYTES" },
+  { "sqlite-commit-rows", '\0', POPT_ARG_INT, &sqlite_commit_rows, 0, "Number of rows after which to commit to SQLite, overriding the profile (0 for no limit)", "N" },
+  { "sqlite-commit-interval", '\0', POPT_ARG_INT, &sqlite_commit_interval, 0, "Time after which to commit to SQLite, overriding the profile (0 for no limit)", "MS" },
+  { "sqlite-checkpoint-pages", '\0', POPT_ARG_INT, &sqlite_checkpoint_pages, 0, "Size of the SQLite WAL above which it is checkpointed after a commit, overriding the profile", "PAGES" },
 #if HAVE_LIBPQ
   { "pg-host", '\0', POPT_ARG_STRING, &pg_host, 0, "PostgreSQL server host to connect to", DEFAULT_PG_HOST },
   { "pg-port", '\0', POPT_ARG_STRING, &pg_port, 0, "PostgreSQL server port to connect to", DEFAULT_PG_PORT },
   { "pg-user", '\0', POPT_ARG_STRING, &pg_user, 0, "PostgreSQL user to connect as", DEFAULT_PG_USER },
   { "pg-pass", '\0', POPT_ARG_STRING, &pg_pass, 'p', "Password of the PostgreSQL user", DEFAULT_PG_PASS },
   { "pg-connect", '\0', POPT_ARG_STRING, &pg_conninfo, 'c', "PostgreSQL connection info string", "\"" DEFAULT_PG_CONNINFO "\""},
+  { "pg-copy", '\0', POPT_ARG_NONE, &pg_copy, 0, "Insert measurements into PostgreSQL with binary COPY rather than one INSERT per sample", NULL },
 #endif
   { "user", '\0', POPT_ARG_STRING, &uidstr, 0, "Change server's user id", "UID" },
   { "group", '\0', POPT_ARG_STRING, &gidstr, 0, "Change server's group id", "GID" },
   { "event-hook", 'H', POPT_ARG_STRING, &hook, 0, "Path to an event hook taking input on stdin", "HOOK" },
   { "timeout", 't', POPT_ARG_INT, &socket_timeout, 0, "Timeout after which idle receiving sockets are cleaned up to avoid resource exhaustion", "60"  },
+  { "event-backend", '\0', POPT_ARG_STRING, &event_backend, 0, "Mechanism used to wait for events on sockets", "{epoll,poll}" },
+  { "threads", '\0', POPT_ARG_INT, &threads, 0, "Number of threads handling clients, each domain being assigned to one (0 to handle everything in the main thread)", "0" },
+  { "queue-high", '\0', POPT_ARG_INT, &storage_high_watermark, 0, "Number of rows queued for a database above which reading from its clients is suspended", "4096" },
+  { "queue-low", '\0', POPT_ARG_INT, &storage_low_watermark, 0, "Number of rows queued for a database below which reading from its clients resumes", "1024" },
   { "debug-level", 'd', POPT_ARG_INT, &log_level, 0, "Increase debug level", "{1 .. 4}"  },
   { "logfile", '\0', POPT_ARG_STRING, &logfile_name, 0, "File to log to", DEFAULT_LOG_FILE },
   { "version", 'v', POPT_ARG_NONE, NULL, 'v', "Print version information and exit", NULL },
@@ -253,9 +281,21 @@ static void drop_privileges (const char *uidstr, const char *gidstr)
   }
 }
 
+/** Create a ClientHandler for a new connection in a worker thread.
+ *
+ * \param handle Socket object created by accept()ing the connection
+ *
+ * \see on_connect, eventloop_post
+ */
+static void on_connect_task(void* handle)
+{
+  (void)client_handler_new((Socket*)handle);
+}
+
 /** Callback called when a new connection is received on the listening Socket.
  *
- * This function creates a ClientHandler to manage the data from this Socket.
+ * This function creates a ClientHandler to manage the data from this Socket,
+ * or asks one of the worker threads to do so, if any.
  * The listening Socket would have been created using socket_server_new().
  *
  * \param new_sock Socket object created by accept()ing the connection
@@ -266,9 +306,17 @@ static void drop_privileges (const char *uidstr, const char *gidstr)
  */
 static void on_connect(Socket* new_sock, void* handle)
 {
+  EventLoop *worker = workers_next();
   (void)handle;
-  (void)client_handler_new(new_sock);
   logdebug("%s: New client connected\n", new_sock->name);
+
+  if (!worker) {
+    (void)client_handler_new(new_sock);
+
+  } else if (eventloop_post(worker, on_connect_task, new_sock)) {
+    logerror("%s: Failed to hand new client over to a worker thread\n", new_sock->name);
+    socket_free(new_sock);
+  }
 }
 
 int main(int argc, const char **argv)
@@ -328,6 +376,14 @@ int main(int argc, const char **argv)
 
   eventloop_init();
   eventloop_set_socket_timeout(socket_timeout);
+  if (event_backend && eventloop_set_backend(event_backend)) {
+    die ("Unsupported event backend '%s'\n", event_backend);
+  }
+  if (storage_high_watermark < 1 || storage_low_watermark < 0 ||
+      storage_low_watermark >= storage_high_watermark) {
+    die ("Invalid storage queue watermarks (high: %d, low: %d)\n",
+        storage_high_watermark, storage_low_watermark);
+  }
 
   Socket* server_sock;
   server_sock = socket_server_new("server", NULL, listen_service, on_connect, NULL);
@@ -347,7 +403,16 @@ int main(int argc, const char **argv)
 
   hook_setup();
 
-  eventloop_run();
+  if (threads < 0 || workers_setup(threads)) {
+    die ("Failed to start %d worker threads\n", threads);
+  }
+
+  int reason = eventloop_run();
+
+  workers_cleanup(reason);
+
+  /* Write the rows still queued by storage threads before exiting */
+  database_cleanup();
 
   signal_cleanup();
 
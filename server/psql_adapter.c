@@ -14,6 +14,7 @@
 
 #define _GNU_SOURCE  /* For NAN */
 #include <math.h>
+#include <stdarg.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,6 +29,7 @@
 #include "mstring.h"
 #include "guid.h"
 #include "json.h"
+#include "htonll.h"
 #include "oml_value.h"
 #include "oml_utils.h"
 #include "database.h"
@@ -41,6 +43,7 @@ char *pg_port = DEFAULT_PG_PORT;
 char *pg_user = DEFAULT_PG_USER;
 char *pg_pass = DEFAULT_PG_PASS;
 char *pg_conninfo = DEFAULT_PG_CONNINFO;
+int pg_copy = 0;
 
 /** Mapping between OML and PostgreSQL data types
  * \see psql_type_to_oml, psql_oml_to_type
@@ -66,6 +69,17 @@ static db_typemap psql_type_pair[] = {
   { OML_VECTOR_BOOL_VALUE,   "TEXT" },
 };
 
+/* Type OIDs (see PostgreSQL's catalog/pg_type.h) of the binary parameters */
+#define PG_BOOLOID 16
+#define PG_BYTEAOID 17
+#define PG_INT8OID 20
+#define PG_INT4OID 23
+#define PG_TEXTOID 25
+#define PG_FLOAT8OID 701
+
+/** Names of the metadata columns, which come first in INSERT statements */
+static const char *psql_metadata_cols[] = { "oml_sender_id", "oml_seq", "oml_ts_client", "oml_ts_server" };
+
 static int sql_stmt(PsqlDB* self, const char* stmt);
 
 /* Functions needed by the Database struct */
@@ -77,6 +91,13 @@ static int psql_table_create (Database* db, DbTable* table, int shallow);
 static int psql_table_free (Database *database, DbTable* table);
 static char *psql_prepared_var(Database *db, unsigned int order);
 static int psql_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count);
+static int psql_insert_copy(Database *db, DbTable *table, DbRow *rows, int count);
+static int psql_copy_end(Database *db);
+#ifdef LIBPQ_HAS_PIPELINING
+static int psql_insert_pipeline(Database *db, DbTable *table, DbRow *rows, int count);
+#endif
+static void psql_idle(Database *db);
+static int psql_commit_idle(Database *db);
 static char* psql_get_key_value (Database* database, const char* table, const char* key_column, const char* value_column, const char* key);
 static int psql_set_key_value (Database* database, const char* table, const char* key_column, const char* value_column, const char* key, const char* value);
 static char* psql_get_metadata (Database* database, const char* key);
@@ -230,6 +251,7 @@ sql_stmt(PsqlDB* self, const char* stmt)
 static int
 psql_stmt(Database* db, const char* stmt)
 {
+ psql_idle(db);
  return sql_stmt((PsqlDB*)db->handle, stmt);
 }
 
@@ -321,6 +343,16 @@ psql_create_database(Database* db)
   db->table_create_meta = dba_table_create_meta;
   db->table_free = psql_table_free;
   db->insert = psql_insert;
+  if (pg_copy) {
+    self->copy_buf = mbuf_create2 (PG_COPY_BUFFER_SIZE, PG_COPY_BUFFER_SIZE);
+    db->insert_batch = psql_insert_copy;
+#ifdef LIBPQ_HAS_PIPELINING
+  } else {
+    self->pending = oml_calloc (PG_PIPELINE_DEPTH, sizeof(PsqlPending));
+    db->insert_batch = psql_insert_pipeline;
+#endif
+  }
+  db->idle = psql_commit_idle;
   db->add_sender_id = psql_add_sender_id;
   db->get_metadata = psql_get_metadata;
   db->set_metadata = psql_set_metadata;
@@ -353,10 +385,162 @@ psql_release(Database* db)
   PsqlDB* self = (PsqlDB*)db->handle;
   dba_end_transaction (db);
   PQfinish(self->conn);
+  if (self->copy_buf) { mbuf_destroy (self->copy_buf); }
+  if (self->pending) { oml_free (self->pending); }
   oml_free(self);
   db->handle = NULL;
 }
 
+/** Allocate the parameter arena of the INSERT statement of a table.
+ *
+ * All parameters are sent in binary format, until psql_table_params_check
+ * finds columns of other types.
+ *
+ * \param psqltable PsqlTable to initialise
+ * \param nfields number of measurement fields in the table
+ * \return 0 on success, -1 otherwise
+ * \see psql_bind_params, psql_table_params_free
+ */
+static int
+psql_table_params_init(PsqlTable *psqltable, int nfields)
+{
+  int i;
+
+  psqltable->nparams = 4 + nfields;
+  psqltable->values = oml_calloc(psqltable->nparams, sizeof(char*));
+  psqltable->lengths = oml_calloc(psqltable->nparams, sizeof(int));
+  psqltable->formats = oml_calloc(psqltable->nparams, sizeof(int));
+  psqltable->scalars = oml_calloc(psqltable->nparams, sizeof(uint64_t));
+  psqltable->json = oml_calloc(nfields > 0 ? nfields : 1, sizeof(char*));
+
+  if (!psqltable->values || !psqltable->lengths || !psqltable->formats ||
+      !psqltable->scalars || !psqltable->json) {
+    return -1;
+  }
+  for (i = 0; i < psqltable->nparams; i++) {
+    psqltable->formats[i] = 1;
+  }
+  return 0;
+}
+
+/** Free the parameter arena of the INSERT statement of a table.
+ * \param psqltable PsqlTable to clean up
+ * \see psql_table_params_init
+ */
+static void
+psql_table_params_free(PsqlTable *psqltable)
+{
+  int i;
+
+  if (psqltable->json) {
+    for (i = 0; i < psqltable->nparams - 4; i++) {
+      if (psqltable->json[i]) { oml_free (psqltable->json[i]); }
+    }
+    oml_free (psqltable->json);
+  }
+  if (psqltable->values) { oml_free (psqltable->values); }
+  if (psqltable->lengths) { oml_free (psqltable->lengths); }
+  if (psqltable->formats) { oml_free (psqltable->formats); }
+  if (psqltable->scalars) { oml_free (psqltable->scalars); }
+  if (psqltable->text) { oml_free (psqltable->text); }
+}
+
+/** Get the type of the binary representation in which values of an OML type are sent.
+ * \param type OmlValueT of the values
+ * \return the Oid of the PostgreSQL type
+ * \see psql_type_pair, psql_bind_params
+ */
+static Oid
+psql_param_oid(OmlValueT type)
+{
+  switch (type) {
+  case OML_LONG_VALUE:
+  case OML_INT32_VALUE:  return PG_INT4OID;
+  case OML_UINT32_VALUE:
+  case OML_INT64_VALUE:
+  case OML_UINT64_VALUE:
+  case OML_GUID_VALUE:   return PG_INT8OID;
+  case OML_DOUBLE_VALUE: return PG_FLOAT8OID;
+  case OML_BOOL_VALUE:   return PG_BOOLOID;
+  case OML_BLOB_VALUE:   return PG_BYTEAOID;
+  default:               return PG_TEXTOID; /* Strings and vectors, as JSON */
+  }
+}
+
+/** Choose the format of each parameter of the INSERT statement of a table.
+ *
+ * The binary representation of a value must be that of the type of its
+ * column. This is the case for tables created by this adapter, but not
+ * necessarily for existing ones, e.g., created by other versions or by hand.
+ * Parameters for which the server expects another type are passed in text
+ * format instead, and converted by the server.
+ *
+ * \param db Database of the table
+ * \param table DbTable whose PsqlTable to update
+ * \param types types of the parameters of the prepared statement, as given by PQparamtype(3)
+ * \param ntypes number of types
+ * \return the number of parameters passed as text, or -1 on error
+ * \see psql_bind_params
+ */
+static int
+psql_table_params_check(Database *db, DbTable *table, const Oid *types, int ntypes)
+{
+  PsqlTable *t = (PsqlTable*)table->handle;
+  struct schema *schema = table->schema;
+  OmlValueT type;
+  int i, ntext = 0;
+
+  if (ntypes != t->nparams) {
+    logerror("psql:%s: INSERT INTO '%s' has %d parameters instead of %d\n",
+        db->name, schema->name, ntypes, t->nparams);
+    return -1;
+  }
+
+  for (i = 0; i < t->nparams; i++) {
+    type = i < 2 ? OML_INT32_VALUE : i < 4 ? OML_DOUBLE_VALUE : schema->fields[i-4].type;
+    t->formats[i] = types[i] == psql_param_oid(type);
+    if (!t->formats[i]) {
+      logwarn("psql:%s: Column '%s' of table '%s' has type %u instead of %u; passing %s values as text\n",
+          db->name, i < 4 ? psql_metadata_cols[i] : schema->fields[i-4].name, schema->name,
+          types[i], psql_param_oid(type), oml_type_to_s(type));
+      ntext++;
+    }
+  }
+
+  if (ntext && !t->text) {
+    t->text = oml_calloc(t->nparams, PG_TEXT_PARAM_SIZE);
+    if (!t->text) {
+      logerror("psql:%s: Could not allocate text parameters for table '%s'\n", db->name, schema->name);
+      return -1;
+    }
+  }
+  return ntext;
+}
+
+/** Choose the format of each parameter of a prepared INSERT statement, from its description.
+ * \param db Database of the table
+ * \param table DbTable whose PsqlTable to update
+ * \param desc result of PQdescribePrepared(3) for the statement
+ * \return the number of parameters passed as text, or -1 on error
+ * \see psql_table_params_check
+ */
+static int
+psql_table_params_describe(Database *db, DbTable *table, const PGresult *desc)
+{
+  int i, n = PQnparams(desc), ret;
+  Oid *types = oml_calloc(n > 0 ? n : 1, sizeof(Oid));
+
+  if (!types) {
+    return -1;
+  }
+  for (i = 0; i < n; i++) {
+    types[i] = PQparamtype(desc, i);
+  }
+  ret = psql_table_params_check(db, table, types, n);
+  oml_free(types);
+  return ret;
+}
+
 /** Create a PostgreSQL database and adapter structures
  * \see db_adapter_create
  */
@@ -384,6 +568,7 @@ psql_table_create (Database *db, DbTable *table, int shallow)
     return -1;
   }
   psqldb = (PsqlDB*)db->handle;
+  psql_idle(db);
 
   if (!shallow) {
     if (dba_table_create_from_schema(db, table->schema)) {
@@ -400,6 +585,11 @@ psql_table_create (Database *db, DbTable *table, int shallow)
         table->schema->name);
   }
   psqltable = (PsqlTable*)oml_malloc(sizeof(PsqlTable));
+  if (!psqltable || psql_table_params_init(psqltable, table->schema->nfields)) {
+    logerror("psql:%s: Could not allocate parameters for table '%s'\n",
+        db->name, table->schema->name);
+    goto fail_exit;
+  }
   table->handle = psqltable;
 
   /* Prepare the insert statement  */
@@ -445,6 +635,20 @@ psql_table_create (Database *db, DbTable *table, int shallow)
       PQclear(res);
       goto fail_exit;
     }
+    PQclear(res);
+
+    res = PQdescribePrepared(psqldb->conn, mstring_buf (insert_name));
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      logerror("psql:%s: Could not describe statement: %s", /* PQerrorMessage strings already have '\n' */
+          db->name, PQerrorMessage(psqldb->conn));
+      PQclear(res);
+      goto fail_exit;
+    }
+  }
+  /* Existing tables may not have the column types binary parameters need */
+  if (psql_table_params_describe(db, table, res) < 0) {
+    PQclear(res);
+    goto fail_exit;
   }
   PQclear(res);
 
@@ -456,7 +660,11 @@ psql_table_create (Database *db, DbTable *table, int shallow)
 fail_exit:
   if (insert) { mstring_delete (insert); }
   if (insert_name) { mstring_delete (insert_name); }
-  if (psqltable) { oml_free (psqltable); }
+  if (psqltable) {
+    psql_table_params_free (psqltable);
+    oml_free (psqltable);
+    if (table->handle == psqltable) { table->handle = NULL; }
+  }
   return -1;
 }
 
@@ -473,6 +681,7 @@ psql_table_free (Database *database, DbTable *table)
   PsqlTable *psqltable = (PsqlTable*)table->handle;
   if (psqltable) {
     mstring_delete (psqltable->insert_stmt);
+    psql_table_params_free (psqltable);
     oml_free (psqltable);
   }
   return 0;
@@ -496,10 +705,280 @@ psql_prepared_var(Database *db, unsigned int order)
   return s;
 }
 
-/** Used as allocation size of strings to hold integers.
- * XXX: We play it safe as INT64_MAX is 9223372036854775807, that is 19 characters
+/** Set a text parameter of the INSERT statement of a table.
+ * \param t PsqlTable holding the parameters
+ * \param i index of the parameter
+ * \param fmt printf(3)-like format of the text
+ */
+static void
+psql_param_text(PsqlTable *t, int i, const char *fmt, ...)
+{
+  char *text = &t->text[i * PG_TEXT_PARAM_SIZE];
+  va_list va;
+
+  va_start(va, fmt);
+  vsnprintf(text, PG_TEXT_PARAM_SIZE, fmt, va);
+  va_end(va);
+  t->values[i] = text;
+  t->lengths[i] = 0;
+}
+
+/** Set an integer parameter of the INSERT statement of a table.
+ * \param t PsqlTable holding the parameters
+ * \param i index of the parameter
+ * \param value value to set
+ * \param size 4 or 8, size of the integer in bytes (INT4 or INT8) in binary format
+ */
+static void
+psql_param_int(PsqlTable *t, int i, int64_t value, int size)
+{
+  if (!t->formats[i]) {
+    psql_param_text(t, i, "%" PRId64, value);
+    return;
+  }
+  if (size == 4) {
+    *(uint32_t*)&t->scalars[i] = htonl((uint32_t)value);
+  } else {
+    t->scalars[i] = htonll((uint64_t)value);
+  }
+  t->values[i] = (const char*)&t->scalars[i];
+  t->lengths[i] = size;
+}
+
+/** Set a FLOAT8 parameter of the INSERT statement of a table.
+ * \param t PsqlTable holding the parameters
+ * \param i index of the parameter
+ * \param value value to set
+ */
+static void
+psql_param_double(PsqlTable *t, int i, double value)
+{
+  uint64_t v;
+
+  if (!t->formats[i]) {
+    psql_param_text(t, i, "%.17g", value);
+    return;
+  }
+  memcpy(&v, &value, sizeof(v));
+  psql_param_int(t, i, (int64_t)v, 8);
+}
+
+/** Set a raw (TEXT or BYTEA) parameter of the INSERT statement of a table.
+ * The data is not copied, and must remain valid until the statement is sent.
+ * In text format, it must be NUL-terminated.
+ * \param t PsqlTable holding the parameters
+ * \param i index of the parameter
+ * \param data bytes to pass, or NULL for an SQL NULL
+ * \param size number of bytes
+ */
+static void
+psql_param_bytes(PsqlTable *t, int i, const void *data, size_t size)
+{
+  t->values[i] = (const char*)data;
+  t->lengths[i] = (int)size;
+}
+
+/** Set a BYTEA parameter of the INSERT statement of a table in text format.
+ * The bytes are written in hex, as PQescapeByteaConn(3) would, in a buffer of the PsqlTable.
+ * \param t PsqlTable holding the parameters
+ * \param i index of the parameter
+ * \param field index of the field, whose buffer to use
+ * \param data bytes to pass
+ * \param size number of bytes
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_param_hex(PsqlTable *t, int i, int field, const uint8_t *data, size_t size)
+{
+  static const char digits[] = "0123456789abcdef";
+  size_t need = 2 * size + 3, j;
+  char *p = t->json[field];
+
+  if (!p || oml_malloc_usable_size(p) < need) {
+    if (!(p = oml_realloc(p, need))) {
+      return -1;
+    }
+    t->json[field] = p;
+  }
+  *p++ = '\\';
+  *p++ = 'x';
+  for (j = 0; j < size; j++) {
+    *p++ = digits[data[j] >> 4];
+    *p++ = digits[data[j] & 0xf];
+  }
+  *p = '\0';
+  t->values[i] = t->json[field];
+  t->lengths[i] = 0;
+  return 0;
+}
+
+/** Set the parameters of the INSERT statement of a table for one row.
+ *
+ * Parameters are passed in binary format, in the representation of the
+ * PostgreSQL type of their column (see psql_type_pair). They are stored in
+ * the PsqlTable, or point directly to the values, so nothing is allocated
+ * except, when they grow, the buffers holding vectors as JSON.
+ *
+ * Parameters for columns of other types are passed in text format, as
+ * chosen by psql_table_params_check.
+ *
+ * \param db Database to write in
+ * \param table DbTable to insert data in
+ * \param sender_id sender ID
+ * \param seq_no sequence number
+ * \param time_stamp timestamp of the sample at the sender
+ * \param time_stamp_server timestamp of the sample at the server
+ * \param values OmlValue array to insert
+ * \param value_count number of values
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_bind_params(Database* db, DbTable* table, int sender_id, int seq_no, double time_stamp, double time_stamp_server,
+    OmlValue* values, int value_count)
+{
+  PsqlTable* t = (PsqlTable*)table->handle;
+  struct schema *schema = table->schema;
+  OmlValue* v = values;
+  ssize_t json_sz;
+  void *ptr;
+  size_t n;
+  int i;
+
+  if (value_count != schema->nfields) {
+    logerror("psql:%s: Failed to insert %d values into table '%s' with %d columns\n",
+        db->name, value_count, schema->name, schema->nfields);
+    return -1;
+  }
+
+  psql_param_int(t, 0, sender_id, 4);
+  psql_param_int(t, 1, seq_no, 4);
+  psql_param_double(t, 2, time_stamp);
+  psql_param_double(t, 3, time_stamp_server);
+
+  for (i = 0; i < value_count; i++, v++) {
+    struct schema_field *field = &schema->fields[i];
+    if (oml_value_get_type(v) != field->type) {
+      logerror("psql:%s: Value %d type mismatch for table '%s'\n", db->name, i, schema->name);
+      return -1;
+    }
+    ptr = v->value.vectorValue.ptr;
+    n = v->value.vectorValue.nof_elts;
+    json_sz = 0;
+
+    switch (field->type) {
+    case OML_LONG_VALUE:   psql_param_int(t, 4+i, (int32_t)omlc_get_long(*oml_value_get_value(v)), 4); break;
+    case OML_INT32_VALUE:  psql_param_int(t, 4+i, omlc_get_int32(*oml_value_get_value(v)), 4); break;
+    case OML_UINT32_VALUE: psql_param_int(t, 4+i, omlc_get_uint32(*oml_value_get_value(v)), 8); break;
+    case OML_INT64_VALUE:  psql_param_int(t, 4+i, omlc_get_int64(*oml_value_get_value(v)), 8); break;
+    case OML_UINT64_VALUE:
+      if (!t->formats[4+i]) {
+        /* The column may hold larger values, e.g., NUMERIC */
+        psql_param_text(t, 4+i, "%" PRIu64, omlc_get_uint64(*oml_value_get_value(v)));
+        break;
+      }
+      if (omlc_get_uint64(*oml_value_get_value(v)) > INT64_MAX) {
+        logerror("psql:%s: Value %" PRIu64 " out of range for column '%s' of table '%s'\n",
+            db->name, omlc_get_uint64(*oml_value_get_value(v)), field->name, schema->name);
+        return -1;
+      }
+      psql_param_int(t, 4+i, (int64_t)omlc_get_uint64(*oml_value_get_value(v)), 8);
+      break;
+    case OML_DOUBLE_VALUE: psql_param_double(t, 4+i, omlc_get_double(*oml_value_get_value(v))); break;
+    case OML_BOOL_VALUE:
+      if (!t->formats[4+i]) {
+        psql_param_text(t, 4+i, "%d", omlc_get_bool(*oml_value_get_value(v)) ? 1 : 0);
+      } else {
+        psql_param_bytes(t, 4+i, omlc_get_bool(*oml_value_get_value(v)) ? "\1" : "\0", 1);
+      }
+      break;
+    case OML_STRING_VALUE:
+      psql_param_bytes(t, 4+i,
+          omlc_get_string_ptr(*oml_value_get_value(v)) ? omlc_get_string_ptr(*oml_value_get_value(v)) : "",
+          omlc_get_string_length(*oml_value_get_value(v)));
+      break;
+    case OML_BLOB_VALUE:
+      if (!t->formats[4+i]) {
+        if (psql_param_hex(t, 4+i, i, omlc_get_blob_ptr(*oml_value_get_value(v)),
+              omlc_get_blob_length(*oml_value_get_value(v)))) {
+          logerror("psql:%s: Could not allocate memory for blob in field %d of table '%s'\n",
+              db->name, i, schema->name);
+          return -1;
+        }
+        break;
+      }
+      psql_param_bytes(t, 4+i,
+          omlc_get_blob_ptr(*oml_value_get_value(v)) ? omlc_get_blob_ptr(*oml_value_get_value(v)) : "",
+          omlc_get_blob_length(*oml_value_get_value(v)));
+      break;
+    case OML_GUID_VALUE:
+      if(omlc_get_guid(*oml_value_get_value(v)) != OMLC_GUID_NULL) {
+        psql_param_int(t, 4+i, (int64_t)omlc_get_guid(*oml_value_get_value(v)), 8);
+      } else {
+        psql_param_bytes(t, 4+i, NULL, 0);
+      }
+      break;
+
+    case OML_VECTOR_DOUBLE_VALUE: json_sz = vector_double_to_json(ptr, n, &t->json[i]); break;
+    case OML_VECTOR_INT32_VALUE:  json_sz = vector_int32_to_json(ptr, n, &t->json[i]); break;
+    case OML_VECTOR_UINT32_VALUE: json_sz = vector_uint32_to_json(ptr, n, &t->json[i]); break;
+    case OML_VECTOR_INT64_VALUE:  json_sz = vector_int64_to_json(ptr, n, &t->json[i]); break;
+    case OML_VECTOR_UINT64_VALUE: json_sz = vector_uint64_to_json(ptr, n, &t->json[i]); break;
+    case OML_VECTOR_BOOL_VALUE:   json_sz = vector_bool_to_json(ptr, n, &t->json[i]); break;
+
+    default:
+      logerror("psql:%s: Unknown type %d in col '%s' of table '%s'; this is probably a bug\n",
+          db->name, field->type, field->name, schema->name);
+      return -1;
+    }
+
+    if (omlc_is_vector_type(field->type)) {
+      psql_param_bytes(t, 4+i, json_sz < 0 ? NULL : t->json[i], json_sz);
+    }
+  }
+
+  return 0;
+}
+
+/** Get the server timestamp for new rows, and commit the current transaction
+ * if it has been open for more than a second.
+ *
+ * \param db Database to write in
+ * \param[out] time_stamp_server time since the start of the experiment
+ * \return 0 on success, -1 if the transaction could not be reopened
  */
-#define MAX_DIGITS 32
+static int
+psql_prepare_insert(Database *db, double *time_stamp_server)
+{
+  PsqlDB* psqldb = (PsqlDB*)db->handle;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  *time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
+
+  if (tv.tv_sec > psqldb->last_commit) {
+    /* psql_stmt finishes any COPY or pipeline before committing */
+    if (dba_reopen_transaction (db) == -1) {
+      return -1;
+    }
+    psqldb->last_commit = tv.tv_sec;
+    psqldb->uncommitted = 0;
+  }
+  return 0;
+}
+
+/** Add the rows found not to be written since the last call to a count of failed rows.
+ *
+ * \param psqldb PsqlDB of the Database
+ * \param failed number of rows which could not be inserted in the current batch
+ * \return the total number of failed rows, to report to the storage thread
+ * \see db_adapter_insert_batch, db_adapter_idle
+ */
+static int
+psql_failed(PsqlDB *psqldb, int failed)
+{
+  failed += psqldb->failed;
+  psqldb->failed = 0;
+  return failed;
+}
 
 /** Insert value in the PostgreSQL database.
  * \see db_adapter_insert
@@ -510,152 +989,664 @@ psql_insert(Database* db, DbTable* table, int sender_id, int seq_no, double time
   PsqlDB* psqldb = (PsqlDB*)db->handle;
   PsqlTable* psqltable = (PsqlTable*)table->handle;
   PGresult* res;
-  int i;
   double time_stamp_server;
   const char* insert_stmt = mstring_buf (psqltable->insert_stmt);
-  unsigned char *escaped_blob;
-  size_t len; /* Will raise warning if we use it in some codepaths where it risk not being initialised;
-		 It's a Good Thing(TM) */
 
-  char *paramValues[4+value_count];
-  for (i=0;i<4+value_count;i++) {
-    /* XXX: If some values are strings or blobs, we'll have to reallocate them */
-    paramValues[i] = oml_malloc(MAX_DIGITS);
+  psql_idle(db);
+
+  if (psql_prepare_insert(db, &time_stamp_server)) {
+    return -1;
   }
 
-  int paramLength[4+value_count];
-  int paramFormat[4+value_count];
+  if (psql_bind_params(db, table, sender_id, seq_no, time_stamp, time_stamp_server,
+        values, value_count)) {
+    return -1;
+  }
+  /* Use stuff from http://www.postgresql.org/docs/current/static/plpgsql-control-structures.html#PLPGSQL-ERROR-TRAPPING */
 
-  snprintf(paramValues[0], MAX_DIGITS, "%i",sender_id);
-  paramLength[0] = 0;
-  paramFormat[0] = 0;
+  res = PQexecPrepared(psqldb->conn, insert_stmt,
+                       psqltable->nparams, psqltable->values,
+                       psqltable->lengths, psqltable->formats, 0 );
 
-  snprintf(paramValues[1], MAX_DIGITS, "%i",seq_no);
-  paramLength[1] = 0;
-  paramFormat[1] = 0;
+  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+    logerror("psql:%s: INSERT INTO '%s' failed: %s", /* PQerrorMessage strings already have '\n' */
+        db->name, table->schema->name, PQerrorMessage(psqldb->conn));
+    PQclear(res);
+    return -1;
+  }
+  PQclear(res);
+  psqldb->uncommitted = 1;
 
-  snprintf(paramValues[2], MAX_DIGITS, "%.14e",time_stamp);
-  paramLength[2] = 0;
-  paramFormat[2] = 0;
+  return 0;
+}
 
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
+#ifdef LIBPQ_HAS_PIPELINING
+/** Queue an entry in the list of commands awaiting their result.
+ *
+ * The list has room for PG_PIPELINE_DEPTH entries; callers must collect
+ * results before it fills up.
+ *
+ * \param psqldb PsqlDB of the pipeline
+ * \param table DbTable of an INSERT, or NULL for a synchronisation point
+ * \param sender_id sender ID of the inserted row
+ * \param seq_no sequence number of the inserted row
+ * \return 0 on success, -1 if the list is full
+ */
+static int
+psql_pipeline_push(PsqlDB *psqldb, DbTable *table, int sender_id, int seq_no)
+{
+  PsqlPending *p;
 
-  if (tv.tv_sec > psqldb->last_commit) {
-    if (dba_reopen_transaction (db) == -1) {
-      return -1;
+  if (psqldb->pending_count >= PG_PIPELINE_DEPTH) {
+    logerror("psql: Too many pipelined commands pending (%d), not tracking sample %d from sender %d\n",
+        psqldb->pending_count, seq_no, sender_id);
+    return -1;
+  }
+  p = &psqldb->pending[(psqldb->pending_head + psqldb->pending_count) % PG_PIPELINE_DEPTH];
+  p->table = table;
+  p->sender_id = sender_id;
+  p->seq_no = seq_no;
+  psqldb->pending_count++;
+  return 0;
+}
+
+/** Mark the end of a group of commands in the pipeline, and flush them to the server.
+ * \param db Database to write in
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_pipeline_sync(Database *db)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+
+  if (PQpipelineSync(psqldb->conn) != 1) {
+    logerror("psql:%s: Could not synchronise pipeline: %s", /* PQerrorMessage strings already have '\n' */
+        db->name, PQerrorMessage(psqldb->conn));
+    return -1;
+  }
+  return psql_pipeline_push(psqldb, NULL, 0, 0);
+}
+
+/** Forget the pending commands for which no result will come.
+ * \param db Database to write in
+ * \return the number of INSERTs forgotten
+ */
+static int
+psql_pipeline_drop(Database *db)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  int failed = 0;
+
+  for (; psqldb->pending_count > 0; psqldb->pending_count--) {
+    if (psqldb->pending[psqldb->pending_head].table) {
+      failed++;
     }
-    psqldb->last_commit = tv.tv_sec;
+    psqldb->pending_head = (psqldb->pending_head + 1) % PG_PIPELINE_DEPTH;
+  }
+  if (failed) {
+    logerror("psql:%s: No result for %d pipelined INSERTs, assuming they failed\n", db->name, failed);
   }
+  return failed;
+}
+
+/** Collect the results of pipelined commands.
+ *
+ * Results come back in the order the commands were sent, so they are matched
+ * to the list of pending commands to report errors against the right table
+ * and sample. After an error, the server skips all commands until the next
+ * synchronisation point.
+ *
+ * \param db Database to write in
+ * \param block if non-zero, wait until all pending commands have completed,
+ * otherwise only process the results already available
+ * \return the number of failed INSERTs
+ */
+static int
+psql_pipeline_collect(Database *db, int block)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  PsqlPending *p;
+  PGresult *res;
+  int failed = 0, nulls = 0;
+
+  while (psqldb->pending_count > 0) {
+    if (!block) {
+      if (!PQconsumeInput(psqldb->conn)) {
+        logerror("psql:%s: Could not read pipeline results: %s", /* PQerrorMessage strings already have '\n' */
+            db->name, PQerrorMessage(psqldb->conn));
+        break;
+      }
+      if (PQisBusy(psqldb->conn)) {
+        break;
+      }
+    }
 
-  snprintf(paramValues[3], MAX_DIGITS, "%.14e",time_stamp_server);
-  paramLength[3] = 0;
-  paramFormat[3] = 0;
+    if (!(res = PQgetResult(psqldb->conn))) {
+      /* In pipeline mode, libpq returns a NULL after the results of each
+       * command, then moves on to the next command it sent; no NULL follows a
+       * PGRES_PIPELINE_SYNC. A second NULL in a row therefore means libpq is
+       * not waiting for any more results: it would otherwise have blocked
+       * (block) or reported being busy (!block). Whatever is left in the list
+       * will never get a result, e.g., after the connection was lost. */
+      if (++nulls > 1) {
+        failed += psql_pipeline_drop(db);
+        break;
+      }
+      continue;
+    }
+    nulls = 0;
 
-  OmlValue* v = values;
-  for (i = 0; i < value_count; i++, v++) {
-    struct schema_field *field = &table->schema->fields[i];
-    if (oml_value_get_type(v) != field->type) {
-      logerror("psql:%s: Value %d type mismatch for table '%s'\n", db->name, i, table->schema->name);
+    p = &psqldb->pending[psqldb->pending_head];
+    psqldb->pending_head = (psqldb->pending_head + 1) % PG_PIPELINE_DEPTH;
+    psqldb->pending_count--;
+
+    switch (PQresultStatus(res)) {
+    case PGRES_COMMAND_OK:
+    case PGRES_PIPELINE_SYNC:
+      break;
+    case PGRES_PIPELINE_ABORTED:
+      psqldb->aborted++;
+      failed++;
+      break;
+    default:
+      logerror("psql:%s: INSERT INTO '%s' failed for sample %d from sender %d: %s", /* PQresultErrorMessage strings already have '\n' */
+          db->name, p->table ? p->table->schema->name : "(none)", p->seq_no, p->sender_id,
+          PQresultErrorMessage(res));
+      failed++;
+      break;
+    }
+    if (PQresultStatus(res) == PGRES_PIPELINE_SYNC && psqldb->aborted) {
+      logwarn("psql:%s: %d pipelined INSERTs skipped after an error\n", db->name, psqldb->aborted);
+      psqldb->aborted = 0;
+    }
+    PQclear(res);
+  }
+
+  return failed;
+}
+
+/** Finish the pipeline in progress, if any, waiting for all pending results.
+ * \param db Database to write in
+ * \return the number of INSERTs, accepted with earlier batches, which failed
+ */
+static int
+psql_pipeline_end(Database *db)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  int failed;
+
+  if (!psqldb->pipeline) {
+    return 0;
+  }
+  failed = psql_pipeline_collect(db, 1);
+  if (PQexitPipelineMode(psqldb->conn) != 1) {
+    logwarn("psql:%s: Could not leave pipeline mode: %s", /* PQerrorMessage strings already have '\n' */
+        db->name, PQerrorMessage(psqldb->conn));
+  }
+  psqldb->pipeline = 0;
+  return failed;
+}
+
+/** Insert a batch of rows in the PostgreSQL database, without waiting for each INSERT to complete.
+ *
+ * The INSERTs are sent in pipeline mode, followed by a synchronisation point,
+ * and their results are collected as they become available, while the next
+ * batches are sent. Up to PG_PIPELINE_DEPTH commands, including
+ * synchronisation points, can be in flight before waiting for the server to
+ * catch up.
+ *
+ * \see db_adapter_insert_batch, psql_pipeline_collect
+ */
+static int
+psql_insert_pipeline(Database *db, DbTable *table, DbRow *rows, int count)
+{
+  PsqlDB* psqldb = (PsqlDB*)db->handle;
+  PsqlTable* psqltable = (PsqlTable*)table->handle;
+  const char* insert_stmt = mstring_buf (psqltable->insert_stmt);
+  double time_stamp_server;
+  int i, failed = 0;
+
+  if (psql_prepare_insert(db, &time_stamp_server)) {
+    return psql_failed(psqldb, count);
+  }
+
+  if (!psqldb->pipeline) {
+    if (PQenterPipelineMode(psqldb->conn) != 1) {
+      logerror("psql:%s: Could not enter pipeline mode: %s", /* PQerrorMessage strings already have '\n' */
+          db->name, PQerrorMessage(psqldb->conn));
+      return psql_failed(psqldb, count);
+    }
+    psqldb->pipeline = 1;
+  }
+
+  /* The previous batch ended with a synchronisation point, so all its
+   * commands have been sent, and their results can be waited for */
+  if (psqldb->pending_count >= PG_PIPELINE_DEPTH - 1) {
+    failed += psql_pipeline_collect(db, 1);
+  }
+
+  for (i = 0; i < count; i++) {
+    if (psqldb->pending_count >= PG_PIPELINE_DEPTH - 1) {
+      /* Keep the last slot for the synchronisation point */
+      psql_pipeline_sync(db);
+      failed += psql_pipeline_collect(db, 1);
+    }
+
+    if (psql_bind_params(db, table, rows[i].sender_id, rows[i].seq_no, rows[i].time_stamp,
+          time_stamp_server, rows[i].values, rows[i].value_count)) {
+      failed++;
+
+    } else if (PQsendQueryPrepared(psqldb->conn, insert_stmt, psqltable->nparams, psqltable->values,
+          psqltable->lengths, psqltable->formats, 0) != 1) {
+      logerror("psql:%s: Could not send INSERT INTO '%s' for sample %d from sender %d: %s", /* PQerrorMessage strings already have '\n' */
+          db->name, table->schema->name, rows[i].seq_no, rows[i].sender_id, PQerrorMessage(psqldb->conn));
+      failed++;
+
+    } else if (psql_pipeline_push(psqldb, table, rows[i].sender_id, rows[i].seq_no)) {
+      failed++;
+    }
+  }
+
+  psql_pipeline_sync(db);
+  failed += psql_pipeline_collect(db, 0);
+  psqldb->uncommitted = 1;
+
+  return psql_failed(psqldb, failed);
+}
+#endif /* LIBPQ_HAS_PIPELINING */
+
+/** Finish any COPY or pipeline in progress, so another command can be sent to the server.
+ *
+ * Rows of earlier batches found to have failed are counted in PsqlDB's
+ * failed, to be reported with the next batch.
+ *
+ * \param db Database to write in
+ * \see psql_copy_end, psql_pipeline_end, psql_failed
+ */
+static void
+psql_idle(Database *db)
+{
+  psql_copy_end(db);
+#ifdef LIBPQ_HAS_PIPELINING
+  {
+    PsqlDB *psqldb = (PsqlDB*)db->handle;
+    psqldb->failed += psql_pipeline_end(db);
+  }
+#endif
+}
+
+/** Finish any COPY or pipeline in progress, and commit, while no new rows come in.
+ *
+ * Otherwise, the last rows received would only reach the database once more
+ * data arrives.
+ *
+ * \param db Database to write in
+ * \return the number of previously-accepted rows which could not be written
+ * \see db_adapter_idle, psql_idle
+ */
+static int
+psql_commit_idle(Database *db)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+
+  if (psqldb->uncommitted) {
+    /* psql_stmt finishes any COPY or pipeline before committing */
+    if (dba_reopen_transaction (db) == 0) {
+      psqldb->last_commit = time (NULL);
+      psqldb->uncommitted = 0;
+    }
+  }
+  return psql_failed(psqldb, 0);
+}
+
+/** Signature and header of the binary COPY format (no flags, no extension) */
+static const char copy_header[19] = "PGCOPY\n\377\r\n\0\0\0\0\0\0\0\0\0";
+
+/** Append an integer in network byte order to the COPY buffer, preceded by its length.
+ * \param buf MBuffer to write into
+ * \param value value to write
+ * \param size 4 or 8, size of the integer in bytes
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_int(MBuffer *buf, int64_t value, int size)
+{
+  uint32_t nv32;
+  uint64_t nv64;
+  uint32_t len = htonl(size);
+
+  if (mbuf_write(buf, (uint8_t*)&len, 4)) {
+    return -1;
+  }
+  if (size == 4) {
+    nv32 = htonl((uint32_t)value);
+    return mbuf_write(buf, (uint8_t*)&nv32, 4);
+  }
+  nv64 = htonll((uint64_t)value);
+  return mbuf_write(buf, (uint8_t*)&nv64, 8);
+}
+
+/** Append a FLOAT8 in network byte order to the COPY buffer, preceded by its length.
+ * \param buf MBuffer to write into
+ * \param value value to write
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_double(MBuffer *buf, double value)
+{
+  uint64_t v;
+
+  memcpy(&v, &value, sizeof(v));
+  return psql_copy_put_int(buf, (int64_t)v, 8);
+}
+
+/** Append raw bytes (TEXT or BYTEA) to the COPY buffer, preceded by their length.
+ * \param buf MBuffer to write into
+ * \param data bytes to write, or NULL for an SQL NULL
+ * \param size number of bytes
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_bytes(MBuffer *buf, const void *data, size_t size)
+{
+  uint32_t len = htonl(data ? (uint32_t)size : (uint32_t)-1);
+
+  if (mbuf_write(buf, (uint8_t*)&len, 4)) {
+    return -1;
+  }
+  return data ? mbuf_write(buf, (const uint8_t*)data, size) : 0;
+}
+
+/** Append a vector to the COPY buffer as JSON text.
+ * \param buf MBuffer to write into
+ * \param v OmlValue containing the vector
+ * \param json pointer to a reusable buffer for the JSON string
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_put_vector(MBuffer *buf, OmlValue *v, char **json)
+{
+  ssize_t json_sz = -1;
+  void *ptr = v->value.vectorValue.ptr;
+  size_t n = v->value.vectorValue.nof_elts;
+
+  switch (oml_value_get_type(v)) {
+  case OML_VECTOR_DOUBLE_VALUE: json_sz = vector_double_to_json(ptr, n, json); break;
+  case OML_VECTOR_INT32_VALUE:  json_sz = vector_int32_to_json(ptr, n, json); break;
+  case OML_VECTOR_UINT32_VALUE: json_sz = vector_uint32_to_json(ptr, n, json); break;
+  case OML_VECTOR_INT64_VALUE:  json_sz = vector_int64_to_json(ptr, n, json); break;
+  case OML_VECTOR_UINT64_VALUE: json_sz = vector_uint64_to_json(ptr, n, json); break;
+  case OML_VECTOR_BOOL_VALUE:   json_sz = vector_bool_to_json(ptr, n, json); break;
+  default: break;
+  }
+  return psql_copy_put_bytes(buf, json_sz < 0 ? NULL : *json, json_sz);
+}
+
+/** Encode one row in the binary COPY format.
+ *
+ * Values are written in the binary representation of the PostgreSQL type
+ * their column has been created with (see psql_type_pair).
+ *
+ * \param db Database to write in
+ * \param table DbTable the row is for
+ * \param buf MBuffer to write into
+ * \param row DbRow to encode
+ * \param time_stamp_server server timestamp of the row
+ * \return 0 on success, -1 if the row cannot be encoded
+ */
+static int
+psql_copy_put_row(Database *db, DbTable *table, MBuffer *buf, DbRow *row, double time_stamp_server)
+{
+  struct schema *schema = table->schema;
+  OmlValue *v = row->values;
+  uint16_t nfields;
+  int i, ret = 0;
+
+  if (row->value_count != schema->nfields) {
+    logerror("psql:%s: Failed to insert %d values into table '%s' with %d columns\n",
+        db->name, row->value_count, schema->name, schema->nfields);
+    return -1;
+  }
+
+  nfields = htons(4 + schema->nfields);
+  ret |= mbuf_write(buf, (uint8_t*)&nfields, 2);
+  ret |= psql_copy_put_int(buf, row->sender_id, 4);
+  ret |= psql_copy_put_int(buf, row->seq_no, 4);
+  ret |= psql_copy_put_double(buf, row->time_stamp);
+  ret |= psql_copy_put_double(buf, time_stamp_server);
+
+  for (i = 0; i < schema->nfields && !ret; i++, v++) {
+    if (oml_value_get_type(v) != schema->fields[i].type) {
+      logerror("psql:%s: Value %d type mismatch for table '%s'\n", db->name, i, schema->name);
       return -1;
     }
-    switch (field->type) {
-    case OML_LONG_VALUE:   snprintf(paramValues[4+i], MAX_DIGITS, "%i",(int)omlc_get_long(*oml_value_get_value(v))); break;
-    case OML_INT32_VALUE:  snprintf(paramValues[4+i], MAX_DIGITS, "%" PRId32,omlc_get_int32(*oml_value_get_value(v))); break;
-    case OML_UINT32_VALUE: snprintf(paramValues[4+i], MAX_DIGITS, "%" PRIu32,omlc_get_uint32(*oml_value_get_value(v))); break;
-    case OML_INT64_VALUE:  snprintf(paramValues[4+i], MAX_DIGITS, "%" PRId64,omlc_get_int64(*oml_value_get_value(v))); break;
-    case OML_UINT64_VALUE: snprintf(paramValues[4+i], MAX_DIGITS, "%" PRIu64,omlc_get_uint64(*oml_value_get_value(v))); break;
-    case OML_DOUBLE_VALUE: snprintf(paramValues[4+i], MAX_DIGITS, "%.14e",omlc_get_double(*oml_value_get_value(v))); break;
-    case OML_BOOL_VALUE:   snprintf(paramValues[4+i], MAX_DIGITS, "%d", omlc_get_bool(*oml_value_get_value(v)) ? 1 : 0); break;
+    switch (schema->fields[i].type) {
+    case OML_LONG_VALUE:   ret = psql_copy_put_int(buf, (int32_t)omlc_get_long(*oml_value_get_value(v)), 4); break;
+    case OML_INT32_VALUE:  ret = psql_copy_put_int(buf, omlc_get_int32(*oml_value_get_value(v)), 4); break;
+    case OML_UINT32_VALUE: ret = psql_copy_put_int(buf, omlc_get_uint32(*oml_value_get_value(v)), 8); break;
+    case OML_INT64_VALUE:  ret = psql_copy_put_int(buf, omlc_get_int64(*oml_value_get_value(v)), 8); break;
+    case OML_UINT64_VALUE:
+      if (omlc_get_uint64(*oml_value_get_value(v)) > INT64_MAX) {
+        logerror("psql:%s: Value %" PRIu64 " out of range for column '%s' of table '%s'\n",
+            db->name, omlc_get_uint64(*oml_value_get_value(v)), schema->fields[i].name, schema->name);
+        return -1;
+      }
+      ret = psql_copy_put_int(buf, (int64_t)omlc_get_uint64(*oml_value_get_value(v)), 8);
+      break;
+    case OML_DOUBLE_VALUE: ret = psql_copy_put_double(buf, omlc_get_double(*oml_value_get_value(v))); break;
+    case OML_BOOL_VALUE:
+      ret = psql_copy_put_bytes(buf, omlc_get_bool(*oml_value_get_value(v)) ? "\1" : "\0", 1);
+      break;
     case OML_STRING_VALUE:
-			   len = omlc_get_string_length(*oml_value_get_value(v)) + 1;
-			   if (len > MAX_DIGITS) {
-                             logdebug2("psql:%s: Reallocating %d bytes for long string\n", db->name, len);
-			     paramValues[4+i] = oml_realloc(paramValues[4+i], len);
-			     if (!paramValues[4+i]) {
-			       logerror("psql:%s: Could not realloc()at memory for string '%s' in field %d of table '%s'\n",
-				   db->name, omlc_get_string_ptr(*oml_value_get_value(v)), i, table->schema->name);
-			       return -1;
-			     }
-			   }
-			   snprintf(paramValues[4+i], len, "%s", omlc_get_string_ptr(*oml_value_get_value(v)));
-			   break;
+      /* Unset strings and blobs are empty, as with INSERTs */
+      ret = psql_copy_put_bytes(buf,
+          omlc_get_string_ptr(*oml_value_get_value(v)) ? omlc_get_string_ptr(*oml_value_get_value(v)) : "",
+          omlc_get_string_length(*oml_value_get_value(v)));
+      break;
     case OML_BLOB_VALUE:
-                           escaped_blob = PQescapeByteaConn(psqldb->conn,
-					   omlc_get_blob_ptr(*oml_value_get_value(v)),
-					   omlc_get_blob_length(*oml_value_get_value(v)),
-					   &len);
-                           if (!escaped_blob) {
-                             logerror("psql:%s: Error escaping blob in field %d of table '%s': %s", /* PQerrorMessage strings already have '\n' */
-                                 db->name, i, table->schema->name, PQerrorMessage(psqldb->conn));
-                           }
-			   if (len > MAX_DIGITS) {
-                             logdebug2("psql:%s: Reallocating %d bytes for big blob\n", db->name, len);
-                             paramValues[4+i] = oml_realloc(paramValues[4+i], len);
-                             if (!paramValues[4+i]) {
-                               logerror("psql:%s: Could not realloc()at memory for escaped blob in field %d of table '%s'\n",
-                                   db->name, i, table->schema->name);
-                               return -1;
-                             }
-                           }
-                           snprintf(paramValues[4+i], len, "%s", escaped_blob);
-                           PQfreemem(escaped_blob);
-                           break;
+      ret = psql_copy_put_bytes(buf,
+          omlc_get_blob_ptr(*oml_value_get_value(v)) ? omlc_get_blob_ptr(*oml_value_get_value(v)) : "",
+          omlc_get_blob_length(*oml_value_get_value(v)));
+      break;
     case OML_GUID_VALUE:
-                           if(omlc_get_guid(*oml_value_get_value(v)) != OMLC_GUID_NULL) {
-                             snprintf(paramValues[4+i], MAX_DIGITS, "%" PRId64, (int64_t)(omlc_get_guid(*oml_value_get_value(v))));
-                           } else {
-                             paramValues[4+i] = NULL;
-                           }
-                           break;
-
-    case OML_VECTOR_DOUBLE_VALUE:
-      vector_double_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &paramValues[4+i]);
+      if(omlc_get_guid(*oml_value_get_value(v)) != OMLC_GUID_NULL) {
+        ret = psql_copy_put_int(buf, (int64_t)omlc_get_guid(*oml_value_get_value(v)), 8);
+      } else {
+        ret = psql_copy_put_bytes(buf, NULL, 0);
+      }
       break;
+    case OML_VECTOR_DOUBLE_VALUE:
     case OML_VECTOR_INT32_VALUE:
-      vector_int32_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &paramValues[4+i]);
-      break;
     case OML_VECTOR_UINT32_VALUE:
-      vector_uint32_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &paramValues[4+i]);
-      break;
     case OML_VECTOR_INT64_VALUE:
-      vector_int64_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &paramValues[4+i]);
-      break;
     case OML_VECTOR_UINT64_VALUE:
-      vector_uint64_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &paramValues[4+i]);
-      break;
     case OML_VECTOR_BOOL_VALUE:
-      vector_bool_to_json(v->value.vectorValue.ptr, v->value.vectorValue.nof_elts, &paramValues[4+i]);
+      ret = psql_copy_put_vector(buf, v, &((PsqlTable*)table->handle)->json[i]);
       break;
-
     default:
       logerror("psql:%s: Unknown type %d in col '%s' of table '%s'; this is probably a bug\n",
-          db->name, field->type, field->name, table->schema->name);
+          db->name, schema->fields[i].type, schema->fields[i].name, schema->name);
       return -1;
     }
-    paramLength[4+i] = 0;
-    paramFormat[4+i] = 0;
   }
-  /* Use stuff from http://www.postgresql.org/docs/current/static/plpgsql-control-structures.html#PLPGSQL-ERROR-TRAPPING */
 
-  res = PQexecPrepared(psqldb->conn, insert_stmt,
-                       4+value_count, (const char**)paramValues,
-                       (int*) &paramLength, (int*) &paramFormat, 0 );
+  return ret ? -1 : 0;
+}
 
-  if (PQresultStatus(res) != PGRES_COMMAND_OK) {
-    logerror("psql:%s: INSERT INTO '%s' failed: %s", /* PQerrorMessage strings already have '\n' */
+/** Send the buffered COPY data to the server.
+ * \param db Database in which a COPY is in progress
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_flush(Database *db)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  MBuffer *buf = psqldb->copy_buf;
+  int ret = 0;
+
+  if (mbuf_fill(buf) > 0 &&
+      PQputCopyData(psqldb->conn, (const char*)mbuf_rdptr(buf), mbuf_fill(buf)) != 1) {
+    logerror("psql:%s: Could not send COPY data for table '%s': %s", /* PQerrorMessage strings already have '\n' */
+        db->name, psqldb->copy_table->schema->name, PQerrorMessage(psqldb->conn));
+    psqldb->copy_failed = 1;
+    ret = -1;
+  }
+  mbuf_clear2(buf, 0);
+  return ret;
+}
+
+/** Start a binary COPY into a table.
+ * \param db Database to write in
+ * \param table DbTable to COPY into
+ * \return 0 on success, -1 otherwise
+ */
+static int
+psql_copy_begin(Database *db, DbTable *table)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  MString *stmt = mstring_create();
+  PGresult *res;
+  int i;
+
+  mstring_sprintf (stmt, "COPY \"%s\" (\"oml_sender_id\", \"oml_seq\", \"oml_ts_client\", \"oml_ts_server\"",
+      table->schema->name);
+  for (i = 0; i < table->schema->nfields; i++) {
+    mstring_sprintf (stmt, ", \"%s\"", table->schema->fields[i].name);
+  }
+  mstring_cat (stmt, ") FROM STDIN WITH (FORMAT binary);");
+
+  logdebug2("psql:%s: Starting COPY into table '%s'\n", db->name, table->schema->name);
+  res = PQexec(psqldb->conn, mstring_buf (stmt));
+  mstring_delete (stmt);
+
+  if (PQresultStatus(res) != PGRES_COPY_IN) {
+    logerror("psql:%s: Could not start COPY into table '%s': %s", /* PQerrorMessage strings already have '\n' */
         db->name, table->schema->name, PQerrorMessage(psqldb->conn));
     PQclear(res);
     return -1;
   }
   PQclear(res);
 
-  for (i=0;i<4+value_count;i++) {
-    oml_free(paramValues[i]);
+  psqldb->copy_table = table;
+  psqldb->copy_rows = 0;
+  psqldb->copy_failed = 0;
+  mbuf_clear2(psqldb->copy_buf, 0);
+  return mbuf_write(psqldb->copy_buf, (const uint8_t*)copy_header, sizeof(copy_header));
+}
+
+/** Finish the COPY in progress, if any.
+ *
+ * This must be called before any other command is sent to the server. If
+ * some data could not be sent, the COPY is aborted rather than letting the
+ * server store part of it. If the COPY fails, none of its rows are written;
+ * they are added to the failed rows to report to the storage thread.
+ *
+ * \param db Database to write in
+ * \return 0 on success (or if no COPY was in progress), -1 otherwise
+ * \see psql_failed
+ */
+static int
+psql_copy_end(Database *db)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  PGresult *res;
+  uint16_t trailer = 0xffff;
+  int ret = 0;
+
+  if (!psqldb->copy_table) {
+    return 0;
   }
 
-  return 0;
+  if (!psqldb->copy_failed) {
+    mbuf_write(psqldb->copy_buf, (uint8_t*)&trailer, 2);
+    psql_copy_flush(db);
+  }
+  if (PQputCopyEnd(psqldb->conn, psqldb->copy_failed ? "incomplete COPY data" : NULL) != 1) {
+    ret = -1;
+  }
+
+  while ((res = PQgetResult(psqldb->conn))) {
+    if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+      logerror("psql:%s: COPY into table '%s' failed: %s", /* PQerrorMessage strings already have '\n' */
+          db->name, psqldb->copy_table->schema->name, PQerrorMessage(psqldb->conn));
+      ret = -1;
+    }
+    PQclear(res);
+  }
+  if (ret || psqldb->copy_failed) {
+    logerror("psql:%s: Lost %d rows of the COPY into table '%s'\n",
+        db->name, psqldb->copy_rows, psqldb->copy_table->schema->name);
+    psqldb->failed += psqldb->copy_rows;
+    ret = -1;
+  }
+  psqldb->copy_table = NULL;
+  psqldb->copy_rows = 0;
+
+  return ret;
+}
+
+/** Insert a batch of rows in the PostgreSQL database using COPY.
+ *
+ * The COPY is kept open across batches for the same table, and only finished
+ * when another table or command is used, or at the periodic commit of the
+ * transaction, or when the storage thread is idle. Encoded rows are passed to
+ * libpq every PG_COPY_BUFFER_SIZE bytes.
+ *
+ * Rows are only known to be written once the COPY is finished. The rows of a
+ * COPY which failed are reported with the next batch, or by psql_commit_idle.
+ *
+ * The binary COPY format needs all columns to have the types given by
+ * psql_type_pair; rows of other tables are INSERTed one by one.
+ *
+ * \see db_adapter_insert_batch, psql_copy_end, psql_commit_idle, psql_table_params_check
+ */
+static int
+psql_insert_copy(Database *db, DbTable *table, DbRow *rows, int count)
+{
+  PsqlDB* psqldb = (PsqlDB*)db->handle;
+  PsqlTable* psqltable = (PsqlTable*)table->handle;
+  double time_stamp_server;
+  int i, failed = 0;
+
+  if (psqltable->text) {
+    for (i = 0; i < count; i++) {
+      if (psql_insert(db, table, rows[i].sender_id, rows[i].seq_no, rows[i].time_stamp,
+            rows[i].values, rows[i].value_count)) {
+        failed++;
+      }
+    }
+    return psql_failed(psqldb, failed);
+  }
+
+  if (psql_prepare_insert(db, &time_stamp_server)) {
+    return psql_failed(psqldb, count);
+  }
+
+  if (psqldb->copy_table != table) {
+    psql_copy_end(db);
+    if (psql_copy_begin(db, table)) {
+      return psql_failed(psqldb, count);
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    mbuf_begin_write(psqldb->copy_buf);
+    if (psql_copy_put_row(db, table, psqldb->copy_buf, &rows[i], time_stamp_server)) {
+      mbuf_reset_write(psqldb->copy_buf);
+      failed++;
+    } else {
+      psqldb->copy_rows++;
+    }
+  }
+  psqldb->uncommitted = 1;
+
+  if (mbuf_fill(psqldb->copy_buf) >= PG_COPY_BUFFER_SIZE &&
+      psql_copy_flush(db)) {
+    /* This accounts for the rows of this batch too */
+    psql_copy_end(db);
+  }
+
+  return psql_failed(psqldb, failed);
 }
 
 /** Do a key-value style select on a database table.
@@ -701,6 +1692,7 @@ psql_get_key_value (Database *database, const char *table, const char *key_colum
 
   PGresult *res;
   PsqlDB *psqldb = (PsqlDB*) database->handle;
+  psql_idle(database);
   MString *stmt = mstring_create();
   mstring_sprintf (stmt, "SELECT %s FROM %s WHERE %s='%s';",
                    value_column, table, key_column, key);
@@ -869,6 +1861,8 @@ psql_get_table_list (Database *database, int *num_tables)
   int have_meta = 0;
   int i, nrows;
 
+  psql_idle(database);
+
   /* Get a list of table names */
   res = PQprepare(self->conn, ptable_stmt, table_stmt, 0, NULL);
   if (PQresultStatus (res) != PGRES_COMMAND_OK) {
@@ -12,6 +12,7 @@
 #define PSQL_ADAPTER_H_
 
 #include <libpq-fe.h>
+#include "mbuf.h"
 #include "database.h"
 
 #define DEFAULT_PG_HOST "localhost"
@@ -20,14 +21,45 @@
 #define DEFAULT_PG_PASS ""
 #define DEFAULT_PG_CONNINFO ""
 
+/** Amount of COPY data buffered before it is handed to libpq */
+#define PG_COPY_BUFFER_SIZE 65536
+/** Size of the buffer of each INSERT parameter passed in text format */
+#define PG_TEXT_PARAM_SIZE 32
+/** Maximal number of pipelined commands awaiting their result */
+#define PG_PIPELINE_DEPTH 1024
+
+typedef struct PsqlPending {
+  DbTable *table; /* Table of a pipelined INSERT, or NULL for a synchronisation point */
+  int sender_id;
+  int seq_no;
+} PsqlPending;
+
 typedef struct PsqlDB {
   PGconn *conn;
   int sender_cnt;
   time_t last_commit;
+  int uncommitted;        /* Non-zero if rows were sent since the last commit */
+  int failed;             /* Number of rows accepted earlier, since found not to be written */
+  DbTable *copy_table;    /* Table into which a COPY is in progress, or NULL */
+  MBuffer *copy_buf;      /* Binary COPY data not yet sent to the server */
+  int copy_rows;          /* Number of rows encoded into the COPY in progress */
+  int copy_failed;        /* Non-zero if some data of the COPY in progress could not be sent */
+  int pipeline;           /* Non-zero while the connection is in pipeline mode */
+  PsqlPending *pending;   /* Circular list of pipelined commands awaiting their result */
+  int pending_head;       /* Index of the oldest pending command */
+  int pending_count;      /* Number of pending commands */
+  int aborted;            /* Number of INSERTs skipped since the last error */
 } PsqlDB;
 
 typedef struct PsqlTable {
   MString *insert_stmt; /* Named statement for inserting into this table */
+  int nparams;          /* Number of parameters of insert_stmt */
+  const char **values;  /* Parameter values, as passed to libpq */
+  int *lengths;         /* Parameter lengths */
+  int *formats;         /* Parameter formats (binary, or text for columns of unexpected types) */
+  uint64_t *scalars;    /* Storage for numeric parameters, in network byte order */
+  char **json;          /* Buffers for vector fields, encoded as JSON, and blobs passed as text */
+  char *text;           /* Storage for numeric parameters passed as text, or NULL if none is */
 } PsqlTable;
 
 int psql_backend_setup ();
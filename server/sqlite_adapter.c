@@ -14,6 +14,7 @@
 #include <limits.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <inttypes.h>
 #include <sqlite3.h>
 #include <time.h>
@@ -38,6 +39,38 @@
 static char backend_name[] = "sqlite";
 /* Cannot be static due to testsuite */
 char *sqlite_database_dir = NULL;
+/* Cannot be static due to the way the server sets its parameters */
+char *sqlite_profile = DEFAULT_SQLITE_PROFILE;
+char *sqlite_journal_mode = NULL;
+char *sqlite_synchronous = NULL;
+int sqlite_page_size = -1;
+int sqlite_cache_size = -1;
+long sqlite_mmap_size = -1;
+int sqlite_commit_rows = -1;
+int sqlite_commit_interval = -1;
+int sqlite_checkpoint_pages = -1;
+
+/** Predefined tuning profiles
+ *
+ * - durable: SQLite's defaults (rollback journal, full synchronisation),
+ *   committing every second; this is how databases were always written;
+ * - balanced: write-ahead log, only synchronised at checkpoints, larger
+ *   cache, commits every second or 50000 rows;
+ * - bulk: no synchronisation at all, large pages, cache and memory map,
+ *   commits every 5 seconds or 200000 rows; a crash of the host (not just
+ *   the server) can corrupt the database.
+ *
+ * \see sq3_profile_setup
+ */
+static Sq3Profile sq3_profiles[] = {
+  { "durable",  "DELETE", "FULL",   0,    0,     0,         0,      1000, 0 },
+  { "balanced", "WAL",    "NORMAL", 0,    16384, 0,         50000,  1000, 4096 },
+  { "bulk",     "WAL",    "OFF",    8192, 65536, 268435456, 200000, 5000, 16384 },
+};
+
+/** Profile used for new databases
+ * \see sq3_profile_setup */
+static Sq3Profile sq3_profile = { "durable",  "DELETE", "FULL", 0, 0, 0, 0, 1000, 0 };
 
 /** Mapping between OML and SQLite3 data types
  * \see sq3_type_to_oml, sq3_oml_to_type
@@ -78,6 +111,8 @@ static int sq3_table_create (Database* db, DbTable* table, int shallow);
 static int sq3_table_free (Database *database, DbTable* table);
 static char *sq3_prepared_var(Database *db, unsigned int order);
 static int sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count);
+static int sq3_insert_batch(Database *db, DbTable *table, DbRow *rows, int count);
+static int sq3_commit_idle(Database *db);
 static char* sq3_get_key_value (Database* database, const char* table, const char* key_column, const char* value_column, const char* key);
 static int sq3_set_key_value (Database* database, const char* table, const char* key_column, const char* value_column, const char* key, const char* value);
 static char* sq3_get_metadata (Database* database, const char* key);
@@ -115,6 +150,87 @@ sq3_dbdir_setup (void)
   }
 }
 
+/** Check that a string is one of a list of (case-insensitive) keywords.
+ * \param value string to check
+ * \param keywords NULL-terminated list of acceptable values
+ * \return 1 if value is in keywords, 0 otherwise
+ */
+static int
+sq3_is_keyword (const char *value, const char * const *keywords)
+{
+  for (; *keywords; keywords++) {
+    if (!strcasecmp (value, *keywords)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/** Select the tuning profile for new databases.
+ *
+ * The profile named by sqlite_profile is used as a base, and any of the
+ * individual settings given on the command line (sqlite_journal_mode,
+ * sqlite_synchronous, ...) override its values.
+ *
+ * \return 0 on success, -1 if the profile is unknown or a setting is invalid
+ * \see sq3_profiles, Sq3Profile
+ */
+int
+sq3_profile_setup (void)
+{
+  static const char * const journal_modes[] = { "DELETE", "TRUNCATE", "PERSIST", "MEMORY", "WAL", "OFF", NULL };
+  static const char * const sync_levels[] = { "OFF", "NORMAL", "FULL", "EXTRA", NULL };
+  int i, n = LENGTH(sq3_profiles);
+
+  for (i = 0; i < n && strcasecmp (sqlite_profile, sq3_profiles[i].name); i++);
+  if (i == n) {
+    logerror ("sqlite: Unknown profile '%s'; valid profiles are durable, balanced and bulk\n", sqlite_profile);
+    return -1;
+  }
+  sq3_profile = sq3_profiles[i];
+
+  if (sqlite_journal_mode) {
+    if (!sq3_is_keyword (sqlite_journal_mode, journal_modes)) {
+      logerror ("sqlite: Invalid journal mode '%s'\n", sqlite_journal_mode);
+      return -1;
+    }
+    sq3_profile.journal_mode = sqlite_journal_mode;
+  }
+  if (sqlite_synchronous) {
+    if (!sq3_is_keyword (sqlite_synchronous, sync_levels)) {
+      logerror ("sqlite: Invalid synchronous level '%s'\n", sqlite_synchronous);
+      return -1;
+    }
+    sq3_profile.synchronous = sqlite_synchronous;
+  }
+  if (sqlite_page_size >= 0) {
+    if (sqlite_page_size && (sqlite_page_size < 512 || sqlite_page_size > 65536 ||
+          (sqlite_page_size & (sqlite_page_size - 1)))) {
+      logerror ("sqlite: Invalid page size %d; it must be a power of two between 512 and 65536\n", sqlite_page_size);
+      return -1;
+    }
+    sq3_profile.page_size = sqlite_page_size;
+  }
+  if (sqlite_cache_size >= 0) { sq3_profile.cache_size = sqlite_cache_size; }
+  if (sqlite_mmap_size >= 0) { sq3_profile.mmap_size = sqlite_mmap_size; }
+  if (sqlite_commit_rows >= 0) { sq3_profile.commit_rows = sqlite_commit_rows; }
+  if (sqlite_commit_interval >= 0) { sq3_profile.commit_interval = sqlite_commit_interval; }
+  if (sqlite_checkpoint_pages >= 0) { sq3_profile.checkpoint_pages = sqlite_checkpoint_pages; }
+
+  if (!sq3_profile.commit_rows && !sq3_profile.commit_interval) {
+    logerror ("sqlite: At least one of the commit row count and interval must be set\n");
+    return -1;
+  }
+
+  loginfo ("sqlite: Using profile '%s': journal_mode=%s, synchronous=%s, commit every %dms or %d rows\n",
+      sq3_profile.name, sq3_profile.journal_mode, sq3_profile.synchronous,
+      sq3_profile.commit_interval, sq3_profile.commit_rows);
+  logdebug ("sqlite: page_size=%d, cache_size=%dKiB, mmap_size=%ldB, checkpoint after %d WAL pages\n",
+      sq3_profile.page_size, sq3_profile.cache_size, sq3_profile.mmap_size, sq3_profile.checkpoint_pages);
+
+  return 0;
+}
+
 /** Setup the SQLite3 backend.
  *
  * \return 0 on success, -1 otherwise
@@ -124,6 +240,9 @@ sq3_dbdir_setup (void)
 int
 sq3_backend_setup (void)
 {
+  if (sq3_profile_setup ()) {
+    return -1;
+  }
   sq3_dbdir_setup ();
 
   /*
@@ -218,6 +337,102 @@ sq3_stmt(Database* db, const char* stmt)
  return sql_stmt((Sq3DB*)db->handle, stmt);
 }
 
+/** Get the current time from a monotonic clock.
+ * \return the time in milliseconds
+ */
+static uint64_t
+sq3_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/** Record the size of the WAL after each commit.
+ * \see sqlite3_wal_hook, sq3_commit
+ */
+static int
+sq3_wal_hook (void *arg, sqlite3 *conn, const char *name, int pages)
+{
+  (void)conn;
+  (void)name;
+  ((Sq3DB*)arg)->wal_pages = pages;
+  return SQLITE_OK;
+}
+
+/** Set the PRAGMAs of a newly opened database according to the current profile.
+ *
+ * When a WAL checkpoint threshold is set, SQLite's automatic checkpoints are
+ * replaced by those done in sq3_commit().
+ *
+ * \param name name of the database, for logging
+ * \param self Sq3DB of the database
+ * \see sq3_profile_setup
+ */
+static void
+sq3_apply_profile (const char *name, Sq3DB *self)
+{
+  MString *pragmas = mstring_create ();
+
+  if (sq3_profile.page_size) {
+    /* Must come first, as it has no effect once the database is in WAL mode */
+    mstring_sprintf (pragmas, "PRAGMA page_size=%d; ", sq3_profile.page_size);
+  }
+  mstring_sprintf (pragmas, "PRAGMA journal_mode=%s; PRAGMA synchronous=%s;",
+      sq3_profile.journal_mode, sq3_profile.synchronous);
+  if (sq3_profile.cache_size) {
+    mstring_sprintf (pragmas, " PRAGMA cache_size=-%d;", sq3_profile.cache_size);
+  }
+  if (sq3_profile.mmap_size) {
+    mstring_sprintf (pragmas, " PRAGMA mmap_size=%ld;", sq3_profile.mmap_size);
+  }
+  if (sq3_profile.checkpoint_pages && !strcasecmp (sq3_profile.journal_mode, "WAL")) {
+    mstring_cat (pragmas, " PRAGMA wal_autocheckpoint=0;");
+    sqlite3_wal_hook (self->conn, sq3_wal_hook, self);
+  }
+
+  logdebug ("sqlite:%s: Applying profile '%s': %s\n", name, sq3_profile.name, mstring_buf (pragmas));
+  if (sql_stmt (self, mstring_buf (pragmas))) {
+    logwarn ("sqlite:%s: Could not apply all settings of profile '%s'\n", name, sq3_profile.name);
+  }
+  mstring_delete (pragmas);
+}
+
+/** Commit the current transaction and start a new one.
+ *
+ * If the WAL has grown past the checkpoint threshold of the profile, it is
+ * checkpointed and truncated in between. This is done by the storage thread of
+ * the database, so clients are not held up.
+ *
+ * \param db Database to commit
+ * \return 0 on success, -1 otherwise
+ * \see dba_reopen_transaction
+ */
+static int
+sq3_commit (Database *db)
+{
+  Sq3DB* self = (Sq3DB*)db->handle;
+  int log = 0, done = 0, rc;
+
+  if (dba_end_transaction (db)) { return -1; }
+
+  if (sq3_profile.checkpoint_pages && self->wal_pages >= sq3_profile.checkpoint_pages) {
+    rc = sqlite3_wal_checkpoint_v2 (self->conn, NULL, SQLITE_CHECKPOINT_TRUNCATE, &log, &done);
+    if (rc == SQLITE_OK) {
+      logdebug ("sqlite:%s: Checkpointed %d WAL pages\n", db->name, done);
+      self->wal_pages = 0;
+    } else {
+      logdebug ("sqlite:%s: WAL checkpoint incomplete (%d/%d pages): %s\n",
+          db->name, done, log, sqlite3_errmsg (self->conn));
+    }
+  }
+
+  if (dba_begin_transaction (db)) { return -1; }
+  self->uncommitted = 0;
+  self->last_commit = sq3_now ();
+  return 0;
+}
+
 /** Create an SQLite3 database and adapter structures
  * \see db_adapter_create
  */
@@ -243,7 +458,8 @@ sq3_create_database(Database* db)
 
   Sq3DB* self = oml_malloc(sizeof(Sq3DB));
   self->conn = conn;
-  self->last_commit = time (NULL);
+  self->last_commit = sq3_now ();
+  sq3_apply_profile (db->name, self);
   db->backend_name = backend_name;
   db->o2t = sq3_oml_to_type;
   db->t2o = sq3_type_to_oml;
@@ -254,6 +470,8 @@ sq3_create_database(Database* db)
   db->release = sq3_release;
   db->prepared_var = sq3_prepared_var;
   db->insert = sq3_insert;
+  db->insert_batch = sq3_insert_batch;
+  db->idle = sq3_commit_idle;
   db->add_sender_id = sq3_add_sender_id;
   db->set_metadata = sq3_set_metadata;
   db->get_metadata = sq3_get_metadata;
@@ -390,30 +608,41 @@ sq3_prepared_var(Database *db, unsigned int order)
   return s;
 }
 
-/** Insert value in the SQLite3 database.
- * \see db_adapter_insert
+/** Get the server timestamp for new rows, and commit the current transaction
+ * if the commit policy of the profile says so.
+ *
+ * \param db Database to write in
+ * \param[out] time_stamp_server time since the start of the experiment
+ * \return 0 on success, -1 if the transaction could not be reopened
+ */
+static int
+sq3_prepare_insert(Database *db, double *time_stamp_server)
+{
+  Sq3DB* sq3db = (Sq3DB*)db->handle;
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  *time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
+
+  if ((sq3_profile.commit_rows && sq3db->uncommitted >= sq3_profile.commit_rows) ||
+      (sq3_profile.commit_interval && sq3_now () - sq3db->last_commit >= (uint64_t)sq3_profile.commit_interval)) {
+    return sq3_commit (db);
+  }
+  return 0;
+}
+
+/** Bind the values of one row to the INSERT statement of a table, and run it.
+ * \see db_adapter_insert, sq3_prepare_insert
  * XXX: This function actively does text protocol interpretation, see #1088
  */
 static int
-sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
+sq3_insert_row(Database *db, DbTable *table, double time_stamp_server, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
 {
   Sq3DB* sq3db = (Sq3DB*)db->handle;
   Sq3Table* sq3table = (Sq3Table*)table->handle;
   int i;
-  double time_stamp_server;
   sqlite3_stmt* stmt = sq3table->insert_stmt;
   char *json = NULL;
   ssize_t json_sz;
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  time_stamp_server = tv.tv_sec - db->start_time + 0.000001 * tv.tv_usec;
-
-  if (tv.tv_sec > sq3db->last_commit) {
-    if (dba_reopen_transaction (db) == -1) {
-      return -1;
-    }
-    sq3db->last_commit = tv.tv_sec;
-  }
 
   //  o_log(O_LOG_DEBUG2, "sq3_insert(%s): insert row %d \n",
   //        table->schema->name, seq_no);
@@ -580,6 +809,68 @@ sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_
   return sqlite3_reset(stmt);
 }
 
+/** Insert value in the SQLite3 database.
+ * \see db_adapter_insert
+ */
+static int
+sq3_insert(Database *db, DbTable *table, int sender_id, int seq_no, double time_stamp, OmlValue *values, int value_count)
+{
+  double time_stamp_server;
+
+  if (sq3_prepare_insert (db, &time_stamp_server)) {
+    return -1;
+  }
+  ((Sq3DB*)db->handle)->uncommitted++;
+  return sq3_insert_row (db, table, time_stamp_server, sender_id, seq_no, time_stamp, values, value_count);
+}
+
+/** Insert a batch of rows in the SQLite3 database.
+ *
+ * The transaction is only checked once for the whole batch, and all rows get
+ * the same server timestamp.
+ *
+ * \see db_adapter_insert_batch
+ */
+static int
+sq3_insert_batch(Database *db, DbTable *table, DbRow *rows, int count)
+{
+  double time_stamp_server;
+  int i, failed = 0;
+
+  if (sq3_prepare_insert (db, &time_stamp_server)) {
+    return count;
+  }
+  for (i = 0; i < count; i++) {
+    if (sq3_insert_row (db, table, time_stamp_server, rows[i].sender_id, rows[i].seq_no,
+          rows[i].time_stamp, rows[i].values, rows[i].value_count)) {
+      failed++;
+    }
+  }
+  ((Sq3DB*)db->handle)->uncommitted += count;
+  return failed;
+}
+
+/** Commit the rows inserted since the last commit, while no new rows come in.
+ *
+ * The commit policy of the profile is only checked when rows arrive, so the
+ * last rows received would otherwise stay in an open transaction, invisible
+ * to readers, until more data comes in or the database is released.
+ *
+ * \param db Database to commit
+ * \return 0, as rows are not lost if the commit fails, and will be retried
+ * \see db_adapter_idle, sq3_commit
+ */
+static int
+sq3_commit_idle(Database *db)
+{
+  Sq3DB* sq3db = (Sq3DB*)db->handle;
+
+  if (sq3db->uncommitted > 0 && sq3_commit (db)) {
+    logwarn ("sqlite:%s: Could not commit %d rows while idle\n", db->name, sq3db->uncommitted);
+  }
+  return 0;
+}
+
 /** Do a key-value style select on a database table.
  *
  * FIXME: Not using prepared statements (#168)
@@ -13,16 +13,35 @@
 #include <sqlite3.h>
 #include "database.h"
 
+/** Name of the default SQLite3 tuning profile \see Sq3Profile */
+#define DEFAULT_SQLITE_PROFILE "durable"
+
+/** Tuning of SQLite3 databases, trading durability for throughput */
+typedef struct Sq3Profile {
+  const char *name;
+  const char *journal_mode; // PRAGMA journal_mode
+  const char *synchronous;  // PRAGMA synchronous
+  int  page_size;           // PRAGMA page_size for new databases, 0 for SQLite's default
+  int  cache_size;          // size of the page cache [KiB], 0 for SQLite's default
+  long mmap_size;           // PRAGMA mmap_size [B], 0 to disable memory-mapped I/O
+  int  commit_rows;         // commit after that many rows, 0 for no limit
+  int  commit_interval;     // commit after that long [ms], 0 for no limit
+  int  checkpoint_pages;    // checkpoint the WAL once it is that many pages long, 0 to let SQLite do it
+} Sq3Profile;
+
 typedef struct Sq3DB {
   sqlite3*  conn;
   int       sender_cnt;
-  time_t    last_commit;
+  uint64_t  last_commit;    // time of the last commit [ms]
+  int       uncommitted;    // number of rows inserted since the last commit
+  int       wal_pages;      // number of pages in the WAL after the last commit
 } Sq3DB;
 
 typedef struct Sq3Table {
   sqlite3_stmt* insert_stmt;  // prepared insert statement
 } Sq3Table;
 
+int sq3_profile_setup (void);
 int sq3_backend_setup (void);
 int sq3_create_database (Database* db);
 
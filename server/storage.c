@@ -0,0 +1,764 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file storage.c
+ * \brief Writes data to a Database from a dedicated thread, so slow storage does not hold up the EventLoop.
+ *
+ * Each Database has a bounded queue of decoded rows, filled by the
+ * ClientHandlers and drained by a storage thread, which is the only one
+ * calling the database adapter. Other operations on the adapter (opening the
+ * database, creating tables, registering senders, ...) are also run by that
+ * thread through storage_call(), ahead of any queued rows; their callers wait
+ * for the storage thread to finish its current batch first.
+ *
+ * When the queue reaches storage_high_watermark rows, the Database is marked
+ * as throttled, and ClientHandlers stop reading from their clients until it
+ * drains below storage_low_watermark. The queue has room for
+ * STORAGE_HEADROOM times as many rows, for those decoded before the
+ * ClientHandlers notice. Producers do not wait for room: rows which do not fit
+ * are not queued, and the ClientHandler keeps them until the queue drains.
+ * Only rows kept by a ClientHandler being freed are queued with
+ * storage_insert_batch_wait(), which waits for the storage thread instead.
+ *
+ * When the queue has stayed empty for STORAGE_REPORT_PERIOD, the storage
+ * thread lets the adapter write out the rows it may still hold (see
+ * db_adapter_idle), so they do not wait for more data to reach the database.
+ *
+ * The depth of the queue, the time rows spend in it, and the number of rows
+ * which could not be written, are regularly reported as the `storage`
+ * measurement point of the server.
+ *
+ * \see database_find, client_handler_throttle
+ */
+#include <stdint.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "ocomm/o_log.h"
+#include "mem.h"
+#include "oml_value.h"
+#include "database.h"
+#include "storage.h"
+#ifndef NOOML
+#include "monitoring_server.h"
+#endif
+
+/** Maximum number of rows written without checking for pending calls */
+#define STORAGE_BATCH 64
+/** Interval between reports of the queue metrics [ms] */
+#define STORAGE_REPORT_PERIOD 1000
+/** Size of the queue, as a multiple of storage_high_watermark */
+#define STORAGE_HEADROOM 2
+
+/** Number of queued rows above which clients of a Database are throttled */
+int storage_high_watermark = DEF_STORAGE_HIGH_WATERMARK;
+/** Number of queued rows below which throttled clients can resume */
+int storage_low_watermark = DEF_STORAGE_LOW_WATERMARK;
+
+/** Bookkeeping for a row waiting to be inserted
+ * \see StorageQueue */
+typedef struct StorageSlot {
+  /** Table to insert the row in */
+  DbTable *table;
+  /** Number of OmlValues allocated in the values of the row; they are kept
+   * allocated when the slot is reused */
+  int values_size;
+  /** Time [us] at which the row was queued */
+  uint64_t queued;
+} StorageSlot;
+
+/** A request to run a function in the storage thread
+ * \see storage_call */
+typedef struct StorageCall {
+  /** Function to run */
+  storage_call_fn fn;
+  /** Argument to pass to fn */
+  void *arg;
+  /** Value returned by fn */
+  int result;
+  /** Set once fn has been run */
+  int done;
+  /** Next call in the list */
+  struct StorageCall *next;
+} StorageCall;
+
+/** Queue of rows and calls for the storage thread of a Database */
+struct StorageQueue {
+  /** Thread writing to the Database */
+  pthread_t thread;
+  /** Lock protecting this structure */
+  pthread_mutex_t lock;
+  /** Signalled when work is available for the storage thread */
+  pthread_cond_t work;
+  /** Broadcast by the storage thread when calls are done, or rows written */
+  pthread_cond_t done;
+
+  /** Circular array of rows, passed as is to database_insert_batch() */
+  DbRow *rows;
+  /** Table and bookkeeping information for each of the rows */
+  StorageSlot *slots;
+  /** Size of the rows and slots arrays */
+  unsigned int size;
+  /** Index of the oldest row */
+  unsigned int head;
+  /** Number of queued rows */
+  unsigned int count;
+
+  /** First call waiting to be run */
+  StorageCall *calls;
+  /** Last call waiting to be run */
+  StorageCall *calls_last;
+
+  /** Set when count reaches storage_high_watermark, until it drops to storage_low_watermark */
+  int throttled;
+  /** Set when the storage thread should exit once the queue is empty */
+  int stopping;
+
+  /** Maximal depth of the queue since the last report */
+  unsigned int max_depth;
+  /** Number of rows written since the last report */
+  uint64_t written;
+  /** Number of rows which could not be written since the last report */
+  uint64_t failed;
+  /** Sum of the time spent in the queue by rows written since the last report [us] */
+  uint64_t latency;
+  /** Maximal time spent in the queue by a row written since the last report [us] */
+  uint64_t max_latency;
+  /** Time of the last report [us] */
+  uint64_t last_report;
+};
+
+/** Get the current time from a monotonic clock.
+ * \return the time in microseconds
+ */
+static uint64_t
+storage_now (void)
+{
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/** Report the metrics of a queue, and reset them.
+ *
+ * Must be called with the queue locked.
+ *
+ * \param db Database of the queue
+ * \param q StorageQueue to report on
+ * \param now current time [us]
+ */
+static void
+storage_report (Database *db, StorageQueue *q, uint64_t now)
+{
+  double latency = q->written ? (double)q->latency / q->written / 1000. : 0.;
+  double max_latency = (double)q->max_latency / 1000.;
+
+  if (q->failed) {
+    logwarn ("%s: %" PRIu64 " rows could not be written to the database\n", db->name, q->failed);
+  }
+  if (q->written || q->count || q->failed) {
+    logdebug ("%s: Storage queue at %u rows (max. %u), wrote %" PRIu64 " rows in %.3fms on average (max. %.3fms)\n",
+        db->name, q->count, q->max_depth, q->written, latency, max_latency);
+#ifndef NOOML
+    storage_event_inject (db->name, q->count, q->max_depth, q->written, q->failed, latency, max_latency);
+#endif
+  }
+
+  q->max_depth = q->count;
+  q->written = 0;
+  q->failed = 0;
+  q->latency = 0;
+  q->max_latency = 0;
+  q->last_report = now;
+}
+
+/** Insert queued rows in the Database.
+ *
+ * Consecutive rows for the same table are inserted with one call to
+ * database_insert_batch(). A batch is also split where the circular array
+ * wraps around.
+ *
+ * The rows are not modified by the producers until they are dequeued, so the
+ * queue does not need to be locked.
+ *
+ * \param db Database to write to
+ * \param q StorageQueue of the Database
+ * \param head index of the first row to write
+ * \param n number of rows to write
+ * \param[out] latency sum of the time spent in the queue by the rows [us]
+ * \param[out] max_latency maximal time spent in the queue by one of the rows [us]
+ * \return the number of rows which could not be written, including rows of
+ * previous batches which the adapter only now found out about
+ */
+static unsigned int
+storage_write (Database *db, StorageQueue *q, unsigned int head, unsigned int n,
+    uint64_t *latency, uint64_t *max_latency)
+{
+  DbTable *table;
+  uint64_t now, l;
+  unsigned int i, j, k, len, failed = 0;
+
+  for (i = 0; i < n; i += len) {
+    j = (head + i) % q->size;
+    table = q->slots[j].table;
+    for (len = 1; i + len < n && j + len < q->size && q->slots[j + len].table == table; len++);
+
+    failed += database_insert_batch (db, table, &q->rows[j], len);
+
+    now = storage_now ();
+    for (k = j; k < j + len; k++) {
+      l = now - q->slots[k].queued;
+      *latency += l;
+      if (l > *max_latency) {
+        *max_latency = l;
+      }
+    }
+  }
+
+  return failed;
+}
+
+/** Let the adapter write out the rows it holds, with the lock of the queue held.
+ *
+ * The lock is released while the adapter works.
+ *
+ * \param db Database to write to
+ * \param q StorageQueue of the Database
+ * \see database_idle
+ */
+static void
+storage_idle (Database *db, StorageQueue *q)
+{
+  int failed;
+
+  pthread_mutex_unlock (&q->lock);
+  failed = database_idle (db);
+  pthread_mutex_lock (&q->lock);
+  q->failed += failed;
+}
+
+/** Main function of storage threads.
+ *
+ * Calls are run first, then rows are written in batches of up to
+ * STORAGE_BATCH. When there has been nothing to do for STORAGE_REPORT_PERIOD,
+ * the adapter is asked to write out the rows it holds. The thread exits when
+ * asked to stop, after all queued rows have been written.
+ *
+ * \param arg the Database
+ * \return NULL
+ * \see storage_start, storage_stop
+ */
+static void*
+storage_run (void *arg)
+{
+  Database *db = (Database*)arg;
+  StorageQueue *q = db->queue;
+  StorageCall *call;
+  unsigned int head, n, failed;
+  uint64_t now, latency, max_latency;
+  struct timespec deadline;
+
+  pthread_mutex_lock (&q->lock);
+  q->last_report = storage_now ();
+
+  while (1) {
+    if ((call = q->calls)) {
+      q->calls = call->next;
+      if (!q->calls) {
+        q->calls_last = NULL;
+      }
+      pthread_mutex_unlock (&q->lock);
+
+      call->result = call->fn (db, call->arg);
+
+      pthread_mutex_lock (&q->lock);
+      call->done = 1;
+      pthread_cond_broadcast (&q->done);
+
+    } else if (q->count > 0) {
+      head = q->head;
+      n = q->count < STORAGE_BATCH ? q->count : STORAGE_BATCH;
+      pthread_mutex_unlock (&q->lock);
+
+      latency = max_latency = 0;
+      failed = storage_write (db, q, head, n, &latency, &max_latency);
+
+      pthread_mutex_lock (&q->lock);
+      q->head = (q->head + n) % q->size;
+      q->count -= n;
+      q->written += n;
+      q->failed += failed;
+      q->latency += latency;
+      if (max_latency > q->max_latency) {
+        q->max_latency = max_latency;
+      }
+      /* Wake up callers of storage_insert_batch_wait() */
+      pthread_cond_broadcast (&q->done);
+
+    } else if (q->stopping) {
+      storage_idle (db, q);
+      break;
+
+    } else {
+      now = storage_now ();
+      if (now - q->last_report >= STORAGE_REPORT_PERIOD * 1000) {
+        storage_report (db, q, now);
+      }
+
+      clock_gettime (CLOCK_REALTIME, &deadline);
+      deadline.tv_sec += STORAGE_REPORT_PERIOD / 1000;
+      if (ETIMEDOUT == pthread_cond_timedwait (&q->work, &q->lock, &deadline) &&
+          !q->calls && !q->count && !q->stopping) {
+        /* No new rows for a while, don't keep the last ones from the database */
+        storage_idle (db, q);
+      }
+      continue;
+    }
+
+    now = storage_now ();
+    if (now - q->last_report >= STORAGE_REPORT_PERIOD * 1000) {
+      storage_report (db, q, now);
+    }
+  }
+
+  storage_report (db, q, storage_now ());
+  pthread_mutex_unlock (&q->lock);
+  logdebug ("%s: Storage thread done\n", db->name);
+
+  return NULL;
+}
+
+/** Create the queue of a Database, and start its storage thread.
+ *
+ * Signals are blocked in the storage thread, so they are only handled by the
+ * main thread.
+ *
+ * \param db Database to start the storage thread for
+ * \return 0 on success, -1 otherwise
+ * \see storage_stop
+ */
+int
+storage_start (Database *db)
+{
+  StorageQueue *q;
+  sigset_t set, oldset;
+
+  if (!(q = oml_malloc (sizeof(StorageQueue)))) {
+    return -1;
+  }
+  q->size = STORAGE_HEADROOM * storage_high_watermark;
+  q->rows = oml_calloc (q->size, sizeof(DbRow));
+  q->slots = oml_calloc (q->size, sizeof(StorageSlot));
+  if (!q->rows || !q->slots) {
+    if (q->rows) { oml_free (q->rows); }
+    if (q->slots) { oml_free (q->slots); }
+    oml_free (q);
+    return -1;
+  }
+  pthread_mutex_init (&q->lock, NULL);
+  pthread_cond_init (&q->work, NULL);
+  pthread_cond_init (&q->done, NULL);
+  db->queue = q;
+
+  sigfillset (&set);
+  pthread_sigmask (SIG_BLOCK, &set, &oldset);
+  errno = pthread_create (&q->thread, NULL, storage_run, db);
+  pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+
+  if (errno) {
+    logerror ("%s: Could not start storage thread: %s\n", db->name, strerror (errno));
+    pthread_cond_destroy (&q->done);
+    pthread_cond_destroy (&q->work);
+    pthread_mutex_destroy (&q->lock);
+    oml_free (q->slots);
+    oml_free (q->rows);
+    oml_free (q);
+    db->queue = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+/** Write all queued rows, stop the storage thread, and free the queue.
+ *
+ * No other thread should be using the Database anymore.
+ *
+ * \param db Database to stop the storage thread of
+ * \see storage_start
+ */
+void
+storage_stop (Database *db)
+{
+  StorageQueue *q = db->queue;
+  unsigned int i;
+
+  if (!q) {
+    return;
+  }
+
+  pthread_mutex_lock (&q->lock);
+  q->stopping = 1;
+  pthread_cond_signal (&q->work);
+  pthread_mutex_unlock (&q->lock);
+
+  pthread_join (q->thread, NULL);
+
+  for (i = 0; i < q->size; i++) {
+    if (q->rows[i].values) {
+      oml_value_array_reset (q->rows[i].values, q->slots[i].values_size);
+      oml_free (q->rows[i].values);
+    }
+  }
+  pthread_cond_destroy (&q->done);
+  pthread_cond_destroy (&q->work);
+  pthread_mutex_destroy (&q->lock);
+  oml_free (q->slots);
+  oml_free (q->rows);
+  oml_free (q);
+  db->queue = NULL;
+}
+
+/** Run a function in the storage thread, and wait for its result.
+ *
+ * The call is run before any queued rows, as soon as the storage thread has
+ * finished its current batch. If the Database has no storage thread, the
+ * function is run directly.
+ *
+ * The caller is blocked meanwhile. When called from a ClientHandler, this
+ * stalls its whole EventLoop, and all the clients it serves, for as long as
+ * the storage thread takes to write up to STORAGE_BATCH rows and run fn. With
+ * a slow or distant backend, that may include completing a PostgreSQL COPY,
+ * or waiting for the results of all pipelined INSERTs (up to
+ * PG_PIPELINE_DEPTH round trips in the worst case), before fn itself starts.
+ * The calls currently made this way (opening the Database, creating tables,
+ * registering senders and the start time) only happen when clients connect or
+ * declare new schemas, which keeps this acceptable; anything on the path of
+ * every sample must go through storage_insert() instead.
+ *
+ * \param db Database to operate on
+ * \param fn function to run
+ * \param arg argument to pass to fn
+ * \return the value returned by fn
+ * \see storage_call_fn
+ */
+int
+storage_call (Database *db, storage_call_fn fn, void *arg)
+{
+  StorageQueue *q = db->queue;
+  StorageCall call;
+
+  if (!q) {
+    return fn (db, arg);
+  }
+
+  memset (&call, 0, sizeof(call));
+  call.fn = fn;
+  call.arg = arg;
+
+  pthread_mutex_lock (&q->lock);
+  if (q->calls_last) {
+    q->calls_last->next = &call;
+  } else {
+    q->calls = &call;
+  }
+  q->calls_last = &call;
+  pthread_cond_signal (&q->work);
+  while (!call.done) {
+    pthread_cond_wait (&q->done, &q->lock);
+  }
+  pthread_mutex_unlock (&q->lock);
+
+  return call.result;
+}
+
+/** Queue a row for insertion by the storage thread, with the lock of the queue held.
+ *
+ * The caller must make sure there is room in the queue.
+ *
+ * \see storage_insert
+ */
+static int
+storage_queue_row (Database *db, StorageQueue *q, DbTable *table, int sender_id, int seq_no,
+    double time_stamp, OmlValue *values, int value_count)
+{
+  DbRow *row;
+  StorageSlot *slot;
+  OmlValue tmp, *new_values;
+  int i;
+
+  if (q->stopping) {
+    return -1;
+  }
+
+  i = (q->head + q->count) % q->size;
+  row = &q->rows[i];
+  slot = &q->slots[i];
+  if (slot->values_size < value_count) {
+    if (!(new_values = oml_calloc (value_count, sizeof(OmlValue)))) {
+      return -1;
+    }
+    if (row->values) {
+      memcpy (new_values, row->values, slot->values_size * sizeof(OmlValue));
+      oml_free (row->values);
+    }
+    row->values = new_values;
+    slot->values_size = value_count;
+  }
+  for (i = 0; i < value_count; i++) {
+    if (OML_STRING_VALUE == oml_value_get_type (&values[i]) &&
+        omlc_get_string_is_const (*oml_value_get_value (&values[i]))) {
+      /* Constant strings, e.g., from a string dictionary, might not outlive
+       * this call; copy them instead, reusing the storage of the slot */
+      if (oml_value_set (&row->values[i], oml_value_get_value (&values[i]), OML_STRING_VALUE)) {
+        return -1;
+      }
+      continue;
+    }
+    tmp = row->values[i];
+    row->values[i] = values[i];
+    values[i] = tmp;
+  }
+
+  slot->table = table;
+  row->sender_id = sender_id;
+  row->seq_no = seq_no;
+  row->time_stamp = time_stamp;
+  row->value_count = value_count;
+  slot->queued = storage_now ();
+
+  if (++q->count > q->max_depth) {
+    q->max_depth = q->count;
+  }
+  if (q->count >= (unsigned int)storage_high_watermark && !q->throttled) {
+    logdebug ("%s: Storage queue reached %u rows, throttling clients\n", db->name, q->count);
+    q->throttled = 1;
+  }
+
+  return 0;
+}
+
+/** Queue a row for insertion by the storage thread.
+ *
+ * The values are moved to the queue, and replaced by previously-used ones,
+ * which the caller should reset before reuse. This avoids copying strings and
+ * blobs. Constant strings are copied, though, into storage reused from
+ * previous rows.
+ *
+ * Callers should check storage_is_throttled() before decoding new rows. If the
+ * queue is full nonetheless, the row is not queued, and the values are left
+ * untouched; the caller should keep them, and try again once
+ * storage_is_throttled() returns 0. This function never waits for room, so
+ * the EventLoop is not blocked by slow storage.
+ *
+ * \param db Database to write to
+ * \param table DbTable to insert data in
+ * \param sender_id sender ID
+ * \param seq_no sequence number
+ * \param time_stamp timestamp of the receiving data
+ * \param values OmlValue array to queue
+ * \param value_count number of values
+ * \return 0 if successful, 1 if the queue is full, -1 otherwise
+ * \see db_adapter_insert, storage_insert_batch
+ */
+int
+storage_insert (Database *db, DbTable *table, int sender_id, int seq_no,
+    double time_stamp, OmlValue *values, int value_count)
+{
+  StorageQueue *q = db->queue;
+  int ret;
+
+  if (!q) {
+    return db->insert (db, table, sender_id, seq_no, time_stamp, values, value_count);
+  }
+
+  pthread_mutex_lock (&q->lock);
+  if (q->count >= q->size) {
+    logdebug ("%s: Storage queue full\n", db->name);
+    ret = 1;
+  } else if (0 == (ret = storage_queue_row (db, q, table, sender_id, seq_no, time_stamp, values, value_count))) {
+    pthread_cond_signal (&q->work);
+  }
+  pthread_mutex_unlock (&q->lock);
+
+  return ret;
+}
+
+/** Queue several rows of a table for insertion by the storage thread.
+ *
+ * This is equivalent to calling storage_insert() for each row, but the queue
+ * is only locked once. If the queue fills up, only the first rows are queued;
+ * the caller should keep the others, and try again once
+ * storage_is_throttled() returns 0.
+ *
+ * \param db Database to write to
+ * \param table DbTable to insert data in
+ * \param sender_id sender ID
+ * \param seq_nos array of the sequence numbers of the rows
+ * \param time_stamps array of the timestamps of the rows
+ * \param values array of rows * value_count OmlValues to queue, row by row
+ * \param value_count number of values in each row
+ * \param rows number of rows
+ * \return the number of rows queued, or -1 on error
+ * \see storage_insert, database_insert_batch
+ */
+int
+storage_insert_batch (Database *db, DbTable *table, int sender_id, const int32_t *seq_nos,
+    const double *time_stamps, OmlValue *values, int value_count, int rows)
+{
+  StorageQueue *q = db->queue;
+  DbRow *batch;
+  int i, ret = 0;
+
+  if (!q) {
+    if (!(batch = oml_calloc (rows, sizeof(DbRow)))) {
+      return -1;
+    }
+    for (i = 0; i < rows; i++) {
+      batch[i].sender_id = sender_id;
+      batch[i].seq_no = seq_nos[i];
+      batch[i].time_stamp = time_stamps[i];
+      batch[i].values = &values[i * value_count];
+      batch[i].value_count = value_count;
+    }
+    ret = database_insert_batch (db, table, batch, rows) ? -1 : rows;
+    oml_free (batch);
+    return ret;
+  }
+
+  pthread_mutex_lock (&q->lock);
+  for (i = 0; i < rows && q->count < q->size; i++) {
+    if (storage_queue_row (db, q, table, sender_id, seq_nos[i], time_stamps[i],
+          &values[i * value_count], value_count)) {
+      ret = -1;
+      break;
+    }
+  }
+  if (i < rows && 0 == ret) {
+    logdebug ("%s: Storage queue full, queued %d of %d rows\n", db->name, i, rows);
+  }
+  pthread_cond_signal (&q->work);
+  pthread_mutex_unlock (&q->lock);
+
+  return ret ? ret : i;
+}
+
+/** Queue several rows of a table for insertion by the storage thread, waiting for room.
+ *
+ * Unlike storage_insert_batch(), this blocks the calling thread while the
+ * queue is full, until the storage thread has written enough rows to make
+ * room for all of them. The rows keep their order with respect to those
+ * already queued. As with storage_call(), this must stay off the path of
+ * every sample; it is meant for rows which cannot wait anymore, e.g., those
+ * left pending by a client being freed.
+ *
+ * \param db Database to write to
+ * \param table DbTable to insert data in
+ * \param sender_id sender ID
+ * \param seq_nos array of the sequence numbers of the rows
+ * \param time_stamps array of the timestamps of the rows
+ * \param values array of rows * value_count OmlValues to queue, row by row
+ * \param value_count number of values in each row
+ * \param rows number of rows
+ * \return the number of rows queued, which is less than rows only if the
+ * storage thread is stopping, or -1 on error
+ * \see storage_insert_batch, client_handler_free
+ */
+int
+storage_insert_batch_wait (Database *db, DbTable *table, int sender_id, const int32_t *seq_nos,
+    const double *time_stamps, OmlValue *values, int value_count, int rows)
+{
+  StorageQueue *q = db->queue;
+  int i, ret = 0;
+
+  if (!q) {
+    return storage_insert_batch (db, table, sender_id, seq_nos, time_stamps,
+        values, value_count, rows);
+  }
+
+  pthread_mutex_lock (&q->lock);
+  for (i = 0; i < rows; i++) {
+    while (q->count >= q->size && !q->stopping) {
+      pthread_cond_signal (&q->work);
+      pthread_cond_wait (&q->done, &q->lock);
+    }
+    if (storage_queue_row (db, q, table, sender_id, seq_nos[i], time_stamps[i],
+          &values[i * value_count], value_count)) {
+      ret = -1;
+      break;
+    }
+  }
+  pthread_cond_signal (&q->work);
+  pthread_mutex_unlock (&q->lock);
+
+  return ret ? ret : i;
+}
+
+/** Check whether clients of a Database should stop sending data.
+ *
+ * \param db Database to check
+ * \return 1 if the queue of the Database has reached storage_high_watermark,
+ * and not yet drained to storage_low_watermark, 0 otherwise
+ * \see storage_insert
+ */
+int
+storage_is_throttled (Database *db)
+{
+  StorageQueue *q = db->queue;
+  int throttled;
+
+  if (!q) {
+    return 0;
+  }
+
+  pthread_mutex_lock (&q->lock);
+  if (q->throttled && q->count <= (unsigned int)storage_low_watermark) {
+    logdebug ("%s: Storage queue down to %u rows, resuming clients\n", db->name, q->count);
+    q->throttled = 0;
+  }
+  throttled = q->throttled;
+  pthread_mutex_unlock (&q->lock);
+
+  return throttled;
+}
+
+/** Get the number of rows waiting to be written to a Database.
+ *
+ * \param db Database to check
+ * \return the number of queued rows
+ */
+unsigned int
+storage_depth (Database *db)
+{
+  StorageQueue *q = db->queue;
+  unsigned int count;
+
+  if (!q) {
+    return 0;
+  }
+
+  pthread_mutex_lock (&q->lock);
+  count = q->count;
+  pthread_mutex_unlock (&q->lock);
+
+  return count;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
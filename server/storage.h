@@ -0,0 +1,67 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA), Australia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ *
+ */
+#ifndef STORAGE_H_
+#define STORAGE_H_
+
+#include "oml_value.h"
+#include "database.h"
+
+/** Default number of queued rows above which clients are throttled */
+#define DEF_STORAGE_HIGH_WATERMARK 4096
+/** Default number of queued rows below which throttled clients resume */
+#define DEF_STORAGE_LOW_WATERMARK 1024
+
+/** Function run by the storage thread on behalf of another thread
+ *
+ * \param db Database the storage thread is writing to
+ * \param arg opaque argument given to storage_call
+ * \return a value passed back to the caller of storage_call
+ * \see storage_call
+ */
+typedef int (*storage_call_fn)(Database *db, void *arg);
+
+extern int storage_high_watermark;
+extern int storage_low_watermark;
+
+int  storage_start (Database *db);
+void storage_stop (Database *db);
+int  storage_call (Database *db, storage_call_fn fn, void *arg);
+int  storage_insert (Database *db, DbTable *table, int sender_id, int seq_no,
+                     double time_stamp, OmlValue *values, int value_count);
+int  storage_insert_batch (Database *db, DbTable *table, int sender_id, const int32_t *seq_nos,
+                           const double *time_stamps, OmlValue *values, int value_count, int rows);
+int  storage_insert_batch_wait (Database *db, DbTable *table, int sender_id, const int32_t *seq_nos,
+                                const double *time_stamps, OmlValue *values, int value_count, int rows);
+int  storage_is_throttled (Database *db);
+unsigned int storage_depth (Database *db);
+
+#endif /* STORAGE_H_ */
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,220 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file workers.c
+ * \brief Runs additional EventLoops in their own threads, and distributes clients between them.
+ *
+ * New connections are spread over the worker threads in a round-robin
+ * fashion. Once a client has announced its domain, it is handed over to the
+ * thread owning that domain, so each Database is only ever used by one
+ * EventLoop.
+ *
+ * \see client_handler_new, process_meta
+ */
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+
+#include "ocomm/o_log.h"
+#include "ocomm/o_eventloop.h"
+#include "mem.h"
+#include "workers.h"
+
+/** A thread running its own EventLoop */
+typedef struct Worker {
+  /** EventLoop run by this worker */
+  EventLoop *loop;
+  /** Thread running the EventLoop */
+  pthread_t thread;
+  /** Non-zero if thread has been started */
+  int started;
+} Worker;
+
+/** Array of workers */
+static Worker *workers = NULL;
+/** Number of workers */
+static int nworkers = 0;
+/** Index of the worker to which the next new client will be given */
+static int next_worker = 0;
+
+/** Main function of worker threads.
+ *
+ * \param arg pointer to the Worker
+ * \return NULL
+ */
+static void*
+worker_run (void *arg)
+{
+  Worker *self = (Worker*)arg;
+
+  eventloop_make_current (self->loop);
+  eventloop_run ();
+  logdebug ("workers: Thread %ld done\n", (long)(self - workers));
+
+  return NULL;
+}
+
+/** Task stopping the EventLoop of a worker.
+ *
+ * \param handle reason for stopping, cast as a pointer
+ * \see eventloop_post, eventloop_terminate
+ */
+static void
+worker_terminate (void *handle)
+{
+  eventloop_terminate ((int)(intptr_t)handle);
+}
+
+/** Start worker threads, each running its own EventLoop.
+ *
+ * Signals are blocked in the worker threads, so they are only handled by the
+ * main thread.
+ *
+ * \param count number of threads to start; nothing is done if less than 1
+ * \return 0 on success, -1 otherwise
+ * \see workers_cleanup
+ */
+int
+workers_setup (int count)
+{
+  sigset_t set, oldset;
+  int i, ret = 0;
+
+  if (count < 1) {
+    return 0;
+  }
+
+  if (!(workers = oml_calloc (count, sizeof(Worker)))) {
+    return -1;
+  }
+  nworkers = count;
+
+  sigfillset (&set);
+  pthread_sigmask (SIG_BLOCK, &set, &oldset);
+
+  for (i = 0; i < count && !ret; i++) {
+    if (!(workers[i].loop = eventloop_new ())) {
+      logerror ("workers: Could not create EventLoop for thread %d\n", i);
+      ret = -1;
+
+    } else if ((errno = pthread_create (&workers[i].thread, NULL, worker_run, &workers[i]))) {
+      logerror ("workers: Could not start thread %d: %s\n", i, strerror (errno));
+      ret = -1;
+
+    } else {
+      workers[i].started = 1;
+    }
+  }
+
+  pthread_sigmask (SIG_SETMASK, &oldset, NULL);
+
+  if (ret) {
+    workers_cleanup (1);
+  } else {
+    loginfo ("workers: Started %d thread%s\n", count, count>1?"s":"");
+  }
+
+  return ret;
+}
+
+/** Stop all worker threads, and wait for them to finish.
+ *
+ * \param reason non-zero reason passed to eventloop_terminate()
+ * \see workers_setup
+ */
+void
+workers_cleanup (int reason)
+{
+  int i;
+
+  for (i = 0; i < nworkers; i++) {
+    if (workers[i].started) {
+      eventloop_post (workers[i].loop, worker_terminate, (void*)(intptr_t)(reason ? reason : 1));
+    }
+  }
+  for (i = 0; i < nworkers; i++) {
+    if (workers[i].started) {
+      pthread_join (workers[i].thread, NULL);
+    }
+    eventloop_free (workers[i].loop);
+  }
+
+  if (workers) {
+    oml_free (workers);
+  }
+  workers = NULL;
+  nworkers = 0;
+  next_worker = 0;
+}
+
+/** Get the number of worker threads.
+ * \return the number of workers, 0 if all clients are handled by the main thread
+ */
+int
+workers_count (void)
+{
+  return nworkers;
+}
+
+/** Choose the worker to handle a new client.
+ *
+ * This should only be called from the main thread.
+ *
+ * \return the EventLoop of the worker, or NULL if there are no workers
+ */
+EventLoop*
+workers_next (void)
+{
+  EventLoop *loop;
+
+  if (nworkers < 1) {
+    return NULL;
+  }
+
+  loop = workers[next_worker].loop;
+  next_worker = (next_worker + 1) % nworkers;
+
+  return loop;
+}
+
+/** Find the worker responsible for a domain.
+ *
+ * All clients for a domain are always handled by the same worker, chosen from
+ * a hash of its name.
+ *
+ * \param domain name of the domain
+ * \return the EventLoop of the worker, or NULL if there are no workers
+ */
+EventLoop*
+workers_for_domain (const char *domain)
+{
+  /* djb2 */
+  uint32_t hash = 5381;
+
+  if (nworkers < 1) {
+    return NULL;
+  }
+
+  while (*domain) {
+    hash = hash * 33 + (unsigned char)*domain++;
+  }
+
+  return workers[hash % nworkers].loop;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
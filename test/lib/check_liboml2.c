@@ -27,6 +27,9 @@ main (void)
   srunner_add_suite (sr, filters_suite ());
   srunner_add_suite (sr, api_suite ());
   srunner_add_suite (sr, config_suite ());
+  srunner_add_suite (sr, spool_suite ());
+  srunner_add_suite (sr, staging_suite ());
+  srunner_add_suite (sr, eventloop_suite ());
   /* The log_suite has to be last, lest it messes up logging for suites
    * following it */
   srunner_add_suite (sr, log_suite ());
@@ -10,7 +10,10 @@
 /** \file  check_liboml2_api.c
  * \brief Test the user-visible OML API.
  */
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <dirent.h>
 #include <check.h>
 
 #include "ocomm/o_log.h"
@@ -20,6 +23,7 @@
 #include "oml_value.h"
 #include "validate.h"
 #include "client.h"
+#include "mem.h"
 
 typedef struct
 {
@@ -224,6 +228,247 @@ START_TEST(test_api_metadata)
 }
 END_TEST
 
+/** Check that batch injection gives the same output as individual injections */
+START_TEST(test_api_batch)
+{
+  OmlMPDef batchdef [] = {
+    { "a", OML_UINT32_VALUE },
+    { "b", OML_INT32_VALUE },
+    { NULL, (OmlValueT)0 }
+  };
+  OmlMP *mp;
+  OmlValueU rows[3 * 2];
+  OmlValueU col_a[2], col_b[2];
+  const OmlValueU *columns[2] = { col_a, col_b };
+  char buf[256];
+  double ts;
+  int i, index, seq, n = 0, mpindex;
+  unsigned int a;
+  int b;
+  FILE *fp;
+
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_api_batch");
+  unlink("test_api_batch");
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("batch", batchdef);
+  fail_if(mp == NULL, "Failed to add MP");
+
+  omlc_zero_array(rows, 6);
+  fail_unless(omlc_inject_batch(mp, rows, 3),
+      "omlc_inject_batch() succeeded before omlc_start was called");
+
+  fail_if(omlc_start(), "Error starting OML");
+  mpindex = mp->streams->index;
+
+  for (i = 0; i < 3; i++) {
+    omlc_set_uint32(rows[2 * i], i);
+    omlc_set_int32(rows[2 * i + 1], -i);
+  }
+  fail_if(omlc_inject_batch(mp, rows, 3), "omlc_inject_batch() failed");
+  fail_if(omlc_inject_batch(mp, rows, 0), "omlc_inject_batch() failed with no samples");
+  fail_unless(omlc_inject_batch(mp, NULL, 3), "omlc_inject_batch() accepted NULL samples");
+
+  for (i = 0; i < 2; i++) {
+    omlc_set_uint32(col_a[i], 3 + i);
+    omlc_set_int32(col_b[i], -3 - i);
+  }
+  fail_if(omlc_inject_batch_columns(mp, columns, 2), "omlc_inject_batch_columns() failed");
+
+  omlc_set_uint32(rows[0], 5);
+  omlc_set_int32(rows[1], -5);
+  fail_if(omlc_inject(mp, rows), "omlc_inject() failed after a batch");
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  fp = fopen("test_api_batch", "r");
+  fail_unless(fp != NULL, "Output file test_api_batch missing");
+  while(fgets(buf, sizeof(buf), fp)) {
+    if (5 == sscanf(buf, "%lf\t%d\t%d\t%u\t%d", &ts, &index, &seq, &a, &b) &&
+        index == mpindex) {
+      fail_unless(seq == n + 1, "Sample %d has sequence number %d", n, seq);
+      fail_unless(a == n && b == -n, "Sample %d has values %u and %d", n, a, b);
+      n++;
+    }
+  }
+  fclose(fp);
+  fail_unless(n == 6, "Found %d samples instead of 6", n);
+}
+END_TEST
+
+START_TEST(test_api_sample)
+{
+  OmlMPDef sampledef [] = {
+    { "a", OML_UINT32_VALUE },
+    { "s", OML_STRING_VALUE },
+    { "b", OML_BLOB_VALUE },
+    { NULL, (OmlValueT)0 }
+  };
+  OmlMP *mp;
+  OmlSample *sample;
+  char str[32], buf[256], s[32], b[32];
+  const char blob[] = "blob";
+  size_t allocated;
+  double ts;
+  int i, index, seq, n = 0, mpindex;
+  unsigned int a;
+  FILE *fp;
+
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Do not lose samples in the small file buffer */
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_sample",
+    "--oml-overflow", "block",
+    "--oml-log-level", "2"};
+  int argc = LENGTH(argv);
+  unlink("test_api_sample");
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  mp = omlc_add_mp("sample", sampledef);
+  fail_if(mp == NULL, "Failed to add MP");
+  fail_if(omlc_start(), "Error starting OML");
+  mpindex = mp->streams->index;
+
+  sample = omlc_sample_new(mp);
+  fail_if(sample == NULL, "Failed to create sample");
+  fail_unless(omlc_sample_set_int32(sample, 0, 1), "Set an OML_UINT32_VALUE field as int32");
+  fail_unless(omlc_sample_set_uint32(sample, 3, 1), "Set a non-existent field");
+  fail_unless(omlc_sample_set_string(sample, 2, str), "Set an OML_BLOB_VALUE field as string");
+  fail_if(omlc_sample_set_blob(sample, 2, blob, 4), "Cannot set blob");
+
+  /* Warm up, then make sure no more memory is needed */
+  allocated = 0;
+  for (i = 0; i < 2000; i++) {
+    if (i == 1000) {
+      allocated = xmemnew();
+    }
+    snprintf(str, sizeof(str), "sample %d", i);
+    fail_if(omlc_sample_set_uint32(sample, 0, i), "Cannot set uint32");
+    fail_if(omlc_sample_set_string(sample, 1, str), "Cannot set string");
+    fail_if(omlc_sample_inject(sample), "Cannot inject sample %d", i);
+    /* The string is borrowed; it can be overwritten as soon as inject returns */
+    memset(str, 'x', sizeof(str) - 1);
+  }
+  fail_unless(xmemnew() == allocated,
+      "%zuB were allocated injecting samples after warm-up", xmemnew() - allocated);
+
+  omlc_sample_free(sample);
+  fail_if(omlc_close(), "Error closing OML");
+
+  fp = fopen("test_api_sample", "r");
+  fail_unless(fp != NULL, "Output file test_api_sample missing");
+  while(fgets(buf, sizeof(buf), fp)) {
+    if (6 == sscanf(buf, "%lf\t%d\t%d\t%u\tsample %31s\t%31s", &ts, &index, &seq, &a, s, b) &&
+        index == mpindex) {
+      snprintf(str, sizeof(str), "%d", n);
+      fail_unless(a == n && !strcmp(s, str), "Sample %d has values %u and 'sample %s'", n, a, s);
+      fail_unless(!strcmp(b, "YmxvYg=="), "Sample %d has blob '%s'", n, b);
+      n++;
+    }
+  }
+  fclose(fp);
+  fail_unless(n == 2000, "Found %d samples instead of 2000", n);
+}
+END_TEST
+
+/** Count the threads of this process, or return -1 if this is not possible */
+static int
+count_threads(void)
+{
+  DIR *d = opendir("/proc/self/task");
+  struct dirent *e;
+  int n = 0;
+
+  if (!d) {
+    return -1;
+  }
+  while ((e = readdir(d))) {
+    if (e->d_name[0] != '.') {
+      n++;
+    }
+  }
+  closedir(d);
+  return n;
+}
+
+#define NINTERVALMPS 16
+
+/** Check that periodic MSs are reported without a thread each */
+START_TEST(test_api_interval)
+{
+  OmlMPDef intervaldef [] = {
+    { "a", OML_UINT32_VALUE },
+    { NULL, (OmlValueT)0 }
+  };
+  static char names[NINTERVALMPS][16];
+  OmlMP *mp[NINTERVALMPS];
+  int mpindex[NINTERVALMPS], reports[NINTERVALMPS];
+  OmlValueU v;
+  char buf[256];
+  double ts, avg;
+  int i, j, index, seq, threads;
+  FILE *fp;
+
+  logdebug("%s\n", __FUNCTION__);
+
+  const char* argv[] = {
+    __FUNCTION__,
+    "--oml-id", __FUNCTION__,
+    "--oml-domain", __FILE__,
+    "--oml-collect", "file:test_api_interval",
+    "--oml-interval", "0.05",
+    "--oml-overflow", "block",
+    "--oml-log-level", "2"};
+  int argc = LENGTH(argv);
+  unlink("test_api_interval");
+
+  fail_if(omlc_init("app", &argc, argv, NULL), "Error initialising OML");
+  for (i = 0; i < NINTERVALMPS; i++) {
+    snprintf(names[i], sizeof(names[i]), "interval%d", i);
+    mp[i] = omlc_add_mp(names[i], intervaldef);
+    fail_if(mp[i] == NULL, "Failed to add MP %d", i);
+  }
+  fail_if(omlc_start(), "Error starting OML");
+
+  omlc_zero(v);
+  for (i = 0; i < NINTERVALMPS; i++) {
+    mpindex[i] = mp[i]->streams->index;
+    reports[i] = 0;
+    omlc_set_uint32(v, i);
+    fail_if(omlc_inject(mp[i], &v), "Cannot inject in MP %d", i);
+  }
+  usleep(300000);
+
+  threads = count_threads();
+  fail_unless(threads < NINTERVALMPS, "%d threads running for %d periodic MSs", threads, NINTERVALMPS);
+
+  fail_if(omlc_close(), "Error closing OML");
+
+  fp = fopen("test_api_interval", "r");
+  fail_unless(fp != NULL, "Output file test_api_interval missing");
+  while(fgets(buf, sizeof(buf), fp)) {
+    if (4 == sscanf(buf, "%lf\t%d\t%d\t%lf", &ts, &index, &seq, &avg)) {
+      for (j = 0; j < NINTERVALMPS; j++) {
+        if (index == mpindex[j]) {
+          fail_unless(seq == reports[j] + 1, "Report %d of MP %d has sequence number %d", reports[j], j, seq);
+          reports[j]++;
+        }
+      }
+    }
+  }
+  fclose(fp);
+  for (i = 0; i < NINTERVALMPS; i++) {
+    fail_unless(reports[i] >= 2, "MP %d was reported %d times in 0.3s, every 0.05s", i, reports[i]);
+  }
+}
+END_TEST
+
 Suite*
 api_suite (void)
 {
@@ -239,6 +484,9 @@ api_suite (void)
   TCase* tc_api_func = tcase_create("ApiFunctions");
   tcase_add_test(tc_api_func, test_api_basic);
   tcase_add_test(tc_api_func, test_api_metadata);
+  tcase_add_test(tc_api_func, test_api_batch);
+  tcase_add_test(tc_api_func, test_api_sample);
+  tcase_add_test(tc_api_func, test_api_interval);
   suite_add_tcase (s, tc_api_func);
 
   return s;
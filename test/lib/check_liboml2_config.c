@@ -20,6 +20,7 @@
 
 #include "ocomm/o_log.h"
 #include "oml2/omlc.h"
+#include "client.h"
 #include "check_utils.h"
 
 OmlMPDef mp_def [] =
@@ -221,6 +222,179 @@ START_TEST (test_config_multi_collect)
 }
 END_TEST
 
+/** Read the data following the headers of an output file.
+ *
+ * \param name name of the file
+ * \param buf buffer to read the file into
+ * \param size size of buf
+ * \param[out] len length of the data
+ * \return a pointer to the data in buf, or NULL if the headers were not found
+ */
+static char*
+read_data(const char *name, char *buf, size_t size, size_t *len)
+{
+  FILE *fp = fopen(name, "r");
+  size_t n;
+  char *data;
+
+  fail_unless(fp != NULL, "Output file %s missing", name);
+  n = fread(buf, 1, size - 1, fp);
+  fclose(fp);
+  buf[n] = '\0';
+
+  if (NULL == (data = strstr(buf, "\n\n"))) {
+    return NULL;
+  }
+  data += 2;
+  *len = n - (data - buf);
+  return data;
+}
+
+/** Check that samples encoded once for several writers reach all of them */
+START_TEST (test_config_fanout)
+{
+  OmlMP *mp;
+  OmlValueU v[2];
+  char buf[5][8192], *data[5];
+  size_t len[5];
+  /* The first writer also is the default writer */
+  char *dests[5] = { "test_config_fanout_default",
+    "test_config_fanout_text1", "test_config_fanout_text2",
+    "test_config_fanout_bin1", "test_config_fanout_bin2" };
+  char config[] = "<omlc domain='check_liboml2_config' id='test_config_fanout'>\n"
+                  "  <collect url='file:test_config_fanout_default' encoding='text' />\n"
+                  "  <collect url='file:test_config_fanout_text1' encoding='text' />\n"
+                  "  <collect url='file:test_config_fanout_bin1' encoding='binary' />\n"
+                  "  <collect url='file:test_config_fanout_text2' encoding='text' />\n"
+                  "  <collect url='file:test_config_fanout_bin2' encoding='binary' />\n"
+                  "</omlc>";
+  int i;
+  FILE *fp;
+
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_config_fanout");
+  argv[1] = "--oml-config";
+  argv[2] = "test_config_fanout.xml";
+  argc = 3;
+
+  fp = fopen (argv[2], "w");
+  fail_unless(fp != NULL, "Could not create configuration file %s: %s", argv[2], strerror(errno));
+  fail_unless(fwrite(config, sizeof(config), 1, fp) == 1,
+      "Could not write configuration in file %s: %s", argv[2], strerror(errno));
+  fclose(fp);
+
+  for (i=0; i<5; i++) {
+    unlink(dests[i]);
+  }
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL),
+      "Could not initialise OML");
+  mp = omlc_add_mp(__FUNCTION__, mp_def);
+  fail_if(mp==NULL, "Could not add MP");
+  fail_if(omlc_start(), "Could not start OML");
+
+  for (i=0; i<20; i++) {
+    omlc_set_uint32(v[0], i);
+    omlc_set_uint32(v[1], 2 * i);
+    fail_if(omlc_inject(mp, v), "Injection %d failed", i);
+  }
+
+  omlc_close();
+
+  for (i=0; i<5; i++) {
+    data[i] = read_data(dests[i], buf[i], sizeof(buf[i]), &len[i]);
+    fail_if(data[i] == NULL, "No end of headers in %s", dests[i]);
+    fail_unless(len[i] > 0, "No data in %s", dests[i]);
+  }
+
+  /* Copies are byte-for-byte identical to the encoded sample */
+  fail_unless(len[1] == len[2] && !memcmp(data[1], data[2], len[1]),
+      "Text outputs differ: '%s' and '%s'", data[1], data[2]);
+  fail_unless(len[3] == len[4] && !memcmp(data[3], data[4], len[3]),
+      "Binary outputs differ");
+  fail_unless(strstr(data[1], "\t20\t19\t38\n") != NULL, "Last sample not found in '%s'", data[1]);
+}
+END_TEST
+
+/** Check that the priority and overflow attributes of <stream /> are applied */
+START_TEST (test_config_stream_policy)
+{
+  OmlMP *mp;
+  OmlMStream *ms;
+  char config[] = "<omlc domain='check_liboml2_config' id='test_config_stream_policy'>\n"
+                  "  <collect url='file:test_config_stream_policy' encoding='text'>\n"
+                  "    <stream mp='test_config_stream_policy' name='low' samples='1' priority='low' overflow='decimate:5' />\n"
+                  "    <stream mp='test_config_stream_policy' name='high' samples='1' priority='high' overflow='block' />\n"
+                  "  </collect>\n"
+                  "</omlc>";
+  int found = 0;
+  FILE *fp;
+
+  logdebug("%s\n", __FUNCTION__);
+
+  MAKEOMLCMDLINE(argc, argv, "file:test_config_stream_policy");
+  argv[1] = "--oml-config";
+  argv[2] = "test_config_stream_policy.xml";
+  argc = 3;
+
+  fp = fopen (argv[2], "w");
+  fail_unless(fp != NULL, "Could not create configuration file %s: %s", argv[2], strerror(errno));
+  fail_unless(fwrite(config, sizeof(config), 1, fp) == 1,
+      "Could not write configuration in file %s: %s", argv[2], strerror(errno));
+  fclose(fp);
+
+  fail_if(omlc_init(__FUNCTION__, &argc, argv, NULL),
+      "Could not initialise OML");
+  mp = omlc_add_mp(__FUNCTION__, mp_def);
+  fail_if(mp==NULL, "Could not add MP");
+  fail_if(omlc_start(), "Could not start OML");
+
+  for (ms = mp->streams; ms; ms = ms->next) {
+    if (!strcmp(ms->table_name, "test_config_stream_policy_low")) {
+      fail_unless(ms->priority == OML_PRIORITY_LOW, "Unexpected priority %d for stream %s", ms->priority, ms->table_name);
+      fail_unless(ms->overflow == OML_OVERFLOW_DECIMATE, "Unexpected overflow policy %d for stream %s", ms->overflow, ms->table_name);
+      fail_unless(ms->overflow_param == 5, "Unexpected decimation factor %d for stream %s", ms->overflow_param, ms->table_name);
+      found++;
+    } else if (!strcmp(ms->table_name, "test_config_stream_policy_high")) {
+      fail_unless(ms->priority == OML_PRIORITY_HIGH, "Unexpected priority %d for stream %s", ms->priority, ms->table_name);
+      fail_unless(ms->overflow == OML_OVERFLOW_BLOCK, "Unexpected overflow policy %d for stream %s", ms->overflow, ms->table_name);
+      fail_unless(ms->overflow_param == OML_OVERFLOW_BLOCK_TIMEOUT, "Unexpected timeout %d for stream %s", ms->overflow_param, ms->table_name);
+      found++;
+    }
+  }
+  fail_unless(found == 2, "Only found %d of the 2 configured streams", found);
+
+  omlc_close();
+}
+END_TEST
+
+/** Check the parsing of priorities and overflow policies */
+START_TEST (test_config_parse_overflow)
+{
+  int v;
+  uint32_t param;
+
+  fail_if(oml_parse_priority("low", &v) || v != OML_PRIORITY_LOW);
+  fail_if(oml_parse_priority("normal", &v) || v != OML_PRIORITY_NORMAL);
+  fail_if(oml_parse_priority("high", &v) || v != OML_PRIORITY_HIGH);
+  fail_unless(oml_parse_priority("urgent", &v) == -1);
+  fail_unless(oml_parse_priority("hig", &v) == -1);
+
+  fail_if(oml_parse_overflow("drop-newest", &v, &param) || v != OML_OVERFLOW_DROP_NEWEST);
+  fail_if(oml_parse_overflow("drop-oldest", &v, &param) || v != OML_OVERFLOW_DROP_OLDEST);
+  fail_if(oml_parse_overflow("block", &v, &param) || v != OML_OVERFLOW_BLOCK ||
+      param != OML_OVERFLOW_BLOCK_TIMEOUT);
+  fail_if(oml_parse_overflow("block:250", &v, &param) || v != OML_OVERFLOW_BLOCK || param != 250);
+  fail_if(oml_parse_overflow("decimate", &v, &param) || v != OML_OVERFLOW_DECIMATE ||
+      param != OML_OVERFLOW_DECIMATE_FACTOR);
+  fail_if(oml_parse_overflow("decimate:3", &v, &param) || v != OML_OVERFLOW_DECIMATE || param != 3);
+  fail_unless(oml_parse_overflow("decimate:0", &v, &param) == -1);
+  fail_unless(oml_parse_overflow("block:x", &v, &param) == -1);
+  fail_unless(oml_parse_overflow("drop", &v, &param) == -1);
+}
+END_TEST
+
 Suite*
 config_suite (void)
 {
@@ -231,6 +405,9 @@ config_suite (void)
   tcase_add_test (tc_config, test_config_metadata);
   tcase_add_test (tc_config, test_config_empty_collect);
   tcase_add_test (tc_config, test_config_multi_collect);
+  tcase_add_test (tc_config, test_config_fanout);
+  tcase_add_test (tc_config, test_config_stream_policy);
+  tcase_add_test (tc_config, test_config_parse_overflow);
 
   suite_add_tcase (s, tc_config);
 
@@ -0,0 +1,525 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_liboml2_eventloop.c
+ * \brief Test the OComm EventLoop
+ */
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <check.h>
+
+#include "ocomm/o_eventloop.h"
+#include "ocomm/o_socket.h"
+#include "check_utils.h"
+
+static const char* backends[] = { "poll", "epoll" };
+
+/** Number of timers in test_eventloop_timers; more than the initial size of the timer heap */
+#define NTIMERS 24
+
+/** Number of channels in test_eventloop_channels; more than the initial size of the poll(3) arrays */
+#define NCHANNELS 16
+
+/** State of one channel for test_eventloop_channels and test_eventloop_fallback */
+typedef struct {
+  Socket socket;
+  int fd;
+  SockEvtSource* source;
+
+  char buf[64];
+  size_t length;          /**< Amount of data in buf */
+  int closed;             /**< Number of SOCKET_CONN_CLOSED reported */
+  int *nclosed;           /**< Number of channels closed in the test */
+} ChannelTest;
+
+/** Shared state of test_eventloop_channels */
+typedef struct {
+  ChannelTest channels[NCHANNELS];
+  int peers[NCHANNELS];   /**< Other end of each socket pair */
+  int nclosed;            /**< Number of channels closed so far */
+  int checks;             /**< Number of calls to the check timer */
+} ChannelsTest;
+
+static int
+channel_get_sockfd(Socket* socket)
+{
+  return ((ChannelTest*)socket)->fd;
+}
+
+static void
+channel_read(SockEvtSource* source, void* handle, void* buffer, int buf_size)
+{
+  ChannelTest* c = (ChannelTest*)handle;
+
+  fail_if(NULL == buffer, "No data passed to the read callback");
+  fail_if(c->length + buf_size > sizeof(c->buf), "Read more data than sent");
+  memcpy(c->buf + c->length, buffer, buf_size);
+  c->length += buf_size;
+}
+
+static void
+channel_status(SockEvtSource* source, SocketStatus status, int errcode, void* handle)
+{
+  ChannelTest* c = (ChannelTest*)handle;
+
+  fail_unless(SOCKET_CONN_CLOSED == status, "Unexpected status %d on '%s'", status, c->socket.name);
+  c->closed++;
+  eventloop_socket_release(source);
+  if (++*c->nclosed == NCHANNELS) {
+    eventloop_stop(1);
+  }
+}
+
+static void
+channels_check(TimerEvtSource* timer, void* handle)
+{
+  ChannelsTest* t = (ChannelsTest*)handle;
+  int i;
+
+  t->checks++;
+  eventloop_timer_stop(timer);
+
+  /* The first channel was inactive, all others have read their data */
+  fail_unless(0 == t->channels[0].length,
+      "Read %zu bytes from an inactive channel", t->channels[0].length);
+  for (i = 1; i < NCHANNELS; i++) {
+    fail_unless(6 == t->channels[i].length,
+        "Read %zu bytes instead of 6 from channel %d", t->channels[i].length, i);
+  }
+
+  eventloop_socket_activate(t->channels[0].source, 1);
+  for (i = 0; i < NCHANNELS; i++) {
+    close(t->peers[i]);
+  }
+}
+
+START_TEST(test_eventloop_channels)
+{
+  ChannelsTest t;
+  char names[NCHANNELS][16];
+  char data[7];
+  int sv[2];
+  int i;
+
+  memset(&t, 0, sizeof(t));
+
+  eventloop_init();
+  if (eventloop_set_backend(backends[_i])) {
+    logwarn("%s backend unavailable, skipping test\n", backends[_i]);
+    return;
+  }
+
+  for (i = 0; i < NCHANNELS; i++) {
+    fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "Cannot create socket pair %d", i);
+    snprintf(names[i], sizeof(names[i]), "channel-%d", i);
+    t.channels[i].socket.name = names[i];
+    t.channels[i].socket.get_sockfd = channel_get_sockfd;
+    t.channels[i].fd = sv[0];
+    t.channels[i].nclosed = &t.nclosed;
+    t.peers[i] = sv[1];
+    t.channels[i].source = eventloop_on_read_in_channel(&t.channels[i].socket,
+        channel_read, channel_status, &t.channels[i]);
+    fail_if(NULL == t.channels[i].source, "Cannot create channel %d", i);
+
+    snprintf(data, sizeof(data), "data%02d", i);
+    fail_unless(6 == write(sv[1], data, 6), "Cannot write test data to channel %d", i);
+  }
+  eventloop_socket_activate(t.channels[0].source, 0);
+  eventloop_every_ms("channels-check", 100, channels_check, &t);
+
+  eventloop_run();
+
+  fail_unless(!strcmp(backends[_i], eventloop_get_backend()),
+      "Backend changed from %s to %s", backends[_i], eventloop_get_backend());
+  fail_unless(1 == t.checks, "Check timer fired %d times instead of once", t.checks);
+  for (i = 0; i < NCHANNELS; i++) {
+    snprintf(data, sizeof(data), "data%02d", i);
+    fail_unless(6 == t.channels[i].length && !strncmp(t.channels[i].buf, data, 6),
+        "Channel %d read '%.*s' instead of '%s'", i, (int)t.channels[i].length, t.channels[i].buf, data);
+    fail_unless(1 == t.channels[i].closed,
+        "Channel %d reported closed %d times", i, t.channels[i].closed);
+    close(t.channels[i].fd);
+  }
+}
+END_TEST
+
+static void
+fallback_read(SockEvtSource* source, void* handle, void* buffer, int buf_size)
+{
+  ChannelTest* c = (ChannelTest*)handle;
+
+  channel_read(source, handle, buffer, buf_size);
+  if (c->length >= 6) {
+    /* There is no end-of-file notification for STDIN */
+    eventloop_socket_release(source);
+    eventloop_stop(1);
+  }
+}
+
+START_TEST(test_eventloop_fallback)
+{
+  ChannelTest c;
+  FILE *f;
+  int stdin_fd;
+
+  memset(&c, 0, sizeof(c));
+
+  eventloop_init();
+  if (eventloop_set_backend(backends[_i])) {
+    logwarn("%s backend unavailable, skipping test\n", backends[_i]);
+    return;
+  }
+
+  /* STDIN redirected from a regular file cannot be monitored with epoll(7) */
+  f = tmpfile();
+  fail_if(NULL == f, "Cannot create temporary file");
+  fail_unless(6 == fwrite("foobar", 1, 6, f), "Cannot write test data");
+  fflush(f);
+  rewind(f);
+  stdin_fd = dup(0);
+  fail_if(stdin_fd < 0 || dup2(fileno(f), 0) < 0, "Cannot redirect STDIN");
+
+  c.source = eventloop_on_stdin(fallback_read, &c);
+  fail_if(NULL == c.source, "Cannot create channel");
+
+  eventloop_run();
+
+  dup2(stdin_fd, 0);
+  close(stdin_fd);
+  fclose(f);
+
+  fail_unless(!strcmp("poll", eventloop_get_backend()),
+      "Still using the %s backend for a regular file", eventloop_get_backend());
+  fail_unless(6 == c.length && !strncmp(c.buf, "foobar", 6),
+      "Read '%.*s' instead of 'foobar'", (int)c.length, c.buf);
+}
+END_TEST
+
+/** Channel state for test_eventloop_nobufs and test_eventloop_bufs_error */
+typedef struct {
+  Socket socket;
+  int fd;
+  SockEvtSource* source;
+
+  int refuse;             /**< Whether the buffer callback has no room (1), or fails (-1) */
+  int buffer_calls;       /**< Number of calls to the buffer callback */
+  SocketStatus status;    /**< Last status reported to the status callback */
+  char buf[64];
+  size_t length;          /**< Amount of data in buf */
+
+  int checks;             /**< Number of calls to the check timer */
+} NobufsTest;
+
+static int
+nobufs_get_sockfd(Socket* socket)
+{
+  return ((NobufsTest*)socket)->fd;
+}
+
+static int
+nobufs_buffer(SockEvtSource* source, void* handle, struct iovec *iov, int iovcnt)
+{
+  NobufsTest* t = (NobufsTest*)handle;
+
+  t->buffer_calls++;
+  if (t->refuse) {
+    return t->refuse < 0 ? -1 : 0;
+  }
+  iov[0].iov_base = t->buf + t->length;
+  iov[0].iov_len = sizeof(t->buf) - t->length;
+  return 1;
+}
+
+static void
+nobufs_read(SockEvtSource* source, void* handle, void* buffer, int buf_size)
+{
+  NobufsTest* t = (NobufsTest*)handle;
+
+  fail_unless(NULL == buffer, "Data not read into the provided buffer");
+  t->length += buf_size;
+}
+
+static void
+nobufs_status(SockEvtSource* source, SocketStatus status, int errcode, void* handle)
+{
+  NobufsTest* t = (NobufsTest*)handle;
+
+  t->status = status;
+  if (SOCKET_DROPPED == status) {
+    eventloop_socket_release(source);
+    eventloop_stop(1);
+  }
+}
+
+static void
+nobufs_check(TimerEvtSource* timer, void* handle)
+{
+  NobufsTest* t = (NobufsTest*)handle;
+
+  if (1 == ++t->checks) {
+    /* A channel which stayed active would have been reported readable again and again */
+    fail_unless(1 == t->buffer_calls,
+        "Buffer callback called %d times while refusing data", t->buffer_calls);
+    fail_unless(0 == t->length, "Read %zu bytes while refusing data", t->length);
+
+    t->refuse = 0;
+    eventloop_socket_activate(t->source, 1);
+
+  } else {
+    fail_unless(6 == t->length, "Read %zu bytes instead of 6 after making room", t->length);
+    fail_unless(!strncmp(t->buf, "foobar", t->length), "Read unexpected data '%.*s'", (int)t->length, t->buf);
+
+    eventloop_timer_stop(timer);
+    eventloop_socket_activate(t->source, 0);
+    eventloop_stop(1);
+  }
+}
+
+START_TEST(test_eventloop_nobufs)
+{
+  NobufsTest t;
+  int sv[2];
+
+  memset(&t, 0, sizeof(t));
+  fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "Cannot create socket pair");
+
+  eventloop_init();
+  if (eventloop_set_backend(backends[_i])) {
+    logwarn("%s backend unavailable, skipping test\n", backends[_i]);
+    return;
+  }
+
+  t.socket.name = "nobufs";
+  t.socket.get_sockfd = nobufs_get_sockfd;
+  t.fd = sv[0];
+  t.refuse = 1;
+  t.source = eventloop_on_read_in_channel(&t.socket, nobufs_read, NULL, &t);
+  fail_if(NULL == t.source, "Cannot create channel");
+  eventloop_socket_set_buffer_callback(t.source, nobufs_buffer);
+  eventloop_every_ms("nobufs-check", 50, nobufs_check, &t);
+
+  fail_unless(6 == write(sv[1], "foobar", 6), "Cannot write test data");
+
+  eventloop_run();
+
+  fail_unless(2 == t.checks, "Check timer fired %d times instead of 2", t.checks);
+
+  close(sv[0]);
+  close(sv[1]);
+}
+END_TEST
+
+static void
+bufs_error_check(TimerEvtSource* timer, void* handle)
+{
+  NobufsTest* t = (NobufsTest*)handle;
+
+  t->checks++;
+  eventloop_timer_stop(timer);
+  eventloop_stop(1);
+}
+
+START_TEST(test_eventloop_bufs_error)
+{
+  NobufsTest t;
+  int sv[2];
+
+  memset(&t, 0, sizeof(t));
+  fail_if(socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "Cannot create socket pair");
+
+  eventloop_init();
+  if (eventloop_set_backend(backends[_i])) {
+    logwarn("%s backend unavailable, skipping test\n", backends[_i]);
+    return;
+  }
+
+  t.socket.name = "bufs-error";
+  t.socket.get_sockfd = nobufs_get_sockfd;
+  t.fd = sv[0];
+  t.refuse = -1;
+  t.status = SOCKET_UNKNOWN;
+  t.source = eventloop_on_read_in_channel(&t.socket, nobufs_read, nobufs_status, &t);
+  fail_if(NULL == t.source, "Cannot create channel");
+  eventloop_socket_set_buffer_callback(t.source, nobufs_buffer);
+  eventloop_every_ms("bufs-error-check", 1000, bufs_error_check, &t);
+
+  fail_unless(6 == write(sv[1], "foobar", 6), "Cannot write test data");
+
+  eventloop_run();
+
+  /* The channel would otherwise be paused forever, and the check timer fire */
+  fail_unless(SOCKET_DROPPED == t.status, "Channel not dropped after a buffer error (status %d)", t.status);
+  fail_unless(0 == t.checks, "Check timer fired before the channel was dropped");
+  fail_unless(1 == t.buffer_calls,
+      "Buffer callback called %d times after an error", t.buffer_calls);
+  fail_unless(0 == t.length, "Read %zu bytes without a buffer", t.length);
+
+  close(sv[0]);
+  close(sv[1]);
+}
+END_TEST
+
+/** State of one timer for test_eventloop_timers */
+typedef struct {
+  TimerEvtSource* timer;
+  uint64_t due;           /**< Expected deadline [ms] */
+  int fired;              /**< Number of times the callback was called */
+  int stopped;            /**< Whether the timer was removed before being due */
+  struct TimersTest *test;
+} TimerTest;
+
+/** Shared state of test_eventloop_timers */
+typedef struct TimersTest {
+  TimerTest timers[NTIMERS + 1]; /**< The last one is armed from a callback */
+  uint64_t last_due;      /**< Deadline of the last timer fired */
+  int nfired;             /**< Number of timers fired so far */
+  int expected;           /**< Number of timers expected to fire */
+} TimersTest;
+
+/** Period [ms] of the i-th timer of test_eventloop_timers, in a scrambled order */
+#define TIMER_PERIOD(i) ((((i) * 7) % NTIMERS + 1) * 10)
+/** Index of the timer of test_eventloop_timers which stops and arms another one */
+#define TIMER_REARMER 4  /* 50ms */
+/** Index of the timer stopped by TIMER_REARMER while inside the heap */
+#define TIMER_REARMED 9  /* 160ms */
+/** Period of the timer armed by TIMER_REARMER, due between the 80ms and 90ms ones */
+#define TIMER_REARM_PERIOD 35
+
+static uint64_t
+timers_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void timer_fired(TimerEvtSource* timer, void* handle);
+
+static void
+timer_arm(TimerTest* t, unsigned int period)
+{
+  t->due = timers_now() + period;
+  t->timer = eventloop_every_ms("timer-test", period, timer_fired, t);
+  fail_if(NULL == t->timer, "Cannot create timer");
+}
+
+static void
+timer_fired(TimerEvtSource* timer, void* handle)
+{
+  TimerTest* t = (TimerTest*)handle;
+  TimersTest* test = t->test;
+
+  fail_if(t->stopped, "Timer %d fired after being stopped", (int)(t - test->timers));
+  /* Allow for the clock ticking between our reading and the EventLoop's */
+  fail_if(t->due + 2 < test->last_due,
+      "Timer %d due at %" PRIu64 " fired after one due at %" PRIu64,
+      (int)(t - test->timers), t->due, test->last_due);
+  if (t->due > test->last_due) {
+    test->last_due = t->due;
+  }
+  t->fired++;
+
+  /* Make this timer a one-shot */
+  eventloop_timer_stop(timer);
+  t->timer = NULL;
+
+  if (t == &test->timers[TIMER_REARMER]) {
+    fail_if(NULL == test->timers[TIMER_REARMED].timer, "Timer to stop already gone");
+    eventloop_timer_stop(test->timers[TIMER_REARMED].timer);
+    test->timers[TIMER_REARMED].timer = NULL;
+    test->timers[TIMER_REARMED].stopped = 1;
+    timer_arm(&test->timers[NTIMERS], TIMER_REARM_PERIOD);
+  }
+
+  if (++test->nfired == test->expected) {
+    eventloop_stop(1);
+  }
+}
+
+static void
+timers_watchdog(TimerEvtSource* timer, void* handle)
+{
+  eventloop_stop(1);
+}
+
+START_TEST(test_eventloop_timers)
+{
+  TimersTest test;
+  TimerEvtSource* timeout;
+  int i;
+
+  memset(&test, 0, sizeof(test));
+  for (i = 0; i <= NTIMERS; i++) {
+    test.timers[i].test = &test;
+  }
+
+  eventloop_init();
+  if (eventloop_set_backend(backends[_i])) {
+    logwarn("%s backend unavailable, skipping test\n", backends[_i]);
+    return;
+  }
+
+  /* Arm timers out of order */
+  for (i = 0; i < NTIMERS; i++) {
+    timer_arm(&test.timers[i], TIMER_PERIOD(i));
+  }
+  /* Remove some of them from the middle and the end of the heap */
+  for (i = 2; i < NTIMERS; i += 5) {
+    eventloop_timer_stop(test.timers[i].timer);
+    test.timers[i].timer = NULL;
+    test.timers[i].stopped = 1;
+  }
+  /* All others fire, but TIMER_REARMED, replaced by another one */
+  test.expected = NTIMERS - (NTIMERS - 2 + 4) / 5;
+
+  timeout = eventloop_every_ms("timers-timeout", 5000, timers_watchdog, NULL);
+  eventloop_run();
+  eventloop_timer_stop(timeout);
+
+  fail_unless(test.expected == test.nfired,
+      "%d timers fired instead of %d", test.nfired, test.expected);
+  for (i = 0; i <= NTIMERS; i++) {
+    fail_unless(test.timers[i].fired == !test.timers[i].stopped,
+        "Timer %d (%sstopped) fired %d times",
+        i, test.timers[i].stopped ? "" : "not ", test.timers[i].fired);
+  }
+}
+END_TEST
+
+Suite*
+eventloop_suite (void)
+{
+  Suite* s = suite_create ("EventLoop");
+
+  TCase* tc_eventloop = tcase_create ("EventLoop");
+
+  tcase_add_loop_test (tc_eventloop, test_eventloop_timers, 0, LENGTH(backends));
+  tcase_add_loop_test (tc_eventloop, test_eventloop_channels, 0, LENGTH(backends));
+  tcase_add_loop_test (tc_eventloop, test_eventloop_fallback, 0, LENGTH(backends));
+  tcase_add_loop_test (tc_eventloop, test_eventloop_nobufs, 0, LENGTH(backends));
+  tcase_add_loop_test (tc_eventloop, test_eventloop_bufs_error, 0, LENGTH(backends));
+
+  suite_add_tcase (s, tc_eventloop);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -36,6 +36,7 @@
 #include "filter/sum_filter.h"
 #include "filter/delta_filter.h"
 #include "oml2/oml_writer.h"
+#include "oml_value.h"
 #include "check_utils.h"
 
 typedef struct OmlAvgFilterInstanceData AvgInstanceData;
@@ -108,6 +109,74 @@ START_TEST (test_filter_create)
 }
 END_TEST
 
+static int custom_snapshots = 0;
+
+static int
+custom_snapshot (OmlFilter* f, OmlValue* snapshot)
+{
+  (void)f;
+  omlc_set_double (*oml_value_get_value(&snapshot[0]), 42.);
+  custom_snapshots++;
+  return 0;
+}
+
+START_TEST (test_filter_snapshot)
+{
+  /*
+   * Capture the output of an averaging filter with the default snapshot
+   * function, then with a custom one.
+   */
+  OmlFilter* f = NULL;
+  AvgInstanceData* instdata = NULL;
+  OmlValue v;
+  OmlValueU u;
+  int32_t input [] = { 1, 2, 3, 4, 5, 6 };
+  double output [] = { 3.5, 1, 6 };
+  int i;
+
+  f = create_filter ("avg", "avginst", OML_INT32_VALUE, 2);
+  fail_if (f->snapshot == NULL, "Filter snapshot function is NULL");
+  fail_if (f->snapshot_result == NULL, "Filter snapshot result is NULL");
+  instdata = (AvgInstanceData*)f->instance_data;
+
+  oml_value_init (&v);
+  omlc_zero (u);
+  for (i = 0; i < 6; i++) {
+    omlc_set_int32 (u, input[i]);
+    oml_value_set (&v, &u, OML_INT32_VALUE);
+    f->input (f, &v);
+  }
+
+  fail_unless (f->snapshot (f, f->snapshot_result) == 0);
+  for (i = 0; i < 3; i++) {
+    fail_unless (oml_value_get_type(&f->snapshot_result[i]) == OML_DOUBLE_VALUE);
+    fail_unless (omlc_get_double(*oml_value_get_value(&f->snapshot_result[i])) == output[i],
+        "Snapshot value %d is %f instead of %f", i,
+        omlc_get_double(*oml_value_get_value(&f->snapshot_result[i])), output[i]);
+  }
+  /* The snapshot started a new window */
+  fail_unless (instdata->sample_count == 0);
+  fail_unless (isnan(instdata->sample_sum));
+
+  fail_unless (destroy_filter(f) == NULL);
+
+  fail_unless (omlf_register_filter_snapshot ("nonexistent", custom_snapshot) == -1);
+  fail_unless (omlf_register_filter_snapshot ("avg", custom_snapshot) == 0);
+  f = create_filter ("avg", "avginst", OML_INT32_VALUE, 2);
+  fail_unless (f->snapshot == custom_snapshot);
+  fail_unless (f->snapshot (f, f->snapshot_result) == 0);
+  fail_unless (custom_snapshots == 1);
+  fail_unless (omlc_get_double(*oml_value_get_value(&f->snapshot_result[0])) == 42.);
+  fail_unless (destroy_filter(f) == NULL);
+
+  /* Back to the default */
+  fail_unless (omlf_register_filter_snapshot ("avg", NULL) == 0);
+  f = create_filter ("avg", "avginst", OML_INT32_VALUE, 2);
+  fail_if (f->snapshot == custom_snapshot);
+  fail_unless (destroy_filter(f) == NULL);
+}
+END_TEST
+
 /********************************************************************************/
 /*                         AVERAGING FILTER TESTS                               */
 /********************************************************************************/
@@ -462,6 +531,7 @@ filters_suite (void)
 
   /* Add tests to test case "FilterCore" */
   tcase_add_test (tc_filter, test_filter_create);
+  tcase_add_test (tc_filter, test_filter_snapshot);
 
   /* Add tests to test case "FilterAverage" */
   tcase_add_test (tc_filter_avg, test_filter_avg_create);
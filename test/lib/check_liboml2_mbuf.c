@@ -243,6 +243,56 @@ START_TEST (test_mbuf_write_null)
 }
 END_TEST
 
+START_TEST (test_mbuf_print_exact)
+{
+  /* The formatted string exactly fills the buffer, without room for the '\0' */
+  MBuffer* mbuf = mbuf_create2 (8, 8);
+  int result = 0;
+
+  result = mbuf_print (mbuf, "%s\t%d", "abc", 1234);
+  fail_if (result != 0);
+  fail_if (mbuf->fill != 8);
+  fail_if (memcmp (mbuf->base, "abc\t1234", 8), "Truncated string '%.8s'", mbuf->base);
+
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+START_TEST (test_mbuf_write_advance)
+{
+  const char *s = "0123456789ABCDEF";
+  size_t len = strlen (s);
+  MBuffer* mbuf = mbuf_create ();
+  size_t length = mbuf_length (mbuf);
+  int result = 0;
+
+  fail_if (mbuf_write_advance (NULL, 1) != -1);
+
+  fail_if (mbuf_check_resize (mbuf, length + len) == -1);
+  length = mbuf_length (mbuf);
+  fail_if (mbuf_wr_remaining (mbuf) < len);
+
+  memcpy (mbuf_wrptr (mbuf), s, len);
+  result = mbuf_write_advance (mbuf, len);
+
+  fail_if (result == -1);
+  fail_if (mbuf->fill != len);
+  fail_if (mbuf->wrptr - mbuf->base != (int)len);
+  fail_if (mbuf->rdptr != mbuf->base);
+  fail_if (mbuf->wr_remaining != length - len);
+  fail_if (mbuf->rd_remaining != len);
+  fail_if (strncmp ((char*)mbuf->base, s, len) != 0);
+
+  /* Advancing past the end of the buffer must fail and leave it untouched */
+  result = mbuf_write_advance (mbuf, mbuf_wr_remaining (mbuf) + 1);
+  fail_if (result != -1);
+  fail_if (mbuf->fill != len);
+  fail_if (mbuf->wr_remaining != length - len);
+
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
 START_TEST (test_mbuf_read)
 {
   char s[8192];
@@ -632,6 +682,8 @@ mbuf_suite (void)
   tcase_add_test (tc_mbuf, test_mbuf_resize_contents);
   tcase_add_test (tc_mbuf, test_mbuf_write);
   tcase_add_test (tc_mbuf, test_mbuf_write_null);
+  tcase_add_test (tc_mbuf, test_mbuf_print_exact);
+  tcase_add_test (tc_mbuf, test_mbuf_write_advance);
   tcase_add_test (tc_mbuf, test_mbuf_read);
   tcase_add_test (tc_mbuf, test_mbuf_read_null);
   tcase_add_test (tc_mbuf, test_mbuf_begin_read);
@@ -402,6 +402,56 @@ START_TEST (test_blob)
 }
 END_TEST
 
+START_TEST (test_borrow)
+{
+  OmlValue v;
+  OmlValueU u;
+  char *test = "test";
+  char blob[] = { 1, 2, 3 };
+  size_t bcount;
+
+  oml_value_init(&v);
+  omlc_zero(u);
+
+  /* Borrowing releases previously owned storage */
+  omlc_set_string_copy(u, "owned", 5);
+  fail_if(oml_value_set(&v, &u, OML_STRING_VALUE));
+  omlc_reset_string(u);
+  bcount = xmembytes();
+  omlc_set_string(u, test);
+  fail_if(oml_value_borrow(&v, &u, OML_STRING_VALUE));
+  fail_unless(xmembytes() < bcount, "Owned storage not freed when borrowing");
+  bcount = xmembytes();
+  fail_unless(omlc_get_string_ptr(*oml_value_get_value(&v)) == test,
+      "Borrowed string was copied");
+  fail_unless(omlc_get_string_length(*oml_value_get_value(&v)) == strlen(test));
+  fail_unless(omlc_get_string_size(*oml_value_get_value(&v)) == 0,
+      "Borrowed string marked as owned");
+  fail_unless(omlc_get_string_is_const(*oml_value_get_value(&v)));
+
+  omlc_set_blob_ptr(u, blob);
+  omlc_set_blob_length(u, sizeof(blob));
+  fail_if(oml_value_borrow(&v, &u, OML_BLOB_VALUE));
+  fail_unless(oml_value_get_type(&v) == OML_BLOB_VALUE);
+  fail_unless(omlc_get_blob_ptr(*oml_value_get_value(&v)) == blob,
+      "Borrowed blob was copied");
+  fail_unless(omlc_get_blob_size(*oml_value_get_value(&v)) == 0,
+      "Borrowed blob marked as owned");
+
+  omlc_set_blob_ptr(u, NULL);
+  fail_unless(oml_value_borrow(&v, &u, OML_BLOB_VALUE), "Borrowed a NULL blob");
+
+  /* Borrowed data is not freed on reset */
+  oml_value_reset(&v);
+  fail_unless(xmembytes() == bcount, "Borrowing allocated memory");
+
+  omlc_set_uint32(u, 42);
+  fail_if(oml_value_borrow(&v, &u, OML_UINT32_VALUE));
+  fail_unless(omlc_get_uint32(*oml_value_get_value(&v)) == 42);
+  oml_value_reset(&v);
+}
+END_TEST
+
 static struct {
   const char* str;
   uint8_t     b;
@@ -435,6 +485,7 @@ omlvalue_suite (void)
   tcase_add_test (tc_omlvalue, test_intrinsic);
   tcase_add_test (tc_omlvalue, test_string);
   tcase_add_test (tc_omlvalue, test_blob);
+  tcase_add_test (tc_omlvalue, test_borrow);
   tcase_add_loop_test (tc_omlvalue, test_bool_loop, 0, LENGTH(booltest));
 
   suite_add_tcase (s, tc_omlvalue);
@@ -0,0 +1,177 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <check.h>
+
+#include "spool.h"
+#include "check_utils.h"
+
+#define SPOOL_TEST_DIR "spool-test"
+
+/** Count the segment files left in SPOOL_TEST_DIR */
+static int
+count_segments(void)
+{
+  DIR* d;
+  struct dirent* e;
+  int n = 0;
+
+  fail_if(NULL == (d = opendir(SPOOL_TEST_DIR)));
+  while ((e = readdir(d))) {
+    if (strstr(e->d_name, ".spool")) {
+      n++;
+    }
+  }
+  closedir(d);
+  return n;
+}
+
+static void
+spool_setup(void)
+{
+  mkdir(SPOOL_TEST_DIR, 0700);
+}
+
+static void
+spool_teardown(void)
+{
+  rmdir(SPOOL_TEST_DIR);
+}
+
+START_TEST (test_spool_roundtrip)
+{
+  Spool* sp = spool_new(SPOOL_TEST_DIR, "test", 0);
+  struct iovec iov[4];
+  uint8_t rec[1000];
+  size_t total = 0;
+  int i, j, n, next = 0;
+
+  fail_if(NULL == sp);
+  fail_unless(spool_peek(sp, iov, 4, 100000) == 0);
+  fail_unless(count_segments() == 0, "Spool created a segment before being written to");
+
+  /* Enough records to span two segments */
+  for (i = 0; i < SPOOL_SEGMENT_SIZE / sizeof(rec) + 10; i++) {
+    memset(rec, i & 0xff, sizeof(rec));
+    fail_unless(spool_append(sp, rec, sizeof(rec)) == 0, "Cannot append record %d", i);
+    total += sizeof(rec);
+  }
+  fail_unless(spool_bytes(sp) == total);
+  fail_unless(count_segments() == 2, "Expected 2 segments, found %d", count_segments());
+
+  /* Records come back in order, without their headers */
+  while ((n = spool_peek(sp, iov, 4, 100000)) > 0) {
+    for (i = 0; i < n; i++) {
+      fail_unless(iov[i].iov_len == sizeof(rec));
+      for (j = 0; j < (int)sizeof(rec); j++) {
+        fail_unless(((uint8_t*)iov[i].iov_base)[j] == (next & 0xff),
+            "Unexpected data in record %d", next);
+      }
+      next++;
+    }
+    spool_consume(sp, n * sizeof(rec));
+    total -= n * sizeof(rec);
+    fail_unless(spool_bytes(sp) == total);
+  }
+  fail_unless(next == SPOOL_SEGMENT_SIZE / sizeof(rec) + 10);
+  fail_unless(count_segments() == 0, "Sent segments were not removed");
+
+  spool_destroy(sp);
+}
+END_TEST
+
+START_TEST (test_spool_partial)
+{
+  Spool* sp = spool_new(SPOOL_TEST_DIR, "test", 0);
+  struct iovec iov[4];
+
+  fail_if(NULL == sp);
+  fail_unless(spool_append(sp, (uint8_t*)"abcdef", 6) == 0);
+  fail_unless(spool_append(sp, (uint8_t*)"ghi", 3) == 0);
+  fail_unless(spool_append(sp, (uint8_t*)"jklmn", 5) == 0);
+
+  /* The size limit is soft, but always leaves whole records */
+  fail_unless(spool_peek(sp, iov, 4, 10) == 2);
+  fail_unless(spool_peek(sp, iov, 4, 0) == 1);
+
+  spool_consume(sp, 8);
+  fail_unless(spool_partial(sp));
+  fail_unless(spool_bytes(sp) == 6);
+  fail_unless(spool_peek(sp, iov, 4, 100) == 2);
+  fail_unless(iov[0].iov_len == 1 && !memcmp(iov[0].iov_base, "i", 1));
+  fail_unless(iov[1].iov_len == 5 && !memcmp(iov[1].iov_base, "jklmn", 5));
+
+  spool_consume(sp, 1);
+  fail_if(spool_partial(sp));
+  spool_consume(sp, 5);
+  fail_unless(spool_bytes(sp) == 0);
+  fail_unless(spool_peek(sp, iov, 4, 100) == 0);
+
+  /* The spool can be used again once emptied */
+  fail_unless(spool_append(sp, (uint8_t*)"op", 2) == 0);
+  fail_unless(spool_peek(sp, iov, 4, 100) == 1);
+  fail_unless(iov[0].iov_len == 2 && !memcmp(iov[0].iov_base, "op", 2));
+
+  spool_destroy(sp);
+  fail_unless(count_segments() == 0, "Segments left after destruction");
+}
+END_TEST
+
+START_TEST (test_spool_max)
+{
+  Spool* sp = spool_new(SPOOL_TEST_DIR, "test", 10);
+  struct iovec iov[4];
+
+  fail_if(NULL == sp);
+  fail_unless(spool_append(sp, (uint8_t*)"abcdef", 6) == 0);
+  fail_unless(spool_append(sp, (uint8_t*)"ghijk", 5) == -1, "Spool exceeded its maximal size");
+  fail_unless(spool_append(sp, (uint8_t*)"ghij", 4) == 0);
+  fail_unless(spool_bytes(sp) == 10);
+
+  fail_unless(spool_peek(sp, iov, 4, 100) == 2);
+  spool_consume(sp, 6);
+  fail_unless(spool_append(sp, (uint8_t*)"ghijk", 5) == 0);
+
+  spool_destroy(sp);
+
+  fail_unless(spool_new("spool-test-nonexistent", "test", 0) == NULL);
+}
+END_TEST
+
+Suite*
+spool_suite (void)
+{
+  Suite* s = suite_create ("Spool");
+
+  TCase* tc_spool = tcase_create ("Spool");
+  tcase_add_checked_fixture (tc_spool, spool_setup, spool_teardown);
+
+  tcase_add_test (tc_spool, test_spool_roundtrip);
+  tcase_add_test (tc_spool, test_spool_partial);
+  tcase_add_test (tc_spool, test_spool_max);
+
+  suite_add_tcase (s, tc_spool);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
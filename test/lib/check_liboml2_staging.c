@@ -0,0 +1,224 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <check.h>
+
+#include "oml2/omlc.h"
+#include "staging.h"
+#include "check_utils.h"
+
+#define NTHREADS 4
+#define NSAMPLES 2000
+
+static OmlMPDef stagingdef [] = {
+  { "thread", OML_UINT32_VALUE },
+  { "seq", OML_UINT32_VALUE },
+  { "label", OML_STRING_VALUE },
+  { NULL, (OmlValueT)0 }
+};
+
+static OmlMP stagingmp;
+
+/** What the drained samples looked like */
+typedef struct {
+  int count;
+  uint32_t next[NTHREADS + 1];  /**< Next expected sequence number per thread */
+  struct timeval last;          /**< Injection time of the previous sample */
+  int disordered;               /**< Number of samples out of order */
+} DrainState;
+
+static void
+check_sample(void *arg, const OmlValueU *values, const struct timeval *tv)
+{
+  DrainState *st = (DrainState*)arg;
+  uint32_t t = omlc_get_uint32(values[0]);
+  uint32_t seq = omlc_get_uint32(values[1]);
+  char label[32];
+
+  fail_unless(t <= NTHREADS, "Unexpected thread %u", t);
+  fail_unless(seq == st->next[t], "Thread %u: got sample %u instead of %u", t, seq, st->next[t]);
+  snprintf(label, sizeof(label), "%u-%u", t, seq);
+  fail_if(strcmp(omlc_get_string_ptr(values[2]), label),
+      "Sample %s has label '%s'", label, omlc_get_string_ptr(values[2]));
+
+  if (timercmp(tv, &st->last, <)) {
+    st->disordered++;
+  }
+  st->last = *tv;
+  st->next[t]++;
+  st->count++;
+}
+
+static void
+staging_setup(void)
+{
+  memset(&stagingmp, 0, sizeof(stagingmp));
+  stagingmp.name = "staging";
+  stagingmp.param_defs = stagingdef;
+  stagingmp.param_count = 3;
+}
+
+/** Stage a sample, with a label which is overwritten as soon as it is staged */
+static int
+push(OmlStaging *sp, uint32_t t, uint32_t seq)
+{
+  OmlValueU v[3];
+  char label[32];
+  int ret;
+
+  omlc_zero_array(v, 3);
+  snprintf(label, sizeof(label), "%u-%u", t, seq);
+  omlc_set_uint32(v[0], t);
+  omlc_set_uint32(v[1], seq);
+  omlc_set_string(v[2], label);
+  ret = staging_push(sp, v);
+  memset(label, 'x', sizeof(label) - 1);
+  return ret;
+}
+
+START_TEST (test_staging_full)
+{
+  OmlStaging *sp = staging_new(&stagingmp);
+  DrainState st;
+  int i;
+
+  memset(&st, 0, sizeof(st));
+  fail_if(NULL == sp);
+  fail_if(staging_pending(sp));
+  fail_unless(staging_drain(sp, check_sample, &st) == 0);
+
+  for (i = 0; i < OML_STAGING_SLOTS; i++) {
+    fail_if(push(sp, 0, i), "Cannot stage sample %d", i);
+  }
+  fail_unless(push(sp, 0, i), "Staged more than %d samples", OML_STAGING_SLOTS);
+  fail_unless(staging_pending(sp));
+
+  fail_unless(staging_drain(sp, check_sample, &st) == OML_STAGING_SLOTS);
+  fail_if(staging_pending(sp));
+  fail_if(push(sp, 0, i), "Cannot stage after draining");
+  fail_unless(staging_drain(sp, check_sample, &st) == 1);
+  fail_unless(st.count == OML_STAGING_SLOTS + 1);
+
+  staging_destroy(sp);
+}
+END_TEST
+
+typedef struct {
+  OmlStaging *sp;
+  uint32_t t;
+  uint32_t n;
+} Producer;
+
+static void*
+producer(void *arg)
+{
+  Producer *p = (Producer*)arg;
+  uint32_t seq;
+
+  for (seq = 0; seq < p->n; seq++) {
+    while (push(p->sp, p->t, seq)) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+START_TEST (test_staging_threads)
+{
+  OmlStaging *sp = staging_new(&stagingmp);
+  pthread_t threads[NTHREADS];
+  Producer p[NTHREADS];
+  DrainState st;
+  int i;
+
+  memset(&st, 0, sizeof(st));
+  fail_if(NULL == sp);
+
+  for (i = 0; i < NTHREADS; i++) {
+    p[i].sp = sp;
+    p[i].t = i + 1;
+    p[i].n = NSAMPLES;
+    pthread_create(&threads[i], NULL, producer, &p[i]);
+  }
+  /* Drain while the producers are running */
+  while (st.count < NTHREADS * NSAMPLES) {
+    if (!staging_drain(sp, check_sample, &st)) {
+      sched_yield();
+    }
+  }
+  for (i = 0; i < NTHREADS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  fail_if(staging_pending(sp));
+  for (i = 1; i <= NTHREADS; i++) {
+    fail_unless(st.next[i] == NSAMPLES, "Thread %d: got %u samples", i, st.next[i]);
+  }
+
+  staging_destroy(sp);
+}
+END_TEST
+
+START_TEST (test_staging_order)
+{
+  OmlStaging *sp = staging_new(&stagingmp);
+  pthread_t thread;
+  Producer p = { sp, 1, 10 };
+  DrainState st;
+  int i;
+
+  memset(&st, 0, sizeof(st));
+  fail_if(NULL == sp);
+
+  /* Interleave samples from two threads; each drain sees both rings */
+  for (i = 0; i < 10; i++) {
+    fail_if(push(sp, 0, 2 * i));
+    pthread_create(&thread, NULL, producer, &p);
+    pthread_join(thread, NULL);
+    fail_if(push(sp, 0, 2 * i + 1));
+    staging_drain(sp, check_sample, &st);
+    st.next[1] = 0;
+  }
+  fail_unless(st.count == 10 * (2 + 10), "Drained %d samples", st.count);
+  fail_unless(st.disordered == 0, "%d samples were not drained in order of injection", st.disordered);
+
+  staging_destroy(sp);
+}
+END_TEST
+
+Suite*
+staging_suite (void)
+{
+  Suite* s = suite_create ("Staging");
+
+  TCase* tc_staging = tcase_create ("Staging");
+  tcase_add_checked_fixture (tc_staging, staging_setup, NULL);
+
+  tcase_add_test (tc_staging, test_staging_full);
+  tcase_add_test (tc_staging, test_staging_threads);
+  tcase_add_test (tc_staging, test_staging_order);
+
+  suite_add_tcase (s, tc_staging);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
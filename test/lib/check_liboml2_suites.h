@@ -16,10 +16,13 @@ extern Suite* api_suite (void);
 extern Suite* bswap_suite (void);
 extern Suite* cbuf_suite (void);
 extern Suite* config_suite (void);
+extern Suite* eventloop_suite (void);
 extern Suite* filters_suite (void);
 extern Suite* log_suite (void);
 extern Suite* mbuf_suite (void);
 extern Suite* omlvalue_suite (void);
+extern Suite* spool_suite (void);
+extern Suite* staging_suite (void);
 extern Suite* writers_suite (void);
 
 #endif /* CHECK_LIBOML2_SUITES_H__ */
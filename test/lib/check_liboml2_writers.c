@@ -24,15 +24,22 @@
 #define _GNU_SOURCE  /* For NAN */
 #include <math.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <pthread.h>
+#include <sched.h>
 #include <check.h>
+#include <zlib.h>
 
+#include "mem.h"
 #include "mbuf.h"
 #include "client.h"
 #include "oml_utils.h"
 #include "file_stream.h"
+#include "zlib_stream.h"
+#include "buffered_writer.h"
 
 /*
 START_TEST (test_bw_create)
@@ -54,6 +61,367 @@ START_TEST (test_bw_create)
 END_TEST
 */
 
+/** An OmlOutStream keeping all data written into it in memory */
+typedef struct MockOutStream {
+  OmlOutStream os;
+
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int stalled;          /**< While set, writes wait, as on a congested connection */
+  int waiting;          /**< Set while a write waits */
+
+  size_t max_write;     /**< Maximal number of bytes accepted by each write, like a short writev(2), or 0 */
+
+  MBuffer* data;        /**< Data received */
+  int nwrites;          /**< Number of writes */
+  int max_iovcnt;       /**< Largest number of buffers passed to one write */
+  int nsplit;           /**< Number of short writes which ended in the middle of a buffer after the first */
+} MockOutStream;
+
+static ssize_t
+mock_writev(OmlOutStream* os, const struct iovec* iov, int iovcnt, uint8_t* header, size_t header_length)
+{
+  MockOutStream* self = (MockOutStream*)os;
+  size_t count = 0, len;
+  int i;
+  (void)header;
+  (void)header_length;
+
+  pthread_mutex_lock(&self->lock);
+  while (self->stalled) {
+    self->waiting = 1;
+    pthread_cond_broadcast(&self->cond);
+    pthread_cond_wait(&self->cond, &self->lock);
+  }
+  self->waiting = 0;
+  for (i = 0; i < iovcnt; i++) {
+    len = iov[i].iov_len;
+    if (self->max_write && count + len > self->max_write) {
+      len = self->max_write - count;
+      if (i > 0 && len > 0) {
+        self->nsplit++;
+      }
+    }
+    mbuf_write(self->data, iov[i].iov_base, len);
+    count += len;
+    if (len < iov[i].iov_len) {
+      break;
+    }
+  }
+  self->nwrites++;
+  if (iovcnt > self->max_iovcnt) {
+    self->max_iovcnt = iovcnt;
+  }
+  pthread_mutex_unlock(&self->lock);
+
+  return (ssize_t)count;
+}
+
+static ssize_t
+mock_write(OmlOutStream* os, uint8_t* buffer, size_t length, uint8_t* header, size_t header_length)
+{
+  struct iovec iov = { .iov_base = buffer, .iov_len = length };
+  return mock_writev(os, &iov, 1, header, header_length);
+}
+
+static int
+mock_close(OmlOutStream* os)
+{
+  (void)os;
+  return 0;
+}
+
+static void
+mock_init(MockOutStream* self)
+{
+  memset(self, 0, sizeof(*self));
+  self->os.write = mock_write;
+  self->os.writev = mock_writev;
+  self->os.close = mock_close;
+  self->os.dest = "mock";
+  pthread_mutex_init(&self->lock, NULL);
+  pthread_cond_init(&self->cond, NULL);
+  self->data = mbuf_create();
+}
+
+static void
+mock_cleanup(MockOutStream* self)
+{
+  mbuf_destroy(self->data);
+  pthread_cond_destroy(&self->cond);
+  pthread_mutex_destroy(&self->lock);
+}
+
+static void
+mock_stall(MockOutStream* self, int stalled)
+{
+  pthread_mutex_lock(&self->lock);
+  self->stalled = stalled;
+  pthread_cond_broadcast(&self->cond);
+  pthread_mutex_unlock(&self->lock);
+}
+
+/** Size of the messages written by bw_test_write, including the newline */
+#define BW_TEST_MSG_SIZE 12
+/** Size of the chunks of the BufferedWriters under test */
+#define BW_TEST_CHUNK_SIZE 64
+/** Number of chunks in the ring of the BufferedWriters under test */
+#define BW_TEST_NCHUNKS 4
+
+/** Write one message, as the OmlWriters do.
+ * \return 1 if the message was accepted, 0 if it was dropped
+ */
+static int
+bw_test_write(BufferedWriter* bw, OmlMStream* ms, int producer, int seq)
+{
+  MBuffer* mbuf = bw_get_write_buf(bw, ms);
+
+  if (!mbuf) {
+    return 0;
+  }
+  mbuf_begin_write(mbuf);
+  fail_if(mbuf_print(mbuf, "%02d %08d\n", producer, seq));
+  mbuf_begin_write(mbuf);
+  bw_msgcount_add(bw, ms, 1);
+  bw_release_write_buf(bw);
+  return 1;
+}
+
+/** Check the messages received from each producer are complete, and in order.
+ * \param received number of messages received from each producer, on return
+ * \param nproducers number of producers
+ */
+static void
+bw_test_check(MockOutStream* mock, int* received, int nproducers)
+{
+  const char* p = (const char*)mbuf_rdptr(mock->data);
+  size_t len = mbuf_fill(mock->data);
+  int producer, seq, n;
+
+  fail_unless(0 == len % BW_TEST_MSG_SIZE, "%d bytes received, not whole messages", (int)len);
+  memset(received, 0, nproducers * sizeof(int));
+  for (; len > 0; p += BW_TEST_MSG_SIZE, len -= BW_TEST_MSG_SIZE) {
+    fail_unless(2 == sscanf(p, "%d %d%n", &producer, &seq, &n) && BW_TEST_MSG_SIZE - 1 == n && '\n' == p[n],
+        "Corrupted message '%.*s'", BW_TEST_MSG_SIZE, p);
+    fail_unless(producer < nproducers);
+    fail_unless(seq == received[producer], "Message %d from producer %d received instead of %d",
+        seq, producer, received[producer]);
+    received[producer]++;
+  }
+}
+
+START_TEST (test_bw_wraparound)
+{
+  MockOutStream mock;
+  OmlMStream ms;
+  BufferedWriter* bw;
+  int i, n = 1000, received;
+
+  mock_init(&mock);
+  memset(&ms, 0, sizeof(ms));
+  ms.priority = OML_PRIORITY_NORMAL;
+  ms.overflow = OML_OVERFLOW_BLOCK;
+  ms.overflow_param = 5000;
+  bw = bw_create(&mock.os, BW_TEST_NCHUNKS * BW_TEST_CHUNK_SIZE, BW_TEST_CHUNK_SIZE);
+  fail_if(NULL == bw);
+
+  /* Many times the size of the ring, waiting for room rather than dropping */
+  for (i = 0; i < n; i++) {
+    fail_unless(bw_test_write(bw, &ms, 0, i), "Message %d dropped", i);
+  }
+  bw_close(bw);
+
+  bw_test_check(&mock, &received, 1);
+  fail_unless(n == received, "%d messages received instead of %d", received, n);
+  fail_unless(0 == ms.lost, "%d messages lost", ms.lost);
+  mock_cleanup(&mock);
+}
+END_TEST
+
+START_TEST (test_bw_full_ring)
+{
+  MockOutStream mock;
+  BufferedWriter* bw;
+  int i, accepted, dropped, received;
+  /* Messages fitting in the whole ring, with the last one crossing the limit of the chunk */
+  int capacity = BW_TEST_NCHUNKS * ((BW_TEST_CHUNK_SIZE + BW_TEST_MSG_SIZE - 1) / BW_TEST_MSG_SIZE);
+
+  mock_init(&mock);
+  bw = bw_create(&mock.os, BW_TEST_NCHUNKS * BW_TEST_CHUNK_SIZE, BW_TEST_CHUNK_SIZE);
+  fail_if(NULL == bw);
+
+  /* The reader cannot send anything, so the ring fills up, and new messages
+   * are dropped (the default policy) */
+  mock_stall(&mock, 1);
+  for (i = 0, accepted = 0, dropped = 0; i < 2 * capacity; i++) {
+    if (bw_test_write(bw, NULL, 0, accepted)) {
+      fail_if(dropped, "Message accepted after one was dropped");
+      accepted++;
+    } else {
+      dropped++;
+    }
+  }
+  fail_unless(accepted > 0 && accepted <= capacity, "%d messages accepted in a ring of %d", accepted, capacity);
+  fail_unless(dropped == 2 * capacity - accepted);
+
+  /* Once the reader catches up, there is room again */
+  mock_stall(&mock, 0);
+  for (i = 0; i < 50 && !bw_test_write(bw, NULL, 0, accepted); i++) {
+    usleep(10000);
+  }
+  fail_if(50 == i, "No room after the ring was drained");
+  accepted++;
+  bw_close(bw);
+
+  bw_test_check(&mock, &received, 1);
+  fail_unless(accepted == received, "%d messages received instead of %d", received, accepted);
+  mock_cleanup(&mock);
+}
+END_TEST
+
+/** Number of producers in test_bw_concurrent */
+#define BW_TEST_NPRODUCERS 4
+/** Number of messages written by each producer in test_bw_concurrent */
+#define BW_TEST_NMESSAGES 2000
+
+typedef struct BwTestProducer {
+  BufferedWriter* bw;
+  OmlMStream ms;
+  int id;
+} BwTestProducer;
+
+static void*
+bw_test_producer(void* arg)
+{
+  BwTestProducer* p = (BwTestProducer*)arg;
+  int i;
+
+  for (i = 0; i < BW_TEST_NMESSAGES; i++) {
+    fail_unless(bw_test_write(p->bw, &p->ms, p->id, i), "Message %d of producer %d dropped", i, p->id);
+    if (0 == i % 256) {
+      sched_yield();
+    }
+  }
+  return NULL;
+}
+
+START_TEST (test_bw_concurrent)
+{
+  MockOutStream mock;
+  BufferedWriter* bw;
+  BwTestProducer producers[BW_TEST_NPRODUCERS];
+  pthread_t threads[BW_TEST_NPRODUCERS];
+  int received[BW_TEST_NPRODUCERS];
+  int i;
+
+  mock_init(&mock);
+  bw = bw_create(&mock.os, BW_TEST_NCHUNKS * BW_TEST_CHUNK_SIZE, BW_TEST_CHUNK_SIZE);
+  fail_if(NULL == bw);
+
+  for (i = 0; i < BW_TEST_NPRODUCERS; i++) {
+    memset(&producers[i], 0, sizeof(producers[i]));
+    producers[i].bw = bw;
+    producers[i].id = i;
+    producers[i].ms.priority = OML_PRIORITY_NORMAL;
+    producers[i].ms.overflow = OML_OVERFLOW_BLOCK;
+    producers[i].ms.overflow_param = 5000;
+    fail_if(pthread_create(&threads[i], NULL, bw_test_producer, &producers[i]));
+  }
+  /* Stall the reader for a while, so producers wait for room */
+  mock_stall(&mock, 1);
+  usleep(50000);
+  mock_stall(&mock, 0);
+  for (i = 0; i < BW_TEST_NPRODUCERS; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  /* The last messages are still in the ring, and sent while closing */
+  bw_close(bw);
+
+  bw_test_check(&mock, received, BW_TEST_NPRODUCERS);
+  for (i = 0; i < BW_TEST_NPRODUCERS; i++) {
+    fail_unless(BW_TEST_NMESSAGES == received[i], "%d messages received from producer %d instead of %d",
+        received[i], i, BW_TEST_NMESSAGES);
+    fail_unless(0 == producers[i].ms.lost, "%d messages of producer %d lost", producers[i].ms.lost, i);
+  }
+  mock_cleanup(&mock);
+}
+END_TEST
+
+/** Fill the ring while the reader is stalled, then let it send everything.
+ * \return the number of messages written
+ */
+static int
+bw_test_fill_stalled(MockOutStream* mock, BufferedWriter* bw)
+{
+  int i;
+
+  mock_stall(mock, 1);
+  for (i = 0; bw_test_write(bw, NULL, 0, i); i++);
+  /* The reader is waiting in the write of the first chunk */
+  pthread_mutex_lock(&mock->lock);
+  while (!mock->waiting) {
+    pthread_cond_wait(&mock->cond, &mock->lock);
+  }
+  pthread_mutex_unlock(&mock->lock);
+  mock_stall(mock, 0);
+  return i;
+}
+
+START_TEST (test_bw_writev_gather)
+{
+  MockOutStream mock;
+  BufferedWriter* bw;
+  int n, received;
+
+  mock_init(&mock);
+  bw = bw_create(&mock.os, BW_TEST_NCHUNKS * BW_TEST_CHUNK_SIZE, BW_TEST_CHUNK_SIZE);
+  fail_if(NULL == bw);
+
+  /* The chunks published while the reader was stalled are sent together */
+  n = bw_test_fill_stalled(&mock, bw);
+  bw_close(bw);
+
+  fail_unless(mock.max_iovcnt >= 2, "Chunks not gathered (at most %d per write)", mock.max_iovcnt);
+  bw_test_check(&mock, &received, 1);
+  fail_unless(n == received, "%d messages received instead of %d", received, n);
+  mock_cleanup(&mock);
+}
+END_TEST
+
+START_TEST (test_bw_writev_partial)
+{
+  MockOutStream mock;
+  OmlMStream ms;
+  BufferedWriter* bw;
+  int i, n, received;
+
+  mock_init(&mock);
+  /* Not a divisor of the size of messages or chunks */
+  mock.max_write = 7;
+  memset(&ms, 0, sizeof(ms));
+  ms.priority = OML_PRIORITY_NORMAL;
+  ms.overflow = OML_OVERFLOW_BLOCK;
+  ms.overflow_param = 5000;
+  bw = bw_create(&mock.os, BW_TEST_NCHUNKS * BW_TEST_CHUNK_SIZE, BW_TEST_CHUNK_SIZE);
+  fail_if(NULL == bw);
+
+  /* Short writes of several chunks at once end in the middle of a chunk... */
+  n = bw_test_fill_stalled(&mock, bw);
+  /* ...and of single chunks */
+  for (i = n; i < n + 200; i++) {
+    fail_unless(bw_test_write(bw, &ms, 0, i), "Message %d dropped", i);
+  }
+  n = i;
+  bw_close(bw);
+
+  fail_unless(mock.nsplit > 0, "No short write ended past the first chunk");
+  bw_test_check(&mock, &received, 1);
+  fail_unless(n == received, "%d messages received instead of %d", received, n);
+  fail_unless(0 == ms.lost, "%d messages lost", ms.lost);
+  mock_cleanup(&mock);
+}
+END_TEST
+
 #define FN	"test_fw_create_buffered"
 
 START_TEST (test_fw_create_buffered)
@@ -107,21 +475,83 @@ START_TEST (test_fw_create_buffered)
 }
 END_TEST
 
+#define ZFN	"test_zw_write"
+
+START_TEST (test_zw_write)
+{
+  /* Headers, followed by a schema 0 message replayed on reconnection */
+  char header[] = "protocol: 4\ncontent: text\n\nmeta\n";
+  char expected_header[] = "protocol: 4\ncontent: text\nencoding: deflate\n\n";
+  char expected_data[] = "meta\naaa\nbbb\nccc\n";
+  char data[sizeof(expected_data)];
+  struct iovec iov[2];
+  uint8_t buf[1024];
+  size_t len;
+  FILE *f;
+  OmlOutStream *os;
+  z_stream zs;
+
+  /* Remove stray file */
+  unlink(ZFN);
+
+  os = file_stream_new(ZFN);
+  file_stream_set_buffered(os, 0);
+  os = zlib_stream_new(os);
+  fail_if(os == NULL);
+
+  iov[0].iov_base = "aaa\n";
+  iov[0].iov_len = 4;
+  iov[1].iov_base = "bbb\n";
+  iov[1].iov_len = 4;
+  fail_unless(os->writev(os, iov, 2, (uint8_t*)header, strlen(header)) == 8);
+  fail_unless(os->write(os, (uint8_t*)"ccc\n", 4, (uint8_t*)header, strlen(header)) == 4);
+  fail_unless(os->close(os) == 0);
+
+  f = fopen(ZFN, "r");
+  len = fread(buf, 1, sizeof(buf), f);
+  fclose(f);
+  fail_unless(len > strlen(expected_header));
+  fail_if(memcmp(buf, expected_header, strlen(expected_header)),
+      "Unexpected headers '%.*s'", (int)strlen(expected_header), buf);
+
+  /* The rest is all compressed, in a raw deflate stream */
+  memset(&zs, 0, sizeof(zs));
+  fail_unless(inflateInit2(&zs, -MAX_WBITS) == Z_OK);
+  zs.next_in = buf + strlen(expected_header);
+  zs.avail_in = len - strlen(expected_header);
+  zs.next_out = (uint8_t*)data;
+  zs.avail_out = sizeof(data);
+  fail_unless(inflate(&zs, Z_SYNC_FLUSH) == Z_OK, "Cannot decompress data: %s", zs.msg);
+  fail_unless(zs.avail_in == 0, "%d bytes of compressed data left", zs.avail_in);
+  len = sizeof(data) - zs.avail_out;
+  fail_unless(len == strlen(expected_data) && !memcmp(data, expected_data, len),
+      "Unexpected data '%.*s'", (int)len, data);
+  inflateEnd(&zs);
+}
+END_TEST
+
 Suite*
 writers_suite (void)
 {
   Suite* s = suite_create ("Writers");
 
   /* Test cases */
-  /*TCase* tc_bw = tcase_create ("BfWr");*/
+  TCase* tc_bw = tcase_create ("BfWr");
   TCase* tc_fw = tcase_create ("FileWr");
 
   /* Add tests */
   /*tcase_add_test (tc_bw, test_bw_create);*/
+  tcase_add_test (tc_bw, test_bw_wraparound);
+  tcase_add_test (tc_bw, test_bw_full_ring);
+  tcase_add_test (tc_bw, test_bw_concurrent);
+  tcase_add_test (tc_bw, test_bw_writev_gather);
+  tcase_add_test (tc_bw, test_bw_writev_partial);
+  tcase_set_timeout (tc_bw, 30);
 
   tcase_add_test (tc_fw, test_fw_create_buffered);
+  tcase_add_test (tc_fw, test_zw_write);
 
-  /*suite_add_tcase (s, tc_bw);*/
+  suite_add_tcase (s, tc_bw);
   suite_add_tcase (s, tc_fw);
   return s;
 }
@@ -40,6 +40,8 @@ main (void)
   srunner_add_suite (sr, util_suite ());
   srunner_add_suite (sr, headers_suite ());
   srunner_add_suite (sr, marshal_suite ());
+  srunner_add_suite (sr, strdict_suite ());
+  srunner_add_suite (sr, mbuf_space_suite ());
 
   srunner_run_all (sr, CK_ENV);
   number_failed += srunner_ntests_failed (sr);
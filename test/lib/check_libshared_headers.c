@@ -24,6 +24,7 @@ static struct {
   { "start_time", H_START_TIME },
   { "start-time", H_START_TIME },
   { "domain", H_DOMAIN },
+  { "encoding", H_ENCODING },
 
   { "protocolx", H_NONE },
   { "experiment-idx", H_NONE },
@@ -34,6 +35,7 @@ static struct {
   { "start_timex", H_NONE },
   { "start-timex", H_NONE },
   { "domaine", H_NONE },
+  { "encodingx", H_NONE },
 
   /*
   { "protocol", H_NONE},
@@ -82,6 +84,7 @@ static struct {
   { "start_time: 123456690", { H_START_TIME, "123456690", NULL }, 0, 0 },
   { "start-time: 123456690", { H_START_TIME, "123456690", NULL }, 0, 0 },
   { "domain: abc", { H_DOMAIN, "abc", NULL }, 0, 0 },
+  { "encoding: deflate", { H_ENCODING, "deflate", NULL }, 0, 0 },
   { "", { H_NONE, NULL, NULL }, 1, 1 },
   { " ", { H_NONE, NULL, NULL }, 1, 1 },
   { NULL, { H_NONE, NULL, NULL }, 1, 1 },
@@ -286,6 +289,51 @@ START_TEST (test_bin_read)
 }
 END_TEST
 
+START_TEST (test_bin_read_compact)
+{
+  /* CDATA_P, stream=3, absolute seqno=5, ts=1.5s, { -2, 42.0, "ABC" } */
+  uint8_t buf [] = { 0xAA, 0xAA, 0x03, 0x00,
+                     0x03, // stream = 3
+                     0x15, // seqno = ZIGZAG(5) << 1 | absolute
+                     0xC0, 0x8D, 0xB7, 0x01, // ts = ZIGZAG(1500000)
+                     0x03, // ZIGZAG(-2)
+                     0x40, 0x45, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 42.0
+                     0x03, 'A',  'B',  'C' // "ABC"
+  };
+  char meta [] = "3 mympstrm id:int32 hitchhiker:double sesame:string";
+  MBuffer *mbuf = mbuf_create ();
+  struct oml_message msg;
+  struct schema *schema = schema_from_meta (meta);
+  OmlValue values [3];
+  int result;
+
+  oml_value_array_init(values, 3);
+  bzero(&msg, sizeof(msg));
+  buf[3] = sizeof (buf) - 4;
+
+  /* Incomplete message */
+  mbuf_write (mbuf, buf, sizeof (buf) - 1);
+  fail_unless (bin_read_msg_start (&msg, mbuf) == 0, "Read an incomplete compact message");
+  mbuf_write (mbuf, buf + sizeof (buf) - 1, 1);
+
+  result = bin_read_msg_start (&msg, mbuf);
+  fail_unless (result == sizeof (buf), "Compact message of length %d instead of %d", result, sizeof (buf));
+  fail_unless (msg.type == MSG_COMPACT);
+  fail_unless (msg.stream == 3);
+  fail_unless (msg.seqno == 5, "Seqno %u instead of 5", msg.seqno);
+  fail_unless (msg.timestamp == 1.5, "Timestamp %f instead of 1.5", msg.timestamp);
+
+  fail_unless (bin_read_msg_values (&msg, mbuf, schema, values) == 0);
+  fail_unless (omlc_get_int32(*oml_value_get_value(&values[0])) == -2);
+  fail_unless (omlc_get_double(*oml_value_get_value(&values[1])) == 42.0);
+  fail_if (strcmp (omlc_get_string_ptr(*oml_value_get_value(&values[2])), "ABC"));
+
+  oml_value_array_reset(values, 3);
+  schema_free (schema);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
 Suite *
 headers_suite (void)
 {
@@ -307,6 +355,7 @@ headers_suite (void)
 
   tcase_add_test (tc_header_from_string, test_text_read);
   tcase_add_test (tc_header_from_string, test_bin_read);
+  tcase_add_test (tc_header_from_string, test_bin_read_compact);
 
   suite_add_tcase (s, tc_tag_from_string);
   suite_add_tcase (s, tc_header_from_string);
@@ -56,6 +56,7 @@ static const int BLOB_T = 0x9;        // marshal.c BLOB_T
 static const int GUID_T = 0xa;        // marshal.c GUID_T
 static const int BOOL_FALSE_T = 0xb;  // marshal.c BOOL_FALSE_T
 static const int BOOL_TRUE_T = 0xc;   // marshal.c BOOL_TRUE_T
+static const int DOUBLE64_T = 0xf;    // marshal.c DOUBLE64_T
 
 #define PACKET_HEADER_SIZE 5 // marshal.c
 
@@ -996,6 +997,389 @@ START_TEST (test_marshal_unmarshal_double)
 }
 END_TEST
 
+START_TEST (test_marshal_unmarshal_double64)
+{
+  const int DOUBLE64_LENGTH = 9;
+  double values[] = { 1.0/3, -0.0, 0.1, 1e300, -4.9e-324, INFINITY, NAN, 1234567890.123456789 };
+  int VALUES_OFFSET, result;
+  unsigned int i;
+  uint64_t nv, hv;
+  double d;
+  OmlValue value;
+
+  oml_value_init(&value);
+
+  fail_unless(marshal_set_protocol_version(6) == 5);
+
+  MBuffer* mbuf = mbuf_create ();
+  marshal_init (mbuf, OMB_DATA_P);
+  result = marshal_measurements (mbuf, 98, 99, 1234567890.123456);
+  fail_if (result == -1);
+
+  VALUES_OFFSET = mbuf_fill (mbuf);
+
+  for (i = 0; i < LENGTH (values); i++) {
+    OmlValueU v;
+    omlc_zero(v);
+    omlc_set_double(v, values[i]);
+    fail_unless (marshal_value (mbuf, OML_DOUBLE_VALUE, &v) == 1);
+
+    uint8_t* buf = &mbuf->base[VALUES_OFFSET + i * DOUBLE64_LENGTH];
+    fail_unless (buf[0] == DOUBLE64_T, "Value %g: type %d instead of %d", values[i], buf[0], DOUBLE64_T);
+    memcpy (&nv, &buf[1], sizeof (nv));
+    hv = ntohll (nv);
+    memcpy (&d, &hv, sizeof (d));
+    fail_if (memcmp (&d, &values[i], sizeof (d)), "Value %g: marshalled as %g", values[i], d);
+  }
+  fail_unless (mbuf_fill (mbuf) == VALUES_OFFSET + LENGTH (values) * DOUBLE64_LENGTH);
+
+  marshal_finalize (mbuf);
+
+  OmlBinaryHeader header;
+  fail_unless (unmarshal_init (mbuf, &header) == 1);
+  fail_unless (header.stream == 98);
+  fail_unless (header.seqno == 99);
+  fail_unless (header.timestamp == 1234567890.123456, "Timestamp %f was not unmarshalled exactly", header.timestamp);
+
+  for (i = 0; i < LENGTH (values); i++) {
+    fail_unless (unmarshal_value (mbuf, &value) == 1);
+    fail_unless (oml_value_get_type(&value) == OML_DOUBLE_VALUE);
+    d = omlc_get_double(*oml_value_get_value(&value));
+    fail_if (memcmp (&d, &values[i], sizeof (d)), "Unmarshalled value %g, expected %g", d, values[i]);
+  }
+
+  /* Back to the older representation */
+  fail_unless(marshal_set_protocol_version(5) == 6);
+  mbuf_clear (mbuf);
+  marshal_init (mbuf, OMB_DATA_P);
+  marshal_measurements (mbuf, 98, 100, 1.0);
+  VALUES_OFFSET = mbuf_fill (mbuf);
+  omlc_set_double(*oml_value_get_value(&value), 1.0/3);
+  marshal_value (mbuf, OML_DOUBLE_VALUE, oml_value_get_value(&value));
+  fail_unless (mbuf->base[VALUES_OFFSET] == DOUBLE_T);
+
+  oml_value_reset(&value);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+START_TEST (test_marshal_unmarshal_compact)
+{
+  OmlValueT types[] = { OML_INT32_VALUE, OML_UINT32_VALUE, OML_INT64_VALUE, OML_UINT64_VALUE,
+    OML_DOUBLE_VALUE, OML_STRING_VALUE, OML_BLOB_VALUE, OML_GUID_VALUE, OML_BOOL_VALUE,
+    OML_VECTOR_INT32_VALUE, OML_VECTOR_DOUBLE_VALUE };
+  int32_t vi32[] = { -1, 0, 1 << 20 };
+  double vd[] = { 1.0/3, -2.5 };
+  char blob[] = { 0, 1, 2, 3 };
+  OmlValue values[LENGTH (types)], read[LENGTH (types)];
+  OmlCompactState wstate, rstate, lost;
+  OmlBinaryHeader header;
+  MBuffer* mbuf = mbuf_create ();
+  size_t start, compact_size, tagged_size;
+  char sent_s[64], read_s[64];
+  unsigned int i;
+  int msg;
+
+  memset (&wstate, 0, sizeof (wstate));
+  memset (&rstate, 0, sizeof (rstate));
+  oml_value_array_init (values, LENGTH (types));
+  oml_value_array_init (read, LENGTH (types));
+
+  for (i = 0; i < LENGTH (types); i++) {
+    oml_value_set_type (&values[i], types[i]);
+  }
+  omlc_set_string (*oml_value_get_value (&values[5]), "compact");
+  omlc_set_blob (*oml_value_get_value (&values[6]), blob, sizeof (blob));
+  omlc_set_guid (*oml_value_get_value (&values[7]), 0x0123456789abcdefULL);
+  omlc_set_bool (*oml_value_get_value (&values[8]), OMLC_BOOL_TRUE);
+  omlc_set_vector_int32 (*oml_value_get_value (&values[9]), vi32, LENGTH (vi32));
+  omlc_set_vector_double (*oml_value_get_value (&values[10]), vd, LENGTH (vd));
+
+  /* An absolute message, then deltas; the second and third are read back */
+  for (msg = 0; msg < 3; msg++) {
+    omlc_set_int32 (*oml_value_get_value (&values[0]), -msg);
+    omlc_set_uint32 (*oml_value_get_value (&values[1]), 300 * msg);
+    omlc_set_int64 (*oml_value_get_value (&values[2]), INT64_MIN + msg);
+    omlc_set_uint64 (*oml_value_get_value (&values[3]), UINT64_MAX - msg);
+    omlc_set_double (*oml_value_get_value (&values[4]), msg / 7.);
+
+    mbuf_clear (mbuf);
+    fail_unless (marshal_compact_init (mbuf, &wstate, 3, 1000 + msg, 1234567890.5 + msg * 0.25) == 1);
+    fail_unless (marshal_compact_values (mbuf, NULL, values, LENGTH (types)) == 1);
+    fail_unless (marshal_compact_finalize (mbuf) == 1);
+    fail_unless (mbuf->base[2] == OMB_CDATA_P);
+
+    fail_unless (unmarshal_init (mbuf, &header) == 1);
+    fail_unless (header.type == OMB_CDATA_P);
+    fail_unless (header.stream == 3);
+    fail_unless (header.absolute == (msg == 0), "Message %d: absolute flag is %d", msg, header.absolute);
+    if (msg == 1) {
+      /* Without the absolute message, the delta cannot be resolved */
+      memset (&lost, 0, sizeof (lost));
+      fail_unless (header.seqno == 1, "Delta seqno %d instead of 1", header.seqno);
+      fail_unless (unmarshal_compact_resolve (&header, &lost) == 0);
+      fail_unless (header.seqno == 1);
+    }
+    fail_unless (unmarshal_compact_resolve (&header, &rstate) == 1);
+    fail_unless (header.seqno == 1000 + msg, "Message %d: seqno %d", msg, header.seqno);
+    fail_unless (header.timestamp == 1234567890.5 + msg * 0.25, "Message %d: timestamp %f", msg, header.timestamp);
+
+    for (i = 0; i < LENGTH (types); i++) {
+      oml_value_set_type (&read[i], types[i]);
+    }
+    fail_unless (unmarshal_measurements (mbuf, &header, read, LENGTH (types)) == LENGTH (types));
+    fail_unless (mbuf_rd_remaining (mbuf) == 0);
+    for (i = 0; i < LENGTH (types); i++) {
+      oml_value_to_s (&values[i], sent_s, sizeof (sent_s));
+      oml_value_to_s (&read[i], read_s, sizeof (read_s));
+      fail_if (strcmp (sent_s, read_s), "Message %d: %s value %d read as '%s' instead of '%s'",
+          msg, oml_type_to_s (types[i]), i, read_s, sent_s);
+    }
+    fail_unless (omlc_get_double (*oml_value_get_value (&read[4])) == msg / 7.);
+  }
+
+  /* Values which do not fit are not resolved */
+  mbuf->base[3]++;
+  mbuf_reset_read (mbuf);
+  fail_unless (unmarshal_init (mbuf, &header) < 0);
+
+  /* Narrow integers are much smaller than in tagged messages */
+  mbuf_clear (mbuf);
+  marshal_compact_init (mbuf, &wstate, 3, 1003, 1234567891.5);
+  start = mbuf_fill (mbuf);
+  marshal_compact_values (mbuf, NULL, values, 2);
+  marshal_compact_finalize (mbuf);
+  compact_size = mbuf_fill (mbuf);
+  fail_unless (compact_size - start == 3, "Compact values took %d bytes", (int)(compact_size - start));
+
+  mbuf_clear (mbuf);
+  marshal_init (mbuf, OMB_DATA_P);
+  marshal_measurements (mbuf, 3, 1003, 1234567891.5);
+  marshal_values (mbuf, values, 2);
+  marshal_finalize (mbuf);
+  tagged_size = mbuf_fill (mbuf);
+  fail_unless (2 * compact_size <= tagged_size, "Compact message of %d bytes, tagged of %d",
+      (int)compact_size, (int)tagged_size);
+
+  oml_value_array_reset (values, LENGTH (types));
+  oml_value_array_reset (read, LENGTH (types));
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+START_TEST (test_marshal_unmarshal_batch)
+{
+  OmlValueT types[] = { OML_UINT32_VALUE, OML_DOUBLE_VALUE, OML_STRING_VALUE };
+  enum { ROWS = 5 };
+  OmlValue values[ROWS * LENGTH (types)], read[ROWS * LENGTH (types)];
+  int32_t seqnos[ROWS], read_seqnos[ROWS];
+  double timestamps[ROWS], read_timestamps[ROWS];
+  OmlCompactState wstate, rstate;
+  OmlBinaryHeader header;
+  MBuffer* mbuf = mbuf_create ();
+  char sent_s[64], read_s[64], label[16];
+  unsigned int i, j;
+
+  memset (&wstate, 0, sizeof (wstate));
+  memset (&rstate, 0, sizeof (rstate));
+  oml_value_array_init (values, LENGTH (values));
+  oml_value_array_init (read, LENGTH (read));
+
+  for (i = 0; i < ROWS; i++) {
+    seqnos[i] = 100 + i * i;
+    timestamps[i] = 1234567890.5 + i * 0.001;
+    snprintf (label, sizeof (label), "row%u", i);
+    for (j = 0; j < LENGTH (types); j++) {
+      oml_value_set_type (&values[i * LENGTH (types) + j], types[j]);
+      oml_value_set_type (&read[i * LENGTH (types) + j], types[j]);
+    }
+    omlc_set_uint32 (*oml_value_get_value (&values[i * LENGTH (types)]), 1000 - i);
+    omlc_set_double (*oml_value_get_value (&values[i * LENGTH (types) + 1]), i / 3.);
+    omlc_set_string (*oml_value_get_value (&values[i * LENGTH (types) + 2]), label);
+  }
+
+  fail_unless (marshal_batch (mbuf, NULL, 3, ROWS, seqnos, timestamps, values, LENGTH (types)) == 1);
+  fail_unless (mbuf->base[2] == OMB_BATCH_P);
+
+  fail_unless (unmarshal_init (mbuf, &header) == 1);
+  fail_unless (header.type == OMB_BATCH_P);
+  fail_unless (header.stream == 3);
+  fail_unless (header.rows == ROWS, "Batch of %d rows instead of %d", header.rows, ROWS);
+  fail_unless (header.absolute);
+  fail_unless (header.seqno == seqnos[0], "Batch starting at seqno %d", header.seqno);
+  /* Row values cannot be read one row at a time */
+  fail_unless (unmarshal_measurements (mbuf, &header, read, LENGTH (types)) < 0);
+
+  fail_unless (unmarshal_batch (mbuf, &header, read_seqnos, read_timestamps, read, LENGTH (types)) == ROWS);
+  fail_unless (mbuf_rd_remaining (mbuf) == 0);
+  for (i = 0; i < ROWS; i++) {
+    fail_unless (read_seqnos[i] == seqnos[i], "Row %d: seqno %d", i, read_seqnos[i]);
+    fail_unless (fabs (read_timestamps[i] - timestamps[i]) < 1e-6, "Row %d: timestamp %f", i, read_timestamps[i]);
+    for (j = 0; j < LENGTH (types); j++) {
+      oml_value_to_s (&values[i * LENGTH (types) + j], sent_s, sizeof (sent_s));
+      oml_value_to_s (&read[i * LENGTH (types) + j], read_s, sizeof (read_s));
+      fail_if (strcmp (sent_s, read_s), "Row %d: %s value %d read as '%s' instead of '%s'",
+          i, oml_type_to_s (types[j]), j, read_s, sent_s);
+    }
+  }
+
+  /* The last row of the batch is the base of the next compact message */
+  fail_unless (header.seqno == seqnos[ROWS - 1]);
+  fail_unless (unmarshal_compact_resolve (&header, &rstate) == 1);
+  mbuf_clear (mbuf);
+  wstate.valid = 1;
+  wstate.seqno = seqnos[ROWS - 1];
+  wstate.timestamp = llround (timestamps[ROWS - 1] * 1e6);
+  fail_unless (marshal_compact_init (mbuf, &wstate, 3, seqnos[ROWS - 1] + 1, timestamps[ROWS - 1] + 0.5) == 1);
+  fail_unless (marshal_compact_values (mbuf, NULL, values, LENGTH (types)) == 1);
+  fail_unless (marshal_compact_finalize (mbuf) == 1);
+  fail_unless (unmarshal_init (mbuf, &header) == 1);
+  fail_if (header.absolute);
+  fail_unless (unmarshal_compact_resolve (&header, &rstate) == 1);
+  fail_unless (header.seqno == seqnos[ROWS - 1] + 1, "Seqno %d after batch", header.seqno);
+
+  /* A truncated batch is not read */
+  mbuf_clear (mbuf);
+  marshal_batch (mbuf, NULL, 3, ROWS, seqnos, timestamps, values, LENGTH (types));
+  mbuf->base[3]--;
+  mbuf_reset_read (mbuf);
+  fail_unless (unmarshal_init (mbuf, &header) == 1);
+  fail_unless (unmarshal_batch (mbuf, &header, read_seqnos, read_timestamps, read, LENGTH (types)) < 0);
+
+  oml_value_array_reset (values, LENGTH (values));
+  oml_value_array_reset (read, LENGTH (read));
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
+START_TEST (test_marshal_unmarshal_strdict)
+{
+  OmlValueT types[] = { OML_STRING_VALUE, OML_STRING_VALUE, OML_UINT32_VALUE, OML_STRING_VALUE };
+  enum { ROWS = 4 };
+  OmlValue values[ROWS * LENGTH (types)], read[ROWS * LENGTH (types)];
+  int32_t seqnos[ROWS], read_seqnos[ROWS];
+  double timestamps[ROWS], read_timestamps[ROWS];
+  OmlCompactState wstate, rstate;
+  OmlBinaryHeader header;
+  MBuffer* mbuf = mbuf_create ();
+  char label[16];
+  size_t sizes[3];
+  unsigned int i, j;
+  int msg;
+
+  memset (&wstate, 0, sizeof (wstate));
+  memset (&rstate, 0, sizeof (rstate));
+  wstate.dict = strdict_new ();
+  rstate.dict = strdict_new ();
+  fail_if (NULL == wstate.dict || NULL == rstate.dict);
+  oml_value_array_init (values, LENGTH (values));
+  oml_value_array_init (read, LENGTH (read));
+
+  for (i = 0; i < LENGTH (types); i++) {
+    oml_value_set_type (&values[i], types[i]);
+  }
+  omlc_set_string (*oml_value_get_value (&values[0]), "eth0");
+  omlc_set_string (*oml_value_get_value (&values[1]), "eth0");
+  omlc_set_string (*oml_value_get_value (&values[3]), "");
+
+  /* An absolute message, a delta, and another absolute message */
+  for (msg = 0; msg < 3; msg++) {
+    omlc_set_uint32 (*oml_value_get_value (&values[2]), msg);
+    if (msg == 2) {
+      wstate.valid = 0;
+    }
+
+    mbuf_clear (mbuf);
+    fail_unless (marshal_compact_init (mbuf, &wstate, 2, msg, 1.5 + msg) == 1);
+    fail_unless (marshal_compact_values (mbuf, wstate.dict, values, LENGTH (types)) == 1);
+    fail_unless (marshal_compact_finalize (mbuf) == 1);
+    sizes[msg] = mbuf_fill (mbuf);
+
+    fail_unless (unmarshal_init (mbuf, &header) == 1);
+    fail_unless (header.absolute == (msg != 1), "Message %d: absolute flag is %d", msg, header.absolute);
+    if (msg == 2) {
+      /* The receiver's dictionary is cleared as well */
+      strdict_add (rstate.dict, "stale", 5, NULL);
+    }
+    fail_unless (unmarshal_compact_resolve (&header, &rstate) == 1);
+    header.dict = rstate.dict;
+    for (i = 0; i < LENGTH (types); i++) {
+      oml_value_set_type (&read[i], types[i]);
+    }
+    fail_unless (unmarshal_measurements (mbuf, &header, read, LENGTH (types)) == LENGTH (types),
+        "Message %d not unmarshalled", msg);
+    fail_unless (mbuf_rd_remaining (mbuf) == 0);
+
+    for (i = 0; i < 2; i++) {
+      fail_if (strcmp (omlc_get_string_ptr (*oml_value_get_value (&read[i])), "eth0"),
+          "Message %d: string %d read as '%s'", msg, i, omlc_get_string_ptr (*oml_value_get_value (&read[i])));
+      /* Strings from the dictionary are not copied */
+      fail_unless (omlc_get_string_is_const (*oml_value_get_value (&read[i])),
+          "Message %d: string %d was copied", msg, i);
+    }
+    fail_unless (omlc_get_uint32 (*oml_value_get_value (&read[2])) == (uint32_t)msg);
+    /* Empty strings are not worth adding to the dictionary */
+    fail_if (strcmp (omlc_get_string_ptr (*oml_value_get_value (&read[3])), ""),
+        "Message %d: empty string read as '%s'", msg, omlc_get_string_ptr (*oml_value_get_value (&read[3])));
+    fail_if (omlc_get_string_is_const (*oml_value_get_value (&read[3])));
+  }
+  fail_unless (sizes[1] + 4 <= sizes[0], "Repeated string not sent as a reference (%d and %d bytes)",
+      (int)sizes[1], (int)sizes[0]);
+  fail_unless (sizes[2] == sizes[0], "Absolute message of %d bytes after clearing, instead of %d",
+      (int)sizes[2], (int)sizes[0]);
+  fail_unless (strdict_find (rstate.dict, "stale", 5) == -1, "Receiver dictionary not cleared");
+
+  /* References to a dictionary the receiver does not have are not resolved */
+  mbuf_clear (mbuf);
+  marshal_compact_init (mbuf, &wstate, 2, 3, 4.5);
+  marshal_compact_values (mbuf, wstate.dict, values, LENGTH (types));
+  marshal_compact_finalize (mbuf);
+  fail_unless (unmarshal_init (mbuf, &header) == 1);
+  fail_unless (unmarshal_compact_resolve (&header, &rstate) == 1);
+  strdict_clear (rstate.dict);
+  header.dict = rstate.dict;
+  fail_unless (unmarshal_measurements (mbuf, &header, read, LENGTH (types)) < 0,
+      "Unmarshalled a reference to an unknown string");
+
+  /* Batches start a new dictionary, and use it across rows */
+  for (i = 0; i < ROWS; i++) {
+    seqnos[i] = 10 + i;
+    timestamps[i] = 10.5 + i;
+    snprintf (label, sizeof (label), "row%u", i % 2);
+    for (j = 0; j < LENGTH (types); j++) {
+      oml_value_set_type (&values[i * LENGTH (types) + j], types[j]);
+      oml_value_set_type (&read[i * LENGTH (types) + j], types[j]);
+    }
+    omlc_set_string_copy (*oml_value_get_value (&values[i * LENGTH (types)]), label, strlen (label));
+    omlc_set_string (*oml_value_get_value (&values[i * LENGTH (types) + 1]), "eth1");
+    omlc_set_uint32 (*oml_value_get_value (&values[i * LENGTH (types) + 2]), i);
+    omlc_set_string (*oml_value_get_value (&values[i * LENGTH (types) + 3]), "");
+  }
+  strdict_add (rstate.dict, "stale", 5, NULL);
+  mbuf_clear (mbuf);
+  fail_unless (marshal_batch (mbuf, wstate.dict, 2, ROWS, seqnos, timestamps, values, LENGTH (types)) == 1);
+  fail_unless (unmarshal_init (mbuf, &header) == 1);
+  header.dict = rstate.dict;
+  fail_unless (unmarshal_batch (mbuf, &header, read_seqnos, read_timestamps, read, LENGTH (types)) == ROWS);
+  fail_unless (mbuf_rd_remaining (mbuf) == 0);
+  for (i = 0; i < ROWS; i++) {
+    snprintf (label, sizeof (label), "row%u", i % 2);
+    fail_if (strcmp (omlc_get_string_ptr (*oml_value_get_value (&read[i * LENGTH (types)])), label),
+        "Row %d: label read as '%s'", i, omlc_get_string_ptr (*oml_value_get_value (&read[i * LENGTH (types)])));
+    fail_if (strcmp (omlc_get_string_ptr (*oml_value_get_value (&read[i * LENGTH (types) + 1])), "eth1"));
+    fail_unless (omlc_get_uint32 (*oml_value_get_value (&read[i * LENGTH (types) + 2])) == i);
+    fail_if (strcmp (omlc_get_string_ptr (*oml_value_get_value (&read[i * LENGTH (types) + 3])), ""));
+  }
+  fail_unless (strdict_find (rstate.dict, "stale", 5) == -1, "Receiver dictionary not cleared by batch");
+
+  oml_value_array_reset (values, LENGTH (values));
+  oml_value_array_reset (read, LENGTH (read));
+  strdict_destroy (wstate.dict);
+  strdict_destroy (rstate.dict);
+  mbuf_destroy (mbuf);
+}
+END_TEST
+
 START_TEST (test_marshal_unmarshal_string)
 {
   int VALUES_OFFSET = 7;
@@ -1833,6 +2217,10 @@ marshal_suite (void)
   tcase_add_test (tc_marshal, test_marshal_unmarshal_int64);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_uint64);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_double);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_double64);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_compact);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_batch);
+  tcase_add_test (tc_marshal, test_marshal_unmarshal_strdict);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_string);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_guid);
   tcase_add_test (tc_marshal, test_marshal_unmarshal_bool);
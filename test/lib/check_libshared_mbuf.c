@@ -0,0 +1,131 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_libshared_mbuf.c
+ * \brief Test the space accounting of MBuffers, as used to read data straight into them
+ */
+#include <string.h>
+#include <check.h>
+
+#include "mbuf.h"
+
+/** Write a string at the write pointer, the way read(2) would, and account for it */
+static void
+write_direct(MBuffer *mbuf, const char *s)
+{
+  size_t len = strlen(s);
+
+  fail_if(mbuf_check_resize(mbuf, len) == -1);
+  fail_if(mbuf_wr_remaining(mbuf) < len);
+  memcpy(mbuf_wrptr(mbuf), s, len);
+  fail_if(mbuf_write_advance(mbuf, len) == -1);
+}
+
+START_TEST (test_mbuf_wr_remaining)
+{
+  const char *s = "0123456789ABCDEF";
+  size_t len = strlen(s);
+  MBuffer *mbuf = mbuf_create2(4 * len, len);
+  size_t length = mbuf_length(mbuf);
+
+  fail_unless(mbuf_wr_remaining(mbuf) == length,
+      "Empty buffer has %d bytes of room instead of %d", mbuf_wr_remaining(mbuf), length);
+
+  fail_if(mbuf_write(mbuf, (const uint8_t*)s, len) == -1);
+  fail_unless(mbuf_wr_remaining(mbuf) == length - len,
+      "Room left after writing %d bytes is %d instead of %d", len, mbuf_wr_remaining(mbuf), length - len);
+
+  /* Reading does not make room at the end of the buffer */
+  fail_if(mbuf_read_skip(mbuf, len / 2) == -1);
+  fail_unless(mbuf_rd_remaining(mbuf) == len - len / 2);
+  fail_unless(mbuf_wr_remaining(mbuf) == length - len,
+      "Room left after reading is %d instead of %d", mbuf_wr_remaining(mbuf), length - len);
+
+  /* Neither does consuming the message, until the buffer is repacked */
+  fail_if(mbuf_consume_message(mbuf) == -1);
+  fail_unless(mbuf_wr_remaining(mbuf) == length - len);
+  fail_if(mbuf_repack_message(mbuf) == -1);
+  fail_unless(mbuf_wr_remaining(mbuf) == length - (len - len / 2),
+      "Room left after repacking is %d instead of %d", mbuf_wr_remaining(mbuf), length - (len - len / 2));
+
+  mbuf_clear2(mbuf, 0);
+  fail_unless(mbuf_wr_remaining(mbuf) == length);
+
+  /* Fill the buffer exactly */
+  while (mbuf_wr_remaining(mbuf) >= len) {
+    fail_if(mbuf_write(mbuf, (const uint8_t*)s, len) == -1);
+  }
+  fail_unless(mbuf_wr_remaining(mbuf) == length % len);
+  fail_unless(mbuf_length(mbuf) == length, "Buffer was resized while not full");
+
+  /* Resizing makes room at the end */
+  fail_if(mbuf_check_resize(mbuf, 2 * len) == -1);
+  fail_unless(mbuf_wr_remaining(mbuf) >= 2 * len);
+  fail_unless(mbuf_wr_remaining(mbuf) == mbuf_length(mbuf) - mbuf_fill(mbuf));
+
+  mbuf_destroy(mbuf);
+}
+END_TEST
+
+START_TEST (test_mbuf_write_advance_split)
+{
+  const char *s1 = "first line\nsecond ";
+  const char *s2 = "line\n";
+  MBuffer *mbuf = mbuf_create2(8, 8);
+  size_t length;
+
+  fail_if(mbuf_write_advance(mbuf, mbuf_wr_remaining(mbuf) + 1) != -1);
+  fail_unless(mbuf_fill(mbuf) == 0);
+
+  /* The buffer is too short, and must grow to receive the data */
+  write_direct(mbuf, s1);
+  fail_unless(mbuf_fill(mbuf) == strlen(s1));
+  fail_unless(mbuf_rd_remaining(mbuf) == strlen(s1));
+  length = mbuf_length(mbuf);
+  fail_unless(mbuf_wr_remaining(mbuf) == length - strlen(s1));
+
+  /* Consume the first line, as a reader would */
+  fail_if(mbuf_read_skip(mbuf, mbuf_find(mbuf, '\n') + 1) == -1);
+  fail_if(mbuf_consume_message(mbuf) == -1);
+  fail_if(mbuf_repack_message(mbuf) == -1);
+  fail_unless(mbuf_fill(mbuf) == strlen("second "));
+  fail_unless(mbuf_wr_remaining(mbuf) == mbuf_length(mbuf) - strlen("second "));
+
+  /* The rest of the line lands right after the start kept in the buffer */
+  write_direct(mbuf, s2);
+  fail_unless(mbuf_rd_remaining(mbuf) == strlen("second line\n"));
+  fail_unless(strncmp((char*)mbuf_rdptr(mbuf), "second line\n", mbuf_rd_remaining(mbuf)) == 0,
+      "Unexpected buffer contents '%.*s'", mbuf_rd_remaining(mbuf), mbuf_rdptr(mbuf));
+  fail_unless(mbuf_wr_remaining(mbuf) == mbuf_length(mbuf) - mbuf_fill(mbuf));
+
+  mbuf_destroy(mbuf);
+}
+END_TEST
+
+Suite*
+mbuf_space_suite (void)
+{
+  Suite* s = suite_create ("MBuffer space");
+
+  TCase* tc_mbuf = tcase_create ("MBuffer space");
+  tcase_add_test (tc_mbuf, test_mbuf_wr_remaining);
+  tcase_add_test (tc_mbuf, test_mbuf_write_advance_split);
+  suite_add_tcase (s, tc_mbuf);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,172 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_libshared_strdict.c
+ * \brief Test the string dictionaries of compact binary messages
+ */
+#include <stdio.h>
+#include <string.h>
+#include <check.h>
+
+#include "strdict.h"
+
+/** Add a string known not to be in the dictionary, and return its ID */
+static int
+add(OmlStringDict *dict, const char *str)
+{
+  fail_unless(strdict_find(dict, str, strlen(str)) == -1, "'%s' already in the dictionary", str);
+  return strdict_add(dict, str, strlen(str), NULL);
+}
+
+START_TEST (test_strdict_basic)
+{
+  OmlStringDict *dict = strdict_new();
+  const char *copy = NULL, *s;
+  char longstr[STRDICT_MAX_LENGTH + 2];
+  size_t len;
+  int id;
+
+  fail_if(NULL == dict);
+
+  id = strdict_add(dict, "abc", 3, &copy);
+  fail_unless(id == 0, "First string got ID %d", id);
+  fail_unless(copy && !strcmp(copy, "abc"), "Copy of the string is '%s'", copy);
+  fail_unless(add(dict, "abd") == 1);
+  /* Not nul-terminated */
+  fail_unless(strdict_add(dict, "abcdef", 2, NULL) == 2);
+
+  fail_unless(strdict_find(dict, "abc", 3) == 0);
+  fail_unless(strdict_find(dict, "abd", 3) == 1);
+  fail_unless(strdict_find(dict, "ab", 2) == 2);
+  fail_unless(strdict_find(dict, "abcd", 4) == -1);
+  fail_unless(strdict_find(dict, "a", 1) == -1);
+
+  s = strdict_get(dict, 1, &len);
+  fail_unless(s && len == 3 && !strcmp(s, "abd"), "ID 1 is '%s' (%zu)", s, len);
+  s = strdict_get(dict, 2, &len);
+  fail_unless(s && len == 2 && !strcmp(s, "ab"), "ID 2 is '%s' (%zu)", s, len);
+  fail_unless(strdict_get(dict, 3, &len) == NULL, "Got a string for an unused ID");
+  fail_unless(strdict_get(dict, -1, &len) == NULL, "Got a string for a negative ID");
+
+  /* Strings which are not worth, or too long, to add */
+  fail_unless(strdict_add(dict, "", 0, NULL) == -1, "Added an empty string");
+  memset(longstr, 'a', sizeof(longstr) - 1);
+  longstr[sizeof(longstr) - 1] = '\0';
+  fail_unless(strdict_add(dict, longstr, STRDICT_MAX_LENGTH + 1, NULL) == -1,
+      "Added a string longer than %d characters", STRDICT_MAX_LENGTH);
+  fail_unless(strdict_add(dict, longstr, STRDICT_MAX_LENGTH, NULL) == 3,
+      "Could not add a string of %d characters", STRDICT_MAX_LENGTH);
+
+  strdict_clear(dict);
+  fail_unless(strdict_find(dict, "abc", 3) == -1, "Found a string after clearing");
+  fail_unless(strdict_get(dict, 0, &len) == NULL, "Got a string after clearing");
+  fail_unless(add(dict, "xyz") == 0, "IDs not reused after clearing");
+
+  strdict_destroy(dict);
+  strdict_destroy(NULL);
+}
+END_TEST
+
+START_TEST (test_strdict_lru)
+{
+  OmlStringDict *dict = strdict_new();
+  char str[16];
+  size_t len;
+  int i, id;
+
+  fail_if(NULL == dict);
+
+  for (i = 0; i < STRDICT_SIZE; i++) {
+    snprintf(str, sizeof(str), "s%d", i);
+    fail_unless(add(dict, str) == i, "'%s' did not get ID %d", str, i);
+  }
+
+  /* Use all but s5, and s7 less recently than the others */
+  fail_unless(strdict_get(dict, 7, &len) != NULL);
+  for (i = 0; i < STRDICT_SIZE; i++) {
+    snprintf(str, sizeof(str), "s%d", i);
+    if (i != 5 && i != 7) {
+      fail_unless(strdict_find(dict, str, strlen(str)) == i);
+    }
+  }
+  strdict_begin(dict);
+  id = add(dict, "new1");
+  fail_unless(id == 5, "'new1' replaced ID %d rather than 5", id);
+  fail_unless(strdict_find(dict, "s5", 2) == -1, "Replaced string still found");
+  id = add(dict, "new2");
+  fail_unless(id == 7, "'new2' replaced ID %d rather than 7", id);
+  fail_unless(!strcmp(strdict_get(dict, 7, &len), "new2"));
+  fail_unless(strdict_find(dict, "s8", 2) == 8, "Remaining strings not found after replacement");
+
+  strdict_destroy(dict);
+}
+END_TEST
+
+START_TEST (test_strdict_begin)
+{
+  OmlStringDict *dict = strdict_new();
+  char str[16];
+  size_t len;
+  int i;
+
+  fail_if(NULL == dict);
+
+  for (i = 0; i < STRDICT_SIZE; i++) {
+    snprintf(str, sizeof(str), "s%d", i);
+    add(dict, str);
+  }
+
+  strdict_begin(dict);
+  /* Entries used in the current message are not replaced... */
+  fail_unless(strdict_find(dict, "s0", 2) == 0);
+  fail_unless(strdict_get(dict, 1, &len) != NULL);
+  fail_unless(add(dict, "new1") == 2, "'new1' did not replace the least recently used entry");
+  fail_unless(add(dict, "new2") == 3);
+
+  /* ...even if all of them were */
+  for (i = 4; i < STRDICT_SIZE; i++) {
+    fail_unless(strdict_get(dict, i, &len) != NULL);
+  }
+  fail_unless(add(dict, "new3") == -1, "Replaced an entry used in the current message");
+  fail_unless(strdict_find(dict, "new3", 4) == -1);
+  fail_unless(!strcmp(strdict_get(dict, 0, &len), "s0"), "Entry 0 changed");
+  fail_unless(!strcmp(strdict_get(dict, 2, &len), "new1"), "Entry 2 changed");
+
+  /* They can be replaced in the next message */
+  strdict_begin(dict);
+  fail_unless(add(dict, "new3") == 1, "'new3' did not replace the least recently used entry");
+
+  strdict_destroy(dict);
+}
+END_TEST
+
+Suite*
+strdict_suite (void)
+{
+  Suite* s = suite_create ("StrDict");
+
+  TCase* tc_strdict = tcase_create ("StrDict");
+
+  tcase_add_test (tc_strdict, test_strdict_basic);
+  tcase_add_test (tc_strdict, test_strdict_lru);
+  tcase_add_test (tc_strdict, test_strdict_begin);
+
+  suite_add_tcase (s, tc_strdict);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
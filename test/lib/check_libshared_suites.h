@@ -33,6 +33,8 @@ extern Suite* mstring_suite (void);
 extern Suite* util_suite (void);
 extern Suite* headers_suite (void);
 extern Suite* marshal_suite (void);
+extern Suite* strdict_suite (void);
+extern Suite* mbuf_space_suite (void);
 
 #endif /* CHECK_LIBOML2_SUITES_H__ */
 
@@ -30,6 +30,7 @@
 #include <check.h>
 #include <sqlite3.h>
 #include <libgen.h>
+#include <zlib.h>
 
 #include "ocomm/o_log.h"
 #include "mem.h"
@@ -217,6 +218,594 @@ START_TEST(test_binary_resync)
 }
 END_TEST
 
+START_TEST(test_binary_compact)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+  OmlCompactState state;
+
+  char domain[] = "binary-compact-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "compact1_table";
+  /* Samples to send, and whether they should be stored */
+  struct {
+    int32_t seqno;
+    double time;
+    uint32_t size;
+    int32_t delta;
+    double value;
+    int resync;
+    int stored;
+  } samples[] = {
+    { 1, 1.096202, 3319660544U, -3, 1./3, 0, 1 },
+    { 2, 2.092702, 106037248, 1 << 20, -2.5, 0, 1 },
+    { 3, 2.5, 42, -1, 0., 1, 0 }, /* Delta after some noise */
+    { 4, 3.000001, 43, 0, 0.5, 0, 0 },
+  };
+  int nsamples = LENGTH(samples), expected = 0;
+
+  char h1[300];
+  char select1[200];
+
+  OmlValue v[3];
+
+  int i, rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h1, sizeof(h1),  "protocol: 7\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s size:uint32 delta:int32 value:double\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select1, sizeof(select1), "select oml_ts_client, oml_seq, size, delta, value from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary compact socket";
+  ch = check_server_prepare_client_handler("test_binary_compact", &source);
+
+  logdebug("Sending header '%s'\n", h1);
+  client_callback(&source, ch, h1, strlen(h1));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+
+  memset(&state, 0, sizeof(state));
+  oml_value_array_init(v, LENGTH(v));
+  oml_value_set_type(&v[0], OML_UINT32_VALUE);
+  oml_value_set_type(&v[1], OML_INT32_VALUE);
+  oml_value_set_type(&v[2], OML_DOUBLE_VALUE);
+
+  for (i = 0; i < nsamples; i++) {
+    if (samples[i].resync) {
+      logdebug("Sending some noise\n");
+      mbuf_clear(mbuf);
+      mbuf_write(mbuf, (uint8_t*)"BRuit", 6);
+      client_callback(&source, ch, mbuf_buffer(mbuf), mbuf_rd_remaining(mbuf));
+    }
+
+    logdebug("Sending sample %d\n", samples[i].seqno);
+    omlc_set_uint32(*oml_value_get_value(&v[0]), samples[i].size);
+    omlc_set_int32(*oml_value_get_value(&v[1]), samples[i].delta);
+    omlc_set_double(*oml_value_get_value(&v[2]), samples[i].value);
+    mbuf_clear(mbuf);
+    marshal_compact_init(mbuf, &state, 1, samples[i].seqno, samples[i].time);
+    marshal_compact_values(mbuf, NULL, v, LENGTH(v));
+    marshal_compact_finalize(mbuf);
+    printmbuf(mbuf);
+    /* In two steps, to exercise partial messages */
+    client_callback(&source, ch, mbuf_buffer(mbuf), 4);
+    fail_if(ch->state == C_PROTOCOL_ERROR, "An incomplete compact sample confused the client_handler");
+    client_callback(&source, ch, mbuf_buffer(mbuf)+4, mbuf_rd_remaining(mbuf)-4);
+    fail_unless(ch->state == C_BINARY_DATA, "Sample %d confused the client handler", samples[i].seqno);
+    expected += samples[i].stored;
+  }
+
+  oml_value_array_reset(v, LENGTH(v));
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select1, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select1, rc);
+
+  for (i = 0; i < nsamples; i++) {
+    if (!samples[i].stored) {
+      continue;
+    }
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == SQLITE_ROW, "Step %d of statement `%s' failed; rc=%d", i, select1, rc);
+    fail_unless(fabs(sqlite3_column_double(stmt, 0) - samples[i].time) < 1e-8,
+        "Invalid oml_ts_client: expected `%f', got `%f'", samples[i].time, sqlite3_column_double(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == samples[i].seqno,
+        "Invalid oml_seq: expected %d, got %d", samples[i].seqno, sqlite3_column_int(stmt, 1));
+    fail_unless((uint32_t)sqlite3_column_int64(stmt, 2) == samples[i].size,
+        "Invalid size: expected %u, got %lld", samples[i].size, sqlite3_column_int64(stmt, 2));
+    fail_unless(sqlite3_column_int(stmt, 3) == samples[i].delta,
+        "Invalid delta: expected %d, got %d", samples[i].delta, sqlite3_column_int(stmt, 3));
+    fail_unless(sqlite3_column_double(stmt, 4) == samples[i].value,
+        "Invalid value: expected %f, got %f", samples[i].value, sqlite3_column_double(stmt, 4));
+  }
+  fail_unless(sqlite3_step(stmt) == SQLITE_DONE, "Samples after a lost base were stored");
+  fail_unless(expected == 2);
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+START_TEST(test_binary_batch)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+  OmlCompactState state;
+
+  char domain[] = "binary-batch-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "batch1_table";
+  /* Samples to send; all but the last one in a batch */
+  struct {
+    int32_t seqno;
+    double time;
+    uint32_t size;
+    int32_t delta;
+    double value;
+  } samples[] = {
+    { 1, 1.096202, 3319660544U, -3, 1./3 },
+    { 2, 2.092702, 106037248, 1 << 20, -2.5 },
+    { 4, 2.5, 42, -1, 0. },
+    { 5, 3.000001, 43, 0, 0.5 },
+  };
+  int nsamples = LENGTH(samples), rows = nsamples - 1;
+  int32_t seqnos[LENGTH(samples)];
+  double timestamps[LENGTH(samples)];
+
+  char h1[300];
+  char select1[200];
+
+  OmlValue v[3 * LENGTH(samples)];
+
+  int i, rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h1, sizeof(h1),  "protocol: 8\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s size:uint32 delta:int32 value:double\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select1, sizeof(select1), "select oml_ts_client, oml_seq, size, delta, value from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary batch socket";
+  ch = check_server_prepare_client_handler("test_binary_batch", &source);
+
+  logdebug("Sending header '%s'\n", h1);
+  client_callback(&source, ch, h1, strlen(h1));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+
+  oml_value_array_init(v, LENGTH(v));
+  for (i = 0; i < nsamples; i++) {
+    seqnos[i] = samples[i].seqno;
+    timestamps[i] = samples[i].time;
+    oml_value_set_type(&v[3*i], OML_UINT32_VALUE);
+    oml_value_set_type(&v[3*i+1], OML_INT32_VALUE);
+    oml_value_set_type(&v[3*i+2], OML_DOUBLE_VALUE);
+    omlc_set_uint32(*oml_value_get_value(&v[3*i]), samples[i].size);
+    omlc_set_int32(*oml_value_get_value(&v[3*i+1]), samples[i].delta);
+    omlc_set_double(*oml_value_get_value(&v[3*i+2]), samples[i].value);
+  }
+
+  logdebug("Sending batch of %d samples\n", rows);
+  mbuf_clear(mbuf);
+  fail_unless(marshal_batch(mbuf, NULL, 1, rows, seqnos, timestamps, v, 3) == 1);
+  printmbuf(mbuf);
+  /* In two steps, to exercise partial messages */
+  client_callback(&source, ch, mbuf_buffer(mbuf), 6);
+  fail_if(ch->state == C_PROTOCOL_ERROR, "An incomplete batch confused the client_handler");
+  client_callback(&source, ch, mbuf_buffer(mbuf)+6, mbuf_rd_remaining(mbuf)-6);
+  fail_unless(ch->state == C_BINARY_DATA, "Batch confused the client handler");
+
+  logdebug("Sending sample %d relative to the batch\n", samples[rows].seqno);
+  memset(&state, 0, sizeof(state));
+  state.valid = 1;
+  state.seqno = samples[rows-1].seqno;
+  state.timestamp = llround(samples[rows-1].time * 1e6);
+  mbuf_clear(mbuf);
+  marshal_compact_init(mbuf, &state, 1, samples[rows].seqno, samples[rows].time);
+  marshal_compact_values(mbuf, NULL, &v[3*rows], 3);
+  marshal_compact_finalize(mbuf);
+  client_callback(&source, ch, mbuf_buffer(mbuf), mbuf_rd_remaining(mbuf));
+  fail_unless(ch->state == C_BINARY_DATA, "Sample %d confused the client handler", samples[rows].seqno);
+
+  oml_value_array_reset(v, LENGTH(v));
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select1, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select1, rc);
+
+  for (i = 0; i < nsamples; i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == SQLITE_ROW, "Step %d of statement `%s' failed; rc=%d", i, select1, rc);
+    fail_unless(fabs(sqlite3_column_double(stmt, 0) - samples[i].time) < 1e-8,
+        "Invalid oml_ts_client: expected `%f', got `%f'", samples[i].time, sqlite3_column_double(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == samples[i].seqno,
+        "Invalid oml_seq: expected %d, got %d", samples[i].seqno, sqlite3_column_int(stmt, 1));
+    fail_unless((uint32_t)sqlite3_column_int64(stmt, 2) == samples[i].size,
+        "Invalid size: expected %u, got %lld", samples[i].size, sqlite3_column_int64(stmt, 2));
+    fail_unless(sqlite3_column_int(stmt, 3) == samples[i].delta,
+        "Invalid delta: expected %d, got %d", samples[i].delta, sqlite3_column_int(stmt, 3));
+    fail_unless(sqlite3_column_double(stmt, 4) == samples[i].value,
+        "Invalid value: expected %f, got %f", samples[i].value, sqlite3_column_double(stmt, 4));
+  }
+  fail_unless(sqlite3_step(stmt) == SQLITE_DONE, "Too many samples stored");
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+START_TEST(test_binary_strdict)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+  OmlCompactState state;
+
+  char domain[] = "binary-strdict-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "strdict1_table";
+  /* Samples to send; the first ones in a batch, the others in compact messages */
+  struct {
+    int32_t seqno;
+    double time;
+    const char *label;
+    uint32_t size;
+  } samples[] = {
+    { 1, 1.096202, "eth0", 1 },
+    { 2, 1.5, "wlan0", 2 },
+    { 3, 2.092702, "eth0", 3 },
+    { 4, 2.5, "wlan0", 4 },
+    { 5, 3.000001, "eth1", 5 },
+    { 6, 3.5, "eth0", 6 },
+  };
+  int nsamples = LENGTH(samples), rows = 3;
+  int32_t seqnos[LENGTH(samples)];
+  double timestamps[LENGTH(samples)];
+
+  char h1[300];
+  char select1[200];
+
+  OmlValue v[2 * LENGTH(samples)];
+
+  int i, rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h1, sizeof(h1),  "protocol: 9\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\ncontent: binary\nschema: 1 %s label:string size:uint32\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select1, sizeof(select1), "select oml_seq, label, size from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary strdict socket";
+  ch = check_server_prepare_client_handler("test_binary_strdict", &source);
+
+  logdebug("Sending header '%s'\n", h1);
+  client_callback(&source, ch, h1, strlen(h1));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+
+  memset(&state, 0, sizeof(state));
+  state.dict = strdict_new();
+  oml_value_array_init(v, LENGTH(v));
+  for (i = 0; i < nsamples; i++) {
+    seqnos[i] = samples[i].seqno;
+    timestamps[i] = samples[i].time;
+    oml_value_set_type(&v[2*i], OML_STRING_VALUE);
+    oml_value_set_type(&v[2*i+1], OML_UINT32_VALUE);
+    omlc_set_const_string(*oml_value_get_value(&v[2*i]), samples[i].label);
+    omlc_set_uint32(*oml_value_get_value(&v[2*i+1]), samples[i].size);
+  }
+
+  logdebug("Sending batch of %d samples\n", rows);
+  mbuf_clear(mbuf);
+  fail_unless(marshal_batch(mbuf, state.dict, 1, rows, seqnos, timestamps, v, 2) == 1);
+  printmbuf(mbuf);
+  client_callback(&source, ch, mbuf_buffer(mbuf), mbuf_rd_remaining(mbuf));
+  fail_unless(ch->state == C_BINARY_DATA, "Batch confused the client handler");
+
+  state.valid = 1;
+  state.seqno = samples[rows-1].seqno;
+  state.timestamp = llround(samples[rows-1].time * 1e6);
+  for (i = rows; i < nsamples; i++) {
+    logdebug("Sending sample %d\n", samples[i].seqno);
+    mbuf_clear(mbuf);
+    marshal_compact_init(mbuf, &state, 1, samples[i].seqno, samples[i].time);
+    fail_unless(marshal_compact_values(mbuf, state.dict, &v[2*i], 2) == 1);
+    marshal_compact_finalize(mbuf);
+    printmbuf(mbuf);
+    /* In two steps, to exercise partial messages */
+    client_callback(&source, ch, mbuf_buffer(mbuf), 4);
+    fail_if(ch->state == C_PROTOCOL_ERROR, "An incomplete compact sample confused the client_handler");
+    client_callback(&source, ch, mbuf_buffer(mbuf)+4, mbuf_rd_remaining(mbuf)-4);
+    fail_unless(ch->state == C_BINARY_DATA, "Sample %d confused the client handler", samples[i].seqno);
+  }
+
+  oml_value_array_reset(v, LENGTH(v));
+  strdict_destroy(state.dict);
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select1, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select1, rc);
+
+  for (i = 0; i < nsamples; i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == SQLITE_ROW, "Step %d of statement `%s' failed; rc=%d", i, select1, rc);
+    fail_unless(sqlite3_column_int(stmt, 0) == samples[i].seqno,
+        "Invalid oml_seq: expected %d, got %d", samples[i].seqno, sqlite3_column_int(stmt, 0));
+    fail_if(strcmp((const char*)sqlite3_column_text(stmt, 1), samples[i].label),
+        "Invalid label: expected '%s', got '%s'", samples[i].label, sqlite3_column_text(stmt, 1));
+    fail_unless((uint32_t)sqlite3_column_int64(stmt, 2) == samples[i].size,
+        "Invalid size: expected %u, got %lld", samples[i].size, sqlite3_column_int64(stmt, 2));
+  }
+  fail_unless(sqlite3_step(stmt) == SQLITE_DONE, "Too many samples stored");
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+/** Compress the data of an MBuffer as a block of a raw deflate stream.
+ *
+ * \param zs deflate stream
+ * \param in MBuffer holding the data to compress
+ * \param out MBuffer to which the compressed block is appended, with a full flush
+ */
+static void
+deflate_block(z_stream *zs, MBuffer *in, MBuffer *out)
+{
+  size_t room;
+
+  zs->next_in = mbuf_rdptr(in);
+  zs->avail_in = mbuf_rd_remaining(in);
+  do {
+    fail_if(mbuf_check_resize(out, 1024), "Cannot make room for compressed data");
+    room = mbuf_wr_remaining(out);
+    zs->next_out = mbuf_wrptr(out);
+    zs->avail_out = room;
+    fail_if(deflate(zs, Z_FULL_FLUSH) == Z_STREAM_ERROR, "Cannot compress data");
+    mbuf_write_advance(out, room - zs->avail_out);
+  } while (zs->avail_in > 0 || 0 == zs->avail_out);
+}
+
+START_TEST(test_binary_deflate)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+  MBuffer* zbuf = mbuf_create();
+  z_stream zs;
+  /* Empty stored block, as liboml2 adds before each compressed block */
+  uint8_t sync[] = { 0x00, 0x00, 0x00, 0xff, 0xff };
+  uint8_t noise[] = { 0xff, 0xff, 0xff, 0xff };
+
+  char domain[] = "binary-deflate-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "deflate1_table";
+  uint32_t sizes[] = { 3319660544U, 106037248, 42, 0xdeadbeef, 7 };
+  int nsamples = LENGTH(sizes);
+
+  char h1[300];
+  char select1[200];
+
+  OmlValue v;
+
+  int i, n, rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h1, sizeof(h1),  "protocol: 4\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\nschema: 1 %s size:uint32\nencoding: deflate\ncontent: binary\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select1, sizeof(select1), "select oml_seq, size from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary deflate socket";
+  ch = check_server_prepare_client_handler("test_binary_deflate", &source);
+
+  memset(&zs, 0, sizeof(zs));
+  fail_unless(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  oml_value_init(&v);
+  oml_value_set_type(&v, OML_UINT32_VALUE);
+
+  /* Encode the samples, in one block each */
+  for (i = 0; i < nsamples; i++) {
+    mbuf_clear(mbuf);
+    omlc_set_uint32(*oml_value_get_value(&v), sizes[i]);
+    marshal_init(mbuf, OMB_DATA_P);
+    marshal_measurements(mbuf, 1, i + 1, 1.0 + i);
+    marshal_values(mbuf, &v, 1);
+    marshal_finalize(mbuf);
+    if (3 == i) {
+      /* Corrupt the stream before this block, which the server should find */
+      mbuf_write(zbuf, noise, sizeof(noise));
+      mbuf_write(zbuf, sync, sizeof(sync));
+    }
+    deflate_block(&zs, mbuf, zbuf);
+    if (0 == i) {
+      /* With the headers */
+      logdebug("Sending header '%s' and first block\n", h1);
+      mbuf_clear(mbuf);
+      mbuf_write(mbuf, (uint8_t*)h1, strlen(h1));
+      mbuf_write(mbuf, mbuf_rdptr(zbuf), mbuf_rd_remaining(zbuf));
+      client_callback(&source, ch, mbuf_rdptr(mbuf), mbuf_rd_remaining(mbuf));
+      fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+      fail_if(ch->inflater == NULL, "Encoding not recognised");
+
+    } else {
+      /* In two steps, to exercise incomplete blocks */
+      n = mbuf_rd_remaining(zbuf) / 2;
+      logdebug("Sending block %d\n", i + 1);
+      client_callback(&source, ch, mbuf_rdptr(zbuf), n);
+      fail_if(ch->state == C_PROTOCOL_ERROR, "An incomplete block confused the client handler");
+      client_callback(&source, ch, mbuf_rdptr(zbuf) + n, mbuf_rd_remaining(zbuf) - n);
+      fail_unless(ch->state == C_BINARY_DATA, "Block %d confused the client handler", i + 1);
+    }
+    mbuf_clear(zbuf);
+  }
+
+  deflateEnd(&zs);
+  oml_value_reset(&v);
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+  mbuf_destroy(zbuf);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select1, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select1, rc);
+
+  for (i = 0; i < nsamples; i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == SQLITE_ROW, "Step %d of statement `%s' failed; rc=%d", i, select1, rc);
+    fail_unless(sqlite3_column_int(stmt, 0) == i + 1,
+        "Invalid oml_seq: expected %d, got %d", i + 1, sqlite3_column_int(stmt, 0));
+    fail_unless((uint32_t)sqlite3_column_int64(stmt, 1) == sizes[i],
+        "Invalid size: expected %u, got %lld", sizes[i], sqlite3_column_int64(stmt, 1));
+  }
+  fail_unless(sqlite3_step(stmt) == SQLITE_DONE, "Too many samples stored");
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
+START_TEST(test_binary_deflate_bound)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+  MBuffer* mbuf = mbuf_create();
+  MBuffer* zbuf = mbuf_create();
+  z_stream zs;
+
+  char domain[] = "binary-deflate-bound-test";
+  char dbname[sizeof(domain)+4];
+  char table[] = "deflate2_table";
+  char label[255]; /* Longest string in the binary protocol */
+  int nsamples = 2000;
+
+  char h1[300];
+  char select1[200];
+
+  OmlValue v;
+
+  int i, rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h1, sizeof(h1),  "protocol: 4\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\nschema: 1 %s label:string\nencoding: deflate\ncontent: binary\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  snprintf(select1, sizeof(select1), "select count(*), sum(length(label)) from %s;", table);
+  memset(label, 'a', sizeof(label) - 1);
+  label[sizeof(label) - 1] = '\0';
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "binary deflate bound socket";
+  ch = check_server_prepare_client_handler("test_binary_deflate_bound", &source);
+
+  memset(&zs, 0, sizeof(zs));
+  fail_unless(deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) == Z_OK);
+  oml_value_init(&v);
+  oml_value_set_type(&v, OML_STRING_VALUE);
+  omlc_set_const_string(*oml_value_get_value(&v), label);
+
+  /* Half a megabyte of highly compressible samples, in a single block */
+  for (i = 0; i < nsamples; i++) {
+    marshal_init(mbuf, OMB_DATA_P);
+    marshal_measurements(mbuf, 1, i + 1, 1.0 + i);
+    marshal_values(mbuf, &v, 1);
+    marshal_finalize(mbuf);
+    mbuf_begin_write(mbuf);
+  }
+  deflate_block(&zs, mbuf, zbuf);
+  fail_unless(mbuf_rd_remaining(zbuf) < 16 * 1024,
+      "Samples not compressed enough for the test (%zuB)", mbuf_rd_remaining(zbuf));
+
+  mbuf_clear(mbuf);
+  mbuf_write(mbuf, (uint8_t*)h1, strlen(h1));
+  mbuf_write(mbuf, mbuf_rdptr(zbuf), mbuf_rd_remaining(zbuf));
+  client_callback(&source, ch, mbuf_rdptr(mbuf), mbuf_rd_remaining(mbuf));
+  fail_unless(ch->state == C_BINARY_DATA, "Inconsistent state: expected %d, got %d", C_BINARY_DATA, ch->state);
+
+  /* The data should have been inflated and processed a bit at a time */
+  fail_if(mbuf_length(ch->mbuf) > 192 * 1024,
+      "Message buffer grew to %zuB to inflate the data", mbuf_length(ch->mbuf));
+
+  deflateEnd(&zs);
+  oml_value_reset(&v);
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+  mbuf_destroy(mbuf);
+  mbuf_destroy(zbuf);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select1, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select1, rc);
+  fail_unless(sqlite3_step(stmt) == SQLITE_ROW, "Cannot count samples");
+  fail_unless(sqlite3_column_int(stmt, 0) == nsamples,
+      "Invalid number of samples: expected %d, got %d", nsamples, sqlite3_column_int(stmt, 0));
+  fail_unless(sqlite3_column_int64(stmt, 1) == (long long)nsamples * (sizeof(label) - 1),
+      "Samples truncated: got %lld bytes of labels", sqlite3_column_int64(stmt, 1));
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
 START_TEST(test_binary_flexibility)
 {
   /* XXX: Code duplication with check_text_protocol.c:test_text_flexibility */
@@ -589,6 +1178,11 @@ Suite* binary_protocol_suite (void)
   TCase* tc_bin_flex = tcase_create ("Binary flexibility");
   tcase_add_test (tc_bin_flex, test_binary_flexibility);
   tcase_add_test (tc_bin_flex, test_binary_metadata);
+  tcase_add_test (tc_bin_flex, test_binary_compact);
+  tcase_add_test (tc_bin_flex, test_binary_batch);
+  tcase_add_test (tc_bin_flex, test_binary_strdict);
+  tcase_add_test (tc_bin_flex, test_binary_deflate);
+  tcase_add_test (tc_bin_flex, test_binary_deflate_bound);
   suite_add_tcase (s, tc_bin_flex);
 
   return s;
@@ -0,0 +1,634 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_psql.c
+ * \brief Tests the encoding of rows and INSERT parameters by the PostgreSQL
+ * adapter, and its accounting of pipelined INSERTs, without a server.
+ *
+ * The adapter is included, so its static functions can be tested directly.
+ * The libpq functions reading results are replaced by mocks, which return
+ * results from a script.
+ */
+
+#define PQconsumeInput mock_PQconsumeInput
+#define PQisBusy mock_PQisBusy
+#define PQgetResult mock_PQgetResult
+#define PQexitPipelineMode mock_PQexitPipelineMode
+
+/* First, as it sets _GNU_SOURCE */
+#include "psql_adapter.c"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <check.h>
+
+#include "schema.h"
+#include "check_server.h"
+
+/** Schema with one field of each OML type stored by the adapter */
+static const char all_types_schema[] =
+  "1 psql_table i32:int32 u32:uint32 i64:int64 u64:uint64 d:double s:string b:blob g:guid t:bool v:[int32]";
+
+/** Text representations of two rows for all_types_schema; NULL leaves the value unset */
+static const char *all_types_rows[][10] = {
+  { "-2147483647", "4294967295", "-9223372036854775807", "9223372036854775807", "13.37",
+    "string", "YWJjZGU=", "9223372036854775807", "true", "3 1 -2 3" },
+  { "0", "0", "0", "0", "NAN",
+    NULL, "", "0", "false", "0" },
+};
+
+/** Set up a Database and a DbTable with the adapter's structures, but no connection */
+static void
+psql_test_setup(Database *db, DbTable *table, const char *meta)
+{
+  PsqlTable *psqltable;
+
+  memset(db, 0, sizeof(*db));
+  strncpy(db->name, "psql-test", sizeof(db->name) - 1);
+  db->handle = oml_malloc(sizeof(PsqlDB));
+  fail_if(NULL == db->handle);
+
+  memset(table, 0, sizeof(*table));
+  table->schema = schema_from_meta(meta);
+  fail_if(NULL == table->schema, "Cannot parse schema '%s'", meta);
+  psqltable = oml_malloc(sizeof(PsqlTable));
+  fail_if(NULL == psqltable);
+  fail_if(psql_table_params_init(psqltable, table->schema->nfields));
+  table->handle = psqltable;
+}
+
+static void
+psql_test_teardown(Database *db, DbTable *table)
+{
+  psql_table_params_free((PsqlTable*)table->handle);
+  oml_free(table->handle);
+  schema_free(table->schema);
+  oml_free(db->handle);
+}
+
+/** Decode the values of a row from their text representations */
+static void
+psql_test_values(DbTable *table, OmlValue *values, const char **reps)
+{
+  int i;
+
+  for (i = 0; i < table->schema->nfields; i++) {
+    oml_value_init(&values[i]);
+    oml_value_set_type(&values[i], table->schema->fields[i].type);
+    if (reps[i]) {
+      fail_if(oml_value_from_s(&values[i], reps[i]), "Cannot convert '%s' to %s",
+          reps[i], oml_type_to_s(table->schema->fields[i].type));
+    }
+  }
+}
+
+/** Check a parameter of an INSERT, passed in binary format */
+static void
+param_check(PsqlTable *t, int i, const void *expected, int length)
+{
+  fail_unless(1 == t->formats[i], "Parameter %d not in binary format", i);
+  fail_unless(length == t->lengths[i], "Parameter %d has length %d instead of %d", i, t->lengths[i], length);
+  fail_if(memcmp(t->values[i], expected, length), "Unexpected value for parameter %d", i);
+}
+
+/** Check a parameter of an INSERT, passed in text format */
+static void
+param_check_text(PsqlTable *t, int i, const char *expected)
+{
+  fail_unless(0 == t->formats[i], "Parameter %d not in text format", i);
+  fail_if(NULL == t->values[i], "Parameter %d is NULL", i);
+  fail_if(strcmp(t->values[i], expected), "Parameter %d is '%s' instead of '%s'", i, t->values[i], expected);
+}
+
+/** Read the length of the next field of an encoded row, and check it */
+static const uint8_t*
+copy_field(const uint8_t *p, int32_t expected, const char *name)
+{
+  uint32_t len;
+
+  memcpy(&len, p, 4);
+  fail_unless((int32_t)ntohl(len) == expected,
+      "Field %s has length %d instead of %d", name, (int32_t)ntohl(len), expected);
+  return p + 4;
+}
+
+static int64_t
+copy_int(const uint8_t *p, int size)
+{
+  uint32_t v32;
+  uint64_t v64;
+
+  if (4 == size) {
+    memcpy(&v32, p, 4);
+    return (int32_t)ntohl(v32);
+  }
+  memcpy(&v64, p, 8);
+  return (int64_t)ntohll(v64);
+}
+
+static double
+copy_double(const uint8_t *p)
+{
+  int64_t v = copy_int(p, 8);
+  double d;
+
+  memcpy(&d, &v, sizeof(d));
+  return d;
+}
+
+/** Types of the INSERT parameters of a table created with all_types_schema */
+static const Oid all_types_oids[] = {
+  PG_INT4OID, PG_INT4OID, PG_FLOAT8OID, PG_FLOAT8OID, /* Metadata */
+  PG_INT4OID, PG_INT8OID, PG_INT8OID, PG_INT8OID, PG_FLOAT8OID,
+  PG_TEXTOID, PG_BYTEAOID, PG_INT8OID, PG_BOOLOID, PG_TEXTOID,
+};
+
+/** Script entry for which mock_PQgetResult returns NULL */
+#define MOCK_NULL ((ExecStatusType)-1)
+/** Script entry for which mock_PQisBusy returns 1, until the script is rewound */
+#define MOCK_BUSY ((ExecStatusType)-2)
+
+/** Results returned by mock_PQgetResult, in order; NULL once exhausted */
+static const ExecStatusType *mock_script;
+static int mock_script_len;
+static int mock_script_pos;
+
+static void
+mock_set_script(const ExecStatusType *script, int len)
+{
+  mock_script = script;
+  mock_script_len = len;
+  mock_script_pos = 0;
+}
+
+int
+mock_PQconsumeInput(PGconn *conn)
+{
+  (void)conn;
+  return 1;
+}
+
+int
+mock_PQisBusy(PGconn *conn)
+{
+  (void)conn;
+  return mock_script_pos < mock_script_len && MOCK_BUSY == mock_script[mock_script_pos];
+}
+
+PGresult*
+mock_PQgetResult(PGconn *conn)
+{
+  ExecStatusType status;
+  (void)conn;
+
+  while (mock_script_pos < mock_script_len && MOCK_BUSY == mock_script[mock_script_pos]) {
+    /* Blocking: the results arrive */
+    mock_script_pos++;
+  }
+  if (mock_script_pos >= mock_script_len) {
+    return NULL;
+  }
+  status = mock_script[mock_script_pos++];
+  return MOCK_NULL == status ? NULL : PQmakeEmptyPGresult(NULL, status);
+}
+
+int
+mock_PQexitPipelineMode(PGconn *conn)
+{
+  (void)conn;
+  return 1;
+}
+
+/** Put the connection of db in pipeline mode, with INSERTs into table (or
+ * synchronisation points for NULL entries) pending */
+static void
+psql_test_pipeline(Database *db, DbTable **tables, int count)
+{
+  PsqlDB *psqldb = (PsqlDB*)db->handle;
+  int i;
+
+  psqldb->pending = oml_calloc(PG_PIPELINE_DEPTH, sizeof(PsqlPending));
+  fail_if(NULL == psqldb->pending);
+  /* Start near the end of the list, so it wraps around */
+  psqldb->pending_head = PG_PIPELINE_DEPTH - 2;
+  psqldb->pipeline = 1;
+  for (i = 0; i < count; i++) {
+    fail_if(psql_pipeline_push(psqldb, tables[i], 1, i));
+  }
+}
+
+START_TEST(test_psql_copy_header)
+{
+  /* Signature, flags, and length of the (empty) header extension */
+  fail_unless(19 == sizeof(copy_header), "COPY header is %d bytes long", (int)sizeof(copy_header));
+  fail_if(memcmp(copy_header, "PGCOPY\n\377\r\n\0", 11), "Invalid COPY signature");
+  fail_if(copy_int((const uint8_t*)&copy_header[11], 4), "Unexpected COPY flags");
+  fail_if(copy_int((const uint8_t*)&copy_header[15], 4), "Unexpected COPY header extension");
+}
+END_TEST
+
+START_TEST(test_psql_copy_row)
+{
+  Database db;
+  DbTable table;
+  DbRow row;
+  OmlValue values[10];
+  MBuffer *buf = mbuf_create();
+  const uint8_t *p;
+  char *json = NULL;
+  int32_t v[] = { 1, -2, 3 };
+  ssize_t json_sz;
+  uint16_t nfields;
+  double ts_server = 2.5;
+
+  psql_test_setup(&db, &table, all_types_schema);
+  psql_test_values(&table, values, all_types_rows[_i]);
+  row.sender_id = 7;
+  row.seq_no = 42 + _i;
+  row.time_stamp = 1.25;
+  row.values = values;
+  row.value_count = LENGTH(values);
+
+  fail_if(psql_copy_put_row(&db, &table, buf, &row, ts_server), "Cannot encode row %d", _i);
+  p = mbuf_rdptr(buf);
+
+  /* Tuple: number of fields, then each field's length and value */
+  memcpy(&nfields, p, 2);
+  fail_unless(ntohs(nfields) == 4 + LENGTH(values), "Tuple has %d fields", ntohs(nfields));
+  p += 2;
+  p = copy_field(p, 4, "oml_sender_id");
+  fail_unless(copy_int(p, 4) == 7);
+  p = copy_field(p + 4, 4, "oml_seq");
+  fail_unless(copy_int(p, 4) == 42 + _i);
+  p = copy_field(p + 4, 8, "oml_ts_client");
+  fail_unless(copy_double(p) == 1.25);
+  p = copy_field(p + 8, 8, "oml_ts_server");
+  fail_unless(copy_double(p) == ts_server);
+  p += 8;
+
+  if (0 == _i) {
+    p = copy_field(p, 4, "i32");                /* INT4 */
+    fail_unless(copy_int(p, 4) == -2147483647);
+    p = copy_field(p + 4, 8, "u32");            /* INT8 */
+    fail_unless(copy_int(p, 8) == 4294967295LL);
+    p = copy_field(p + 8, 8, "i64");
+    fail_unless(copy_int(p, 8) == -9223372036854775807LL);
+    p = copy_field(p + 8, 8, "u64");            /* BIGINT */
+    fail_unless(copy_int(p, 8) == 9223372036854775807LL);
+    p = copy_field(p + 8, 8, "d");              /* FLOAT8 */
+    fail_unless(copy_double(p) == 13.37);
+    p = copy_field(p + 8, 6, "s");              /* TEXT, not NUL-terminated */
+    fail_if(memcmp(p, "string", 6));
+    p = copy_field(p + 6, 5, "b");              /* BYTEA, raw */
+    fail_if(memcmp(p, "abcde", 5));
+    p = copy_field(p + 5, 8, "g");              /* BIGINT */
+    fail_unless(copy_int(p, 8) == 9223372036854775807LL);
+    p = copy_field(p + 8, 1, "t");              /* BOOLEAN */
+    fail_unless(1 == *p);
+    json_sz = vector_int32_to_json(v, LENGTH(v), &json);
+    p = copy_field(p + 1, json_sz, "v");        /* TEXT, as JSON */
+    fail_if(memcmp(p, json, json_sz), "Unexpected vector '%.*s'", (int)json_sz, p);
+
+  } else {
+    p = copy_field(p, 4, "i32");
+    fail_unless(copy_int(p, 4) == 0);
+    p = copy_field(p + 4, 8, "u32");
+    fail_unless(copy_int(p, 8) == 0);
+    p = copy_field(p + 8, 8, "i64");
+    fail_unless(copy_int(p, 8) == 0);
+    p = copy_field(p + 8, 8, "u64");
+    fail_unless(copy_int(p, 8) == 0);
+    p = copy_field(p + 8, 8, "d");              /* NaN is a value, not NULL */
+    fail_unless(isnan(copy_double(p)));
+    p = copy_field(p + 8, 0, "s");              /* Unset string stored as '' */
+    p = copy_field(p, 0, "b");
+    p = copy_field(p, -1, "g");                 /* OMLC_GUID_NULL is NULL */
+    p = copy_field(p, 1, "t");
+    fail_unless(0 == *p);
+    json_sz = vector_int32_to_json(v, 0, &json);
+    p = copy_field(p + 1, json_sz, "v");
+    fail_if(memcmp(p, json, json_sz), "Unexpected vector '%.*s'", (int)json_sz, p);
+  }
+  p += json_sz;
+  fail_unless(p == mbuf_wrptr(buf), "%d bytes of extra data after the row", (int)(mbuf_wrptr(buf) - p));
+
+  oml_free(json);
+  oml_value_array_reset(values, LENGTH(values));
+  mbuf_destroy(buf);
+  psql_test_teardown(&db, &table);
+}
+END_TEST
+
+START_TEST(test_psql_copy_row_invalid)
+{
+  Database db;
+  DbTable table;
+  DbRow row;
+  OmlValue values[10];
+  MBuffer *buf = mbuf_create();
+
+  o_set_log_level(-1);
+
+  psql_test_setup(&db, &table, all_types_schema);
+  psql_test_values(&table, values, all_types_rows[0]);
+  row.sender_id = 1;
+  row.seq_no = 1;
+  row.time_stamp = 1.;
+  row.values = values;
+
+  row.value_count = LENGTH(values) - 1;
+  fail_unless(-1 == psql_copy_put_row(&db, &table, buf, &row, 1.), "Row with missing values encoded");
+
+  row.value_count = LENGTH(values);
+  omlc_set_uint64(*oml_value_get_value(&values[3]), (uint64_t)INT64_MAX + 1);
+  fail_unless(-1 == psql_copy_put_row(&db, &table, buf, &row, 1.), "UINT64 larger than INT64_MAX encoded");
+
+  omlc_set_uint64(*oml_value_get_value(&values[3]), 1);
+  oml_value_set_type(&values[0], OML_DOUBLE_VALUE);
+  fail_unless(-1 == psql_copy_put_row(&db, &table, buf, &row, 1.), "Value of the wrong type encoded");
+
+  oml_value_array_reset(values, LENGTH(values));
+  mbuf_destroy(buf);
+  psql_test_teardown(&db, &table);
+}
+END_TEST
+
+START_TEST(test_psql_bind_params)
+{
+  Database db;
+  DbTable table;
+  PsqlTable *t;
+  OmlValue values[10];
+  char *json = NULL;
+  int32_t v[] = { 1, -2, 3 };
+  ssize_t json_sz;
+  uint32_t n32;
+  uint64_t n64;
+  double d;
+
+  psql_test_setup(&db, &table, all_types_schema);
+  t = (PsqlTable*)table.handle;
+  fail_unless(0 == psql_table_params_check(&db, &table, all_types_oids, LENGTH(all_types_oids)),
+      "Parameters of a table created by the adapter passed as text");
+  psql_test_values(&table, values, all_types_rows[_i]);
+
+  fail_if(psql_bind_params(&db, &table, 7, 42, 1.25, 2.5, values, LENGTH(values)), "Cannot bind row %d", _i);
+  fail_unless(LENGTH(all_types_oids) == t->nparams);
+
+  n32 = htonl(7);
+  param_check(t, 0, &n32, 4);                   /* oml_sender_id, INT4 */
+  n32 = htonl(42);
+  param_check(t, 1, &n32, 4);                   /* oml_seq, INT4 */
+  d = 1.25;
+  memcpy(&n64, &d, 8);
+  n64 = htonll(n64);
+  param_check(t, 2, &n64, 8);                   /* oml_ts_client, FLOAT8 */
+
+  if (0 == _i) {
+    n32 = htonl((uint32_t)-2147483647);
+    param_check(t, 4, &n32, 4);                 /* INT4 */
+    n64 = htonll(4294967295ULL);
+    param_check(t, 5, &n64, 8);                 /* UINT32 promoted to INT8 */
+    n64 = htonll((uint64_t)-9223372036854775807LL);
+    param_check(t, 6, &n64, 8);
+    n64 = htonll(9223372036854775807ULL);
+    param_check(t, 7, &n64, 8);
+    d = 13.37;
+    memcpy(&n64, &d, 8);
+    n64 = htonll(n64);
+    param_check(t, 8, &n64, 8);
+    param_check(t, 9, "string", 6);             /* TEXT, not NUL-terminated */
+    param_check(t, 10, "abcde", 5);             /* BYTEA, raw */
+    n64 = htonll(9223372036854775807ULL);
+    param_check(t, 11, &n64, 8);                /* GUID, BIGINT */
+    param_check(t, 12, "\1", 1);                /* BOOLEAN */
+    json_sz = vector_int32_to_json(v, LENGTH(v), &json);
+    param_check(t, 13, json, json_sz);          /* TEXT, as JSON */
+
+  } else {
+    n32 = 0;
+    param_check(t, 4, &n32, 4);
+    n64 = 0;
+    param_check(t, 5, &n64, 8);
+    param_check(t, 6, &n64, 8);
+    param_check(t, 7, &n64, 8);
+    d = 0.;
+    memcpy(&n64, &t->scalars[8], 8);
+    n64 = ntohll(n64);
+    memcpy(&d, &n64, 8);
+    fail_unless(isnan(d), "NaN passed as %g", d);  /* NaN is a value, not NULL */
+    fail_unless(8 == t->lengths[8]);
+    param_check(t, 9, "", 0);                   /* Unset string passed as '' */
+    param_check(t, 10, "", 0);
+    fail_unless(NULL == t->values[11], "NULL GUID not passed as NULL");
+    param_check(t, 12, "\0", 1);
+    json_sz = vector_int32_to_json(v, 0, &json);
+    param_check(t, 13, json, json_sz);
+  }
+
+  oml_free(json);
+  oml_value_array_reset(values, LENGTH(values));
+  psql_test_teardown(&db, &table);
+}
+END_TEST
+
+START_TEST(test_psql_bind_params_invalid)
+{
+  Database db;
+  DbTable table;
+  OmlValue values[10];
+
+  o_set_log_level(-1);
+
+  psql_test_setup(&db, &table, all_types_schema);
+  psql_test_values(&table, values, all_types_rows[0]);
+
+  fail_unless(-1 == psql_bind_params(&db, &table, 1, 1, 1., 1., values, LENGTH(values) - 1),
+      "Row with missing values bound");
+
+  omlc_set_uint64(*oml_value_get_value(&values[3]), (uint64_t)INT64_MAX + 1);
+  fail_unless(-1 == psql_bind_params(&db, &table, 1, 1, 1., 1., values, LENGTH(values)),
+      "UINT64 larger than INT64_MAX bound to a BIGINT");
+
+  omlc_set_uint64(*oml_value_get_value(&values[3]), 1);
+  oml_value_set_type(&values[0], OML_DOUBLE_VALUE);
+  fail_unless(-1 == psql_bind_params(&db, &table, 1, 1, 1., 1., values, LENGTH(values)),
+      "Value of the wrong type bound");
+
+  oml_value_array_reset(values, LENGTH(values));
+  psql_test_teardown(&db, &table);
+}
+END_TEST
+
+START_TEST(test_psql_bind_params_text)
+{
+  Database db;
+  DbTable table;
+  PsqlTable *t;
+  OmlValue values[10];
+  Oid types[LENGTH(all_types_oids)];
+  uint32_t n32;
+
+  o_set_log_level(-1);
+
+  psql_test_setup(&db, &table, all_types_schema);
+  t = (PsqlTable*)table.handle;
+  psql_test_values(&table, values, all_types_rows[0]);
+
+  fail_unless(-1 == psql_table_params_check(&db, &table, all_types_oids, LENGTH(all_types_oids) - 1),
+      "Statement with missing parameters accepted");
+
+  /* Columns of an existing table, created with other types */
+  memcpy(types, all_types_oids, sizeof(types));
+  types[3] = 700;       /* oml_ts_server FLOAT4 */
+  types[5] = 1700;      /* u32 NUMERIC */
+  types[7] = 1700;      /* u64 NUMERIC */
+  types[8] = 1700;      /* d NUMERIC */
+  types[10] = PG_TEXTOID;
+  types[12] = PG_INT4OID;
+  fail_unless(6 == psql_table_params_check(&db, &table, types, LENGTH(types)),
+      "Wrong number of parameters passed as text");
+
+  omlc_set_uint64(*oml_value_get_value(&values[3]), UINT64_MAX);
+  fail_if(psql_bind_params(&db, &table, 7, 42, 1.25, 2.5, values, LENGTH(values)), "Cannot bind row as text");
+
+  n32 = htonl(7);
+  param_check(t, 0, &n32, 4);
+  param_check_text(t, 3, "2.5");
+  param_check_text(t, 5, "4294967295");
+  param_check_text(t, 7, "18446744073709551615"); /* Larger than INT64_MAX */
+  param_check_text(t, 8, "13.369999999999999");
+  param_check_text(t, 10, "\\x6162636465");      /* BYTEA hex, as PQescapeByteaConn */
+  param_check_text(t, 12, "1");
+  param_check(t, 9, "string", 6);                 /* Unaffected */
+
+  /* NaN, and an empty blob */
+  psql_test_values(&table, values, all_types_rows[1]);
+  fail_if(psql_bind_params(&db, &table, 7, 42, 1.25, 2.5, values, LENGTH(values)), "Cannot bind row as text");
+  param_check_text(t, 8, "nan");
+  param_check_text(t, 10, "\\x");
+  param_check_text(t, 12, "0");
+  fail_unless(NULL == t->values[11], "NULL GUID not passed as NULL");
+
+  oml_value_array_reset(values, LENGTH(values));
+  psql_test_teardown(&db, &table);
+}
+END_TEST
+
+START_TEST(test_psql_pipeline_collect)
+{
+  Database db;
+  DbTable table;
+  PsqlDB *psqldb;
+  DbTable *pending[] = { &table, &table, NULL, &table, &table, &table, NULL };
+  const ExecStatusType script[] = {
+    /* First group, one error */
+    PGRES_COMMAND_OK, MOCK_NULL,
+    PGRES_FATAL_ERROR, MOCK_NULL,
+    PGRES_PIPELINE_SYNC,
+    /* Second group, the rest is skipped after an error */
+    PGRES_COMMAND_OK, MOCK_NULL,
+    MOCK_BUSY,
+    PGRES_FATAL_ERROR, MOCK_NULL,
+    PGRES_PIPELINE_ABORTED, MOCK_NULL,
+    PGRES_PIPELINE_SYNC,
+  };
+
+  o_set_log_level(-1);
+
+  psql_test_setup(&db, &table, all_types_schema);
+  psqldb = (PsqlDB*)db.handle;
+  psql_test_pipeline(&db, pending, LENGTH(pending));
+  mock_set_script(script, LENGTH(script));
+
+  /* Without blocking, only the results already received are processed */
+  fail_unless(1 == psql_pipeline_collect(&db, 0), "Wrong number of failed INSERTs in the first group");
+  fail_unless(3 == psqldb->pending_count, "%d commands pending instead of 3", psqldb->pending_count);
+
+  /* The failures still pending are not lost when leaving pipeline mode... */
+  fail_unless(2 == psql_pipeline_end(&db), "Wrong number of failed INSERTs in the second group");
+  fail_unless(0 == psqldb->pending_count);
+  fail_unless(0 == psqldb->aborted, "Skipped INSERTs still counted after the synchronisation point");
+  fail_if(psqldb->pipeline);
+  fail_unless(0 == psql_pipeline_end(&db), "Pipeline ended twice");
+
+  oml_free(psqldb->pending);
+  psql_test_teardown(&db, &table);
+}
+END_TEST
+
+START_TEST(test_psql_pipeline_lost)
+{
+  Database db;
+  DbTable table;
+  PsqlDB *psqldb;
+  DbTable *pending[] = { &table, &table, &table, NULL };
+  /* The connection was lost after the first result */
+  const ExecStatusType script[] = {
+    PGRES_COMMAND_OK, MOCK_NULL,
+  };
+
+  o_set_log_level(-1);
+
+  psql_test_setup(&db, &table, all_types_schema);
+  psqldb = (PsqlDB*)db.handle;
+  psql_test_pipeline(&db, pending, LENGTH(pending));
+  mock_set_script(script, LENGTH(script));
+
+  /* ...nor are those for which no result ever comes, and the idle
+   * processing reports them with the next batch */
+  psql_idle(&db);
+  fail_unless(0 == psqldb->pending_count, "%d commands still pending", psqldb->pending_count);
+  fail_if(psqldb->pipeline);
+  fail_unless(3 == psql_failed(psqldb, 1), "Lost INSERTs not reported with the next batch");
+  fail_unless(0 == psql_failed(psqldb, 0), "Lost INSERTs reported twice");
+
+  oml_free(psqldb->pending);
+  psql_test_teardown(&db, &table);
+}
+END_TEST
+
+Suite*
+psql_suite (void)
+{
+  Suite* s = suite_create ("PostgreSQL");
+
+  TCase* tc_psql_copy = tcase_create ("PostgreSQL COPY");
+  tcase_add_test (tc_psql_copy, test_psql_copy_header);
+  tcase_add_loop_test (tc_psql_copy, test_psql_copy_row, 0, LENGTH(all_types_rows));
+  tcase_add_test (tc_psql_copy, test_psql_copy_row_invalid);
+  suite_add_tcase (s, tc_psql_copy);
+
+  TCase* tc_psql_params = tcase_create ("PostgreSQL INSERT parameters");
+  tcase_add_loop_test (tc_psql_params, test_psql_bind_params, 0, LENGTH(all_types_rows));
+  tcase_add_test (tc_psql_params, test_psql_bind_params_invalid);
+  tcase_add_test (tc_psql_params, test_psql_bind_params_text);
+  suite_add_tcase (s, tc_psql_params);
+
+#ifdef LIBPQ_HAS_PIPELINING
+  TCase* tc_psql_pipeline = tcase_create ("PostgreSQL pipeline");
+  tcase_add_test (tc_psql_pipeline, test_psql_pipeline_collect);
+  tcase_add_test (tc_psql_pipeline, test_psql_pipeline_lost);
+  suite_add_tcase (s, tc_psql_pipeline);
+#endif
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -28,6 +28,10 @@
 
 extern Suite* text_protocol_suite (void);
 extern Suite* binary_protocol_suite (void);
+extern Suite* storage_suite (void);
+#ifdef HAVE_LIBPQ
+extern Suite* psql_suite (void);
+#endif
 
 #endif /* CHECK_LIBOML2_SUITES_H__ */
 
@@ -0,0 +1,517 @@
+/*
+ * Copyright 2015 National ICT Australia (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file check_storage.c
+ * \brief Tests the queue between the client handlers and the storage thread.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <check.h>
+#include <sqlite3.h>
+
+#include "ocomm/o_log.h"
+#include "oml_utils.h"
+#include "oml_value.h"
+#include "schema.h"
+#include "database.h"
+#include "storage.h"
+#include "sqlite_adapter.h"
+#include "check_server.h"
+
+extern char *dbbackend;
+extern char *sqlite_database_dir;
+extern char *sqlite_profile;
+extern char *sqlite_journal_mode;
+extern int sqlite_commit_rows;
+extern int sqlite_commit_interval;
+
+static pthread_mutex_t hold_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t hold_cond = PTHREAD_COND_INITIALIZER;
+static int held = 0;
+static int released = 0;
+
+/* Keep the storage thread busy until released is set */
+static int
+hold_storage(Database *db, void *arg)
+{
+  (void)db;
+  (void)arg;
+  pthread_mutex_lock(&hold_lock);
+  held = 1;
+  pthread_cond_broadcast(&hold_cond);
+  while (!released) {
+    pthread_cond_wait(&hold_cond, &hold_lock);
+  }
+  pthread_mutex_unlock(&hold_lock);
+  return 0;
+}
+
+static void*
+call_hold_storage(void *arg)
+{
+  storage_call((Database*)arg, hold_storage, NULL);
+  return NULL;
+}
+
+START_TEST(test_storage_watermarks)
+{
+  Database *db;
+  DbTable *table;
+  struct schema *schema;
+  sqlite3_stmt *stmt;
+  pthread_t thread;
+  OmlValue v;
+
+  char domain[] = "storage-test";
+  char dbname[sizeof(domain)+4];
+  char select[] = "select oml_seq, value from storage_table;";
+  int nrows = 4;
+  int32_t seqno;
+  double ts;
+  int i, rc, tries, queued;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  storage_high_watermark = nrows;
+  storage_low_watermark = 1;
+
+  db = database_find(domain);
+  fail_if(db == NULL, "Cannot create database %s", domain);
+  schema = schema_from_meta("1 storage_table value:int32");
+  table = database_find_or_create_table(db, schema);
+  fail_if(table == NULL, "Cannot create table for schema '1 storage_table value:int32'");
+  schema_free(schema);
+
+  /* Stall the storage thread, so rows pile up */
+  fail_if(pthread_create(&thread, NULL, call_hold_storage, db));
+  pthread_mutex_lock(&hold_lock);
+  while (!held) {
+    pthread_cond_wait(&hold_cond, &hold_lock);
+  }
+  pthread_mutex_unlock(&hold_lock);
+
+  oml_value_init(&v);
+  for (i = 0; i < nrows; i++) {
+    fail_if(storage_is_throttled(db), "Queue throttled after %d rows", i);
+    oml_value_set_type(&v, OML_INT32_VALUE);
+    omlc_set_int32(*oml_value_get_value(&v), 10 * i);
+    fail_if(storage_insert(db, table, 1, i, (double)i, &v, 1), "Cannot queue row %d", i);
+  }
+  fail_unless(storage_depth(db) == (unsigned int)nrows,
+      "Unexpected queue depth (%d instead of %d)", storage_depth(db), nrows);
+  fail_unless(storage_is_throttled(db), "Queue not throttled at the high watermark");
+
+  /* There is some room past the high watermark, but a full queue does not block */
+  for (rc = 0; i < 100; i++) {
+    oml_value_set_type(&v, OML_INT32_VALUE);
+    omlc_set_int32(*oml_value_get_value(&v), 10 * i);
+    if ((rc = storage_insert(db, table, 1, i, (double)i, &v, 1))) {
+      break;
+    }
+  }
+  fail_unless(1 == rc, "Full queue not reported (%d after %d rows)", rc, i);
+  fail_unless(i > nrows, "Queue full at the high watermark (%d rows)", i);
+  queued = i;
+  seqno = i;
+  ts = (double)i;
+  fail_unless(0 == storage_insert_batch(db, table, 1, &seqno, &ts, &v, 1, 1),
+      "Row queued past the end of the queue");
+  oml_value_reset(&v);
+  fail_unless(storage_depth(db) == (unsigned int)queued,
+      "Unexpected queue depth (%d instead of %d)", storage_depth(db), queued);
+
+  /* Let the storage thread drain the queue */
+  pthread_mutex_lock(&hold_lock);
+  released = 1;
+  pthread_cond_broadcast(&hold_cond);
+  pthread_mutex_unlock(&hold_lock);
+  pthread_join(thread, NULL);
+
+  for (tries = 0; tries < 1000 && storage_is_throttled(db); tries++) {
+    usleep(1000);
+  }
+  fail_if(storage_is_throttled(db), "Queue still throttled after draining (%d rows left)", storage_depth(db));
+
+  /* Closing the database writes all remaining rows */
+  database_release(db);
+  storage_high_watermark = DEF_STORAGE_HIGH_WATERMARK;
+  storage_low_watermark = DEF_STORAGE_LOW_WATERMARK;
+
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+  for (i = 0; i < queued; i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == SQLITE_ROW, "Missing row %d; rc=%d", i, rc);
+    fail_unless(sqlite3_column_int(stmt, 0) == i,
+        "Invalid sequence number in row %d: got %d", i, sqlite3_column_int(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == 10 * i,
+        "Invalid value in row %d: expected %d, got %d", i, 10 * i, sqlite3_column_int(stmt, 1));
+  }
+  fail_unless(sqlite3_step(stmt) == SQLITE_DONE, "Too many rows in table");
+  sqlite3_finalize(stmt);
+
+  database_release(db);
+}
+END_TEST
+
+START_TEST(test_storage_batches)
+{
+  Database *db;
+  DbTable *tables[2];
+  struct schema *schema;
+  sqlite3_stmt *stmt;
+  OmlValue v;
+
+  char domain[] = "storage-batch-test";
+  char dbname[sizeof(domain)+4];
+  char *select[] = {
+    "select oml_seq, value from batch_table1;",
+    "select oml_seq, value from batch_table2;",
+  };
+  int counts[2] = { 0, 0 };
+  int nrows = 200;
+  int i, t, rc, tries;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  /* A small queue, so batches wrap around it */
+  storage_high_watermark = 13;
+  storage_low_watermark = 1;
+
+  db = database_find(domain);
+  fail_if(db == NULL, "Cannot create database %s", domain);
+  schema = schema_from_meta("1 batch_table1 value:int32");
+  tables[0] = database_find_or_create_table(db, schema);
+  schema_free(schema);
+  schema = schema_from_meta("2 batch_table2 value:int32");
+  tables[1] = database_find_or_create_table(db, schema);
+  schema_free(schema);
+  fail_if(tables[0] == NULL || tables[1] == NULL, "Cannot create tables");
+
+  /* Runs of rows of varying length for each table */
+  oml_value_init(&v);
+  for (i = 0; i < nrows; i++) {
+    t = (i / (1 + i % 7)) % 2;
+    oml_value_set_type(&v, OML_INT32_VALUE);
+    omlc_set_int32(*oml_value_get_value(&v), i);
+    /* Wait for room, as a throttled client would */
+    for (tries = 0; tries < 1000 &&
+        1 == (rc = storage_insert(db, tables[t], 1, counts[t], (double)i, &v, 1)); tries++) {
+      usleep(1000);
+    }
+    fail_if(rc, "Cannot queue row %d", i);
+    counts[t]++;
+  }
+  oml_value_reset(&v);
+
+  database_release(db);
+  storage_high_watermark = DEF_STORAGE_HIGH_WATERMARK;
+  storage_low_watermark = DEF_STORAGE_LOW_WATERMARK;
+
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  for (t = 0; t < 2; t++) {
+    rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select[t], -1, &stmt, 0);
+    fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select[t], rc);
+    for (i = 0; i < counts[t]; i++) {
+      rc = sqlite3_step(stmt);
+      fail_unless(rc == SQLITE_ROW, "Missing row %d in table %d; rc=%d", i, t + 1, rc);
+      fail_unless(sqlite3_column_int(stmt, 0) == i,
+          "Invalid sequence number in row %d of table %d: got %d", i, t + 1, sqlite3_column_int(stmt, 0));
+    }
+    fail_unless(sqlite3_step(stmt) == SQLITE_DONE, "Too many rows in table %d", t + 1);
+    sqlite3_finalize(stmt);
+  }
+
+  database_release(db);
+}
+END_TEST
+
+/** Rows queued with storage_insert_batch_wait() from another thread */
+typedef struct {
+  Database *db;
+  DbTable *table;
+  int32_t seqnos[10];
+  double timestamps[10];
+  OmlValue values[10];
+  int queued;             /**< Value returned by storage_insert_batch_wait() */
+  int done;               /**< Set once storage_insert_batch_wait() has returned */
+} WaitRows;
+
+static void*
+insert_wait(void *arg)
+{
+  WaitRows *w = (WaitRows*)arg;
+
+  w->queued = storage_insert_batch_wait(w->db, w->table, 1, w->seqnos, w->timestamps,
+      w->values, 1, LENGTH(w->seqnos));
+  pthread_mutex_lock(&hold_lock);
+  w->done = 1;
+  pthread_mutex_unlock(&hold_lock);
+  return NULL;
+}
+
+START_TEST(test_storage_insert_wait)
+{
+  Database *db;
+  DbTable *table;
+  struct schema *schema;
+  sqlite3_stmt *stmt;
+  pthread_t thread, waiter;
+  WaitRows w;
+  OmlValue v;
+
+  char domain[] = "storage-wait-test";
+  char dbname[sizeof(domain)+4];
+  char select[] = "select oml_seq, value from wait_table;";
+  int i, j, rc, done, queued;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  storage_high_watermark = 4;
+  storage_low_watermark = 1;
+
+  db = database_find(domain);
+  fail_if(db == NULL, "Cannot create database %s", domain);
+  schema = schema_from_meta("1 wait_table value:int32");
+  table = database_find_or_create_table(db, schema);
+  fail_if(table == NULL, "Cannot create table for schema '1 wait_table value:int32'");
+  schema_free(schema);
+
+  /* Stall the storage thread, and fill its queue */
+  held = released = 0;
+  fail_if(pthread_create(&thread, NULL, call_hold_storage, db));
+  pthread_mutex_lock(&hold_lock);
+  while (!held) {
+    pthread_cond_wait(&hold_cond, &hold_lock);
+  }
+  pthread_mutex_unlock(&hold_lock);
+
+  oml_value_init(&v);
+  for (rc = 0, i = 0; !rc; i++) {
+    oml_value_set_type(&v, OML_INT32_VALUE);
+    omlc_set_int32(*oml_value_get_value(&v), 10 * i);
+    fail_if((rc = storage_insert(db, table, 1, i, (double)i, &v, 1)) < 0, "Cannot queue row %d", i);
+  }
+  oml_value_reset(&v);
+  queued = i - 1;
+
+  /* More rows, which have to wait for room */
+  memset(&w, 0, sizeof(w));
+  w.db = db;
+  w.table = table;
+  for (j = 0; j < (int)LENGTH(w.seqnos); j++) {
+    w.seqnos[j] = queued + j;
+    w.timestamps[j] = (double)(queued + j);
+    oml_value_init(&w.values[j]);
+    oml_value_set_type(&w.values[j], OML_INT32_VALUE);
+    omlc_set_int32(*oml_value_get_value(&w.values[j]), 10 * (queued + j));
+  }
+  fail_if(pthread_create(&waiter, NULL, insert_wait, &w));
+  usleep(100000);
+  pthread_mutex_lock(&hold_lock);
+  done = w.done;
+  pthread_mutex_unlock(&hold_lock);
+  fail_if(done, "Rows queued without room in the queue (%d queued)", w.queued);
+
+  /* Let the storage thread make room */
+  pthread_mutex_lock(&hold_lock);
+  released = 1;
+  pthread_cond_broadcast(&hold_cond);
+  pthread_mutex_unlock(&hold_lock);
+  pthread_join(thread, NULL);
+  pthread_join(waiter, NULL);
+  fail_unless(w.queued == (int)LENGTH(w.seqnos), "Queued %d rows instead of %d",
+      w.queued, LENGTH(w.seqnos));
+  oml_value_array_reset(w.values, LENGTH(w.values));
+
+  database_release(db);
+  storage_high_watermark = DEF_STORAGE_HIGH_WATERMARK;
+  storage_low_watermark = DEF_STORAGE_LOW_WATERMARK;
+
+  /* All rows were written, in order */
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+  for (i = 0; i < queued + (int)LENGTH(w.seqnos); i++) {
+    rc = sqlite3_step(stmt);
+    fail_unless(rc == SQLITE_ROW, "Missing row %d; rc=%d", i, rc);
+    fail_unless(sqlite3_column_int(stmt, 0) == i,
+        "Invalid sequence number in row %d: got %d", i, sqlite3_column_int(stmt, 0));
+    fail_unless(sqlite3_column_int(stmt, 1) == 10 * i,
+        "Invalid value in row %d: expected %d, got %d", i, 10 * i, sqlite3_column_int(stmt, 1));
+  }
+  fail_unless(sqlite3_step(stmt) == SQLITE_DONE, "Too many rows in table");
+  sqlite3_finalize(stmt);
+
+  database_release(db);
+}
+END_TEST
+
+static int
+get_journal_mode(Database *db, void *arg)
+{
+  sqlite3_stmt *stmt;
+  char *mode = arg;
+
+  if (sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, "PRAGMA journal_mode;", -1, &stmt, 0)) {
+    return -1;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    snprintf(mode, 16, "%s", (const char*)sqlite3_column_text(stmt, 0));
+  }
+  sqlite3_finalize(stmt);
+  return 0;
+}
+
+/** Count the committed rows of a table, from another connection than the storage thread's */
+static int
+count_committed_rows(const char *dbname, const char *select)
+{
+  sqlite3 *conn;
+  sqlite3_stmt *stmt;
+  int n = -1;
+
+  fail_if(sqlite3_open_v2(dbname, &conn, SQLITE_OPEN_READONLY, NULL), "Cannot open %s", dbname);
+  if (!sqlite3_prepare_v2(conn, select, -1, &stmt, 0)) {
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      n = sqlite3_column_int(stmt, 0);
+    }
+    sqlite3_finalize(stmt);
+  }
+  sqlite3_close(conn);
+  return n;
+}
+
+START_TEST(test_storage_sqlite_profile)
+{
+  Database *db;
+  DbTable *table;
+  struct schema *schema;
+  sqlite3_stmt *stmt;
+  OmlValue v;
+
+  char domain[] = "storage-profile-test";
+  char dbname[sizeof(domain)+4];
+  char select[] = "select count(*) from profile_table;";
+  char mode[16] = "";
+  int nrows = 1000;
+  int i, rc, n;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  /* Invalid settings are rejected */
+  sqlite_profile = "reckless";
+  fail_unless(sq3_profile_setup(), "Unknown profile '%s' accepted", sqlite_profile);
+  sqlite_profile = "bulk";
+  sqlite_journal_mode = "scribbled";
+  fail_unless(sq3_profile_setup(), "Unknown journal mode '%s' accepted", sqlite_journal_mode);
+  sqlite_journal_mode = NULL;
+  sqlite_commit_rows = 0;
+  sqlite_commit_interval = 0;
+  fail_unless(sq3_profile_setup(), "Profile without commit policy accepted");
+
+  /* Commit often, so rows span several transactions */
+  sqlite_commit_rows = 64;
+  sqlite_commit_interval = -1;
+  fail_if(sq3_profile_setup(), "Cannot set up the bulk profile");
+
+  db = database_find(domain);
+  fail_if(db == NULL, "Cannot create database %s", domain);
+  fail_if(storage_call(db, get_journal_mode, mode), "Cannot query the journal mode");
+  fail_unless(!strcmp(mode, "wal"), "Unexpected journal mode '%s' for the bulk profile", mode);
+
+  schema = schema_from_meta("1 profile_table value:int32");
+  table = database_find_or_create_table(db, schema);
+  fail_if(table == NULL, "Cannot create table for schema '1 profile_table value:int32'");
+  schema_free(schema);
+
+  oml_value_init(&v);
+  for (i = 0; i < nrows; i++) {
+    oml_value_set_type(&v, OML_INT32_VALUE);
+    omlc_set_int32(*oml_value_get_value(&v), i);
+    fail_if(storage_insert(db, table, 1, i, (double)i, &v, 1), "Cannot queue row %d", i);
+  }
+  oml_value_reset(&v);
+
+  /* The last rows do not make a full transaction, and are committed once
+   * the storage thread has been idle for a while, without releasing db */
+  for (i = 0; i < 50 && (n = count_committed_rows(dbname, select)) != nrows; i++) {
+    usleep(100000);
+  }
+  fail_unless(n == nrows, "Only %d of %d rows committed while idle", n, nrows);
+  database_release(db);
+
+  sqlite_profile = DEFAULT_SQLITE_PROFILE;
+  sqlite_commit_rows = -1;
+  fail_if(sq3_profile_setup(), "Cannot restore the default profile");
+
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+  fail_unless(sqlite3_step(stmt) == SQLITE_ROW, "Cannot count rows");
+  fail_unless(sqlite3_column_int(stmt, 0) == nrows,
+      "Unexpected number of rows (%d instead of %d)", sqlite3_column_int(stmt, 0), nrows);
+  sqlite3_finalize(stmt);
+
+  database_release(db);
+}
+END_TEST
+
+Suite*
+storage_suite (void)
+{
+  Suite* s = suite_create ("Storage");
+
+  dbbackend = "sqlite";
+  sqlite_database_dir = ".";
+
+  TCase* tc_storage_queue = tcase_create ("Storage queue");
+  tcase_add_test (tc_storage_queue, test_storage_watermarks);
+  tcase_add_test (tc_storage_queue, test_storage_batches);
+  tcase_add_test (tc_storage_queue, test_storage_insert_wait);
+  tcase_add_test (tc_storage_queue, test_storage_sqlite_profile);
+  suite_add_tcase (s, tc_storage_queue);
+
+  return s;
+}
+
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -131,6 +131,109 @@ START_TEST(test_text_insert)
 }
 END_TEST
 
+/** Copy data to the end of the client's MBuffer, as buffer_callback lets
+ * the EventLoop read(2) it, then tell client_callback it is there */
+static void
+text_read_into_mbuf(SockEvtSource *source, ClientHandler *ch, const char *data, size_t len)
+{
+  fail_if(mbuf_check_resize(ch->mbuf, len) == -1);
+  fail_unless(mbuf_wr_remaining(ch->mbuf) >= len,
+      "Not enough room in MBuffer: %d < %d", mbuf_wr_remaining(ch->mbuf), len);
+  memcpy(mbuf_wrptr(ch->mbuf), data, len);
+  client_callback(source, ch, NULL, len);
+}
+
+START_TEST(test_text_insert_mbuf)
+{
+  ClientHandler *ch;
+  Database *db;
+  sqlite3_stmt *stmt;
+  SockEvtSource source;
+
+  char domain[] = "text-mbuf-test";
+  char dbname[sizeof(domain)+3];
+  char table[] = "text_table";
+  double time1 = 1.096202;
+  double time2 = 2.092702;
+  int d1 = 3319660544;
+  int d2 = 106037248;
+
+  char h[200];
+  char s[100];
+  char select[200];
+  size_t split;
+
+  int rc = -1;
+
+  o_set_log_level(-1);
+  logdebug("%s\n", __FUNCTION__);
+
+  /* Remove pre-existing databases */
+  *dbname=0;
+  snprintf(dbname, sizeof(dbname), "%s.sq3", domain);
+  unlink(dbname);
+
+  snprintf(h, sizeof(h),  "protocol: 4\ndomain: %s\nstart-time: 1332132092\nsender-id: %s\napp-name: %s\nschema: 1 %s size:uint32\n\n", domain, basename(__FILE__), __FUNCTION__, table);
+  /* Both samples in one buffer, to be read in two chunks splitting the second one */
+  snprintf(s, sizeof(s), "%f\t1\t%d\t%d\n%f\t1\t%d\t%d\n", time1, 1, d1, time2, 2, d2);
+  split = strchr(s, '\n') - s + 5;
+  snprintf(select, sizeof(select), "select oml_ts_client, oml_seq, size from %s;", table);
+
+  memset(&source, 0, sizeof(SockEvtSource));
+  source.name = "text mbuf insert socket";
+  ch = check_server_prepare_client_handler("test_text_insert_mbuf", &source);
+  fail_unless(ch->state == C_HEADER);
+
+  /* Process the header */
+  text_read_into_mbuf(&source, ch, h, strlen(h));
+
+  fail_unless(ch->state == C_TEXT_DATA, "Inconsistent state: expected %d, got %d", C_TEXT_DATA, ch->state);
+  fail_if(ch->database == NULL);
+
+  /* Process the first sample and the beginning of the second */
+  text_read_into_mbuf(&source, ch, s, split);
+  fail_unless(ch->state == C_TEXT_DATA, "Inconsistent state: expected %d, got %d", C_TEXT_DATA, ch->state);
+
+  /* Process the rest of the second sample */
+  text_read_into_mbuf(&source, ch, s + split, strlen(s) - split);
+  fail_unless(ch->state == C_TEXT_DATA, "Inconsistent state: expected %d, got %d", C_TEXT_DATA, ch->state);
+
+  database_release(ch->database);
+  check_server_destroy_client_handler(ch);
+
+  logdebug("Checking recorded data in %s.sq3\n", domain);
+  /* Open database */
+  db = database_find(domain);
+  fail_if(db == NULL || ((Sq3DB*)(db->handle))->conn == NULL , "Cannot open SQLite3 database");
+  rc = sqlite3_prepare_v2(((Sq3DB*)(db->handle))->conn, select, -1, &stmt, 0);
+  fail_unless(rc == 0, "Preparation of statement `%s' failed; rc=%d", select, rc);
+
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == 100, "First step of statement `%s' failed; rc=%d", select, rc);
+  fail_unless(fabs(sqlite3_column_double(stmt, 0) - time1) < 10e-10,
+      "Invalid oml_ts_value in 1st row: expected `%f', got `%f'",
+      time1, sqlite3_column_double(stmt, 0));
+  fail_unless(sqlite3_column_int(stmt, 2) == d1,
+      "Invalid size in 1st row: expected `%d', got `%d'",
+      d1, sqlite3_column_int(stmt, 2));
+
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == 100, "Second step of statement `%s' failed; rc=%d", select, rc);
+  fail_unless(fabs(sqlite3_column_double(stmt, 0) - time2) < 10e-10,
+      "Invalid oml_ts_value in 2nd row: expected `%f', got `%f'",
+      time2, sqlite3_column_double(stmt, 0));
+  fail_unless(sqlite3_column_int(stmt, 2) == d2,
+      "Invalid size in 2nd row: expected `%d', got `%d'",
+      d2, sqlite3_column_int(stmt, 2));
+
+  rc = sqlite3_step(stmt);
+  fail_unless(rc == SQLITE_DONE, "Unexpected third row in `%s'; rc=%d", select, rc);
+
+  sqlite3_finalize(stmt);
+  database_release(db);
+}
+END_TEST
+
 #define MAXTYPETESTNAME 15
 static struct {
  char *name;        /* name of this test, no longer than MAXTYPETESTNAME */
@@ -540,6 +643,7 @@ text_protocol_suite (void)
 
   TCase* tc_text_insert = tcase_create ("Text insert");
   tcase_add_test (tc_text_insert, test_text_insert);
+  tcase_add_test (tc_text_insert, test_text_insert_mbuf);
   tcase_add_loop_test (tc_text_insert, test_text_types, 0, LENGTH (type_tests));
   suite_add_tcase (s, tc_text_insert);
 
@@ -0,0 +1,163 @@
+/*
+ * Copyright 2015 National ICT Australia Limited (NICTA)
+ *
+ * This software may be used and distributed solely under the terms of
+ * the MIT license (License).  You should find a copy of the License in
+ * COPYING or at http://opensource.org/licenses/MIT. By downloading or
+ * using this software you accept the terms and the liability disclaimer
+ * in the License.
+ */
+/** \file injectbench.c
+ * \brief A benchmark of the per-sample cost of omlc_inject, compared to
+ * omlc_inject_batch and omlc_inject_batch_columns.
+ *
+ * The same number of samples is injected in each mode, and the time per
+ * sample is reported on stderr. Use, e.g., --oml-collect file:/dev/null and
+ * a large --oml-bufsize so the output does not get in the way.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include <popt.h>
+
+#include "oml2/omlc.h"
+
+static int samples = 1000000;
+static int batch = 256;
+
+struct poptOption options[] = {
+  POPT_AUTOHELP
+  { "samples", 'n', POPT_ARG_INT, &samples, 0, "Number of samples to inject in each mode. Default=1000000", "SAMPLES"},
+  { "batch", 'b', POPT_ARG_INT, &batch, 0, "Number of samples per batch. Default=256", "BATCH"},
+  { NULL, 0, 0, NULL, 0, NULL, NULL }
+};
+
+static OmlMPDef mpdef[] = {
+  { "seq", OML_UINT32_VALUE },
+  { "length", OML_UINT32_VALUE },
+  { "delay", OML_DOUBLE_VALUE },
+  { NULL, (OmlValueT)0 },
+};
+#define NFIELDS (sizeof(mpdef) / sizeof(mpdef[0]) - 1)
+
+static OmlMP *mp;
+
+double difftv(struct timeval t1, struct timeval t2)
+{
+  return (((double)(t1.tv_sec - t2.tv_sec)) + (double)(t1.tv_usec - t2.tv_usec)/1000000.);
+}
+
+/** Fill one sample, as a packet capture would */
+static void
+fill (OmlValueU *seq, OmlValueU *length, OmlValueU *delay, uint32_t i)
+{
+  omlc_set_uint32(*seq, i);
+  omlc_set_uint32(*length, 64 + i % 1400);
+  omlc_set_double(*delay, 0.001 * (i % 100));
+}
+
+static void
+report (const char *mode, struct timeval beg, struct timeval end)
+{
+  double deltaT = difftv(end, beg);
+
+  fprintf (stderr, "%-8s %d samples in %fs: %.1fns/sample\n", mode, samples, deltaT,
+      1e9 * deltaT / samples);
+}
+
+static void
+run_single (void)
+{
+  struct timeval beg, end;
+  OmlValueU v[NFIELDS];
+  int i;
+
+  omlc_zero_array(v, NFIELDS);
+  gettimeofday(&beg, NULL);
+  for (i = 0; i < samples; i++) {
+    fill(&v[0], &v[1], &v[2], i);
+    omlc_inject(mp, v);
+  }
+  gettimeofday(&end, NULL);
+  report("single", beg, end);
+}
+
+static void
+run_batch (void)
+{
+  struct timeval beg, end;
+  OmlValueU *rows = calloc(batch * NFIELDS, sizeof(OmlValueU));
+  int i, n;
+
+  gettimeofday(&beg, NULL);
+  for (i = 0; i < samples; i += n) {
+    for (n = 0; n < batch && i + n < samples; n++) {
+      fill(&rows[n * NFIELDS], &rows[n * NFIELDS + 1], &rows[n * NFIELDS + 2], i + n);
+    }
+    omlc_inject_batch(mp, rows, n);
+  }
+  gettimeofday(&end, NULL);
+  report("batch", beg, end);
+
+  free(rows);
+}
+
+static void
+run_columns (void)
+{
+  struct timeval beg, end;
+  OmlValueU *columns[NFIELDS];
+  unsigned int j;
+  int i, n;
+
+  for (j = 0; j < NFIELDS; j++) {
+    columns[j] = calloc(batch, sizeof(OmlValueU));
+  }
+
+  gettimeofday(&beg, NULL);
+  for (i = 0; i < samples; i += n) {
+    for (n = 0; n < batch && i + n < samples; n++) {
+      fill(&columns[0][n], &columns[1][n], &columns[2][n], i + n);
+    }
+    omlc_inject_batch_columns(mp, (const OmlValueU *const *)columns, n);
+  }
+  gettimeofday(&end, NULL);
+  report("columns", beg, end);
+
+  for (j = 0; j < NFIELDS; j++) {
+    free(columns[j]);
+  }
+}
+
+int
+main (int argc, const char **argv)
+{
+  int c;
+
+  omlc_init ("injectbench", &argc, argv, NULL);
+  mp = omlc_add_mp ("packets", mpdef);
+  omlc_start ();
+
+  poptContext optcon = poptGetContext (NULL, argc, argv, options, 0);
+  while ((c = poptGetNextOpt(optcon)) >= 0);
+
+  if (samples <= 0 || batch <= 0) {
+    fprintf (stderr, "The numbers of samples and the batch size must be positive\n");
+    return 1;
+  }
+
+  run_single();
+  run_batch();
+  run_columns();
+
+  omlc_close ();
+  return 0;
+}
+/*
+ Local Variables:
+ mode: C
+ tab-width: 2
+ indent-tabs-mode: nil
+ End:
+ vim: sw=2:sts=2:expandtab
+*/
@@ -0,0 +1,95 @@
+#!/bin/bash
+# PostgreSQL pipelining test.
+#
+# Copyright 2015 National ICT Australia (NICTA)
+#
+# This software may be used and distributed solely under the terms of
+# the MIT license (License).  You should find a copy of the License in
+# COPYING or at http://opensource.org/licenses/MIT. By downloading or
+# using this software you accept the terms and the liability disclaimer
+# in the License.
+#
+# A client injects samples as fast as it can, in batches several times larger
+# than PG_PIPELINE_DEPTH, so the storage thread of the oml2-server sends
+# batches of INSERTs back to back, and the list of pipelined commands awaiting
+# their result fills up and wraps around many times. All rows should be
+# stored, and no INSERT should be reported as failed.
+#
+# Can be run manually as
+#  top_srcdir=../.. srcdir=. top_builddir=../.. builddir=. POSTGRES=`which postgres` ./runpg-pipeline.sh
+#
+srcdir=${srcdir/#./$PWD\/.}	# Get directories, replacing ./ with a full path
+top_builddir=${top_builddir/#./$PWD\/.}
+builddir=${builddir/#./$PWD\/.}
+
+BN=`basename $0`
+DOMAIN=${BN%%.sh}
+PGPATH=`dirname ${POSTGRES} 2>/dev/null`
+
+depth=1024 # PG_PIPELINE_DEPTH
+n=$((5 * depth)) # samples injected in each of the three modes of injectbench
+batch=$((2 * depth))
+
+LOG=$PWD/${DOMAIN}.log
+source ${srcdir}/tap_helper.sh
+
+## Wait for a pattern to appear in a log, as long as a process is alive
+# waitfor LOGFILE PATTERN PID
+waitfor() {
+	i=0
+	while ! grep -q "$2" "$1" 2>/dev/null; do
+		if ! kill -0 $3 2>/dev/null || [ $((i++)) -gt 10 ]; then
+			return 1
+		fi
+		sleep 1
+	done
+}
+
+tap_message "testing back-to-back pipelined INSERTs into PostgreSQL"
+
+test_plan
+
+tap_test "make temporary directory" yes mktemp -d ${DOMAIN}-test.XXXXXX
+DIR=`tail -n 1 $LOG` # XXX: $LOG cannot be /dev/stdout here
+cd $DIR
+tap_message "working in $DIR; it won't be cleaned up in case of bail out"
+
+pgport=$((RANDOM + 32766))
+port=$((RANDOM + 32766))
+
+tap_test "initialise PostgreSQL cluster" yes ${PGPATH}/initdb -U oml2 db
+${POSTGRES} -k $PWD -D $PWD/db -p $pgport > db.log 2>&1 &
+PGPID=$!
+tap_message "started PostgreSQL with PID $PGPID (might need manual killing if the suit bails out)"
+tap_test "wait for PostgreSQL" yes waitfor db.log "accept connections" $PGPID
+
+${top_builddir}/server/oml2-server -d 1 --logfile server.log -l $port \
+	--backend=postgresql --pg-user=oml2 --pg-port=$pgport --oml-noop &
+SERVERPID=$!
+tap_message "started oml2-server with PID $SERVERPID (might need manual killing if the suit bails out)"
+tap_test "wait for oml2-server" yes waitfor server.log "EventLoop" $SERVERPID
+
+tap_test "inject $n samples in batches of $batch" yes ${builddir}/injectbench -n $n -b $batch \
+	--oml-id a --oml-domain ${DOMAIN} --oml-collect localhost:$port --oml-bufsize 4194304
+
+tap_message "waiting for oml2-server to process all data..."
+sleep 5
+tap_test "stop oml2-server" yes kill $SERVERPID
+while kill -0 $SERVERPID 2>/dev/null; do sleep 1; done
+
+rows=`${PGPATH}/psql -h localhost -p $pgport ${DOMAIN} oml2 -P tuples_only=on -P format=unaligned \
+	-c 'SELECT count(*) FROM injectbench_packets' 2>>db.log`
+tap_test "confirm that all rows were stored ($rows/$((3 * n)))" no test "x$rows" = "x$((3 * n))"
+tap_test "confirm that no INSERT was reported as failed" no test `grep -c "failed for sample\|not tracking sample" server.log` -eq 0
+
+kill $PGPID
+while kill -0 $PGPID 2>/dev/null; do sleep 1; done
+
+cd - >/dev/null
+if [ x$failed = x0 ]; then
+	tap_message "cleaning $DIR"
+	rm -rf $DIR
+fi
+
+tap_summary
+exit $failed